@@ -0,0 +1,423 @@
+#include <forthbyte/forth.h>
+#include <forthbyte/simd.h>
+#include <forthbyte/jit.h>
+#include <forthbyte/ssa.h>
+
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+namespace
+  {
+
+  struct song
+    {
+    std::string name;
+    std::string script;
+    bool is_float;
+    int64_t sample_rate;
+    int64_t memory_size;
+    int64_t control_rate;
+    std::vector<std::string> init_memory;
+    };
+
+  song load_song(const std::string& folder, const std::string& name)
+    {
+    song s;
+    s.name = name;
+    s.is_float = true;
+    s.sample_rate = 8000;
+    s.memory_size = 256;
+    s.control_rate = forth::interpreter<double>::default_control_rate;
+    std::ifstream f(folder + name);
+    std::string ln;
+    while (std::getline(f, ln))
+      {
+      std::stringstream str(ln);
+      std::string first_word;
+      str >> first_word;
+      if (first_word == "#byte")
+        s.is_float = false;
+      else if (first_word == "#float")
+        s.is_float = true;
+      else if (first_word == "#samplerate")
+        str >> s.sample_rate;
+      else if (first_word == "#memory")
+        str >> s.memory_size;
+      else if (first_word == "#controlrate")
+        str >> s.control_rate;
+      else if (first_word == "#initmemory")
+        {
+        std::string value;
+        while (str >> value)
+          s.init_memory.push_back(value);
+        }
+      s.script.append(ln);
+      s.script.push_back('\n');
+      }
+    return s;
+    }
+
+  template <class T>
+  forth::interpreter<T> make_interpreter(const song& s)
+    {
+    forth::interpreter<T> interpr;
+    interpr.make_variable("t");
+    interpr.make_variable("sr");
+    interpr.make_variable("c");
+    interpr.set_variable_value("sr", (T)s.sample_rate);
+    interpr.set_memory_size(s.memory_size);
+    interpr.control_rate = s.control_rate;
+    int index = 0;
+    for (const auto& val : s.init_memory)
+      {
+      std::stringstream str;
+      str << val;
+      str >> interpr.memory_stack[index];
+      index = (index + 1) % (int)interpr.memory_stack.size();
+      }
+    return interpr;
+    }
+
+  template <class T>
+  uint64_t hash_value(uint64_t h, T val)
+    {
+    uint64_t bits = 0;
+    memcpy(&bits, &val, sizeof(T));
+    return h * 1099511628211ull + bits;
+    }
+
+  template <class T, class F>
+  double time_per_sample(forth::interpreter<T>& interpr, int64_t samples, uint64_t& checksum, F run)
+    {
+    checksum = 0;
+    auto tic = std::chrono::high_resolution_clock::now();
+    for (int64_t t = 0; t < samples; ++t)
+      {
+      interpr.globals[0] = (T)t;
+      interpr.globals[2] = (T)0;
+      run();
+      checksum = hash_value(checksum, interpr.pop());
+      }
+    auto toc = std::chrono::high_resolution_clock::now();
+    return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(toc - tic).count() / (double)samples;
+    }
+
+  template <class T>
+  double time_per_sample_block(forth::interpreter<T>& interpr, const typename forth::interpreter<T>::Bytecode& code, int64_t samples, uint64_t& checksum)
+    {
+    checksum = 0;
+    std::vector<T> out(4096);
+    auto tic = std::chrono::high_resolution_clock::now();
+    for (int64_t t = 0; t < samples; t += (int64_t)out.size())
+      {
+      int count = (int)std::min<int64_t>((int64_t)out.size(), samples - t);
+      interpr.eval_block(code, t, count, 0, out.data());
+      for (int k = 0; k < count; ++k)
+        checksum = hash_value(checksum, out[k]);
+      }
+    auto toc = std::chrono::high_resolution_clock::now();
+    return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(toc - tic).count() / (double)samples;
+    }
+
+  // both channels of a block, one channel at a time or with eval_block_stereo
+  template <class T>
+  double time_per_sample_stereo(forth::interpreter<T>& interpr, const typename forth::interpreter<T>::Bytecode& code, int64_t samples, uint64_t& checksum, bool shared)
+    {
+    checksum = 0;
+    std::vector<T> left(4096), right(4096);
+    auto tic = std::chrono::high_resolution_clock::now();
+    for (int64_t t = 0; t < samples; t += (int64_t)left.size())
+      {
+      int count = (int)std::min<int64_t>((int64_t)left.size(), samples - t);
+      if (shared)
+        interpr.eval_block_stereo(code, t, count, left.data(), right.data());
+      else
+        {
+        interpr.eval_block(code, t, count, 0, left.data());
+        interpr.eval_block(code, t, count, 1, right.data());
+        }
+      for (int k = 0; k < count; ++k)
+        checksum = hash_value(hash_value(checksum, left[k]), right[k]);
+      }
+    auto toc = std::chrono::high_resolution_clock::now();
+    return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(toc - tic).count() / (double)samples;
+    }
+
+  template <class T>
+  void bench_song(const song& s, int64_t samples, bool dump)
+    {
+    auto words = forth::tokenize(s.script);
+    auto interpr = make_interpreter<T>(s);
+    auto prog = interpr.parse(words);
+    // eval runs the program as parsed, the other columns run the optimized program
+    auto optimized = interpr.optimize(prog);
+    auto code = interpr.compile(optimized);
+    auto reference = interpr;
+    auto block = interpr;
+    auto simd = interpr;
+    simd.kernels = forth::simd_lane_kernels<T>();
+    auto reg = interpr;
+    forth::ssa<T> ssa;
+    bool ssa_compiled = ssa.compile(code);
+    auto native = interpr;
+    forth::jit<T> j;
+    bool jit_compiled = j.compile(code);
+    // the same engines with common subexpression elimination switched off
+    auto reg_unshared = interpr;
+    forth::ssa<T> ssa_unshared;
+    ssa_unshared.compile(code, false);
+    auto native_unshared = interpr;
+    forth::jit<T> jit_unshared;
+    jit_unshared.compile(code, false);
+    // and with every operator called every time
+    auto simd_unmemoized = simd;
+    simd_unmemoized.memoize = false;
+    auto reg_unmemoized = interpr;
+    forth::ssa<T> ssa_unmemoized;
+    ssa_unmemoized.compile(code, true, false);
+    auto native_unmemoized = interpr;
+    forth::jit<T> jit_unmemoized;
+    jit_unmemoized.compile(code, true, false);
+
+    uint64_t checksum_eval, checksum_run, checksum_block, checksum_simd, checksum_ssa, checksum_jit;
+    double ns_eval = time_per_sample(reference, samples, checksum_eval, [&]() { reference.eval(prog); });
+    double ns_run = time_per_sample(interpr, samples, checksum_run, [&]() { interpr.run(code); });
+    double ns_block = time_per_sample_block(block, code, samples, checksum_block);
+    double ns_simd = time_per_sample_block(simd, code, samples, checksum_simd);
+    double ns_ssa = ssa_compiled ? time_per_sample(reg, samples, checksum_ssa, [&]() { ssa.run(reg); }) : ns_run;
+    if (!ssa_compiled)
+      checksum_ssa = checksum_run;
+    double ns_jit = jit_compiled ? time_per_sample(native, samples, checksum_jit, [&]() { j.run(native); }) : ns_run;
+    if (!jit_compiled)
+      checksum_jit = checksum_run;
+
+    std::cout << std::left << std::setw(18) << s.name << std::right << std::fixed << std::setprecision(1);
+    std::cout << std::setw(10) << ns_eval << std::setw(10) << ns_run << std::setw(10) << ns_block << std::setw(10) << ns_simd << std::setw(10) << ns_ssa << std::setw(10) << ns_jit;
+    std::cout << std::setw(9) << std::setprecision(2) << ns_eval / ns_run << "x";
+    std::cout << std::setw(9) << std::setprecision(2) << ns_eval / ns_block << "x";
+    std::cout << std::setw(9) << std::setprecision(2) << ns_eval / ns_simd << "x";
+    std::cout << std::setw(9) << std::setprecision(2) << ns_eval / ns_ssa << "x";
+    std::cout << std::setw(9) << std::setprecision(2) << ns_eval / ns_jit << "x";
+    if (checksum_eval != checksum_run || checksum_eval != checksum_block || checksum_eval != checksum_ssa || checksum_eval != checksum_jit)
+      std::cout << "  MISMATCH";
+    else if (checksum_eval != checksum_simd)
+      std::cout << "  (simd within ulp tolerance)";
+    std::cout << std::endl;
+    std::cout << "  statements: " << prog.statements.size() << " parsed, " << optimized.statements.size() << " optimized" << std::endl;
+
+    if (ssa_compiled || jit_compiled)
+      {
+      std::cout << "  common subexpressions:" << std::setprecision(1);
+      if (ssa_compiled)
+        {
+        uint64_t checksum;
+        double ns = time_per_sample(reg_unshared, samples, checksum, [&]() { ssa_unshared.run(reg_unshared); });
+        std::cout << " ssa " << ssa.shared_count() << " shared, " << ns << " -> " << ns_ssa << " ns (" << std::setprecision(2) << ns / ns_ssa << "x)," << std::setprecision(1);
+        if (checksum != checksum_ssa)
+          std::cout << "  MISMATCH";
+        }
+      if (jit_compiled)
+        {
+        uint64_t checksum;
+        double ns = time_per_sample(native_unshared, samples, checksum, [&]() { jit_unshared.run(native_unshared); });
+        std::cout << " jit " << j.shared_count() << " shared, " << ns << " -> " << ns_jit << " ns (" << std::setprecision(2) << ns / ns_jit << "x)";
+        if (checksum != checksum_jit)
+          std::cout << "  MISMATCH";
+        }
+      std::cout << std::endl;
+      }
+    // operators of values that change every so many samples, see forth::is_memoized
+    if (ssa.memoized_count() > 0 || j.memoized_count() > 0)
+      {
+      uint64_t checksum;
+      double ns = time_per_sample_block(simd_unmemoized, code, samples, checksum);
+      std::cout << "  memoized: simd " << std::setprecision(1) << ns << " -> " << ns_simd << " ns (" << std::setprecision(2) << ns / ns_simd << "x),";
+      if (ssa_compiled)
+        {
+        ns = time_per_sample(reg_unmemoized, samples, checksum, [&]() { ssa_unmemoized.run(reg_unmemoized); });
+        std::cout << " ssa " << ssa.memoized_count() << " operators, " << std::setprecision(1) << ns << " -> " << ns_ssa << " ns (" << std::setprecision(2) << ns / ns_ssa << "x),";
+        if (checksum != checksum_ssa)
+          std::cout << "  MISMATCH";
+        }
+      if (jit_compiled)
+        {
+        ns = time_per_sample(native_unmemoized, samples, checksum, [&]() { jit_unmemoized.run(native_unmemoized); });
+        std::cout << " jit " << j.memoized_count() << " operators, " << std::setprecision(1) << ns << " -> " << ns_jit << " ns (" << std::setprecision(2) << ns / ns_jit << "x)";
+        if (checksum != checksum_jit)
+          std::cout << "  MISMATCH";
+        }
+      std::cout << std::endl;
+      }
+    // songs whose result depends on c: the simd column for both channels
+    if (code.effect.lanes_are_independent() && code.dependencies.back() == forth::DEP_CHANNEL)
+      {
+      auto separate = simd;
+      auto shared = simd;
+      uint64_t checksum_separate, checksum_shared;
+      double ns_separate = time_per_sample_stereo(separate, code, samples, checksum_separate, false);
+      double ns_shared = time_per_sample_stereo(shared, code, samples, checksum_shared, true);
+      std::cout << "  stereo: channel by channel " << std::setprecision(1) << ns_separate << " -> shared " << ns_shared << " ns (" << std::setprecision(2) << ns_separate / ns_shared << "x)";
+      if (checksum_separate != checksum_shared)
+        std::cout << "  MISMATCH";
+      std::cout << std::endl;
+      }
+    if (dump)
+      std::cout << "  " << interpr.dump(optimized.statements) << std::endl;
+    }
+
+
+  // a tone with sin, and with the table of osc-sin, in the simd and jit engines
+  void bench_oscillators(int64_t samples)
+    {
+    std::cout << "a sine of 440 Hz, ns per sample: sin -> osc-sin" << std::endl;
+    const char* scripts[] = { "t 440 * sr / 6.283185307179586 * sin", "t 440 * sr / osc-sin" };
+    double ns_simd[2], ns_jit[2];
+    for (int k = 0; k < 2; ++k)
+      {
+      song s;
+      s.name = scripts[k];
+      s.script = scripts[k];
+      s.is_float = true;
+      s.sample_rate = 44100;
+      s.memory_size = 256;
+      s.control_rate = forth::interpreter<double>::default_control_rate;
+      auto simd = make_interpreter<double>(s);
+      auto words = forth::tokenize(s.script);
+      auto code = simd.compile(simd.optimize(simd.parse(words)));
+      simd.kernels = forth::simd_lane_kernels<double>();
+      auto native = simd;
+      forth::jit<double> j;
+      uint64_t checksum;
+      ns_simd[k] = time_per_sample_block(simd, code, samples, checksum);
+      ns_jit[k] = j.compile(code) ? time_per_sample(native, samples, checksum, [&]() { j.run(native); }) : 0.0;
+      }
+    std::cout << std::setprecision(1) << "  simd " << ns_simd[0] << " -> " << ns_simd[1] << " ns (" << std::setprecision(2) << ns_simd[0] / ns_simd[1] << "x),";
+    std::cout << std::setprecision(1) << " jit " << ns_jit[0] << " -> " << ns_jit[1] << " ns (" << std::setprecision(2) << ns_jit[0] / ns_jit[1] << "x)" << std::endl;
+    }
+
+  // a one-pole lowpass written with @ and !, which runs sample by sample, and the word lowpass,
+  // which runs over whole blocks after the input is evaluated lane by lane
+  void bench_filters(int64_t samples)
+    {
+    std::cout << "a one-pole lowpass, ns per sample: @ ! -> lowpass" << std::endl;
+    const char* scripts[] = { "t 7 * 255 & 0 @ - 0.0453 * 0 @ + dup 0 !", "t 7 * 255 & 320 lowpass" };
+    double ns[2];
+    for (int k = 0; k < 2; ++k)
+      {
+      song s;
+      s.name = scripts[k];
+      s.script = scripts[k];
+      s.is_float = true;
+      s.sample_rate = 44100;
+      s.memory_size = 256;
+      s.control_rate = forth::interpreter<double>::default_control_rate;
+      auto interpr = make_interpreter<double>(s);
+      auto words = forth::tokenize(s.script);
+      auto code = interpr.compile(interpr.optimize(interpr.parse(words)));
+      interpr.kernels = forth::simd_lane_kernels<double>();
+      uint64_t checksum;
+      ns[k] = time_per_sample_block(interpr, code, samples, checksum);
+      }
+    std::cout << std::setprecision(1) << "  " << ns[0] << " -> " << ns[1] << " ns (" << std::setprecision(2) << ns[0] / ns[1] << "x)" << std::endl;
+    }
+
+  // two lfos, an envelope and a pitch sequence evaluated for every sample, and as k: words,
+  // which eval_block computes once per 64 samples, under a sawtooth at audio rate
+  void bench_control_rate(int64_t samples)
+    {
+    std::cout << "lfos, an envelope and a pitch sequence, ns per sample: : -> k:" << std::endl;
+    const char* scripts[] = {
+      ": lfo t 0.0002 * sin 0.4 * 0.6 + ; : vib t 0.0007 * sin 0.01 * 1 + ; : env t 11025 % -0.0003 * exp ; "
+      ": pitch t 11025 / floor 8 % 3 * 12 / 2 swap pow 220 * vib * ; t pitch * sr / osc-saw lfo * env *",
+      "k: lfo t 0.0002 * sin 0.4 * 0.6 + ; k: vib t 0.0007 * sin 0.01 * 1 + ; k: env t 11025 % -0.0003 * exp ; "
+      "k: pitch t 11025 / floor 8 % 3 * 12 / 2 swap pow 220 * vib * ; t pitch * sr / osc-saw lfo * env *" };
+    double ns[2];
+    for (int k = 0; k < 2; ++k)
+      {
+      song s;
+      s.name = scripts[k];
+      s.script = scripts[k];
+      s.is_float = true;
+      s.sample_rate = 44100;
+      s.memory_size = 256;
+      s.control_rate = forth::interpreter<double>::default_control_rate;
+      auto interpr = make_interpreter<double>(s);
+      auto words = forth::tokenize(s.script);
+      auto code = interpr.compile(interpr.optimize(interpr.parse(words)));
+      interpr.kernels = forth::simd_lane_kernels<double>();
+      uint64_t checksum;
+      ns[k] = time_per_sample_block(interpr, code, samples, checksum);
+      }
+    std::cout << std::setprecision(1) << "  " << ns[0] << " -> " << ns[1] << " ns (" << std::setprecision(2) << ns[0] / ns[1] << "x)" << std::endl;
+    }
+
+  // a / d and a % d with a divide instruction, as for a divisor that is only known at run time,
+  // and with the multiplication and shifts of forth::constant_divisor
+  void bench_constant_division(int64_t samples)
+    {
+    std::cout << "integer / and % by a literal, ns per pair: divide instruction -> constant_divisor" << std::endl;
+    const int64_t divisors[] = { 24, 1000, 16384, -7 };
+    for (int64_t d : divisors)
+      {
+      volatile int64_t runtime_divisor = d;
+      const int64_t divisor = runtime_divisor;
+      const forth::constant_divisor reduced(d);
+      uint64_t checksum_divide = 0, checksum_reduced = 0;
+      auto tic = std::chrono::high_resolution_clock::now();
+      for (int64_t a = -samples; a < samples; ++a)
+        checksum_divide = hash_value(checksum_divide, a / divisor + a % divisor);
+      auto toc = std::chrono::high_resolution_clock::now();
+      for (int64_t a = -samples; a < samples; ++a)
+        checksum_reduced = hash_value(checksum_reduced, reduced.quotient(a) + reduced.remainder(a));
+      auto toc2 = std::chrono::high_resolution_clock::now();
+      double ns_divide = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(toc - tic).count() / (double)(2 * samples);
+      double ns_reduced = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(toc2 - toc).count() / (double)(2 * samples);
+      std::cout << "  " << std::left << std::setw(8) << d << std::right << std::setprecision(2) << ns_divide << " -> " << ns_reduced << " ns (" << ns_divide / ns_reduced << "x)";
+      if (checksum_divide != checksum_reduced)
+        std::cout << "  MISMATCH";
+      std::cout << std::endl;
+      }
+    }
+
+  }
+
+int main(int argc, char** argv)
+  {
+  std::string folder(FORTHBYTE_EXAMPLES_FOLDER);
+  int64_t samples = 1 << 20;
+  if (argc > 1)
+    folder = argv[1];
+  if (argc > 2)
+    samples = std::stoll(argv[2]);
+  bool dump = argc > 3 && std::string(argv[3]) == "dump";
+
+  std::vector<std::string> names = { "beat.txt", "funky.txt", "guitarhead.txt", "mu6k.txt", "panning.txt" };
+
+  std::cout << "ns/sample, " << samples << " samples per song" << std::endl;
+  std::cout << std::left << std::setw(18) << "song" << std::right << std::setw(10) << "eval" << std::setw(10) << "bytecode" << std::setw(10) << "block" << std::setw(10) << "simd" << std::setw(10) << "ssa" << std::setw(10) << "jit";
+  std::cout << std::setw(10) << "x bytec." << std::setw(10) << "x block" << std::setw(10) << "x simd" << std::setw(10) << "x ssa" << std::setw(10) << "x jit" << std::endl;
+  if (forth::simd_lane_kernels<double>() == nullptr)
+    std::cout << "(no vectorized kernels on this processor, simd equals block)" << std::endl;
+#if !defined(FORTH_JIT_X64)
+  std::cout << "(no native code generation on this processor, jit equals bytecode)" << std::endl;
+#endif
+  for (const auto& name : names)
+    {
+    song s = load_song(folder, name);
+    if (s.is_float)
+      bench_song<double>(s, samples, dump);
+    else
+      bench_song<int64_t>(s, samples, dump);
+    }
+  bench_oscillators(samples);
+  bench_filters(samples);
+  bench_control_rate(samples);
+  bench_constant_division(samples);
+  return 0;
+  }
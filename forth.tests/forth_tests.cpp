@@ -2,8 +2,17 @@
 #include "test_assert.h"
 
 #include <forthbyte/forth.h>
+#include <forthbyte/resampler.h>
+#include <forthbyte/spsc_ring.h>
+#include <forthbyte/wav_writer.h>
 
+#include <cstring>
 #include <iostream>
+#include <limits>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <vector>
 
 using namespace forth;
 
@@ -17,6 +26,192 @@ namespace
       return false;
     return true;
     }
+
+  template <class T>
+  bool run_equals_eval(const std::string& script, int64_t samples = 100)
+    {
+    auto words = tokenize(script);
+    interpreter<T> interpr;
+    interpr.make_variable("t");
+    auto prog = interpr.parse(words);
+    auto code = interpr.compile(prog);
+    interpreter<T> reference = interpr;
+    for (int64_t t = 0; t < samples; ++t)
+      {
+      interpr.globals[0] = (T)t;
+      reference.globals[0] = (T)t;
+      interpr.run(code);
+      reference.eval(prog);
+      T a = interpr.pop();
+      T b = reference.pop();
+      if (memcmp(&a, &b, sizeof(T)) != 0)
+        return false;
+      if (interpr.stack_pointer != reference.stack_pointer)
+        return false;
+      }
+    return true;
+    }
+
+  template <class T>
+  bool eval_block_equals_run(const std::string& script, int64_t t0, int count, int channel = 1)
+    {
+    auto words = tokenize(script);
+    interpreter<T> interpr;
+    interpr.make_variable("t");
+    interpr.make_variable("sr");
+    interpr.make_variable("c");
+    interpr.set_variable_value("sr", (T)8000);
+    interpr.memory_stack[3] = (T)7;
+    auto prog = interpr.parse(words);
+    auto code = interpr.compile(prog);
+    interpreter<T> reference = interpr;
+    std::vector<T> out(count);
+    interpr.eval_block(code, t0, count, channel, out.data());
+    for (int k = 0; k < count; ++k)
+      {
+      reference.globals[0] = (T)(t0 + k);
+      reference.globals[2] = (T)channel;
+      reference.run(code);
+      T val = reference.pop();
+      if (memcmp(&val, &out[k], sizeof(T)) != 0)
+        return false;
+      }
+    if (interpr.stack_pointer != reference.stack_pointer)
+      return false;
+    // the values that the last samples left behind on the stack
+    int leftover = code.effect.is_static ? (code.effect.depth - 1) * std::min(count, 8) : 0;
+    for (int i = 1; i <= leftover; ++i)
+      {
+      int index = (interpr.stack_pointer - i + 256) % 256;
+      if (memcmp(&interpr.stack[index], &reference.stack[index], sizeof(T)) != 0)
+        return false;
+      }
+    return interpr.globals == reference.globals;
+    }
+
+  // eval_block_stereo must give the same channels, stack and globals as running the program for
+  // channel 0 and 1 of every sample in turn
+  template <class T>
+  bool eval_block_stereo_equals_run(const std::string& script, int64_t t0, int count)
+    {
+    auto words = tokenize(script);
+    interpreter<T> interpr;
+    interpr.make_variable("t");
+    interpr.make_variable("sr");
+    interpr.make_variable("c");
+    interpr.set_variable_value("sr", (T)8000);
+    interpr.memory_stack[3] = (T)7;
+    auto code = interpr.compile(interpr.parse(words));
+    interpreter<T> reference = interpr;
+    std::vector<T> left(count), right(count);
+    interpr.eval_block_stereo(code, t0, count, left.data(), right.data());
+    for (int k = 0; k < count; ++k)
+      {
+      reference.globals[0] = (T)(t0 + k);
+      for (int channel = 0; channel < 2; ++channel)
+        {
+        reference.globals[2] = (T)channel;
+        reference.run(code);
+        T val = reference.pop();
+        if (memcmp(&val, channel ? &right[k] : &left[k], sizeof(T)) != 0)
+          return false;
+        }
+      }
+    if (interpr.stack_pointer != reference.stack_pointer)
+      return false;
+    int leftover = code.effect.is_static ? (code.effect.depth - 1) * std::min(2 * count, 8) : 0;
+    for (int i = 1; i <= leftover; ++i)
+      {
+      int index = (interpr.stack_pointer - i + 256) % 256;
+      if (memcmp(&interpr.stack[index], &reference.stack[index], sizeof(T)) != 0)
+        return false;
+      }
+    return interpr.globals == reference.globals;
+    }
+
+  template <class T>
+  std::vector<e_dependency> dependencies_of(const std::string& script)
+    {
+    auto words = tokenize(script);
+    interpreter<T> interpr;
+    interpr.make_variable("t");
+    interpr.make_variable("sr");
+    interpr.make_variable("c");
+    return interpr.compile(interpr.parse(words)).dependencies;
+    }
+
+  // the optimized program must leave the same values on the stack and in memory as the parsed one,
+  // with run, eval and eval_block
+  template <class T>
+  bool optimized_equals_parsed(const std::string& script, int64_t samples = 100)
+    {
+    auto words = tokenize(script);
+    interpreter<T> interpr;
+    interpr.make_variable("t");
+    interpr.make_variable("sr");
+    interpr.make_variable("c");
+    interpr.set_variable_value("sr", (T)8000);
+    for (int i = 0; i < 256; ++i)
+      interpr.memory_stack[i] = (T)(i % 7);
+    auto prog = interpr.parse(words);
+    auto optimized = interpr.optimize(prog);
+    auto code = interpr.compile(prog);
+    auto optimized_code = interpr.compile(optimized);
+    interpreter<T> reference = interpr;
+    interpreter<T> evaluated = interpr;
+    for (int64_t t = 0; t < samples; ++t)
+      {
+      interpr.globals[0] = (T)t;
+      reference.globals[0] = (T)t;
+      evaluated.globals[0] = (T)t;
+      interpr.run(optimized_code);
+      reference.run(code);
+      evaluated.eval(optimized);
+      if (interpr.stack_pointer != reference.stack_pointer || evaluated.stack_pointer != reference.stack_pointer)
+        return false;
+      for (int i = 1; i <= code.effect.depth; ++i)
+        {
+        int index = (reference.stack_pointer - i + 256) % 256;
+        if (memcmp(&interpr.stack[index], &reference.stack[index], sizeof(T)) != 0 || memcmp(&evaluated.stack[index], &reference.stack[index], sizeof(T)) != 0)
+          return false;
+        }
+      if (interpr.memory_stack != reference.memory_stack || evaluated.memory_stack != reference.memory_stack)
+        return false;
+      }
+    if (!optimized_code.effect.lanes_are_independent())
+      return true;
+    std::vector<T> out(samples), expected(samples);
+    interpr.eval_block(optimized_code, 0, (int)samples, 0, out.data());
+    reference.eval_block(code, 0, (int)samples, 0, expected.data());
+    return memcmp(out.data(), expected.data(), sizeof(T) * samples) == 0;
+    }
+
+  template <class T>
+  bool parse_fails(const std::string& script)
+    {
+    auto words = tokenize(script);
+    interpreter<T> interpr;
+    interpr.make_variable("t");
+    try
+      {
+      interpr.parse(words);
+      }
+    catch (std::logic_error&)
+      {
+      return true;
+      }
+    return false;
+    }
+
+  template <class T>
+  std::string optimized_dump(const std::string& script)
+    {
+    auto words = tokenize(script);
+    interpreter<T> interpr;
+    interpr.make_variable("t");
+    auto prog = interpr.optimize(interpr.parse(words));
+    return interpr.dump(prog.statements);
+    }
   }
 
 void test_tokenize()
@@ -33,6 +228,13 @@ void test_tokenize()
   TEST_ASSERT(equal(words[5], "tureluut", token::T_WORD));
   TEST_ASSERT(equal(words[6], "1.e-8", token::T_VALUE));
   TEST_ASSERT(equal(words[7], "4509.3498.234234", token::T_WORD));
+
+  words = tokenize("memo: f ; memo :");
+  TEST_EQ(5, (int)words.size());
+  TEST_ASSERT(equal(words[0], "memo:", token::T_MEMO));
+  TEST_EQ(1, words[0].column_nr);
+  TEST_ASSERT(equal(words[3], "memo", token::T_WORD));
+  TEST_ASSERT(equal(words[4], ":", token::T_COLON));
   }
 
 void test_parse_value()
@@ -135,6 +337,1134 @@ void test_store_fetch()
   TEST_EQ(3.14f, res);
   }
 
+void test_compile()
+  {
+  auto words = tokenize("t 3 + sin");
+  interpreter<double> interpr;
+  interpr.make_variable("t");
+  auto prog = interpr.parse(words);
+  auto code = interpr.compile(prog);
+  TEST_EQ(4, (int)code.instructions.size());
+  TEST_EQ((int)OP_VARIABLE, (int)code.instructions[0].op);
+  TEST_EQ(0, code.instructions[0].index);
+  TEST_EQ((int)OP_VALUE, (int)code.instructions[1].op);
+  TEST_EQ(3.0, code.instructions[1].val);
+  TEST_EQ((int)OP_ADD, (int)code.instructions[2].op);
+  TEST_EQ((int)OP_SIN, (int)code.instructions[3].op);
+  }
+
+void test_run_add()
+  {
+  auto words = tokenize("1 2 +");
+  interpreter<int> interpr;
+  auto prog = interpr.parse(words);
+  auto code = interpr.compile(prog);
+  for (int i = 0; i < 3; ++i)
+    {
+    interpr.run(code);
+    int res = interpr.pop();
+    TEST_EQ(3, res);
+    TEST_EQ(0, interpr.stack_pointer);
+    }
+  }
+
+void test_run_equals_eval()
+  {
+  TEST_ASSERT(run_equals_eval<int64_t>("t 5 * 3 >> t & t 4096 % 1024 < & t 12 >> 19 & 1 + 25 * pick 208 % 3 * + + 4 / 255 & dup dup 4 *"));
+  TEST_ASSERT(run_equals_eval<int64_t>("t 8 >> t 10 >> ^ t 14 >> | 63 & t not ^ 0 / drop"));
+  TEST_ASSERT(run_equals_eval<int64_t>("1 2 3 rot -rot swap over nip tuck 2dup min max = <> < > <= >= t 0 ! 0 @ >r r> + + + + +"));
+  TEST_ASSERT(run_equals_eval<double>("t t 7 / sin t 3000 / sin 100 * * + sin 1 t 16000 / 5 % 1 + floor 0.25 * - 8 pow *"));
+  TEST_ASSERT(run_equals_eval<double>("t 100 / cos t tan t log t exp t sqrt t ceil t abs t negate t 3 atan2 + + + + + + + +"));
+  TEST_ASSERT(run_equals_eval<double>("drop drop t 3 pick +", 600));
+  }
+
+void test_stack_effect()
+  {
+  interpreter<int64_t> interpr;
+  interpr.make_variable("t");
+  auto words = tokenize("t dup 3 + swap >r 4 pick r> rot drop");
+  auto code = interpr.compile(interpr.parse(words));
+  TEST_ASSERT(code.effect.is_static);
+  TEST_EQ(2, code.effect.depth);
+  TEST_EQ(-4, code.effect.min_depth);
+  TEST_EQ(3, code.effect.max_depth);
+  TEST_EQ(0, code.effect.return_depth);
+  TEST_EQ(1, code.effect.max_return_depth);
+  TEST_ASSERT(!code.effect.lanes_are_independent());
+
+  words = tokenize("t 2 * dup 3 pick");
+  code = interpr.compile(interpr.parse(words));
+  TEST_ASSERT(code.effect.is_static);
+  TEST_ASSERT(!code.effect.lanes_are_independent());
+
+  words = tokenize("t dup pick");
+  code = interpr.compile(interpr.parse(words));
+  TEST_ASSERT(!code.effect.is_static);
+
+  words = tokenize("t 1 ! t");
+  code = interpr.compile(interpr.parse(words));
+  TEST_ASSERT(code.effect.writes_memory);
+  TEST_ASSERT(!code.effect.lanes_are_independent());
+
+  words = tokenize("t dup * 1 2 rot 2 pick >r + r> nip");
+  code = interpr.compile(interpr.parse(words));
+  TEST_ASSERT(code.effect.lanes_are_independent());
+  }
+
+void test_constant_divisor()
+  {
+  const int64_t min = std::numeric_limits<int64_t>::min();
+  const int64_t max = std::numeric_limits<int64_t>::max();
+  std::vector<int64_t> divisors = { 3, 5, 6, 7, 10, 24, 25, 125, 641, 1000, 3000, 16000, 16383, 1000000007, max, max - 1, min + 1, (int64_t)1 << 40, ((int64_t)1 << 40) + 1 };
+  for (int d = 2; d < 70; ++d)
+    divisors.push_back(d);
+  for (int k = 1; k < 63; ++k)
+    divisors.push_back((int64_t)1 << k);
+  for (size_t i = 0, n = divisors.size(); i < n; ++i)
+    divisors.push_back(-divisors[i]);
+  std::vector<int64_t> dividends = { 0, 1, -1, 2, -2, 23, 24, 25, -23, -24, -25, 999, 1000, -1000, max, max - 1, min, min + 1 };
+  std::mt19937_64 gen(10);
+  for (int i = 0; i < 200; ++i)
+    {
+    dividends.push_back((int64_t)gen());
+    dividends.push_back((int64_t)(gen() >> (gen() % 64)));
+    dividends.push_back(-(int64_t)(gen() >> (1 + gen() % 63)));
+    }
+  bool ok = true;
+  for (int64_t d : divisors)
+    {
+    TEST_ASSERT(constant_divisor::is_reducible(d));
+    constant_divisor divisor(d);
+    for (int64_t a : dividends)
+      ok = ok && divisor.quotient(a) == a / d && divisor.remainder(a) == a % d;
+    }
+  TEST_ASSERT(ok);
+  TEST_ASSERT(!constant_divisor::is_reducible(0));
+  TEST_ASSERT(!constant_divisor::is_reducible(1));
+  TEST_ASSERT(!constant_divisor::is_reducible(-1));
+  TEST_ASSERT(!constant_divisor::is_reducible(min));
+
+  // fused divisions of integer programs get a divisor, the others keep their divide instruction
+  interpreter<int64_t> interpr;
+  interpr.make_variable("t");
+  auto words = tokenize("t 24 / t 1000 % t 0 / t -1 / t 16384 %");
+  auto code = interpr.compile(interpr.optimize(interpr.parse(words)));
+  TEST_EQ(3, (int)code.divisors.size());
+  TEST_ASSERT(optimized_equals_parsed<int64_t>("t 5000 - 24 / t 5000 - 1000 % + t 5000 - -7 / + t 5000 - 16384 % + t 5000 - -8 / + t 5000 - 3 % + t 5000 - -1 / + t 0 / +", 10000));
+  }
+
+void test_eval_block()
+  {
+  // lanes are independent
+  TEST_ASSERT(eval_block_equals_run<int64_t>("3000 t 16383 & / 1 & 35 * t 16 >> 3 & @ t * 24 / 127 & t 8 >> t 10 >> ^ t 14 >> | 63 & + +", 0, 1000));
+  TEST_ASSERT(eval_block_equals_run<int64_t>("t dup * 1 2 rot 2 pick >r + r> nip c + tuck 2dup over - -rot swap min max sr + 0 / not", 12345, 700));
+  TEST_ASSERT(eval_block_equals_run<int64_t>("t 3 dup dup", 5, 300));
+  TEST_ASSERT(eval_block_equals_run<double>("t t 7 / sin t 3000 / sin 100 * * + sin 1 t 16000 / 5 % 1 + floor 0.25 * - 8 pow * c 0.5 * +", 0, 1024));
+  TEST_ASSERT(eval_block_equals_run<double>("t 100 / cos t tan t log t exp t sqrt t ceil t abs t negate t 3 atan2 + + + + + + + + 3 @ *", 100, 513));
+  // lanes depend on each other
+  TEST_ASSERT(eval_block_equals_run<int64_t>("t 5 * 3 >> t & t 4096 % 1024 < & t 12 >> 19 & 1 + 25 * pick 208 % 3 * + + 4 / 255 & dup dup 4 *", 0, 1000));
+  TEST_ASSERT(eval_block_equals_run<int64_t>("3 @ t + dup 3 !", 0, 100));
+  TEST_ASSERT(eval_block_equals_run<double>("drop t +", 0, 300));
+  }
+
+void test_dependencies()
+  {
+  auto deps = dependencies_of<int64_t>("sr 8 / t * c 3 + *");
+  TEST_EQ(9, (int)deps.size());
+  TEST_ASSERT(deps[0] == DEP_SONG); // sr
+  TEST_ASSERT(deps[2] == DEP_SONG); // sr 8 /
+  TEST_ASSERT(deps[4] == DEP_SAMPLE); // sr 8 / t *
+  TEST_ASSERT(deps[5] == DEP_CHANNEL); // c
+  TEST_ASSERT(deps[8] == DEP_CHANNEL); // the result
+  // the top of the stack after shuffles, and fetches from memory
+  deps = dependencies_of<int64_t>("c t swap drop 5 @ 1 pick >r r>");
+  TEST_ASSERT(deps[1] == DEP_SAMPLE);
+  TEST_ASSERT(deps[2] == DEP_CHANNEL);
+  TEST_ASSERT(deps[3] == DEP_SAMPLE);
+  TEST_ASSERT(deps[5] == DEP_STEP); // memory that the program does not write
+  TEST_ASSERT(deps[9] == DEP_SAMPLE);
+  TEST_ASSERT(dependencies_of<int64_t>("t c drop").back() == DEP_SAMPLE);
+  // what the other channel left behind, or wrote to memory, depends on the channel
+  TEST_ASSERT(dependencies_of<int64_t>("drop 1 +").back() == DEP_CHANNEL);
+  TEST_ASSERT(dependencies_of<int64_t>("3 @ t 4 !").back() == DEP_CHANNEL);
+  TEST_ASSERT(dependencies_of<int64_t>("t t pick").empty());
+  // values that only change every so many samples
+  TEST_ASSERT(dependencies_of<int64_t>("t 16 >>").back() == DEP_STEP);
+  TEST_ASSERT(dependencies_of<int64_t>("t 16 >> 3 & @ 5 pow").back() == DEP_STEP);
+  TEST_ASSERT(dependencies_of<int64_t>("t 1000 /").back() == DEP_STEP);
+  TEST_ASSERT(dependencies_of<double>("t 1000 /").back() == DEP_SAMPLE);
+  TEST_ASSERT(dependencies_of<double>("t 1000 / 5 % 1 + floor").back() == DEP_STEP);
+  TEST_ASSERT(dependencies_of<int64_t>("t floor").back() == DEP_SAMPLE);
+  TEST_ASSERT(dependencies_of<int64_t>("t 0 >>").back() == DEP_SAMPLE);
+  TEST_ASSERT(dependencies_of<int64_t>("t 16 >> t +").back() == DEP_SAMPLE);
+  TEST_ASSERT(dependencies_of<int64_t>("t 16 >> c +").back() == DEP_CHANNEL);
+  }
+
+void test_eval_block_memoized()
+  {
+  // the operators of step values are called once per run of equal operands, with the same results
+  TEST_ASSERT(eval_block_equals_run<double>("t 1000 / 5 % 1 + floor 5 pow t 700 / floor 0.5 * sin t 12 >> 3 & @ exp + + t 100 / floor 3 atan2 +", 0, 3000));
+  TEST_ASSERT(eval_block_equals_run<int64_t>("t 1000 / 3 pow t 9 >> sin 100 * + t 12 >> 3 & @ 2 pow +", 5000, 3000));
+  // a step value that changes every sample, -0, and nan
+  TEST_ASSERT(eval_block_equals_run<double>("t 0.5 + floor sin t 300 / floor negate 0.5 pow + t 700 / floor 1 - log +", 0, 2000));
+
+  // the last operands of an instruction do not carry over to another program
+  interpreter<double> interpr;
+  interpr.make_variable("t");
+  auto words = tokenize("t 1000 / floor sin");
+  auto code_sin = interpr.compile(interpr.parse(words));
+  words = tokenize("t 1000 / floor cos");
+  auto code_cos = interpr.compile(interpr.parse(words));
+  std::vector<double> out(500);
+  interpr.eval_block(code_sin, 1800, 500, 0, out.data());
+  TEST_EQ(std::sin(2.0), out[499]);
+  interpr.eval_block(code_cos, 1800, 500, 0, out.data());
+  TEST_EQ(std::cos(1.0), out[0]);
+  TEST_EQ(std::cos(2.0), out[499]);
+  }
+
+void test_eval_block_stereo()
+  {
+  TEST_ASSERT(eval_block_stereo_equals_run<int64_t>("t c 3 << >>", 0, 1000));
+  TEST_ASSERT(eval_block_stereo_equals_run<int64_t>("t", 0, 300));
+  TEST_ASSERT(eval_block_stereo_equals_run<int64_t>("c", 0, 300));
+  TEST_ASSERT(eval_block_stereo_equals_run<int64_t>("sr 8 / 3 + t c + * t 5 >> c - over swap dup", 7, 600));
+  TEST_ASSERT(eval_block_stereo_equals_run<int64_t>("t dup * 1 2 rot 2 pick >r + r> nip c + tuck 2dup over - -rot swap min max sr + 0 / not", 12345, 700));
+  TEST_ASSERT(eval_block_stereo_equals_run<int64_t>("c t c t c + - * +", 0, 100));
+  TEST_ASSERT(eval_block_stereo_equals_run<double>("t t 7 / sin t 3000 / sin 100 * * + sin 1 t 16000 / 5 % 1 + floor 0.25 * - 8 pow * c 0.5 * +", 0, 1024));
+  TEST_ASSERT(eval_block_stereo_equals_run<double>("c 0.3 * t 1000 / sin sr sqrt * + c >r t r> 2 + pow 3 @ * c sin -rot", 100, 513));
+  // the channels share state, so they are interleaved
+  TEST_ASSERT(eval_block_stereo_equals_run<int64_t>("3 @ c + dup 3 !", 0, 100));
+  TEST_ASSERT(eval_block_stereo_equals_run<double>("drop c +", 0, 300));
+  }
+
+void test_optimize()
+  {
+  TEST_EQ(std::string("7"), optimized_dump<int64_t>("3 4 +"));
+  TEST_EQ(std::string("t [7 *]"), optimized_dump<int64_t>("t 3 4 + *"));
+  TEST_EQ(std::string("t t"), optimized_dump<int64_t>("t t swap swap dup drop"));
+  TEST_EQ(std::string("t [dup *]"), optimized_dump<int64_t>("t dup *"));
+  TEST_EQ(std::string("t [16383 &]"), optimized_dump<int64_t>(": y t 16383 & ; y"));
+  TEST_EQ(std::string("t t nip"), optimized_dump<int64_t>("t t swap drop"));
+  TEST_EQ(std::string("t t 2dup -rot"), optimized_dump<int64_t>("t t over over rot rot"));
+  TEST_EQ(std::string("2 2 t"), optimized_dump<int64_t>("1 2 swap 2 * t"));
+  TEST_EQ(std::string("t dup t"), optimized_dump<int64_t>("t 0 pick >r r> t"));
+  TEST_EQ(std::string("t 5 [0 %]"), optimized_dump<int64_t>("t 5 0 %")); // traps at run time, not here
+  TEST_EQ(std::string("t [0.5 *]"), optimized_dump<double>("t 1 2 / *"));
+  // these programs can see what run leaves above the stack pointer
+  TEST_EQ(std::string("drop 3 4 +"), optimized_dump<int64_t>("drop 3 4 +"));
+  TEST_EQ(std::string("t t pick 3 4 +"), optimized_dump<int64_t>("t t pick 3 4 +"));
+
+  TEST_ASSERT(optimized_equals_parsed<int64_t>("3000 t 16383 & / 1 & 35 * t 16 >> 3 & @ t * 24 / 127 & t 8 >> t 10 >> ^ t 14 >> | 63 & + +"));
+  TEST_ASSERT(optimized_equals_parsed<int64_t>("t dup * 1 2 rot 2 pick >r + r> nip c + tuck 2dup over - -rot swap min max sr + 0 / not 3 4 + 5 *"));
+  TEST_ASSERT(optimized_equals_parsed<int64_t>("t 3 + t 3 - t 3 * t 3 / t 3 % t 3 << t 3 >> t 3 & t 3 | t 3 ^ + + + + + + + + + 1 2 3 rot swap swap -rot drop drop t 1 ! +"));
+  TEST_ASSERT(optimized_equals_parsed<double>("t t 7 / sin t 3000 / sin 100 * * + sin 1 t 16000 / 5 % 1 + floor 0.25 * - 8 pow * c 0.5 * + 3.1415926 2 / sin *"));
+  TEST_ASSERT(optimized_equals_parsed<double>("t 3 + t 3 - t 3 * t 3 / t 3 % t dup * 0.5 2 pow 1 3 atan2 2 sqrt + + + + + + + + 2 3 < 4 5 >= - 2 cos 3 tan 4 log 5 exp 6 floor 7 ceil -8 abs -9 negate + + + + + + + + + *"));
+  TEST_ASSERT(optimized_equals_parsed<double>("t 0 / t 0 * t -0.0 * 0 0 / + + +"));
+
+  // only the live part of a branch with a literal condition is left
+  TEST_EQ(std::string("t [2 +]"), optimized_dump<int64_t>("t 1 if 2 + else 3 - then"));
+  TEST_EQ(std::string("t [3 -]"), optimized_dump<int64_t>("t 0 if 2 + else 3 - then"));
+  TEST_EQ(std::string("t if 3 else t [4 *] then"), optimized_dump<int64_t>("t if 1 2 + else t 4 * then"));
+  TEST_EQ(std::string("t 3 0 do [2 +] loop"), optimized_dump<int64_t>("t 3 0 do 1 1 + + loop 5 5 do t loop"));
+  TEST_ASSERT(optimized_equals_parsed<int64_t>("t 5 % 2 < if t 3 * 1 2 + + else 4 0 do i t + * 2 1 swap - + loop then 1 if 7 + then"));
+  TEST_ASSERT(optimized_equals_parsed<double>("t begin 1 + dup 0.5 * floor 3 % 0 = until 2 0 do t i 2 * + sin + loop"));
+  }
+
+void test_control_flow()
+  {
+  TEST_ASSERT(run_equals_eval<int64_t>("t 3 % if t 3 * else t 5 + then"));
+  TEST_ASSERT(run_equals_eval<int64_t>("t 7 & 4 < if t 2 % if 1 then 1 + else 9 then t +"));
+  TEST_ASSERT(run_equals_eval<int64_t>("0 10 0 do i + loop t +"));
+  TEST_ASSERT(run_equals_eval<int64_t>("0 4 1 do 3 0 do i j * + t 5 % if i + then loop loop"));
+  TEST_ASSERT(run_equals_eval<int64_t>("t begin 1 + dup 7 & 0 = until"));
+  TEST_ASSERT(run_equals_eval<int64_t>(": sq dup * ; t 3 % if t sq then t 0 -5 do i sq + loop"));
+  TEST_ASSERT(run_equals_eval<int64_t>("t 3 3 do 1 + loop 3 8 do 1 + loop i j +"));
+  TEST_ASSERT(run_equals_eval<double>("t 0.5 * sin 0 > if t 3 0 do i 0.25 * + sin loop else t cos then"));
+
+  interpreter<int64_t> interpr;
+  interpr.make_variable("t");
+  auto words = tokenize("0 10 0 do i + loop 0 begin 1 + 0 until t if 5 else 6 then");
+  auto code = interpr.compile(interpr.parse(words));
+  interpr.globals[0] = 0;
+  interpr.run(code);
+  TEST_EQ(6, (int)interpr.pop());
+  TEST_EQ((int)interpreter<int64_t>::max_until_iterations, (int)interpr.pop());
+  TEST_EQ(45, (int)interpr.pop());
+
+  // if jumps over the then part when the condition is zero, and the then part over the else part
+  words = tokenize("t if 1 else 2 then");
+  code = interpr.compile(interpr.parse(words));
+  TEST_EQ(5, (int)code.instructions.size());
+  TEST_EQ(OP_JUMP_IF_ZERO, code.instructions[1].op);
+  TEST_EQ(4, code.instructions[1].index);
+  TEST_EQ(OP_JUMP, code.instructions[3].op);
+  TEST_EQ(5, code.instructions[3].index);
+  TEST_ASSERT(code.effect.is_static);
+  TEST_ASSERT(code.effect.has_control_flow);
+  TEST_EQ(1, code.effect.depth);
+  TEST_ASSERT(!code.effect.lanes_are_independent());
+  TEST_ASSERT(code.dependencies.empty());
+  TEST_ASSERT(eval_block_equals_run<int64_t>("t 3 % if t 3 * else t c + then 4 0 do i + loop", 0, 300));
+  TEST_ASSERT(eval_block_stereo_equals_run<double>("t c + 2 % if 10 0 do t i + sin + loop then", 0, 300));
+
+  // the paths have to agree on the depth for the stack to be static
+  words = tokenize("t if 1 then");
+  TEST_ASSERT(!interpr.compile(interpr.parse(words)).effect.is_static);
+  words = tokenize("4 0 do t loop");
+  TEST_ASSERT(!interpr.compile(interpr.parse(words)).effect.is_static);
+  words = tokenize("t begin 1 + dup until");
+  TEST_ASSERT(interpr.compile(interpr.parse(words)).effect.is_static);
+
+  // the loops have literal bounds and are bounded in length
+  TEST_ASSERT(parse_fails<int64_t>("t 0 do loop"));
+  TEST_ASSERT(parse_fails<double>("10 0.5 do loop"));
+  TEST_ASSERT(parse_fails<int64_t>("1 if 2"));
+  TEST_ASSERT(parse_fails<int64_t>("1 then"));
+  TEST_ASSERT(parse_fails<int64_t>("begin t loop"));
+  TEST_ASSERT(parse_fails<int64_t>(": f if ; 1 f then"));
+  TEST_ASSERT(parse_fails<int64_t>("1 if : f ; then"));
+  TEST_ASSERT(parse_fails<int64_t>("1000 0 do 1000 0 do loop loop"));
+  TEST_ASSERT(parse_fails<int64_t>("begin begin 0 until 0 until"));
+  std::string calls = ": f 300 0 do loop ;";
+  for (int k = 0; k < 250; ++k)
+    calls.append(" f");
+  TEST_ASSERT(parse_fails<int64_t>(calls)); // words are inlined, so their loops count every time
+  TEST_ASSERT(parse_fails<int64_t>("2 0 do 2 0 do 2 0 do 2 0 do 2 0 do 2 0 do 2 0 do 2 0 do 2 0 do loop loop loop loop loop loop loop loop loop"));
+  TEST_ASSERT(!parse_fails<int64_t>("2 0 do 2 0 do 2 0 do 2 0 do 2 0 do 2 0 do 2 0 do 2 0 do loop loop loop loop loop loop loop loop"));
+  TEST_ASSERT(!parse_fails<int64_t>("255 0 do 255 0 do loop loop"));
+  TEST_ASSERT(!parse_fails<int64_t>("0 100000 do loop 1 if 60000 0 do loop else 60000 0 do loop then"));
+  }
+
+void test_called_words()
+  {
+  // a word with more than max_inline_size statements gets its own code, after the program,
+  // when it is called from several places and the program with its calls inlined has more
+  // than max_flat_size statements
+  const int big_size = 2 * (int)(interpreter<int64_t>::max_flat_size / 4 + 1);
+  const char* operators[] = { "+", "*", "^" };
+  std::string big = ": big";
+  for (int k = 0; k < big_size / 2; ++k)
+    big += " " + std::to_string(k + 1) + " " + operators[k % 3];
+  big += " ; ";
+  interpreter<int64_t> interpr;
+  interpr.make_variable("t");
+  auto words = tokenize(big + ": small 3 + ; t big small big");
+  auto prog = interpr.parse(words);
+  TEST_EQ(1, (int)prog.words.size());
+  TEST_EQ(std::string("t big [3 +] big"), interpr.dump(interpr.optimize(prog).statements));
+  auto code = interpr.compile(prog);
+  TEST_EQ(6 + big_size + 1, (int)code.instructions.size());
+  TEST_EQ(OP_CALL, code.instructions[1].op);
+  TEST_EQ(6, code.instructions[1].index);
+  TEST_EQ(6, code.instructions[4].index);
+  TEST_EQ(OP_RETURN, code.instructions[5].op);
+  TEST_EQ(OP_RETURN, code.instructions.back().op);
+  TEST_ASSERT(code.effect.is_static);
+  TEST_ASSERT(code.effect.has_control_flow);
+  TEST_EQ(1, code.effect.depth);
+  TEST_EQ(0, code.effect.min_depth);
+
+  TEST_ASSERT(run_equals_eval<int64_t>(big + "t big t 3 % if big else 1 then +"));
+  TEST_ASSERT(run_equals_eval<double>(big + ": twice big big ; : more twice twice t sin * ; t more 4 0 do more i + loop"));
+  TEST_ASSERT(run_equals_eval<int64_t>(big + ": twice big big ; : more twice 3 0 do twice loop ; 1 2 t more 2 pick + more"));
+  TEST_ASSERT(optimized_equals_parsed<int64_t>(big + ": twice big 0 0 + + big ; t twice 5 0 do twice i + loop t 2 % if twice then"));
+  TEST_ASSERT(eval_block_stereo_equals_run<int64_t>(big + "t big c big +", 0, 100));
+  // a word that is called from one place, or any word of a program that stays small with its
+  // calls inlined, is inlined after all, so that the program can run in lanes
+  auto has_calls = [](const std::string& script)
+    {
+    interpreter<int64_t> interpr;
+    interpr.make_variable("t");
+    auto words = tokenize(script);
+    auto code = interpr.compile(interpr.parse(words));
+    for (const auto& instr : code.instructions)
+      if (instr.op == OP_CALL)
+        return true;
+    return false;
+    };
+  const std::string medium = ": medium 1 + 2 * 3 ^ 4 + 5 * 6 ^ 7 + 8 * 9 ^ 10 + 11 * 12 ^ 13 + 14 * 15 ^ 16 + 17 * 18 ^ ; ";
+  TEST_ASSERT(!has_calls(big + "t big"));
+  TEST_ASSERT(!has_calls(big + ": twice big 3 * ; t twice"));
+  TEST_ASSERT(!has_calls(medium + "t medium t 1 + medium +"));
+  TEST_ASSERT(has_calls(big + "t big t 1 + big +"));
+  TEST_ASSERT(has_calls(big + ": twice big 3 * ; t twice t 1 + twice +"));
+  TEST_ASSERT(run_equals_eval<int64_t>(medium + "t medium t 1 + medium +"));
+  TEST_ASSERT(eval_block_equals_run<int64_t>(big + ": once t 2 * big ; once", 0, 600));
+  // the effect of a word counts where it is called
+  words = tokenize(big + ": pops big drop drop ; t pops");
+  TEST_EQ(-1, interpr.compile(interpr.parse(words)).effect.min_depth);
+  // the loops of a word count for every call
+  TEST_ASSERT(parse_fails<int64_t>(big + ": spin 3000 0 do big loop ; spin spin spin spin spin spin spin spin spin spin spin spin spin spin spin spin spin spin spin spin spin spin"));
+  }
+
+void test_called_words_stress()
+  {
+  // Every word calls the one before twice, which inlined would double the program at every
+  // level. The words stay small instead, so the statements and instructions grow linearly.
+  std::string definitions = ": w0 t 1 + 2 * 3 ^ 4 + 5 * 6 ^ 7 + 8 * 9 ^ 10 + 11 * 12 ^ 13 + 14 * 15 ^ 16 + 17 * 18 ^ ;";
+  const int levels = 14;
+  for (int k = 1; k <= levels; ++k)
+    definitions += " : w" + std::to_string(k) + " w" + std::to_string(k - 1) + " w" + std::to_string(k - 1) + " + ;";
+  const std::string script = definitions + " w" + std::to_string(levels);
+  interpreter<int64_t> interpr;
+  interpr.make_variable("t");
+  auto words = tokenize(script);
+  auto prog = interpr.parse(words);
+  auto code = interpr.compile(prog);
+  TEST_ASSERT(prog.words.size() <= (size_t)levels);
+  TEST_ASSERT(code.instructions.size() < 40 * (size_t)levels);
+  TEST_ASSERT(code.effect.is_static);
+  TEST_EQ(1, code.effect.depth);
+  TEST_ASSERT(run_equals_eval<int64_t>(script, 2));
+  // a single call of w14 runs 2^14 copies of w0
+  interpreter<int64_t> reference;
+  reference.make_variable("t");
+  words = tokenize(": w0 t 1 + 2 * 3 ^ 4 + 5 * 6 ^ 7 + 8 * 9 ^ 10 + 11 * 12 ^ 13 + 14 * 15 ^ 16 + 17 * 18 ^ ; w0");
+  auto w0 = reference.compile(reference.parse(words));
+  interpr.globals[0] = reference.globals[0] = 5;
+  interpr.run(code);
+  reference.run(w0);
+  TEST_EQ(reference.pop() * (1 << levels), interpr.pop());
+
+  // many more levels are refused as too large to run, but parse quickly
+  for (int k = levels + 1; k <= 200; ++k)
+    definitions += " : w" + std::to_string(k) + " w" + std::to_string(k - 1) + " w" + std::to_string(k - 1) + " + ;";
+  TEST_ASSERT(parse_fails<int64_t>(definitions + " w200"));
+  TEST_ASSERT(!parse_fails<int64_t>(definitions + " w14"));
+  }
+
+void test_memo_words()
+  {
+  // note gives a frequency for a handful of notes, so after the first round every call hits
+  const std::string note = "memo: note 12 / 2 swap pow 440 * ; ";
+  interpreter<double> interpr;
+  interpr.make_variable("t");
+  auto words = tokenize(note + "t 8 % note t 4 % note +");
+  auto prog = interpr.parse(words);
+  TEST_EQ(1, (int)interpr.memos.size());
+  TEST_EQ(1, interpr.memos[0].inputs);
+  TEST_EQ(1, interpr.memos[0].outputs);
+  TEST_EQ(std::string("t [8 %] note t [4 %] note +"), interpr.dump(interpr.optimize(prog).statements));
+  auto code = interpr.compile(prog);
+  TEST_EQ(OP_MEMO, code.instructions[3].op);
+  TEST_EQ(OP_CALL, code.instructions[4].op);
+  TEST_EQ(OP_MEMO_STORE, code.instructions[5].op);
+  TEST_ASSERT(code.effect.is_static);
+  TEST_EQ(1, code.effect.depth);
+  for (int t = 0; t < 100; ++t)
+    {
+    interpr.globals[0] = (double)t;
+    interpr.run(code);
+    TEST_EQ(440.0 * std::pow(2.0, (t % 8) / 12.0) + 440.0 * std::pow(2.0, (t % 4) / 12.0), interpr.pop());
+    }
+  TEST_EQ(8u, interpr.memos[0].misses);
+  TEST_EQ(192u, interpr.memos[0].hits);
+
+  TEST_ASSERT(run_equals_eval<double>(note + "t 16 % note t sin +"));
+  TEST_ASSERT(run_equals_eval<int64_t>("memo: mix 2dup * rot + swap 3 % ; : f t 7 % t 5 % t 3 % ; f mix - f mix f mix + *"));
+  TEST_ASSERT(run_equals_eval<int64_t>("memo: pulse dup 2 % if 3 * else 5 0 do i + loop then ; memo: two pulse pulse 1 + ; t 9 % two t 4 % pulse -"));
+  TEST_ASSERT(run_equals_eval<int64_t>("memo: seven 7 ; t seven seven * +"));
+  TEST_ASSERT(optimized_equals_parsed<int64_t>(note + "t 3 % 1 + note 2 note 2 note + +"));
+  // the words can only compute with the values on the stack, and take and leave a fixed
+  // number of them
+  TEST_ASSERT(parse_fails<int64_t>("memo: now t + ; 1 now"));
+  TEST_ASSERT(parse_fails<int64_t>("memo: peek @ ; 1 peek"));
+  TEST_ASSERT(parse_fails<int64_t>("memo: poke 1 ! 0 ; 1 poke"));
+  TEST_ASSERT(parse_fails<int64_t>("memo: hide >r r> ; 1 hide"));
+  TEST_ASSERT(parse_fails<int64_t>("memo: index i + ; 4 0 do 1 index loop"));
+  TEST_ASSERT(parse_fails<int64_t>(": now t ; memo: late now + ; 1 late"));
+  TEST_ASSERT(parse_fails<int64_t>("memo: odd if 1 2 then ; 1 odd"));
+  TEST_ASSERT(parse_fails<int64_t>("memo: none drop ; 1 none"));
+  TEST_ASSERT(parse_fails<int64_t>("memo: wide + + + + ; 1 2 3 4 5 wide"));
+  TEST_ASSERT(parse_fails<int64_t>("memo: outer : inner 1 ; ;"));
+  TEST_ASSERT(!parse_fails<int64_t>("memo: sum 0 4 0 do i + loop + ; 1 sum"));
+  }
+
+void test_locals_and_values()
+  {
+  // { a b } pops b and then a into globals of their own, which to can assign too
+  interpreter<int64_t> interpr;
+  interpr.make_variable("t");
+  auto words = tokenize("3 value gain : mix { a b } a b * a b + - gain * ; t 7 % t 3 % mix 4 to gain");
+  auto prog = interpr.parse(words);
+  TEST_EQ(std::string("t [7 %] t [3 %] to mix.b to mix.a mix.a mix.b * mix.a mix.b + - gain * 4 to gain"), interpr.dump(interpr.optimize(prog).statements));
+  TEST_EQ(3, interpr.globals[interpr.variables["gain"]]);
+  auto code = interpr.compile(prog);
+  TEST_ASSERT(code.effect.is_static);
+  TEST_EQ(1, code.effect.depth);
+  TEST_ASSERT(code.effect.carries_globals); // the next sample sees gain as 4
+  interpr.globals[0] = 12;
+  interpr.run(code);
+  TEST_EQ((5 * 0 - 5) * 3, interpr.pop());
+  TEST_EQ(4, interpr.globals[interpr.variables["gain"]]);
+
+  const char* scripts[] = {
+    ": mix { a b } a b * a b + - ; t 7 % t 3 % mix t 5 % 2 mix +",
+    "0 value acc acc t + 255 & to acc acc 3 *",
+    "5 value x t to x x x * t 1 + to x x +",
+    "2 value x : f { a } a to x a 1 + ; t f x +",
+    ": scale { v } v 3 * ; : twice { v } v v + ; t 3 % scale twice t sin scale +",
+    ": f { a } a 2 * ; : f { a } a 1 + f a + ; t f"
+    };
+  for (auto script : scripts)
+    {
+    TEST_ASSERT(run_equals_eval<int64_t>(script));
+    TEST_ASSERT(run_equals_eval<double>(script));
+    TEST_ASSERT(optimized_equals_parsed<int64_t>(script));
+    TEST_ASSERT(eval_block_equals_run<int64_t>(script, 0, 600));
+    TEST_ASSERT(eval_block_equals_run<double>(script, 100, 300, 0));
+    TEST_ASSERT(eval_block_stereo_equals_run<int64_t>(script, 0, 600));
+    TEST_ASSERT(eval_block_stereo_equals_run<double>(script, 7, 300));
+    }
+  // a redefinition that calls the word it replaces has locals of its own: (t + 1) * 2 + t
+  interpreter<int64_t> redefined;
+  redefined.make_variable("t");
+  words = tokenize(": f { a } a 2 * ; : f { a } a 1 + f a + ; t f");
+  auto code_redefined = redefined.compile(redefined.optimize(redefined.parse(words)));
+  for (int64_t t = 0; t < 4; ++t)
+    {
+    redefined.globals[0] = t;
+    redefined.run(code_redefined);
+    TEST_EQ(3 * t + 2, redefined.pop());
+    }
+  TEST_ASSERT(eval_block_stereo_equals_run<int64_t>(": pan { v } v c 1 + * ; t 3 % pan t pan +", 0, 600));
+  TEST_ASSERT(eval_block_stereo_equals_run<double>("2 value x : f { a } a to x a 1 + ; t f x + c +", 0, 600));
+  // locals are assigned before they are read, so the samples stay independent, but a value that
+  // is read before it is assigned carries over to the next sample
+  auto effect_of = [](const std::string& script)
+    {
+    interpreter<double> interpr;
+    interpr.make_variable("t");
+    auto words = tokenize(script);
+    return interpr.compile(interpr.parse(words)).effect;
+    };
+  TEST_ASSERT(effect_of(scripts[0]).lanes_are_independent());
+  TEST_ASSERT(effect_of(scripts[2]).lanes_are_independent());
+  TEST_ASSERT(!effect_of(scripts[1]).lanes_are_independent());
+  TEST_ASSERT(effect_of(scripts[1]).carries_globals);
+  auto deps = dependencies_of<int64_t>(": f { a } a 2 / ; t f");
+  TEST_ASSERT(deps.back() == DEP_STEP);
+  TEST_ASSERT(dependencies_of<int64_t>("0 value acc acc 1 + to acc acc")[0] == DEP_CHANNEL);
+
+  TEST_ASSERT(!parse_fails<int64_t>("memo: sq { a } a a * ; t sq"));
+  TEST_ASSERT(parse_fails<int64_t>("1 value x memo: bump x + ; t bump"));
+  TEST_ASSERT(parse_fails<int64_t>("1 value x memo: keep dup to x ; t keep"));
+  TEST_ASSERT(parse_fails<int64_t>("1 to t"));
+  TEST_ASSERT(parse_fails<int64_t>(": f { a } ; a"));
+  TEST_ASSERT(parse_fails<int64_t>("{ a } 1"));
+  TEST_ASSERT(parse_fails<int64_t>(": f if { a } then ;"));
+  TEST_ASSERT(parse_fails<int64_t>(": f { a ;"));
+  TEST_ASSERT(parse_fails<int64_t>("t value x"));
+  TEST_ASSERT(parse_fails<int64_t>(": f 1 value x ;"));
+  }
+
+void test_constants()
+  {
+  // a constant is replaced by its literal, which then folds like any other literal
+  interpreter<int64_t> interpr;
+  interpr.make_variable("t");
+  auto words = tokenize("440 constant a4 a4 2 / constant a3 : f a4 * ; t f a3 +");
+  auto prog = interpr.parse(words);
+  TEST_EQ(std::string("t [440 *] [220 +]"), interpr.dump(interpr.optimize(prog).statements));
+  TEST_EQ(1, (int)interpr.variables.size());
+
+  const char* scripts[] = {
+    "440 constant a4 t a4 * a4 2 / +",
+    "3 4 * constant twelve : semi twelve / ; t 8 >> semi t 5 >> twelve % +",
+    "7 constant k 1 k << constant mask t mask & k -"
+    };
+  for (auto script : scripts)
+    {
+    TEST_ASSERT(run_equals_eval<int64_t>(script));
+    TEST_ASSERT(run_equals_eval<double>(script));
+    TEST_ASSERT(optimized_equals_parsed<int64_t>(script));
+    }
+  TEST_ASSERT(parse_fails<int64_t>("t constant x"));
+  TEST_ASSERT(parse_fails<int64_t>(": f 1 constant x ;"));
+  TEST_ASSERT(parse_fails<int64_t>("1 constant"));
+  }
+
+void test_memory_size()
+  {
+  // the memory is rounded up to a power of two, and @ and ! wrap addresses around it
+  interpreter<int64_t> interpr;
+  interpr.make_variable("t");
+  TEST_EQ(256, (int)interpr.memory_stack.size());
+  interpr.set_memory_size(1000);
+  TEST_EQ(1024, (int)interpr.memory_stack.size());
+  auto words = tokenize("7 1000 ! 5 -1 ! 1000 @ 2024 @ + 1023 @ +");
+  auto prog = interpr.parse(words);
+  auto code = interpr.compile(prog);
+  interpr.run(code);
+  TEST_EQ(19, interpr.pop());
+  interpr.eval(prog);
+  TEST_EQ(19, interpr.pop());
+  TEST_EQ(7, interpr.memory_stack[1000]);
+  TEST_EQ(5, interpr.memory_stack[1023]);
+  interpr.set_memory_size(interpreter<int64_t>::max_memory_size * 4);
+  TEST_EQ(interpreter<int64_t>::max_memory_size, (int64_t)interpr.memory_stack.size());
+  TEST_EQ(0, interpr.memory_stack[1000]);
+  }
+
+void test_oscillators()
+  {
+  // the phase counts cycles, or 256ths of a cycle for integers
+  TEST_EQ(0.0, oscillator(WAVE_SIN, 0.0));
+  TEST_EQ(1.0, oscillator(WAVE_SIN, 0.25));
+  TEST_EQ(1.0, oscillator(WAVE_SIN, -0.75));
+  TEST_EQ(-1.0, oscillator(WAVE_SIN, 3.75));
+  double max_error = 0.0;
+  for (int i = 0; i <= 1000; ++i)
+    {
+    const double phase = -2.0 + i * 0.00437;
+    max_error = std::max(max_error, std::abs(oscillator(WAVE_SIN, phase) - std::sin(6.283185307179586 * phase)));
+    }
+  TEST_ASSERT(max_error < 1e-5);
+  TEST_ASSERT(oscillator(WAVE_SQUARE, 0.25) > 0.9);
+  TEST_ASSERT(oscillator(WAVE_SQUARE, 0.75) < -0.9);
+  TEST_ASSERT(oscillator(WAVE_SAW, 0.1) < oscillator(WAVE_SAW, 0.4));
+  TEST_ASSERT(oscillator(WAVE_SAW, 0.6) < oscillator(WAVE_SAW, 0.9));
+  TEST_ASSERT(oscillator(WAVE_SIN, std::numeric_limits<double>::infinity()) != oscillator(WAVE_SIN, std::numeric_limits<double>::infinity()));
+  TEST_EQ(128, oscillator(WAVE_SIN, (int64_t)0));
+  TEST_EQ(255, oscillator(WAVE_SIN, (int64_t)64));
+  TEST_EQ(255, oscillator(WAVE_SIN, (int64_t)(64 - 256 * 3)));
+  TEST_EQ(0, oscillator(WAVE_SIN, (int64_t)192));
+
+  // the words fold like the other operators
+  interpreter<double> interpr;
+  interpr.make_variable("t");
+  auto words = tokenize("t osc-saw 0.25 osc-sin +");
+  TEST_EQ(std::string("t osc-saw [1 +]"), interpr.dump(interpr.optimize(interpr.parse(words)).statements));
+  const char* scripts[] = {
+    "t 0.01 * osc-sin t 0.003 * osc-saw + t 0.007 * osc-square *",
+    "t 3 * osc-sin t osc-saw - t 5 >> osc-square +"
+    };
+  for (auto script : scripts)
+    {
+    TEST_ASSERT(run_equals_eval<int64_t>(script));
+    TEST_ASSERT(run_equals_eval<double>(script));
+    TEST_ASSERT(optimized_equals_parsed<int64_t>(script));
+    TEST_ASSERT(optimized_equals_parsed<double>(script));
+    TEST_ASSERT(eval_block_equals_run<int64_t>(script, 0, 600));
+    TEST_ASSERT(eval_block_equals_run<double>(script, 100, 300, 0));
+    }
+  }
+
+void test_delay_lines()
+  {
+  // x n delay leaves the x of n evaluations ago, x n gain feedback adds gain times its own output
+  // of n evaluations ago to x
+  auto outputs = [](interpreter<double>& interpr, const std::string& script, int samples)
+    {
+    auto words = tokenize(script);
+    auto code = interpr.compile(interpr.parse(words));
+    std::vector<double> out;
+    for (int t = 0; t < samples; ++t)
+      {
+      interpr.globals[0] = (double)t;
+      interpr.run(code);
+      out.push_back(interpr.pop());
+      }
+    return out;
+    };
+  interpreter<double> interpr;
+  interpr.make_variable("t");
+  TEST_ASSERT(outputs(interpr, "t 1 + 3 delay", 6) == std::vector<double>({ 0, 0, 0, 1, 2, 3 }));
+  TEST_EQ(3, interpr.delay_lines[0].mask);
+  interpr = interpreter<double>();
+  interpr.make_variable("t");
+  TEST_ASSERT(outputs(interpr, "t 0 = 3 0.5 feedback", 8) == std::vector<double>({ 1, 0, 0, 0.5, 0, 0, 0.25, 0 }));
+  interpreter<int64_t> bytes;
+  bytes.make_variable("t");
+  auto words = tokenize("t 0 = 255 & 2 128 feedback");
+  auto code = bytes.compile(bytes.parse(words));
+  std::vector<int64_t> byte_out;
+  for (int t = 0; t < 5; ++t)
+    {
+    bytes.globals[0] = t;
+    bytes.run(code);
+    byte_out.push_back(bytes.pop());
+    }
+  TEST_ASSERT(byte_out == std::vector<int64_t>({ 255, 0, 127, 0, 63 }));
+
+  // the ring holds the literal length, a computed length gets the default size, and a word
+  // that is inlined twice has two lines, where the line of the definition gets no samples
+  interpr = interpreter<double>();
+  interpr.make_variable("t");
+  words = tokenize("t 5000 delay t dup delay +");
+  interpr.parse(words);
+  TEST_EQ(8191, interpr.delay_lines[0].mask);
+  TEST_EQ(interpreter<double>::default_delay_size - 1, interpr.delay_lines[1].mask);
+  interpr = interpreter<double>();
+  interpr.make_variable("t");
+  TEST_ASSERT(outputs(interpr, ": echo 2 delay ; t echo t 10 * echo +", 5) == std::vector<double>({ 0, 0, 0, 11, 22 }));
+  TEST_EQ(3, (int)interpr.delay_lines.size());
+  TEST_EQ(16, (int)interpr.delay_memory.size());
+  TEST_ASSERT(parse_fails<double>("memo: m 3 delay ; t m"));
+  // so does a word that is too large to inline otherwise
+  std::string padding;
+  for (int k = 0; k < 16; ++k)
+    padding += " 0 +";
+  interpr = interpreter<double>();
+  interpr.make_variable("t");
+  const std::vector<double> called = outputs(interpr, ": e 3 delay" + padding + " ; t e t 100 + e +", 6);
+  interpr = interpreter<double>();
+  interpr.make_variable("t");
+  const std::vector<double> inlined = outputs(interpr, "t 3 delay" + padding + " t 100 + 3 delay" + padding + " +", 6);
+  TEST_ASSERT(called == std::vector<double>({ 0, 0, 0, 100, 102, 104 }));
+  TEST_ASSERT(called == inlined);
+  TEST_ASSERT(parse_fails<double>("t 4000000 delay t 4000000 delay t 4000000 delay t 4000000 delay t 4000000 delay t 4000000 delay t 4000000 delay t 4000000 delay t 4000000 delay"));
+
+  // every channel has a past of its own
+  interpr = interpreter<double>();
+  interpr.make_variable("t");
+  interpr.make_variable("sr");
+  interpr.make_variable("c");
+  words = tokenize("t c 100 * + 1 delay");
+  auto stereo_code = interpr.compile(interpr.parse(words));
+  TEST_ASSERT(!stereo_code.effect.lanes_are_independent());
+  std::vector<double> left(4), right(4);
+  interpr.eval_block_stereo(stereo_code, 10, 4, left.data(), right.data());
+  TEST_ASSERT(left == std::vector<double>({ 0, 10, 11, 12 }));
+  TEST_ASSERT(right == std::vector<double>({ 0, 110, 111, 112 }));
+  TEST_ASSERT(dependencies_of<int64_t>("t 3 delay").back() == DEP_CHANNEL);
+
+  words = tokenize("t 3 delay 0.5 * 1 2 + 0.25 feedback");
+  interpr = interpreter<double>();
+  interpr.make_variable("t");
+  TEST_EQ(std::string("t 3 delay [0.5 *] 3 0.25 feedback"), interpr.dump(interpr.optimize(interpr.parse(words)).statements));
+  const char* scripts[] = {
+    "t 7 * 255 & 100 delay t 3 >> 50 delay +",
+    "t 5 % 40 t 3 % 2 + * feedback 255 &",
+    ": echo 20 delay ; t echo echo t 1 + echo -",
+    "t 9 & if t 3 delay else t 5 delay then"
+    };
+  for (auto script : scripts)
+    {
+    TEST_ASSERT(run_equals_eval<int64_t>(script, 300));
+    TEST_ASSERT(run_equals_eval<double>(script, 300));
+    TEST_ASSERT(optimized_equals_parsed<int64_t>(script, 300));
+    TEST_ASSERT(optimized_equals_parsed<double>(script, 300));
+    TEST_ASSERT(eval_block_equals_run<int64_t>(script, 0, 600));
+    TEST_ASSERT(eval_block_equals_run<double>(script, 100, 300, 0));
+    }
+  }
+
+void test_filters()
+  {
+  // the gain at 0 Hz, and the gain of the bandpass at its frequency
+  auto gain = [](e_filter kind, double frequency, double q, double cycle)
+    {
+    filter_coefficients c = make_filter(kind, frequency, q);
+    double z1 = 0.0, z2 = 0.0, peak = 0.0;
+    for (int i = 0; i < 20000; ++i)
+      {
+      double y = filter_sample(c, z1, z2, std::cos(6.283185307179586 * cycle * i));
+      if (i >= 10000)
+        peak = std::max(peak, std::abs(y));
+      }
+    return peak;
+    };
+  TEST_ASSERT(std::abs(gain(FILTER_ONE_POLE_LOWPASS, 0.01, 0.0, 0.0) - 1.0) < 1e-9);
+  TEST_ASSERT(gain(FILTER_ONE_POLE_HIGHPASS, 0.01, 0.0, 0.0) < 1e-9);
+  TEST_ASSERT(gain(FILTER_ONE_POLE_LOWPASS, 0.001, 0.0, 0.25) < 0.01);
+  TEST_ASSERT(std::abs(gain(FILTER_LOWPASS, 0.05, 0.7071, 0.0) - 1.0) < 1e-9);
+  TEST_ASSERT(gain(FILTER_LOWPASS, 0.01, 0.7071, 0.3) < 0.001);
+  TEST_ASSERT(gain(FILTER_HIGHPASS, 0.05, 0.7071, 0.0) < 1e-9);
+  TEST_ASSERT(std::abs(gain(FILTER_BANDPASS, 0.1, 2.0, 0.1) - 1.0) < 1e-3);
+  TEST_ASSERT(gain(FILTER_BANDPASS, 0.1, 2.0, 0.0) < 1e-9);
+
+  // literal parameters, also after folding, are made into coefficients once, at sr
+  interpreter<double> interpr;
+  interpr.make_variable("t");
+  interpr.make_variable("sr");
+  interpr.make_variable("c");
+  interpr.set_variable_value("sr", 8000.0);
+  auto words = tokenize("t 1000 lowpass 500 2 * 0.5 bq-highpass t dup 100 * 1 bq-bandpass +");
+  auto prog = interpr.parse(words);
+  TEST_EQ(std::string("t [1000 lowpass] [1000 0.5 bq-highpass] t dup [100 *] 1 bq-bandpass +"), interpr.dump(interpr.optimize(prog).statements));
+  TEST_EQ(3, (int)interpr.filters.size());
+  TEST_ASSERT(interpr.filters[1].coefficients.b0 == make_filter(FILTER_HIGHPASS, 0.125, 0.5).b0);
+  auto code = interpr.compile(prog);
+  TEST_ASSERT(!code.runs_in_lanes());
+  TEST_ASSERT(dependencies_of<double>("t 0.1 lowpass").back() == DEP_CHANNEL);
+  TEST_ASSERT(parse_fails<double>("memo: smooth 0.1 lowpass ; t smooth"));
+  // every use of a word has filters of its own, also when the word is too large to inline
+  // otherwise
+  std::string padding;
+  for (int k = 0; k < 16; ++k)
+    padding += " 0 +";
+  auto filtered = [](const std::string& script)
+    {
+    interpreter<double> interpr;
+    interpr.make_variable("t");
+    interpr.make_variable("sr");
+    interpr.set_variable_value("sr", 8000.0);
+    auto words = tokenize(script);
+    auto code = interpr.compile(interpr.parse(words));
+    std::vector<double> out;
+    for (int t = 0; t < 300; ++t)
+      {
+      interpr.globals[0] = (double)t;
+      interpr.run(code);
+      out.push_back(interpr.pop());
+      }
+    return out;
+    };
+  TEST_ASSERT(filtered(": e 500 lowpass" + padding + " ; t 7 * 255 & e t 3 * 255 & e -") == filtered("t 7 * 255 & 500 lowpass" + padding + " t 3 * 255 & 500 lowpass" + padding + " -"));
+  TEST_ASSERT(filtered(": e 3 delay 900 2 bq-bandpass" + padding + " ; t 5 * 255 & e t e +") == filtered("t 5 * 255 & 3 delay 900 2 bq-bandpass" + padding + " t 3 delay 900 2 bq-bandpass" + padding + " +"));
+
+  // a program that ends with filters with literal parameters is evaluated lane by lane up to
+  // the filters, which then run over the block
+  words = tokenize(": smooth 300 lowpass ; t 7 * 255 & smooth t 3 * 255 & smooth + 2000 0.8 bq-lowpass");
+  interpr = interpreter<double>();
+  interpr.make_variable("t");
+  interpr.make_variable("sr");
+  interpr.make_variable("c");
+  interpr.set_variable_value("sr", 8000.0);
+  code = interpr.compile(interpr.parse(words));
+  TEST_EQ(4, (int)interpr.filters.size());
+  TEST_EQ(0, code.filter_tail);
+  words = tokenize("t 7 * 255 & t 3 >> 3 * 255 & c * + 300 lowpass 2000 0.8 bq-lowpass");
+  code = interpr.compile(interpr.parse(words));
+  TEST_EQ(2, code.filter_tail);
+  TEST_ASSERT(code.runs_in_lanes());
+
+  const char* scripts[] = {
+    "t 7 * 255 & t 3 >> 3 * 255 & + 300 lowpass 2000 0.8 bq-lowpass",
+    "t 5 >> 255 & 2000 highpass 127 +",
+    "t 7 * 255 & t 13 >> 7 & 300 * 100 + 2 bq-lowpass",
+    ": smooth 300 lowpass ; t 7 * 255 & smooth t 3 * 255 & smooth + 2000 0.8 bq-lowpass"
+    };
+  for (auto script : scripts)
+    {
+    TEST_ASSERT(run_equals_eval<int64_t>(script, 300));
+    TEST_ASSERT(run_equals_eval<double>(script, 300));
+    TEST_ASSERT(optimized_equals_parsed<int64_t>(script, 300));
+    TEST_ASSERT(optimized_equals_parsed<double>(script, 300));
+    TEST_ASSERT(eval_block_equals_run<int64_t>(script, 0, 600));
+    TEST_ASSERT(eval_block_equals_run<double>(script, 100, 300, 0));
+    }
+  const char* stereo_scripts[] = {
+    "t 7 * 255 & t 3 >> 3 * 255 & c * + 300 lowpass 2000 0.8 bq-lowpass",
+    "t 7 * 255 & t 13 >> 7 & 300 * 100 + 4 c + bq-bandpass 2000 c 0.5 * 0.5 + bq-highpass"
+    };
+  for (auto script : stereo_scripts)
+    {
+    TEST_ASSERT(eval_block_stereo_equals_run<int64_t>(script, 0, 600));
+    TEST_ASSERT(eval_block_stereo_equals_run<double>(script, 100, 300));
+    }
+  }
+
+void test_control_rate()
+  {
+  // the t of a k: word is rounded down to a multiple of the control rate, also in the words that
+  // it inlines, so that eval_block computes it once per run
+  interpreter<double> interpr;
+  interpr.make_variable("t");
+  interpr.make_variable("sr");
+  interpr.make_variable("c");
+  interpr.control_rate = 100;
+  auto words = tokenize(": ramp t 3 * ; k: env ramp sin ; env t +");
+  auto prog = interpr.parse(words);
+  TEST_EQ(std::string("t 100 / floor 100 * 3 * sin t +"), interpr.dump(prog.statements));
+  TEST_EQ(std::string("t [100 /] floor [100 *] [3 *] sin t +"), interpr.dump(interpr.optimize(prog).statements));
+  auto code = interpr.compile(interpr.optimize(prog));
+  TEST_EQ(100, (int)code.periods[4]);
+  TEST_ASSERT(code.dependencies[5] == DEP_STEP);
+  TEST_EQ(100, (int)code.periods[5]);
+  TEST_ASSERT(code.dependencies.back() == DEP_SAMPLE);
+  TEST_ASSERT(parse_fails<double>("k: f k: g ; ;"));
+  interpr.control_rate = 64;
+  words = tokenize("k: f t 2 + ; f");
+  prog = interpr.optimize(interpr.parse(words));
+  TEST_EQ(std::string("t [6 >>] [6 <<] [2 +]"), interpr.dump(prog.statements));
+  code = interpr.compile(prog);
+  TEST_EQ(64, (int)code.periods.back());
+
+  // the periods of steps, and of what is computed from them
+  auto periods_of = [](const std::string& script, bool floating)
+    {
+    auto words = tokenize(script);
+    std::vector<int64_t> periods;
+    if (floating)
+      {
+      interpreter<double> interpr;
+      interpr.make_variable("t");
+      interpr.make_variable("sr");
+      interpr.make_variable("c");
+      periods = interpr.compile(interpr.parse(words)).periods;
+      }
+    else
+      {
+      interpreter<int64_t> interpr;
+      interpr.make_variable("t");
+      interpr.make_variable("sr");
+      interpr.make_variable("c");
+      periods = interpr.compile(interpr.parse(words)).periods;
+      }
+    return periods.empty() ? (int64_t)-1 : periods.back();
+    };
+  TEST_EQ(65536, periods_of("t 16 >> 3 *", false));
+  TEST_EQ(1000, periods_of("t 1000 / 7 &", false));
+  TEST_EQ(200, periods_of("t 1000 / t 600 / +", false));
+  TEST_EQ(0, periods_of("t 3 * 16 >>", false));
+  TEST_EQ(0, periods_of("5 @ t 16 >> +", false));
+  TEST_EQ(0, periods_of("t 16 >> t +", false));
+  TEST_EQ(64, periods_of("t 64 / floor sr *", true));
+  TEST_EQ(0, periods_of("t 64 / ceil", true));
+  TEST_EQ(0, periods_of("t 2.5 / floor", true));
+  TEST_EQ(0, periods_of("t 1000 / 5 % floor", true));
+  TEST_EQ(-1, periods_of("t if 1 then", true));
+
+  const char* scripts[] = {
+    "k: env t 0.001 * sin 1 + 100 * ; t 7 * 255 & env *",
+    "k: seq t 13 >> 7 & ; : note seq 3 * 40 + ; t note * 255 &",
+    "k: lfo t 1000 % 0.5 * ; k: step t 8192 / 3 & ; t lfo + step *",
+    "k: a t 64 >> ; t a +",
+    "k: a t 0.01 * sin 100 * ; k: b a 2 * t 700 % + ; t b +"
+    };
+  for (auto script : scripts)
+    {
+    TEST_ASSERT(run_equals_eval<int64_t>(script, 300));
+    TEST_ASSERT(run_equals_eval<double>(script, 300));
+    TEST_ASSERT(optimized_equals_parsed<int64_t>(script, 300));
+    TEST_ASSERT(optimized_equals_parsed<double>(script, 300));
+    TEST_ASSERT(eval_block_equals_run<int64_t>(script, 0, 600));
+    TEST_ASSERT(eval_block_equals_run<double>(script, 100, 700, 0));
+    TEST_ASSERT(eval_block_equals_run<double>(script, 8190, 300, 0));
+    }
+  TEST_ASSERT(eval_block_stereo_equals_run<double>("k: pan t 0.01 * sin c * ; t 5 * 255 & pan *", 37, 600));
+  TEST_ASSERT(eval_block_stereo_equals_run<int64_t>("k: pan t 7 >> c + ; t 5 * 255 & pan *", 37, 600));
+
+  // the value of a k: word holds for control_rate samples
+  interpreter<double> held;
+  held.make_variable("t");
+  held.control_rate = 32;
+  code = held.compile(held.optimize(held.parse(words = tokenize("k: lfo t 0.01 * sin ; lfo"))));
+  std::vector<double> out(256);
+  held.eval_block(code, 1000, 256, 0, out.data());
+  for (int k = 0; k < 256; ++k)
+    TEST_EQ(std::sin((double)((1000 + k) / 32 * 32) * 0.01), out[k]);
+
+  // also in the words that a k: word calls, which get copies of their own
+  std::string big = ": big t";
+  for (int k = 0; k < 40; ++k)
+    big += " 0 +";
+  big += " ; ";
+  interpreter<int64_t> called;
+  called.make_variable("t");
+  called.control_rate = 4;
+  auto called_code = called.compile(called.parse(words = tokenize(big + "k: kk big ; k: k2 big 1 + ; kk k2 + big +")));
+  for (int64_t t = 0; t < 12; ++t)
+    {
+    called.globals[0] = t;
+    called.run(called_code);
+    TEST_EQ(t / 4 * 4 * 2 + 1 + t, called.pop());
+    }
+  TEST_EQ(2, (int)called.words.size());
+  TEST_ASSERT(run_equals_eval<double>(big + "k: kk big ; k: k2 big 1 + ; kk k2 + big +", 300));
+  TEST_ASSERT(eval_block_equals_run<double>(big + ": twice big big + ; k: kk twice ; kk t twice +", 0, 600));
+  }
+
+void test_spsc_ring()
+  {
+  spsc_ring<int16_t> ring(6);
+  TEST_EQ(8, (int)ring.capacity());
+  int16_t in[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+  int16_t out[8] = { 0 };
+  TEST_EQ(5, (int)ring.write(in, 5));
+  TEST_EQ(3, (int)ring.read(out, 3));
+  TEST_EQ(3, (int)out[2]);
+  // wraps around the end, and only takes what fits
+  TEST_EQ(6, (int)ring.write(in, 8));
+  TEST_EQ(8, (int)ring.size());
+  TEST_EQ(0, (int)ring.write(in, 1));
+  TEST_EQ(8, (int)ring.read(out, 8));
+  const int16_t expected[8] = { 4, 5, 1, 2, 3, 4, 5, 6 };
+  for (int i = 0; i < 8; ++i)
+    TEST_EQ(expected[i], out[i]);
+  TEST_EQ(0, (int)ring.read(out, 8));
+
+  // a producer and a consumer thread pass a sequence through a small ring without losing or reordering values
+  const uint32_t count = 200000;
+  spsc_ring<uint32_t> shared(64);
+  std::thread producer([&]()
+    {
+    uint32_t chunk[17];
+    uint32_t next = 0;
+    while (next < count)
+      {
+      uint32_t n = 0;
+      while (n < 17 && next + n < count)
+        {
+        chunk[n] = next + n;
+        ++n;
+        }
+      size_t written = 0;
+      while (written < n)
+        {
+        written += shared.write(chunk + written, n - written);
+        std::this_thread::yield();
+        }
+      next += n;
+      }
+    });
+  bool in_order = true;
+  uint32_t expected_next = 0;
+  uint32_t values[23];
+  while (expected_next < count)
+    {
+    const size_t n = shared.read(values, 23);
+    for (size_t i = 0; i < n; ++i)
+      in_order = in_order && values[i] == expected_next++;
+    if (n == 0)
+      std::this_thread::yield();
+    }
+  producer.join();
+  TEST_ASSERT(in_order);
+  TEST_EQ(0, (int)shared.size());
+  }
+
+namespace
+  {
+  // resamples the input in chunks of the given sizes, which are repeated until frames frames are made
+  std::vector<int16_t> resample(e_resample_quality quality, uint32_t input_rate, uint32_t output_rate, const std::vector<int32_t>& input, uint32_t frames, const std::vector<uint32_t>& chunks)
+    {
+    resampler r;
+    r.reset(input_rate, output_rate, quality);
+    std::vector<int16_t> out(frames * 2);
+    uint32_t done = 0;
+    size_t pushed = 0;
+    size_t chunk = 0;
+    while (done < frames)
+      {
+      const uint32_t n = std::min(chunks[chunk++ % chunks.size()], frames - done);
+      const uint32_t needed = r.input_needed(n);
+      if (pushed + needed > input.size())
+        return std::vector<int16_t>();
+      r.push(input.data() + pushed, input.data() + pushed, needed);
+      pushed += needed;
+      r.process(out.data() + done * 2, n, 2);
+      done += n;
+      }
+    return out;
+    }
+  }
+
+void test_resampler()
+  {
+  TEST_ASSERT(resample_quality("sinc") == RESAMPLE_SINC);
+  TEST_ASSERT(resample_quality("cubic") == RESAMPLE_QUALITY_COUNT);
+  std::vector<int32_t> ramp(20000);
+  for (size_t i = 0; i < ramp.size(); ++i)
+    ramp[i] = (int32_t)(i % 30000);
+
+  // hold repeats sample n * 8000 / 44100, the zero-order hold of the original audio callback
+  auto held = resample(RESAMPLE_HOLD, 8000, 44100, ramp, 5000, { 4096 });
+  TEST_EQ(10000, (int)held.size());
+  bool ok = true;
+  for (uint32_t n = 0; n < 5000; ++n)
+    ok = ok && held[2 * n] == (int16_t)(n * 8000 / 44100) && held[2 * n + 1] == held[2 * n];
+  TEST_ASSERT(ok);
+
+  // linear lies on the ramp
+  auto linear = resample(RESAMPLE_LINEAR, 8000, 48000, ramp, 5000, { 256 });
+  ok = true;
+  for (uint32_t n = 0; n < 5000; ++n)
+    ok = ok && std::abs(linear[2 * n] - std::floor(n / 6.0 + 0.5)) <= 1.0;
+  TEST_ASSERT(ok);
+
+  // every quality gives the same frames however the output is cut into chunks
+  for (int q = 0; q < RESAMPLE_QUALITY_COUNT; ++q)
+    {
+    auto whole = resample((e_resample_quality)q, 11025, 44100, ramp, 6000, { 6000 });
+    auto chunked = resample((e_resample_quality)q, 11025, 44100, ramp, 6000, { 1, 255, 37, 512 });
+    TEST_ASSERT(!whole.empty() && whole == chunked);
+    auto down = resample((e_resample_quality)q, 96000, 44100, ramp, 4000, { 4000 });
+    auto down_chunked = resample((e_resample_quality)q, 96000, 44100, ramp, 4000, { 100, 3 });
+    TEST_ASSERT(!down.empty() && down == down_chunked);
+    }
+
+  // the windowed sincs reconstruct a 440 Hz tone at 8000 Hz closely, once the silence before it has left the filter
+  std::vector<int32_t> tone(20000);
+  for (size_t i = 0; i < tone.size(); ++i)
+    tone[i] = (int32_t)std::floor(std::sin(2.0 * 3.14159265358979323846 * 440.0 * (double)i / 8000.0) * 8000.0);
+  for (auto quality : { RESAMPLE_SINC, RESAMPLE_BEST })
+    {
+    auto out = resample(quality, 8000, 44100, tone, 40000, { 512 });
+    double max_error = 0.0;
+    for (uint32_t n = 1000; n < 40000; ++n)
+      {
+      const double expected = std::sin(2.0 * 3.14159265358979323846 * 440.0 * (double)n / 44100.0) * 8000.0;
+      max_error = std::max(max_error, std::abs(out[2 * n] - expected));
+      }
+    TEST_ASSERT(max_error < 40.0);
+    }
+  }
+
+namespace
+  {
+  uint32_t read32(const std::vector<unsigned char>& bytes, size_t pos)
+    {
+    return bytes[pos] | (bytes[pos + 1] << 8) | (bytes[pos + 2] << 16) | ((uint32_t)bytes[pos + 3] << 24);
+    }
+
+  uint64_t read64(const std::vector<unsigned char>& bytes, size_t pos)
+    {
+    return read32(bytes, pos) | ((uint64_t)read32(bytes, pos + 4) << 32);
+    }
+
+  std::vector<unsigned char> write_wav(const std::string& filename, const std::vector<int16_t>& samples, uint64_t riff_limit)
+    {
+    wav_writer writer(riff_limit);
+    if (!writer.open(filename, 44100, 2))
+      return std::vector<unsigned char>();
+    // in pieces that are not a multiple of the blocks
+    for (size_t i = 0; i < samples.size(); i += 1000)
+      writer.write_all(samples.data() + i, std::min<size_t>(1000, samples.size() - i));
+    writer.close();
+    std::vector<unsigned char> bytes;
+    FILE* f = fopen(filename.c_str(), "rb");
+    int c;
+    while ((c = fgetc(f)) != EOF)
+      bytes.push_back((unsigned char)c);
+    fclose(f);
+    remove(filename.c_str());
+    return bytes;
+    }
+  }
+
+void test_wav_writer()
+  {
+  std::vector<int16_t> samples(100000);
+  for (size_t i = 0; i < samples.size(); ++i)
+    samples[i] = (int16_t)(i * 7);
+  auto riff = write_wav("forth_tests_riff.wav", samples, wav_riff_limit);
+  TEST_EQ(80 + 200000, (int)riff.size());
+  TEST_ASSERT(memcmp(riff.data(), "RIFF", 4) == 0 && memcmp(riff.data() + 12, "JUNK", 4) == 0 && memcmp(riff.data() + 72, "data", 4) == 0);
+  TEST_EQ(80 - 8 + 200000, (int)read32(riff, 4));
+  TEST_EQ(44100, (int)read32(riff, 60));
+  TEST_EQ(200000, (int)read32(riff, 76));
+  TEST_ASSERT(memcmp(riff.data() + 80, samples.data(), 200000) == 0);
+
+  // beyond the riff limit the header becomes RF64, with the sizes in ds64
+  auto rf64 = write_wav("forth_tests_rf64.wav", samples, 100000);
+  TEST_EQ(80 + 200000, (int)rf64.size());
+  TEST_ASSERT(memcmp(rf64.data(), "RF64", 4) == 0 && memcmp(rf64.data() + 12, "ds64", 4) == 0);
+  TEST_EQ(0xFFFFFFFF, read32(rf64, 4));
+  TEST_EQ(0xFFFFFFFF, read32(rf64, 76));
+  TEST_EQ(80 - 8 + 200000, (int)read64(rf64, 20));
+  TEST_EQ(200000, (int)read64(rf64, 28));
+  TEST_EQ(50000, (int)read64(rf64, 36));
+  TEST_ASSERT(memcmp(rf64.data() + 80, samples.data(), 200000) == 0);
+
+  // a writer that is not open takes nothing
+  wav_writer closed;
+  TEST_EQ(0, (int)closed.write(samples.data(), 10));
+  }
+
 void run_all_forth_tests()
   {
   test_tokenize();
@@ -146,4 +1476,28 @@ void run_all_forth_tests()
   test_eval_add();
   test_eval_sub();
   test_store_fetch();
+  test_compile();
+  test_run_add();
+  test_run_equals_eval();
+  test_stack_effect();
+  test_constant_divisor();
+  test_eval_block();
+  test_dependencies();
+  test_eval_block_memoized();
+  test_eval_block_stereo();
+  test_optimize();
+  test_control_flow();
+  test_called_words();
+  test_called_words_stress();
+  test_memo_words();
+  test_locals_and_values();
+  test_constants();
+  test_memory_size();
+  test_oscillators();
+  test_delay_lines();
+  test_filters();
+  test_control_rate();
+  test_spsc_ring();
+  test_resampler();
+  test_wav_writer();
   }
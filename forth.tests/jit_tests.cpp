@@ -0,0 +1,258 @@
+#include "jit_tests.h"
+#include "test_assert.h"
+
+#include <forthbyte/jit.h>
+
+#include <cstring>
+#include <random>
+#include <string>
+
+using namespace forth;
+
+namespace
+  {
+  template <class Values>
+  bool same_values(const Values& a, const Values& b)
+    {
+    if (a.size() != b.size())
+      return false;
+    for (size_t i = 0; i < a.size(); ++i)
+      {
+      if (a[i] != a[i] && b[i] != b[i]) // nan payloads may differ
+        continue;
+      if (memcmp(&a[i], &b[i], sizeof(a[i])) != 0)
+        return false;
+      }
+    return true;
+    }
+
+  template <class T>
+  interpreter<T> make_filled_interpreter(int64_t memory_size = 256)
+    {
+    interpreter<T> interpr;
+    interpr.set_memory_size(memory_size);
+    interpr.make_variable("t");
+    interpr.make_variable("sr");
+    interpr.make_variable("c");
+    interpr.set_variable_value("sr", (T)8000);
+    for (int i = 0; i < 256; ++i)
+      {
+      interpr.stack[i] = (T)(i * 7 - 300);
+      interpr.return_stack[i] = (T)(i - 5);
+      }
+    for (size_t i = 0; i < interpr.memory_stack.size(); ++i)
+      interpr.memory_stack[i] = (T)(i * 3 + 1);
+    return interpr;
+    }
+
+  // runs the script samples times with run and with the jit, and compares everything the interpreter holds
+  template <class T>
+  bool jit_equals_run(const std::string& script, int samples, bool optimize = false, int64_t memory_size = 256)
+    {
+    auto reference = make_filled_interpreter<T>(memory_size);
+    auto words = tokenize(script);
+    auto prog = reference.parse(words);
+    if (optimize)
+      prog = reference.optimize(prog);
+    auto code = reference.compile(prog);
+    auto native = reference;
+    jit<T> j;
+    if (!j.compile(code))
+      return false;
+    for (int s = 0; s < samples; ++s)
+      {
+      reference.globals[0] = (T)(s * 37);
+      native.globals[0] = (T)(s * 37);
+      reference.globals[2] = (T)(s & 1);
+      native.globals[2] = (T)(s & 1);
+      reference.run(code);
+      j.run(native);
+      if (reference.stack_pointer != native.stack_pointer || reference.return_stack_pointer != native.return_stack_pointer)
+        return false;
+      if (!same_values(reference.stack, native.stack) || !same_values(reference.memory_stack, native.memory_stack) || !same_values(reference.return_stack, native.return_stack) || !same_values(reference.globals, native.globals))
+        return false;
+      }
+    return true;
+    }
+
+  const char* scripts[] = {
+    "1 2 +",
+    "t 1000 / t 3 >> -",
+    "t dup * 1 2 rot 2 pick >r + r> nip c + tuck 2dup over - -rot swap min max sr + 0 / not",
+    "3000 t 16383 & / 1 & 35 * t 16 >> 3 & @ t * 24 / 127 & t 8 >> t 10 >> ^ t 14 >> | 63 & + +",
+    "t 5 * 3 >> t & t 4096 % 1024 < & t 12 >> 19 & 1 + 25 * pick 208 % 3 * + + 4 / 255 & dup dup 4 *",
+    "3 @ t + dup 3 !",
+    "drop drop 5 swap",
+    "t t t t t t t t t t t t t t t t + + + + + + + + + + + + + + +",
+    "t 7 % t 3 + t -1 / t 0 / t abs negate t 5 > t 5 < t 5 <= t 5 >= t 5 = t 5 <> + + + + + + + + + + +",
+    "t sin t cos + t tan + t log + t exp + t sqrt + t floor + t ceil + t 2 pow + t 3 atan2 +",
+    "t 1 t - pick t 300 - pick +",
+    ">r >r r> r> t +",
+    "t -5 pick",
+    ": mix { a b } a b * a b + - ; t 7 % t 3 % mix t 5 % 2 mix +",
+    "0 value acc acc t + 255 & to acc acc 3 * 5 value x x to acc t to x x acc + x to acc",
+    "1 value x 2 value y x y to x to y x y -",
+    "t 3 * osc-sin t 7 / osc-saw + t -5 * osc-square * t 0 / osc-sin +"
+    };
+  }
+
+void test_jit_scripts_int()
+  {
+  for (auto script : scripts)
+    TEST_ASSERT(jit_equals_run<int64_t>(script, 300));
+  // addresses wrap around a larger memory too, also when they are negative
+  TEST_ASSERT(jit_equals_run<int64_t>("t 3000 + @ t 5 * 2 - ! t -3 * @ t 4097 + @ + t 3 - 7000 !", 300, false, 4096));
+  }
+
+void test_jit_scripts_double()
+  {
+  for (auto script : scripts)
+    TEST_ASSERT(jit_equals_run<double>(script, 300));
+  TEST_ASSERT(jit_equals_run<double>("t 100 / sin t 3000 / sin 100 * * 1 t 16000 / 5 % 1 + floor 0.25 * - 8 pow * c 0.5 * + 0 / t 0 * t 1 << t 3 & t 5 | t 9 ^ + + + + + +", 300));
+  TEST_ASSERT(jit_equals_run<double>("t 2.5 pick t 100 / cos t tan t log t exp t sqrt t ceil t abs t negate t 3 atan2 + + + + + + + + 3 @ * not", 300));
+  TEST_ASSERT(jit_equals_run<double>("t 3000 + @ t 5 * 2 - ! t -3 * @ t 4097 + @ + t 3 - 7000 !", 300, false, 4096));
+  }
+
+void test_jit_fused()
+  {
+  const char* fused[] = {
+    "t 3 + t 3 - t 3 * t 3 / t 7 % t 3 << t 3 >> t 3 & t 3 | t 3 ^ t dup * + + + + + + + + + +",
+    "t 0 / t -1 / t 0 * t 1 2 + * 1 2 swap - t dup dup * * +",
+    "3000 t 16383 & / 1 & 35 * t 16 >> 3 & @ t * 24 / 127 & t 8 >> t 10 >> ^ t 14 >> | 63 & + +",
+    // literal divisors of integer programs are multiplied with, see constant_divisor
+    "t 5000 - 24 / t 5000 - 1000 % t 5000 - -7 / t 5000 - 16384 % t 5000 - -8 / t 5000 - 3 % t 5000 - 4611686018427387904 / t 5000 - 10000000007 % t 5000 - -1000000007 / + + + + + + + +"
+    };
+  for (auto script : fused)
+    {
+    TEST_ASSERT(jit_equals_run<int64_t>(script, 300));
+    TEST_ASSERT(jit_equals_run<int64_t>(script, 300, true));
+    TEST_ASSERT(jit_equals_run<double>(script, 300, true));
+    }
+  TEST_ASSERT(jit_equals_run<double>("t 0.5 * t 0.25 / t 0.3 % t dup * 3.5 pow + + +", 300, true));
+  }
+
+void test_jit_common_subexpressions()
+  {
+  const char* shared[] = {
+    "t 1000 / 5 % 1 + floor t 1000 / 9 % 1 + floor t 1000 / 5 % +",
+    "3 @ 3 @ + 3 ! 3 @ 3 @ t 3 @ 4 ! 3 @",
+    "t 7 * t 7 * t 7 * t 7 * >r >r + r> r> * -",
+    "t 7 * dup t 15 & pick t 7 * 1 pick t 7 * 3 pick t 7 * + + + + + +",
+    "t 7 * >r 1 + r> t 7 * -rot + t 1 pick 7 * t 7 * t 7 * t 7 * t 7 * t 7 * t 7 * t 7 * t 7 * t 7 * t 7 * t 7 * t 7 * t 7 * t 7 * t 7 * t 7 * t 7 * t 7 * t 7 *"
+    };
+  for (auto script : shared)
+    {
+    TEST_ASSERT(jit_equals_run<int64_t>(script, 300));
+    TEST_ASSERT(jit_equals_run<double>(script, 300));
+    TEST_ASSERT(jit_equals_run<int64_t>(script, 300, true));
+    TEST_ASSERT(jit_equals_run<double>(script, 300, true));
+    }
+
+  auto interpr = make_filled_interpreter<double>();
+  auto words = tokenize("t 1000 / sin t 1000 / sin 100 * +");
+  auto code = interpr.compile(interpr.parse(words));
+  jit<double> j;
+  TEST_ASSERT(j.compile(code));
+  TEST_EQ(2, j.shared_count()); // the second / and sin
+  TEST_ASSERT(j.compile(code, false));
+  TEST_EQ(0, j.shared_count());
+  // fetches from an address that may lie outside of the memory are not shared
+  words = tokenize("t 3 & @ t 3 & @ t @ t @ 4 @ 4 @ + + + + +");
+  code = interpr.compile(interpr.parse(words));
+  TEST_ASSERT(j.compile(code));
+  TEST_EQ(3, j.shared_count()); // t 3 &, t 3 & @ and 4 @
+  }
+
+void test_jit_memoized()
+  {
+  auto interpr = make_filled_interpreter<double>();
+  auto words = tokenize("t 1000 / 5 % 1 + floor 5 pow t 1000 / 7 % 1 + floor 2.5 pow * t 3000 / sin *");
+  auto code = interpr.compile(interpr.parse(words));
+  jit<double> j;
+  TEST_ASSERT(j.compile(code));
+  TEST_EQ(2, j.memoized_count()); // the pows, t 3000 / sin changes every sample
+  TEST_ASSERT(j.compile(code, true, false));
+  TEST_EQ(0, j.memoized_count());
+
+  const char* scripts[] = {
+    "t 1000 / 5 % 1 + floor 5 pow t 1000 / 7 % 1 + floor 2.5 pow * t 3000 / sin *",
+    "t 12 >> 3 & @ exp t 9 >> sin + t 9 >> cos t 9 >> tan + +",
+    "t 300 / floor negate 0.5 pow t 700 / floor 1 - log + t 100 / floor 3 atan2 +"
+    };
+  for (auto script : scripts)
+    {
+    TEST_ASSERT(jit_equals_run<int64_t>(script, 300));
+    TEST_ASSERT(jit_equals_run<double>(script, 300));
+    TEST_ASSERT(jit_equals_run<int64_t>(script, 300, true));
+    TEST_ASSERT(jit_equals_run<double>(script, 300, true));
+    }
+  }
+
+void test_jit_random_programs()
+  {
+  // @ and ! take any address, negative and beyond the memory too, which every engine masks
+  const char* words[] = { "t", "c", "sr", "1", "3", "-2", "7", "200", "+", "-", "*", "7 /", "<<", ">>", "&", "|", "^", "not", "<", ">", "<=", ">=", "=", "<>",
+    "dup", "15 & pick", "drop", "2dup", "over", "nip", "tuck", "swap", "rot", "-rot", "min", "max", "negate", "abs", "@", "!", ">r", "r>", "sin", "sqrt", "floor", "1 pick", "3 pick" };
+  const char* double_words[] = { "%", "tan", "log", "exp", "pow", "atan2", "0.5", "2.5" };
+  const int nr_words = (int)(sizeof(words) / sizeof(words[0]));
+  const int nr_double_words = (int)(sizeof(double_words) / sizeof(double_words[0]));
+  std::mt19937 gen(2024);
+  for (int it = 0; it < 400; ++it)
+    {
+    bool is_double = (it & 1) != 0;
+    int length = 1 + (int)(gen() % 40);
+    std::string script;
+    for (int k = 0; k < length; ++k)
+      {
+      int w = (int)(gen() % (nr_words + (is_double ? nr_double_words : 0)));
+      script.append(w < nr_words ? words[w] : double_words[w - nr_words]);
+      script.push_back(' ');
+      }
+    TEST_ASSERT(is_double ? jit_equals_run<double>(script, 20) : jit_equals_run<int64_t>(script, 20));
+    }
+  }
+
+void test_jit_too_deep()
+  {
+  // more than 256 live stack entries cannot be mapped on the ring buffer statically
+  auto interpr = make_filled_interpreter<int64_t>();
+  std::string script;
+  for (int i = 0; i < 300; ++i)
+    script.append("t ");
+  auto words = tokenize(script);
+  auto code = interpr.compile(interpr.parse(words));
+  jit<int64_t> j;
+  TEST_ASSERT(!j.compile(code));
+  TEST_ASSERT(!j.is_compiled());
+  }
+
+void test_jit_control_flow()
+  {
+  // programs with jumps are left to interpreter::run
+  auto interpr = make_filled_interpreter<int64_t>();
+  auto words = tokenize("t 1 & if t else 4 0 do i + loop then");
+  auto code = interpr.compile(interpr.parse(words));
+  jit<int64_t> j;
+  TEST_ASSERT(!j.compile(code));
+  TEST_ASSERT(!j.is_compiled());
+  // and so are delay lines
+  words = tokenize("t 5 * 100 delay t +");
+  code = interpr.compile(interpr.parse(words));
+  TEST_ASSERT(!j.compile(code));
+  }
+
+void run_all_jit_tests()
+  {
+#if defined(FORTH_JIT_X64)
+  test_jit_scripts_int();
+  test_jit_scripts_double();
+  test_jit_fused();
+  test_jit_common_subexpressions();
+  test_jit_memoized();
+  test_jit_random_programs();
+  test_jit_too_deep();
+  test_jit_control_flow();
+#else
+  TEST_OUTPUT_LINE("No native code generation on this processor, skipping jit tests.");
+#endif
+  }
@@ -0,0 +1,294 @@
+#include "simd_tests.h"
+#include "test_assert.h"
+
+#include <forthbyte/simd.h>
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <vector>
+
+using namespace forth;
+
+namespace
+  {
+  std::vector<double> double_inputs(double low, double high, int n)
+    {
+    std::mt19937_64 gen(1234);
+    std::uniform_real_distribution<double> dist(low, high);
+    std::vector<double> values(n);
+    for (auto& v : values)
+      v = dist(gen);
+    return values;
+    }
+
+  std::vector<int64_t> int_inputs(int64_t low, int64_t high, int n)
+    {
+    std::mt19937_64 gen(4321);
+    std::uniform_int_distribution<int64_t> dist(low, high);
+    std::vector<int64_t> values(n);
+    for (auto& v : values)
+      v = dist(gen);
+    return values;
+    }
+
+  int64_t ordered_bits(double d)
+    {
+    int64_t i;
+    memcpy(&i, &d, sizeof(double));
+    return i < 0 ? std::numeric_limits<int64_t>::min() - i : i;
+    }
+
+  // distance in units in the last place, nan only equals nan
+  int64_t ulp_distance(double a, double b)
+    {
+    if (std::isnan(a) || std::isnan(b))
+      return (std::isnan(a) && std::isnan(b)) ? 0 : std::numeric_limits<int64_t>::max();
+    int64_t d = ordered_bits(a) - ordered_bits(b);
+    return d < 0 ? -d : d;
+    }
+
+  template <class T>
+  bool bitwise_equal(const std::vector<T>& a, const std::vector<T>& b)
+    {
+    return a.size() == b.size() && memcmp(a.data(), b.data(), a.size() * sizeof(T)) == 0;
+    }
+
+  int64_t max_ulp_unary(e_opcode op, double(*f)(double), const std::vector<double>& a)
+    {
+    const lane_kernels<double>* k = simd_lane_kernels<double>();
+    std::vector<double> r(a.size());
+    k->unary[op](r.data(), a.data(), (int)a.size());
+    int64_t worst = 0;
+    for (size_t i = 0; i < a.size(); ++i)
+      worst = std::max(worst, ulp_distance(r[i], f(a[i])));
+    return worst;
+    }
+
+  int64_t max_ulp_binary(e_opcode op, double(*f)(double, double), const std::vector<double>& a, const std::vector<double>& b)
+    {
+    const lane_kernels<double>* k = simd_lane_kernels<double>();
+    std::vector<double> r(a.size());
+    k->binary[op](r.data(), a.data(), b.data(), (int)a.size());
+    int64_t worst = 0;
+    for (size_t i = 0; i < a.size(); ++i)
+      worst = std::max(worst, ulp_distance(r[i], f(a[i], b[i])));
+    return worst;
+    }
+
+  double sin_ref(double a) { return std::sin(a); }
+  double cos_ref(double a) { return std::cos(a); }
+  double tan_ref(double a) { return std::tan(a); }
+  double exp_ref(double a) { return std::exp(a); }
+  double log_ref(double a) { return std::log(a); }
+  double pow_ref(double a, double b) { return std::pow(a, b); }
+  double mod_ref(double a, double b) { return modulo(a, b); }
+  double mul_ref(double a, double b) { return multiply(a, b); }
+  double div_ref(double a, double b) { return divide(a, b); }
+
+  template <class T>
+  bool kernels_equal_eval_block(const std::string& script, int64_t t0, int count)
+    {
+    auto words = tokenize(script);
+    interpreter<T> interpr;
+    interpr.make_variable("t");
+    interpr.make_variable("sr");
+    interpr.make_variable("c");
+    auto prog = interpr.parse(words);
+    auto code = interpr.compile(prog);
+    interpreter<T> reference = interpr;
+    interpr.kernels = simd_lane_kernels<T>();
+    std::vector<T> out(count), expected(count);
+    interpr.eval_block(code, t0, count, 0, out.data());
+    reference.eval_block(code, t0, count, 0, expected.data());
+    return bitwise_equal(out, expected) && interpr.stack_pointer == reference.stack_pointer;
+    }
+
+  // both channels at once must give what the kernels give for one channel at a time
+  template <class T>
+  bool stereo_equals_eval_block(const std::string& script, int64_t t0, int count)
+    {
+    auto words = tokenize(script);
+    interpreter<T> interpr;
+    interpr.make_variable("t");
+    interpr.make_variable("sr");
+    interpr.make_variable("c");
+    interpr.kernels = simd_lane_kernels<T>();
+    auto code = interpr.compile(interpr.parse(words));
+    interpreter<T> reference = interpr;
+    std::vector<T> left(count), right(count), expected_left(count), expected_right(count);
+    interpr.eval_block_stereo(code, t0, count, left.data(), right.data());
+    reference.eval_block(code, t0, count, 0, expected_left.data());
+    reference.eval_block(code, t0, count, 1, expected_right.data());
+    return bitwise_equal(left, expected_left) && bitwise_equal(right, expected_right);
+    }
+  }
+
+void test_simd_exact_double()
+  {
+  const lane_kernels<double>* k = simd_lane_kernels<double>();
+  auto a = double_inputs(-1000.0, 1000.0, 1003);
+  auto b = double_inputs(-50.0, 50.0, 1003);
+  for (int i = 0; i < 1003; i += 17)
+    {
+    a[i] = 0.0;
+    b[i + 5] = 0.0;
+    a[i + 9] = std::floor(a[i + 9]);
+    b[i + 9] = std::floor(b[i + 9] / 8.0);
+    }
+  a[3] = -0.0;
+  a[4] = std::numeric_limits<double>::infinity();
+  b[6] = std::numeric_limits<double>::quiet_NaN();
+  b[7] = -std::numeric_limits<double>::infinity();
+  const e_opcode binary_ops[] = { OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD, OP_LESS, OP_GREATER, OP_LEQ, OP_GEQ, OP_EQ, OP_NEQ, OP_MIN, OP_MAX };
+  double(*binary_refs[])(double, double) = { [](double x, double y) { return x + y; }, [](double x, double y) { return x - y; }, &mul_ref, &div_ref, &mod_ref,
+    [](double x, double y) { return truth<double>(x < y); }, [](double x, double y) { return truth<double>(x > y); }, [](double x, double y) { return truth<double>(x <= y); },
+    [](double x, double y) { return truth<double>(x >= y); }, [](double x, double y) { return truth<double>(x == y); }, [](double x, double y) { return truth<double>(x != y); },
+    [](double x, double y) { return x < y ? x : y; }, [](double x, double y) { return x > y ? x : y; } };
+  for (int i = 0; i < 13; ++i)
+    {
+    std::vector<double> r(a.size()), expected(a.size());
+    k->binary[binary_ops[i]](r.data(), a.data(), b.data(), (int)a.size());
+    for (size_t j = 0; j < a.size(); ++j)
+      expected[j] = binary_refs[i](a[j], b[j]);
+    TEST_ASSERT(bitwise_equal(r, expected));
+    }
+  const e_opcode unary_ops[] = { OP_NOT, OP_SQRT, OP_FLOOR, OP_CEIL, OP_ABS, OP_NEGATE };
+  double(*unary_refs[])(double) = { [](double x) { return not_value(x); }, [](double x) { return std::sqrt(x); }, [](double x) { return std::floor(x); },
+    [](double x) { return std::ceil(x); }, [](double x) { return std::abs(x); }, [](double x) { return -x; } };
+  for (int i = 0; i < 6; ++i)
+    {
+    std::vector<double> r(a.size()), expected(a.size());
+    k->unary[unary_ops[i]](r.data(), a.data(), (int)a.size());
+    for (size_t j = 0; j < a.size(); ++j)
+      expected[j] = unary_refs[i](a[j]);
+    TEST_ASSERT(bitwise_equal(r, expected));
+    }
+  // the phases of the oscillators, with tails of every length
+  auto phases = double_inputs(-3.0, 3.0, 1003);
+  phases[1] = -1e-20;
+  phases[2] = 1e300;
+  phases[3] = std::numeric_limits<double>::quiet_NaN();
+  for (e_opcode op : { OP_OSC_SIN, OP_OSC_SAW, OP_OSC_SQUARE })
+    {
+    for (int n = 1000; n <= 1003; ++n)
+      {
+      std::vector<double> r(n), expected(n);
+      k->unary[op](r.data(), phases.data(), n);
+      for (int j = 0; j < n; ++j)
+        expected[j] = unary_value(op, phases[j]);
+      TEST_ASSERT(bitwise_equal(r, expected));
+      }
+    }
+  }
+
+void test_simd_exact_int64()
+  {
+  const lane_kernels<int64_t>* k = simd_lane_kernels<int64_t>();
+  auto a = int_inputs(std::numeric_limits<int64_t>::min(), std::numeric_limits<int64_t>::max(), 1001);
+  auto b = int_inputs(-100000, 100000, 1001);
+  auto shift = int_inputs(0, 63, 1001);
+  for (int i = 0; i < 1001; i += 13)
+    {
+    a[i] = b[i];
+    b[i + 3] = 0;
+    }
+  const e_opcode binary_ops[] = { OP_ADD, OP_SUB, OP_MUL, OP_AND, OP_OR, OP_XOR, OP_LESS, OP_GREATER, OP_LEQ, OP_GEQ, OP_EQ, OP_NEQ, OP_MIN, OP_MAX };
+  int64_t(*binary_refs[])(int64_t, int64_t) = { [](int64_t x, int64_t y) { return (int64_t)((uint64_t)x + (uint64_t)y); }, [](int64_t x, int64_t y) { return (int64_t)((uint64_t)x - (uint64_t)y); },
+    [](int64_t x, int64_t y) { return x == 0 || y == 0 ? (int64_t)0 : (int64_t)((uint64_t)x * (uint64_t)y); }, &binary_and<int64_t>, &binary_or<int64_t>, &binary_xor<int64_t>,
+    [](int64_t x, int64_t y) { return truth<int64_t>(x < y); }, [](int64_t x, int64_t y) { return truth<int64_t>(x > y); }, [](int64_t x, int64_t y) { return truth<int64_t>(x <= y); },
+    [](int64_t x, int64_t y) { return truth<int64_t>(x >= y); }, [](int64_t x, int64_t y) { return truth<int64_t>(x == y); }, [](int64_t x, int64_t y) { return truth<int64_t>(x != y); },
+    [](int64_t x, int64_t y) { return x < y ? x : y; }, [](int64_t x, int64_t y) { return x > y ? x : y; } };
+  for (int i = 0; i < 14; ++i)
+    {
+    std::vector<int64_t> r(a.size()), expected(a.size());
+    k->binary[binary_ops[i]](r.data(), a.data(), b.data(), (int)a.size());
+    for (size_t j = 0; j < a.size(); ++j)
+      expected[j] = binary_refs[i](a[j], b[j]);
+    TEST_ASSERT(bitwise_equal(r, expected));
+    }
+  std::vector<int64_t> r(a.size()), expected(a.size());
+  k->binary[OP_LEFT_SHIFT](r.data(), a.data(), shift.data(), (int)a.size());
+  for (size_t j = 0; j < a.size(); ++j)
+    expected[j] = left_shift(a[j], shift[j]);
+  TEST_ASSERT(bitwise_equal(r, expected));
+  k->binary[OP_RIGHT_SHIFT](r.data(), a.data(), shift.data(), (int)a.size());
+  for (size_t j = 0; j < a.size(); ++j)
+    expected[j] = right_shift(a[j], shift[j]);
+  TEST_ASSERT(bitwise_equal(r, expected));
+  k->unary[OP_NOT](r.data(), a.data(), (int)a.size());
+  for (size_t j = 0; j < a.size(); ++j)
+    expected[j] = not_value(a[j]);
+  TEST_ASSERT(bitwise_equal(r, expected));
+  k->unary[OP_NEGATE](r.data(), b.data(), (int)b.size());
+  for (size_t j = 0; j < b.size(); ++j)
+    expected[j] = -b[j];
+  TEST_ASSERT(bitwise_equal(r, expected));
+  k->unary[OP_ABS](r.data(), b.data(), (int)b.size());
+  for (size_t j = 0; j < b.size(); ++j)
+    expected[j] = std::abs(b[j]);
+  TEST_ASSERT(bitwise_equal(r, expected));
+  for (e_opcode op : { OP_OSC_SIN, OP_OSC_SAW, OP_OSC_SQUARE })
+    {
+    k->unary[op](r.data(), a.data(), (int)a.size());
+    for (size_t j = 0; j < a.size(); ++j)
+      expected[j] = unary_value(op, a[j]);
+    TEST_ASSERT(bitwise_equal(r, expected));
+    }
+  }
+
+void test_simd_ulp_tolerance()
+  {
+  auto angles = double_inputs(-100000.0, 100000.0, 4001);
+  auto small_angles = double_inputs(-4.0, 4.0, 4001);
+  TEST_ASSERT(max_ulp_unary(OP_SIN, &sin_ref, angles) <= 2);
+  TEST_ASSERT(max_ulp_unary(OP_SIN, &sin_ref, small_angles) <= 2);
+  TEST_ASSERT(max_ulp_unary(OP_COS, &cos_ref, angles) <= 2);
+  TEST_ASSERT(max_ulp_unary(OP_COS, &cos_ref, small_angles) <= 2);
+  TEST_ASSERT(max_ulp_unary(OP_TAN, &tan_ref, small_angles) <= 4);
+  auto exponents = double_inputs(-700.0, 709.0, 4001);
+  TEST_ASSERT(max_ulp_unary(OP_EXP, &exp_ref, exponents) <= 2);
+  TEST_ASSERT(max_ulp_unary(OP_EXP, &exp_ref, small_angles) <= 2);
+  auto positive = double_inputs(1e-300, 1e300, 4001);
+  auto near_one = double_inputs(0.5, 2.0, 4001);
+  TEST_ASSERT(max_ulp_unary(OP_LOG, &log_ref, positive) <= 2);
+  TEST_ASSERT(max_ulp_unary(OP_LOG, &log_ref, near_one) <= 2);
+  auto bases = double_inputs(0.01, 100.0, 4001);
+  auto powers = double_inputs(-8.0, 8.0, 4001);
+  TEST_ASSERT(max_ulp_binary(OP_POW, &pow_ref, bases, powers) <= 2 * 8 * 5 + 4);
+  std::vector<double> integral_bases = { 2.0, 3.0, 0.5, 10.0, 7.0, 1.5, 0.25, 2.0 };
+  std::vector<double> integral_powers = { 8.0, 5.0, -3.0, 4.0, 0.0, 2.0, 6.0, -10.0 };
+  TEST_EQ(0, (int)max_ulp_binary(OP_POW, &pow_ref, integral_bases, integral_powers));
+  // out of range input goes through the scalar functions
+  std::vector<double> special = { 0.0, -1.0, std::numeric_limits<double>::infinity(), std::numeric_limits<double>::quiet_NaN(), 1e300, -1e-310, 4.9e-324, 1.0 };
+  TEST_EQ(0, (int)max_ulp_unary(OP_SIN, &sin_ref, special));
+  TEST_EQ(0, (int)max_ulp_unary(OP_LOG, &log_ref, special));
+  TEST_EQ(0, (int)max_ulp_binary(OP_POW, &pow_ref, special, special));
+  std::vector<double> large = { -800.0, 710.0, 1000.0, -708.5, std::numeric_limits<double>::infinity(), -std::numeric_limits<double>::infinity(), 0.0, 1.0 };
+  TEST_EQ(0, (int)max_ulp_unary(OP_EXP, &exp_ref, large));
+  }
+
+void test_simd_eval_block()
+  {
+  TEST_ASSERT(kernels_equal_eval_block<int64_t>("t 5 * t 3 >> | t 7 >> & 255 & t 9 >> t 11 >> ^ - t 3 min t 2 max * not negate abs", 0, 1000));
+  TEST_ASSERT(kernels_equal_eval_block<int64_t>("t dup * 1 2 rot 2 pick >r + r> nip tuck 2dup over - -rot swap min max 0 / not", 12345, 701));
+  TEST_ASSERT(kernels_equal_eval_block<double>("t 100 / floor t 7 % t 3 / ceil + * t 0.5 * sqrt - abs negate t 4 > t 9 <= + t 2 = t 2 <> + + *", 0, 1023));
+  TEST_ASSERT(stereo_equals_eval_block<double>("t 100 / sin c 0.5 * + t 3000 / cos * sr log c 1 + * pow", 0, 1023));
+  TEST_ASSERT(stereo_equals_eval_block<int64_t>("t 5 * t c 3 + >> | t 7 >> & 255 & sr 9 >> c ^ -", 0, 1000));
+  // the filters at the end step both channels in one register
+  TEST_ASSERT(stereo_equals_eval_block<double>("t 100 / sin c 0.5 * + 0.01 lowpass 0.1 0.7 bq-bandpass", 0, 1023));
+  }
+
+void run_all_simd_tests()
+  {
+  if (simd_lane_kernels<double>() == nullptr || simd_lane_kernels<int64_t>() == nullptr)
+    {
+    TEST_OUTPUT_LINE("No vectorized kernels on this processor, skipping simd tests.");
+    return;
+    }
+  test_simd_exact_double();
+  test_simd_exact_int64();
+  test_simd_ulp_tolerance();
+  test_simd_eval_block();
+  }
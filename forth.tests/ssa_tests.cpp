@@ -0,0 +1,274 @@
+#include "ssa_tests.h"
+#include "test_assert.h"
+
+#include <forthbyte/ssa.h>
+
+#include <cstring>
+#include <random>
+#include <string>
+
+using namespace forth;
+
+namespace
+  {
+  template <class T>
+  interpreter<T> make_filled_interpreter(int64_t memory_size = 256)
+    {
+    interpreter<T> interpr;
+    interpr.set_memory_size(memory_size);
+    interpr.make_variable("t");
+    interpr.make_variable("sr");
+    interpr.make_variable("c");
+    interpr.set_variable_value("sr", (T)8000);
+    for (int i = 0; i < 256; ++i)
+      {
+      interpr.stack[i] = (T)(i * 7 - 300);
+      interpr.return_stack[i] = (T)(i - 5);
+      }
+    for (size_t i = 0; i < interpr.memory_stack.size(); ++i)
+      interpr.memory_stack[i] = (T)(i * 3 + 1);
+    return interpr;
+    }
+
+  template <class T>
+  bool same_value(T a, T b)
+    {
+    return (a != a && b != b) || memcmp(&a, &b, sizeof(T)) == 0;
+    }
+
+  template <class T>
+  bool ssa_compiles(const std::string& script)
+    {
+    auto interpr = make_filled_interpreter<T>();
+    auto words = tokenize(script);
+    auto code = interpr.compile(interpr.parse(words));
+    ssa<T> s;
+    return s.compile(code);
+    }
+
+  // runs the script samples times with run and with ssa, and compares the stack below the
+  // stack pointer, the memory and the stack pointers
+  template <class T>
+  bool ssa_equals_run(const std::string& script, int samples, bool optimize = false, int64_t memory_size = 256)
+    {
+    auto reference = make_filled_interpreter<T>(memory_size);
+    auto words = tokenize(script);
+    auto prog = reference.parse(words);
+    if (optimize)
+      prog = reference.optimize(prog);
+    auto code = reference.compile(prog);
+    auto reg = reference;
+    ssa<T> s;
+    if (!s.compile(code))
+      return false;
+    for (int k = 0; k < samples; ++k)
+      {
+      reference.globals[0] = (T)(k * 37);
+      reg.globals[0] = (T)(k * 37);
+      reference.globals[2] = (T)(k & 1);
+      reg.globals[2] = (T)(k & 1);
+      reference.run(code);
+      s.run(reg);
+      if (reference.stack_pointer != reg.stack_pointer || reference.return_stack_pointer != reg.return_stack_pointer)
+        return false;
+      for (int i = 1; i <= code.effect.depth; ++i)
+        {
+        int p = (reference.stack_pointer - i + 256) % 256;
+        if (!same_value(reference.stack[p], reg.stack[p]))
+          return false;
+        }
+      for (int i = 0; i < 256; ++i)
+        if (!same_value(reference.globals[i], reg.globals[i]))
+          return false;
+      for (size_t i = 0; i < reference.memory_stack.size(); ++i)
+        if (!same_value(reference.memory_stack[i], reg.memory_stack[i]))
+          return false;
+      if (code.effect.depth > 0)
+        {
+        reference.pop();
+        reg.pop();
+        }
+      }
+    return true;
+    }
+  }
+
+void test_ssa_scripts()
+  {
+  const char* scripts[] = {
+    "1 2 +",
+    "t 1000 / t 3 >> -",
+    "t dup * 1 2 rot 2 pick >r + r> nip c + tuck 2dup over - -rot swap min max sr + 0 / not",
+    "3000 t 16383 & / 1 & 35 * t 16 >> 3 & @ t * 24 / 127 & t 8 >> t 10 >> ^ t 14 >> | 63 & + +",
+    "3 @ t + dup 3 ! 3 @ 7 @ +",
+    "t 7 % t 3 + t -1 / t 0 / t abs negate t 5 > t 5 < t 5 <= t 5 >= t 5 = t 5 <> + + + + + + + + + +",
+    "t sin t cos + t tan + t log + t exp + t sqrt + t floor + t ceil + t 2 pow + t 3 atan2 +",
+    "t t t t t t t t t t t t t t t t + + + + + + + + + + + + + + +",
+    "t 1 + t 2 + t 3 +",
+    "t dup 1 + dup 2 + 2 pick 0 pick",
+    "t 5000 - 24 / t 5000 - 1000 % t 5000 - -7 / t 5000 - 16384 % t 5000 - -8 / t 5000 - 3 % t 5000 - 4611686018427387904 / t 5000 - 10000000007 % t 5000 - -1000000007 / + + + + + + + +",
+    ": mix { a b } a b * a b + - ; t 7 % t 3 % mix t 5 % 2 mix +",
+    "0 value acc acc t + 255 & to acc acc 3 * 5 value x x to acc t to x x acc +",
+    "t 3 * osc-sin t 7 / osc-saw + t -5 * osc-square * t 0 / osc-sin +"
+    };
+  for (auto script : scripts)
+    {
+    TEST_ASSERT(ssa_equals_run<int64_t>(script, 300));
+    TEST_ASSERT(ssa_equals_run<double>(script, 300));
+    TEST_ASSERT(ssa_equals_run<int64_t>(script, 300, true));
+    TEST_ASSERT(ssa_equals_run<double>(script, 300, true));
+    }
+  // addresses wrap around a larger memory too, also when they are negative
+  const char* memory_script = "t 3000 + @ t 5 * 2 - ! t -3 * @ t 4097 + @ + t 3 - 7000 !";
+  TEST_ASSERT(ssa_equals_run<int64_t>(memory_script, 300, false, 4096));
+  TEST_ASSERT(ssa_equals_run<double>(memory_script, 300, false, 4096));
+  }
+
+void test_ssa_fallback()
+  {
+  TEST_ASSERT(!ssa_compiles<int64_t>("drop t"));
+  TEST_ASSERT(!ssa_compiles<int64_t>("t 1 pick"));
+  TEST_ASSERT(!ssa_compiles<int64_t>("t t pick"));
+  TEST_ASSERT(!ssa_compiles<int64_t>("t >r"));
+  TEST_ASSERT(!ssa_compiles<int64_t>("r> t +"));
+  TEST_ASSERT(!ssa_compiles<double>("t swap"));
+  TEST_ASSERT(!ssa_compiles<int64_t>("t 1 & if t else 3 then"));
+  TEST_ASSERT(!ssa_compiles<double>("t 100 delay"));
+  TEST_ASSERT(ssa_compiles<double>("t >r t r> +"));
+  }
+
+void test_ssa_shuffles_disappear()
+  {
+  auto interpr = make_filled_interpreter<int64_t>();
+  auto words = tokenize("t dup swap over rot drop drop 5 1 pick nip >r r> 1 +");
+  auto code = interpr.compile(interpr.parse(words));
+  ssa<int64_t> s;
+  TEST_ASSERT(s.compile(code));
+  TEST_EQ(2, s.operation_count()); // load t, add 1
+  TEST_EQ(3, s.register_count()); // the constant, t and t + 1
+
+  words = tokenize("t 1 + t 2 + * t 3 + *");
+  code = interpr.compile(interpr.parse(words));
+  TEST_ASSERT(s.compile(code));
+  TEST_EQ(6, s.operation_count()); // t is loaded once
+  TEST_ASSERT(s.register_count() <= 6);
+  TEST_ASSERT(s.compile(code, false));
+  TEST_EQ(8, s.operation_count());
+
+  // locals are read from the node that they got, and only written at the end
+  words = tokenize(": lerp { a b } a b a - 3 * + ; t 5 lerp");
+  code = interpr.compile(interpr.parse(words));
+  TEST_ASSERT(s.compile(code));
+  TEST_EQ(1 + 3 + 2, s.operation_count()); // load t, -, *, + and write a and b
+  }
+
+void test_ssa_common_subexpressions()
+  {
+  auto interpr = make_filled_interpreter<double>();
+  auto words = tokenize("t 1000 / 5 % 1 + floor t 1000 / 9 % 1 + floor t 1000 / 5 % +");
+  auto prog = interpr.parse(words);
+  ssa<double> s;
+  TEST_ASSERT(s.compile(interpr.compile(prog)));
+  TEST_EQ(9, s.operation_count()); // t, /, % 5, +, floor, % 9, +, floor, +
+  TEST_EQ(5, s.shared_count());
+  // fused operators are shared with the operator and the literal they came from
+  TEST_ASSERT(s.compile(interpr.compile(interpr.optimize(prog))));
+  TEST_EQ(9, s.operation_count());
+
+  // a fetch is only shared with fetches that come after the same stores
+  words = tokenize("3 @ 3 @ + 3 ! 3 @ 3 @ t 3 @ 4 ! 3 @");
+  auto code = interpr.compile(interpr.parse(words));
+  TEST_ASSERT(s.compile(code));
+  TEST_EQ(3, s.shared_count()); // the second fetch, and the second and third fetch after the first store
+  TEST_ASSERT(s.compile(code, false));
+  TEST_EQ(0, s.shared_count());
+
+  const char* scripts[] = {
+    "t 1000 / 5 % 1 + floor t 1000 / 9 % 1 + floor t 1000 / 5 % +",
+    "3 @ 3 @ + 3 ! 3 @ 3 @ t 3 @ 4 ! 3 @",
+    "t 7 * t 7 * t 7 * t 7 * >r >r + r> r> * -",
+    "t c + c t + t c - c t - + + +"
+    };
+  for (auto script : scripts)
+    {
+    TEST_ASSERT(ssa_equals_run<int64_t>(script, 100));
+    TEST_ASSERT(ssa_equals_run<double>(script, 100));
+    TEST_ASSERT(ssa_equals_run<int64_t>(script, 100, true));
+    TEST_ASSERT(ssa_equals_run<double>(script, 100, true));
+    }
+  }
+
+void test_ssa_memoized()
+  {
+  auto interpr = make_filled_interpreter<double>();
+  auto words = tokenize("t 1000 / 5 % 1 + floor 5 pow t 1000 / 7 % 1 + floor 2.5 pow * t 3000 / sin *");
+  auto code = interpr.compile(interpr.parse(words));
+  ssa<double> s;
+  TEST_ASSERT(s.compile(code));
+  TEST_EQ(2, s.memoized_count()); // the pows, t 3000 / sin changes every sample
+  TEST_ASSERT(s.compile(code, true, false));
+  TEST_EQ(0, s.memoized_count());
+
+  const char* scripts[] = {
+    "t 1000 / 5 % 1 + floor 5 pow t 1000 / 7 % 1 + floor 2.5 pow * t 3000 / sin *",
+    "t 12 >> 3 & @ exp t 9 >> sin + t 9 >> cos t 9 >> tan + +",
+    "t 300 / floor negate 0.5 pow t 700 / floor 1 - log + t 100 / floor 3 atan2 +"
+    };
+  for (auto script : scripts)
+    {
+    TEST_ASSERT(ssa_equals_run<int64_t>(script, 300));
+    TEST_ASSERT(ssa_equals_run<double>(script, 300));
+    TEST_ASSERT(ssa_equals_run<int64_t>(script, 300, true));
+    TEST_ASSERT(ssa_equals_run<double>(script, 300, true));
+    }
+  }
+
+void test_ssa_random_programs()
+  {
+  struct word
+    {
+    const char* text;
+    int needs, delta; // stack entries read, and the change in depth
+    int return_needs, return_delta;
+    };
+  const word words[] = { {"t", 0, 1, 0, 0}, {"c", 0, 1, 0, 0}, {"sr", 0, 1, 0, 0}, {"3", 0, 1, 0, 0}, {"-2", 0, 1, 0, 0}, {"200", 0, 1, 0, 0},
+    {"+", 2, -1, 0, 0}, {"-", 2, -1, 0, 0}, {"*", 2, -1, 0, 0}, {"7 /", 1, 0, 0, 0}, {"<<", 2, -1, 0, 0}, {">>", 2, -1, 0, 0}, {"&", 2, -1, 0, 0},
+    {"|", 2, -1, 0, 0}, {"^", 2, -1, 0, 0}, {"not", 1, 0, 0, 0}, {"<", 2, -1, 0, 0}, {">=", 2, -1, 0, 0}, {"<>", 2, -1, 0, 0},
+    {"dup", 1, 1, 0, 0}, {"drop", 1, -1, 0, 0}, {"2dup", 2, 2, 0, 0}, {"over", 2, 1, 0, 0}, {"nip", 2, -1, 0, 0}, {"tuck", 2, 1, 0, 0},
+    {"swap", 2, 0, 0, 0}, {"rot", 3, 0, 0, 0}, {"-rot", 3, 0, 0, 0}, {"min", 2, -1, 0, 0}, {"max", 2, -1, 0, 0}, {"negate", 1, 0, 0, 0},
+    {"abs", 1, 0, 0, 0}, {"255 & @", 1, 0, 0, 0}, {"255 & !", 2, -2, 0, 0}, {">r", 1, -1, 0, 1}, {"r>", 0, 1, 1, -1}, {"sin", 1, 0, 0, 0},
+    {"sqrt", 1, 0, 0, 0}, {"floor", 1, 0, 0, 0}, {"1 pick", 2, 1, 0, 0}, {"3 pick", 4, 1, 0, 0} };
+  const int nr_words = (int)(sizeof(words) / sizeof(words[0]));
+  std::mt19937 gen(77);
+  for (int it = 0; it < 200; ++it)
+    {
+    int length = 1 + (int)(gen() % 40);
+    int depth = 0, return_depth = 0;
+    std::string script;
+    while (length > 0 || return_depth > 0 || depth == 0)
+      {
+      const word& w = words[gen() % nr_words];
+      if (w.needs > depth || w.return_needs > return_depth)
+        continue;
+      if (length <= 0 && w.return_delta > 0)
+        continue;
+      depth += w.delta;
+      return_depth += w.return_delta;
+      script.append(w.text);
+      script.push_back(' ');
+      --length;
+      }
+    bool is_double = (it & 1) != 0;
+    TEST_ASSERT(is_double ? ssa_equals_run<double>(script, 10) : ssa_equals_run<int64_t>(script, 10));
+    }
+  }
+
+void run_all_ssa_tests()
+  {
+  test_ssa_scripts();
+  test_ssa_fallback();
+  test_ssa_shuffles_disappear();
+  test_ssa_common_subexpressions();
+  test_ssa_memoized();
+  test_ssa_random_programs();
+  }
@@ -0,0 +1,3 @@
+#pragma once
+
+void run_all_ssa_tests();
@@ -1,6 +1,9 @@
 #include "test_assert.h"
 
 #include "forth_tests.h"
+#include "simd_tests.h"
+#include "jit_tests.h"
+#include "ssa_tests.h"
 
 #include <ctime>
 
@@ -10,6 +13,9 @@ int main(int /*argc*/, const char* /*argv*/[])
 
   auto tic = std::clock();
   run_all_forth_tests();
+  run_all_simd_tests();
+  run_all_jit_tests();
+  run_all_ssa_tests();
   
   auto toc = std::clock();
 
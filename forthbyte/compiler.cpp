@@ -1,6 +1,104 @@
 #include "compiler.h"
+#include "simd.h"
+#include "tables.h"
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
 #include <sstream>
 
+#include <jtk/file_utils.h>
+
+namespace
+  {
+  template <class T>
+  void set_memory_size(forth::interpreter<T, 256>& interpr, int64_t size)
+    {
+    if (size > forth::interpreter<T, 256>::max_memory_size)
+      {
+      std::stringstream str;
+      str << "#memory can be at most " << forth::interpreter<T, 256>::max_memory_size;
+      throw std::logic_error(str.str());
+      }
+    interpr.set_memory_size(size);
+    }
+
+  // a table that is not found as given is looked for next to the song
+  std::vector<table_file> resolve_table_paths(std::vector<table_file> tables, const std::string& song_filename)
+    {
+    std::string folder = jtk::get_folder(song_filename);
+    for (auto& table : tables)
+      {
+      if (!jtk::file_exists(table.filename) && !folder.empty() && jtk::file_exists(folder + table.filename))
+        table.filename = folder + table.filename;
+      }
+    return tables;
+    }
+
+  template <class T>
+  void set_control_rate(forth::interpreter<T, 256>& interpr, int64_t rate)
+    {
+    if (rate > forth::interpreter<T, 256>::max_control_rate)
+      {
+      std::stringstream str;
+      str << "#controlrate can be at most " << forth::interpreter<T, 256>::max_control_rate;
+      throw std::logic_error(str.str());
+      }
+    interpr.control_rate = rate;
+    }
+
+  template <class T>
+  void run_once(forth::interpreter<T, 256>& interpr, const typename forth::interpreter<T, 256>::Bytecode& code, forth::ssa<T, 256>& ssa, forth::jit<T, 256>& jit)
+    {
+    if (jit.is_compiled())
+      jit.run(interpr);
+    else if (ssa.is_compiled())
+      ssa.run(interpr);
+    else
+      interpr.run(code);
+    }
+
+  template <class T>
+  void run_block(forth::interpreter<T, 256>& interpr, const typename forth::interpreter<T, 256>::Bytecode& code, forth::ssa<T, 256>& ssa, forth::jit<T, 256>& jit, bool stereo, int64_t t0, int count, T* left, T* right)
+    {
+    if (!stereo && code.runs_in_lanes())
+      {
+      interpr.eval_block(code, t0, count, 0, left);
+      std::copy(left, left + count, right);
+      }
+    else if (!stereo)
+      {
+      // eval_block would fall back to interpreter::run, which leaves the jit and ssa unused
+      interpr.globals[2] = (T)0;
+      for (int i = 0; i < count; ++i)
+        {
+        interpr.globals[0] = (T)(t0 + i);
+        run_once(interpr, code, ssa, jit);
+        left[i] = interpr.pop();
+        }
+      std::copy(left, left + count, right);
+      }
+    else if (code.runs_in_lanes())
+      {
+      // the part of the program that does not depend on c is evaluated once for both channels
+      interpr.eval_block_stereo(code, t0, count, left, right);
+      }
+    else
+      {
+      // the channels share state from one sample to the next, so keep them interleaved
+      for (int i = 0; i < count; ++i)
+        {
+        interpr.globals[0] = (T)(t0 + i);
+        interpr.globals[2] = (T)0;
+        run_once(interpr, code, ssa, jit);
+        left[i] = interpr.pop();
+        interpr.globals[2] = (T)1;
+        run_once(interpr, code, ssa, jit);
+        right[i] = interpr.pop();
+        }
+      }
+    }
+  }
+
 compiler::compiler()
   {
 
@@ -20,7 +118,17 @@ void compiler::compile_byte(const std::string& script, const preprocess_settings
   interpr_int.make_variable("sr");
   interpr_int.make_variable("c");
   interpr_int.set_variable_value("sr", sett._sample_rate);
+  set_memory_size(interpr_int, sett._memory_size);
+  set_control_rate(interpr_int, sett._control_rate);
+  interpr_int.kernels = simd_lane_kernels<int64_t>();
   prog_int = interpr_int.parse(words);
+  prog_int = interpr_int.optimize(prog_int);
+  code_int = interpr_int.compile(prog_int);
+  ssa_int.compile(code_int);
+  if (sett._jit)
+    jit_int.compile(code_int);
+  else
+    jit_int.clear();
   stereo_int = _program_byte_is_stereo();
   }
 
@@ -33,7 +141,17 @@ void compiler::compile_float(const std::string& script, const preprocess_setting
   interpr_double.make_variable("sr");
   interpr_double.make_variable("c");
   interpr_double.set_variable_value("sr", sett._sample_rate);
+  set_memory_size(interpr_double, sett._memory_size);
+  set_control_rate(interpr_double, sett._control_rate);
+  interpr_double.kernels = simd_lane_kernels<double>();
   prog_double = interpr_double.parse(words);
+  prog_double = interpr_double.optimize(prog_double);
+  code_double = interpr_double.compile(prog_double);
+  ssa_double.compile(code_double);
+  if (sett._jit)
+    jit_double.compile(code_double);
+  else
+    jit_double.clear();
   stereo_double = _program_float_is_stereo();
   }
 
@@ -42,10 +160,7 @@ void compiler::init_memory_byte(const std::vector<std::string>& mem)
   int index = 0;
   for (const auto& val : mem)
     {
-    std::stringstream str;
-    str << val;
-    int64_t v;
-    str >> v;
+    int64_t v = std::strtoll(val.c_str(), nullptr, 10);
     interpr_int.memory_stack[index] = v;
     ++index;
     if (index >= interpr_int.memory_stack.size())
@@ -58,10 +173,7 @@ void compiler::init_memory_float(const std::vector<std::string>& mem)
   int index = 0;
   for (const auto& val : mem)
     {
-    std::stringstream str;
-    str << val;
-    double v;
-    str >> v;
+    double v = std::strtod(val.c_str(), nullptr);
     interpr_double.memory_stack[index] = v;
     ++index;
     if (index >= interpr_double.memory_stack.size())
@@ -69,11 +181,39 @@ void compiler::init_memory_float(const std::vector<std::string>& mem)
     }
   }
 
+void compiler::load_tables_byte(const std::vector<table_file>& tables)
+  {
+  for (const auto& table : tables)
+    load_table(table.filename, table.offset, interpr_int.memory_stack.data(), (int64_t)interpr_int.memory_stack.size());
+  }
+
+void compiler::load_tables_float(const std::vector<table_file>& tables)
+  {
+  for (const auto& table : tables)
+    load_table(table.filename, table.offset, interpr_double.memory_stack.data(), (int64_t)interpr_double.memory_stack.size());
+  }
+
+void compiler::compile(const std::string& script, const preprocess_settings& sett, const std::string& song_filename)
+  {
+  if (sett._float)
+    {
+    compile_float(script, sett);
+    init_memory_float(sett.init_memory);
+    load_tables_float(resolve_table_paths(sett.tables, song_filename));
+    }
+  else
+    {
+    compile_byte(script, sett);
+    init_memory_byte(sett.init_memory);
+    load_tables_byte(resolve_table_paths(sett.tables, song_filename));
+    }
+  }
+
 unsigned char compiler::run_byte(int64_t t, int c)
   {
   interpr_int.globals[0] = t;
   interpr_int.globals[2] = c;
-  interpr_int.eval(prog_int);
+  run_once(interpr_int, code_int, ssa_int, jit_int);
   int64_t val = interpr_int.pop();
   return (unsigned char)(val & 255);
   }
@@ -82,37 +222,59 @@ double compiler::run_float(int64_t t, int c)
   {
   interpr_double.globals[0] = (double)t;
   interpr_double.globals[2] = (double)c;
-  interpr_double.eval(prog_double);
+  run_once(interpr_double, code_double, ssa_double, jit_double);
   double val = interpr_double.pop();
   return val;
   }
 
+void compiler::run_byte_block(int64_t t0, int count, unsigned char* left, unsigned char* right)
+  {
+  if ((int)block_int_left.size() < count)
+    {
+    block_int_left.resize(count);
+    block_int_right.resize(count);
+    }
+  run_block(interpr_int, code_int, ssa_int, jit_int, stereo_int, t0, count, block_int_left.data(), block_int_right.data());
+  for (int i = 0; i < count; ++i)
+    {
+    left[i] = (unsigned char)(block_int_left[i] & 255);
+    right[i] = (unsigned char)(block_int_right[i] & 255);
+    }
+  }
+
+void compiler::run_float_block(int64_t t0, int count, double* left, double* right)
+  {
+  run_block(interpr_double, code_double, ssa_double, jit_double, stereo_double, t0, count, left, right);
+  }
+
 bool compiler::_program_byte_is_stereo()
   {
+  // c can be used without reaching the result, as in t c drop
+  if (code_int.effect.lanes_are_independent())
+    return code_int.dependencies.back() == forth::DEP_CHANNEL;
   auto it = interpr_int.variables.find(std::string("c"));
   assert(it != interpr_int.variables.end());
-  for (const auto& st : prog_int.statements)
+  // the instructions include the parts of branches and the bodies of loops
+  for (const auto& instr : code_int.instructions)
     {
-    if (std::holds_alternative<forth::interpreter<int64_t, 256>::Variable>(st))
-      {
-      if (std::get<forth::interpreter<int64_t, 256>::Variable>(st).index == it->second)
-        return true;
-      }
+    if (instr.op == forth::OP_VARIABLE && instr.index == it->second)
+      return true;
     }
   return false;
   }
 
 bool compiler::_program_float_is_stereo()
   {
+  // c can be used without reaching the result, as in t c drop
+  if (code_double.effect.lanes_are_independent())
+    return code_double.dependencies.back() == forth::DEP_CHANNEL;
   auto it = interpr_double.variables.find(std::string("c"));
   assert(it != interpr_double.variables.end());
-  for (const auto& st : prog_double.statements)
+  // the instructions include the parts of branches and the bodies of loops
+  for (const auto& instr : code_double.instructions)
     {
-    if (std::holds_alternative<forth::interpreter<double, 256>::Variable>(st))
-      {
-      if (std::get<forth::interpreter<double, 256>::Variable>(st).index == it->second)
-        return true;
-      }
+    if (instr.op == forth::OP_VARIABLE && instr.index == it->second)
+      return true;
     }
   return false;
   }
\ No newline at end of file
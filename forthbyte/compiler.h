@@ -1,6 +1,8 @@
 #pragma once
 
 #include "forth.h"
+#include "jit.h"
+#include "ssa.h"
 #include "preprocessor.h"
 
 #include <string>
@@ -16,6 +18,12 @@ class compiler
     void compile_float(const std::string& script, const preprocess_settings& sett);
     void init_memory_byte(const std::vector<std::string>& mem);
     void init_memory_float(const std::vector<std::string>& mem);
+    void load_tables_byte(const std::vector<table_file>& tables);
+    void load_tables_float(const std::vector<table_file>& tables);
+
+    // compiles script as a bytebeat or floatbeat song as sett says, and fills its memory and
+    // tables, which are also looked for next to song_filename
+    void compile(const std::string& script, const preprocess_settings& sett, const std::string& song_filename);
 
     bool stereo_byte() const { return stereo_int; }
     bool stereo_float() const { return stereo_double; }
@@ -23,6 +31,10 @@ class compiler
     unsigned char run_byte(int64_t t, int c);
     double run_float(int64_t t, int c);
 
+    // evaluate count consecutive samples t0, t0+1, ... of both channels in one go
+    void run_byte_block(int64_t t0, int count, unsigned char* left, unsigned char* right);
+    void run_float_block(int64_t t0, int count, double* left, double* right);
+
   private:
     bool _program_byte_is_stereo();
     bool _program_float_is_stereo();
@@ -34,6 +46,17 @@ class compiler
     forth::interpreter<int64_t, 256>::Program prog_int;
     forth::interpreter<double, 256>::Program prog_double;
 
+    forth::interpreter<int64_t, 256>::Bytecode code_int;
+    forth::interpreter<double, 256>::Bytecode code_double;
+
+    forth::ssa<int64_t, 256> ssa_int;
+    forth::ssa<double, 256> ssa_double;
+
+    forth::jit<int64_t, 256> jit_int;
+    forth::jit<double, 256> jit_double;
+
+    std::vector<int64_t> block_int_left, block_int_right;
+
     bool stereo_int;
     bool stereo_double;
   };
@@ -0,0 +1,131 @@
+#pragma once
+
+#include "forth.h"
+
+#include <cstring>
+#include <map>
+#include <stdint.h>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+/*
+Common subexpression elimination by hash-consing.
+
+expression_table gives every value that a program computes a number, such that two values get
+the same number only if they are computed by the same operator from operands with the same
+numbers. Literals are numbered by their bits and globals by their index, so t 1000 / gets the
+same number everywhere in a song, also when one of them was fused into OP_DIV_VALUE by
+interpreter::optimize. A fetch is numbered together with the number of stores that came before
+it, so it is only shared with fetches that cannot observe a different memory. Fetches are only
+shared when the address is known to lie in [0, N), a literal or a value masked with one, as the
+interpreter reads outside of its memory otherwise. Stores, the return stack and picks with a
+computed index give new numbers.
+
+The globals are only written by to, and the compilers read a global that to assigned as the value
+that it got, and write it when the program ends. So within one sample every number stands for one
+value, and a compiler can evaluate it once and reuse it wherever it appears again.
+*/
+
+namespace forth
+  {
+
+  inline bool is_commutative(e_opcode op)
+    {
+    switch (op)
+      {
+      case OP_ADD:
+      case OP_MUL:
+      case OP_AND:
+      case OP_OR:
+      case OP_XOR:
+      case OP_EQ:
+      case OP_NEQ:
+      case OP_MIN:
+      case OP_MAX:
+        return true;
+      default:
+        return false;
+      }
+    }
+
+  template <class T, int N = 256>
+  class expression_table
+    {
+    public:
+      expression_table() : numbers(0), stores(0)
+        {
+        }
+
+      void clear()
+        {
+        table.clear();
+        address.clear();
+        numbers = 0;
+        stores = 0;
+        }
+
+      int value(T val)
+        {
+        uint64_t bits = 0;
+        memcpy(&bits, &val, sizeof(T));
+        int number = _number(OP_VALUE, -1, -1, bits);
+        address[number] = val >= (T)0 && val < (T)N;
+        return number;
+        }
+
+      int variable(int index)
+        {
+        return _number(OP_VARIABLE, -1, -1, (uint64_t)index);
+        }
+
+      // op is an operator or OP_FETCH, b is -1 for operators with one operand
+      int operation(e_opcode op, int a, int b)
+        {
+        // for doubles a + b and b + a can differ in the payload of a nan
+        if (std::is_integral<T>::value && is_commutative(op) && b < a)
+          std::swap(a, b);
+        if (op == OP_FETCH && !address[a])
+          return unknown();
+        int number = _number(op, a, b, op == OP_FETCH ? (uint64_t)stores : 0);
+        if (op == OP_AND && (address[a] || address[b]))
+          address[number] = true;
+        return number;
+        }
+
+      // a value that is not known to equal any other value
+      int unknown()
+        {
+        address.push_back(false);
+        return numbers++;
+        }
+
+      void store()
+        {
+        ++stores;
+        }
+
+      // the number of different values seen so far
+      int size() const
+        {
+        return numbers;
+        }
+
+    private:
+      int _number(e_opcode op, int a, int b, uint64_t extra)
+        {
+        auto key = std::make_tuple((int)op, a, b, extra);
+        auto it = table.find(key);
+        if (it != table.end())
+          return it->second;
+        table[key] = numbers;
+        return unknown();
+        }
+
+      std::map<std::tuple<int, int, int, uint64_t>, int> table;
+      std::vector<bool> address; // the numbers of values that are a memory address in [0, N)
+      int numbers;
+      int stores;
+    };
+
+  } // namespace forth
@@ -13,6 +13,11 @@
 #include <SDL_syswm.h>
 #include <curses.h>
 
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <memory>
+
 extern "C"
   {
 #include <sdl2/pdcsdl.h>
@@ -123,6 +128,14 @@ void draw_music_info(app_state state, const music& m)
   else
     str << "FloatBeat  ";
   str << "t: " << m.get_timer();
+  str << "  latency: " << (int)std::round(m.get_latency()) << " ms (" << m.get_period() << " @ " << m.get_device_rate() << " Hz";
+  if (m.is_low_latency())
+    str << ", low latency";
+  str << ")";
+  if (m.underruns() > 0)
+    str << "  underruns: " << m.underruns();
+  if (m.recording_drops() > 0)
+    str << "  recording drops: " << m.recording_drops();
   std::string line = str.str();
   line = line.substr(0, cols);
   while (line.length() < cols)
@@ -454,11 +467,11 @@ namespace
     {
     keyword_data kd;
 
-    std::string in = "! @ + - * / & | ^ >> << not sin cos % < > <= >= = <> dup pick drop 2dup over nip tuck swap rot -rot min max pow atan2 negate tan log exp sqrt floor ceil abs";
+    std::string in = "! @ + - * / & | ^ >> << not sin cos % < > <= >= = <> dup pick drop 2dup over nip tuck swap rot -rot min max pow atan2 negate tan log exp sqrt floor ceil abs osc-sin osc-saw osc-square delay feedback lowpass highpass bq-lowpass bq-highpass bq-bandpass";
     kd.keywords_1 = break_string(in);
     std::sort(kd.keywords_1.begin(), kd.keywords_1.end());
 
-    in = "t sr c : ; #samplerate #byte #float #initmemory";
+    in = "t sr c : ; #samplerate #byte #float #initmemory #memory #controlrate #resample #devicerate #period #loadtable #jit";
     kd.keywords_2 = break_string(in);
     std::sort(kd.keywords_2.begin(), kd.keywords_2.end());
     return kd;
@@ -1012,24 +1025,15 @@ file_buffer set_multiline_comments(file_buffer fb)
   }
 
 
-app_state compile_buffer(app_state state, compiler& c, music& m)
+app_state compile_buffer(app_state state, music& m)
   {
   try
     {
     auto sett = preprocess(state.buffer.content);
-    m.set_sample_rate(sett._sample_rate);
-    if (sett._float)
-      {
-      c.compile_float(buffer_to_string(state.buffer), sett);
-      c.init_memory_float(sett.init_memory);
-      m.set_float();
-      }
-    else
-      {
-      c.compile_byte(buffer_to_string(state.buffer), sett);
-      c.init_memory_byte(sett.init_memory);
-      m.set_byte();
-      }
+    // the song is compiled next to the one that is playing, which is only swapped out when this one is ready
+    std::unique_ptr<compiler> c(new compiler());
+    c->compile(buffer_to_string(state.buffer), sett, state.buffer.name);
+    m.set_song(c, sett);
     
     state.message = string_to_line("[Build succeeded]");
     }
@@ -1040,7 +1044,7 @@ app_state compile_buffer(app_state state, compiler& c, music& m)
   return state;
   }
 
-app_state open_file(app_state state, compiler& c, music& m)
+app_state open_file(app_state state, music& m)
   {
   std::wstring wfilename;
   if (!state.operation_buffer.content.empty())
@@ -1075,7 +1079,7 @@ app_state open_file(app_state state, compiler& c, music& m)
     }
   state.buffer = set_multiline_comments(state.buffer);
   state.buffer = init_lexer_status(state.buffer);
-  state = compile_buffer(state, c, m);
+  state = compile_buffer(state, m);
   return state;
   }
 
@@ -1157,14 +1161,14 @@ app_state make_new_buffer(app_state state)
   return state;
   }
 
-std::optional<app_state> ret_operation(app_state state, compiler& c, music& m)
+std::optional<app_state> ret_operation(app_state state, music& m)
   {
   bool done = false;
   while (!done)
     {
     switch (state.operation)
       {
-      case op_open: state = open_file(state, c, m); break;
+      case op_open: state = open_file(state, m); break;
       case op_save: state = save_file(state); break;
       case op_export: state = export_file(state, m); break;
       case op_query_save: state = save_file(state); break;
@@ -1186,11 +1190,11 @@ std::optional<app_state> ret_operation(app_state state, compiler& c, music& m)
   return state;
   }
 
-std::optional<app_state> ret(app_state state, compiler& c, music& m)
+std::optional<app_state> ret(app_state state, music& m)
   {
   if (state.operation == op_editing)
     return ret_editor(state);
-  return ret_operation(state, c, m);
+  return ret_operation(state, m);
   }
 
 app_state clear_operation_buffer(app_state state)
@@ -1408,7 +1412,9 @@ Editor commands
 ^E        : Whenever you play, the song is recorded on disk to a wav file.
             With this command you can set the output file. If not set by 
             ^E, the default output file is session.wav in your forthbyte 
-            binaries folder.
+            binaries folder. The file is written by a thread of its own; if
+            the disk cannot keep up, the samples that were dropped are
+            shown next to `t`.
 ^N        : Make an empty buffer
 ^P        : Play / pause
 ^H        : Show tis help text
@@ -1422,6 +1428,17 @@ Editor commands
 ^Y        : Redo
 ^Z        : Undo
 
+Start forthbyte as
+`forthbyte [--render-ahead ms] [--device-rate hz] [--period frames]
+           [--low-latency] [file]`.
+The song is rendered on a thread of its own, ms milliseconds (50 by default)
+ahead of the audio device, which opens at 44100 Hz with periods of 4096
+frames unless asked otherwise. `--low-latency` starts with periods of 256
+frames and 10 ms of render ahead, and doubles both after underruns. The
+latency is shown next to `t`, and the underruns too if there were any.
+`forthbyte --render song.txt --seconds N --out file.wav` renders a song to a
+wav file as fast as possible, without opening a window.
+
 
 Glossary
 --------
@@ -1432,7 +1449,22 @@ Glossary
 `#float` use floatbeat (this is the default)
 `#samplerate nr` set the sample rate (default value is 8000)
 `#initmemory a b c ... ` initializes the memory with the values given by
-             `a`, `b`, `c`, ... . There are 256 memory spots available.
+             `a`, `b`, `c`, ... . There are 256 memory spots available,
+             unless `#memory` asks for more.
+`#memory nr` make the memory hold nr values (rounded up to a power of two)
+`#controlrate nr` the samples between two updates of a `k:` word
+                  (default value is 64)
+`#resample quality` how the song is converted to the rate of the audio
+                  device: hold (repeat every sample, the classic harsh
+                  bytebeat sound), linear, sinc (the default) or best
+`#devicerate nr` open the audio device at this rate, from the next play on
+`#period nr` the frames of one audio callback (a power of two from 32 to
+             8192), from the next play on
+`#loadtable file offset` copy the samples of a .wav or .raw (32 bit float)
+             file into the memory from offset on, as values from -1 to 1
+             (#float) or from 0 to 255 (#byte)
+`#jit off` run the song with the interpreter instead of native code
+           (`#jit on` is the default)
 
 ### Predefined variables
 
@@ -1497,23 +1529,41 @@ memory entries, or the Forth return stack.
               regular stack. 
 `: ;` Define a new word, e..g. `: twice 2 * ;` defines the word `twice`, so
       that `3 twice` equals `3 2 *` equals `6`.
+`k: ;` Define a word that sees `t` rounded down to a multiple of
+       `#controlrate`, so that its value is held for that many samples,
+       e.g. `k: lfo t 0.0002 * sin ;`. Cheaper for envelopes and lfos.
 `abs` ( a -- b ) Pops the top value from the stack, and pushes the absolue
                  value on the stack.
 `atan2` ( a b -- c ) Pops the two top values from the stack, and pushes
                      atan2(a, b) on the stack.
+`bq-lowpass` `bq-highpass` `bq-bandpass` ( a f q -- b ) Pops a value, a
+                    frequency in Hz and a q, and pushes the value through a
+                    biquad filter. Every filter keeps its own state for
+                    each channel. A q of 0.7071 has no resonance.
 `ceil` ( a -- b ) Pops the top value from the stack, rounds the value up,
                   and pushes this value on the stack.
 `cos` ( a -- b ) Pops the top value from the stack, and pushes the cosine
                  on the stack.
+`delay` ( a n -- b ) Pops a value and a length, and pushes the value that
+                    this delay got n samples ago. Every delay has a ring of
+                    its own for each channel, long enough for a literal n,
+                    or 262144 samples if n is computed.
 `drop` ( a -- )  Pop the top element of the stack.
 `dup` ( a -- a a )  Duplicate the value on the top of the stack.
 `2dup` ( a b -- a b a b ) Duplicate the top two elements on the stack.
 `exp` ( a -- b ) Pops the top value from the stack, and pushes the 
                  exponential on the stack.
+`feedback` ( a n g -- b ) Like delay, but pushes a plus g times the value
+                    that this feedback pushed n samples ago, and remembers
+                    that. For #byte g counts 256ths.
 `floor` ( a -- b ) Pops the top value from the stack, rounds the value down,
                    and pushes this value on the stack.
+`highpass` ( a f -- b ) Pops a value and a frequency in Hz, and pushes the
+                    value through a one-pole highpass filter.
 `log` ( a -- b ) Pops the top value from the stack, and pushes the logarithm
                  on the stack.
+`lowpass` ( a f -- b ) Pops a value and a frequency in Hz, and pushes the
+                    value through a one-pole lowpass filter.
 `max` ( a b -- c ) Pops the two top values from the stack, and pushes their
                    maximum on the stack.
 `min` ( a b -- c ) Pops the two top values from the stack, and pushes their
@@ -1523,6 +1573,10 @@ memory entries, or the Forth return stack.
 `nip` ( a b -- b )  Drop the first item below the top of the stack.
 `not` ( a -- b ) Pops the top value from the stack, and pushes the binary not
                  on the stack.
+`osc-sin` `osc-saw` `osc-square` ( a -- b ) Pops a phase from the stack, and
+                 pushes a sine, sawtooth or square wave at that phase. A phase
+                 of 1 (256 for #byte) is a whole cycle. The values go from -1
+                 to 1 (0 to 255 for #byte).
 `over` ( a b -- a b a )  Duplicate the element under the top stack element.
 `pick` ( a_b ... a_1 a_0 b -- a_b ... a_1 a_0 a_b )  Remove b from the stack
                                                      and copy a_b to the top
@@ -1546,7 +1600,7 @@ memory entries, or the Forth return stack.
   return state;
   }
 
-std::optional<app_state> process_input(app_state state, compiler& c, music& m)
+std::optional<app_state> process_input(app_state state, music& m)
   {
   SDL_Event event;
   auto tic = std::chrono::steady_clock::now();
@@ -1586,7 +1640,7 @@ std::optional<app_state> process_input(app_state state, compiler& c, music& m)
           case SDLK_END: return move_end(state);
           case SDLK_TAB: return tab(state);
           case SDLK_KP_ENTER:
-          case SDLK_RETURN: return ret(state, c, m);
+          case SDLK_RETURN: return ret(state, m);
           case SDLK_BACKSPACE: return backspace(state);
           case SDLK_DELETE: 
           {
@@ -1625,7 +1679,7 @@ std::optional<app_state> process_input(app_state state, compiler& c, music& m)
           {
           if (ctrl_pressed())
             {
-            return compile_buffer(state, c, m);
+            return compile_buffer(state, m);
             }
           }
           case SDLK_c:
@@ -1695,7 +1749,7 @@ std::optional<app_state> process_input(app_state state, compiler& c, music& m)
               {
               state.operation = state.operation_stack.back();
               state.operation_stack.pop_back();
-              return ret(state, c, m);
+              return ret(state, m);
               }
               default: return new_buffer(state);
               }
@@ -1766,7 +1820,7 @@ std::optional<app_state> process_input(app_state state, compiler& c, music& m)
               case op_query_save:
               {
               state.operation = op_save;
-              return ret(state, c, m);
+              return ret(state, m);
               }
               default: return redo(state);
               }
@@ -1806,13 +1860,15 @@ std::optional<app_state> process_input(app_state state, compiler& c, music& m)
         case SDL_QUIT: return exit(state);
         } // switch (event.type)
       }
+    if (m.adapt_latency())
+      state.message = string_to_line("[Underruns: the audio period is now " + std::to_string(m.get_period()) + "]");
     draw_music_info(state, m);
     SDL_UpdateWindowSurface(pdc_window);
     std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(5.0));
     }
   }
 
-engine::engine(int argc, char** argv) : m(&c)
+engine::engine(int argc, char** argv)
   {
   pdc_font_size = 17;
 #ifdef _WIN32
@@ -1842,8 +1898,23 @@ engine::engine(int argc, char** argv) : m(&c)
   init_colors();
   bkgd(COLOR_PAIR(default_color));
 
-  if (argc > 1)
-    state.buffer = read_from_file(std::string(argv[1]));
+  std::string filename;
+  for (int i = 1; i < argc; ++i)
+    {
+    std::string arg(argv[i]);
+    if (arg == "--render-ahead" && i + 1 < argc)
+      m.set_render_ahead((uint32_t)std::max(0, atoi(argv[++i])));
+    else if (arg == "--device-rate" && i + 1 < argc)
+      m.set_device_rate((uint32_t)std::max(0, atoi(argv[++i])));
+    else if (arg == "--period" && i + 1 < argc)
+      m.set_period((uint32_t)std::max(0, atoi(argv[++i])));
+    else if (arg == "--low-latency")
+      m.set_low_latency(true);
+    else if (filename.empty())
+      filename = arg;
+    }
+  if (!filename.empty())
+    state.buffer = read_from_file(filename);
   else
     state.buffer = make_empty_buffer();
   state.export_location = jtk::get_folder(jtk::get_executable_path()) + std::string("session.wav");
@@ -1857,7 +1928,7 @@ engine::engine(int argc, char** argv) : m(&c)
   state.paused = false;
   state.senv.show_all_characters = false;
   state.senv.tab_space = 8;
-  state = compile_buffer(state, c, m);
+  state = compile_buffer(state, m);
 
   SDL_ShowCursor(1);
   SDL_SetWindowSize(pdc_window, w, h);
@@ -1881,7 +1952,7 @@ void engine::run()
   state = draw(state, m);
   SDL_UpdateWindowSurface(pdc_window);
 
-  while (auto new_state = process_input(state, c, m))
+  while (auto new_state = process_input(state, m))
     {
     state = *new_state;
     state = draw(state, m);
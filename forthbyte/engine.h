@@ -36,7 +36,6 @@ struct app_state
 struct engine
   {
   app_state state;
-  compiler c;
   music m;
 
   engine(int argc, char** argv);
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <cmath>
+#include <string>
+
+/*
+The one-pole and biquad filters of the words lowpass, highpass, bq-lowpass, bq-highpass and
+bq-bandpass.
+
+Every filter runs in transposed direct form II, the one-pole filters with b2 and a2 at zero,
+so that one function steps them all. The biquads follow the Audio EQ Cookbook of Robert
+Bristow-Johnson; bq-bandpass peaks at 0 dB.
+
+The frequency counts cycles per sample. It is clamped to [min_filter_frequency,
+max_filter_frequency], which keeps the filters stable, and nan becomes the lowest frequency.
+The q of a biquad is clamped to [min_filter_q, max_filter_q].
+*/
+
+namespace forth
+  {
+
+  enum e_filter
+    {
+    FILTER_ONE_POLE_LOWPASS,
+    FILTER_ONE_POLE_HIGHPASS,
+    FILTER_LOWPASS,
+    FILTER_HIGHPASS,
+    FILTER_BANDPASS,
+    FILTER_COUNT
+    };
+
+  constexpr double min_filter_frequency = 1e-5;
+  constexpr double max_filter_frequency = 0.49;
+  constexpr double min_filter_q = 0.1;
+  constexpr double max_filter_q = 100.0;
+
+  struct filter_coefficients
+    {
+    double b0, b1, b2, a1, a2;
+    };
+
+  inline const char* filter_word(e_filter kind)
+    {
+    static const char* const words[FILTER_COUNT] = { "lowpass", "highpass", "bq-lowpass", "bq-highpass", "bq-bandpass" };
+    return words[kind];
+    }
+
+  // FILTER_COUNT if word is not a filter
+  inline e_filter filter_kind(const std::string& word)
+    {
+    int kind = 0;
+    while (kind < FILTER_COUNT && word != filter_word((e_filter)kind))
+      ++kind;
+    return (e_filter)kind;
+    }
+
+  // the values that the word takes after its input: the frequency, and the q of a biquad
+  inline int filter_parameters(e_filter kind)
+    {
+    return kind >= FILTER_LOWPASS ? 2 : 1;
+    }
+
+  inline filter_coefficients make_filter(e_filter kind, double frequency, double q)
+    {
+    const double pi = 3.14159265358979323846;
+    if (!(frequency >= min_filter_frequency))
+      frequency = min_filter_frequency;
+    if (frequency > max_filter_frequency)
+      frequency = max_filter_frequency;
+    if (!(q >= min_filter_q))
+      q = min_filter_q;
+    if (q > max_filter_q)
+      q = max_filter_q;
+    filter_coefficients c = { 0.0, 0.0, 0.0, 0.0, 0.0 };
+    if (kind == FILTER_ONE_POLE_LOWPASS || kind == FILTER_ONE_POLE_HIGHPASS)
+      {
+      // the lowpass y = (1 - p) x + p y', and the highpass, x minus that, p (x - x') + p y'
+      const double pole = std::exp(-2.0 * pi * frequency);
+      c.a1 = -pole;
+      if (kind == FILTER_ONE_POLE_LOWPASS)
+        c.b0 = 1.0 - pole;
+      else
+        {
+        c.b0 = pole;
+        c.b1 = -pole;
+        }
+      return c;
+      }
+    const double w = 2.0 * pi * frequency;
+    const double cosw = std::cos(w);
+    const double alpha = std::sin(w) / (2.0 * q);
+    const double a0 = 1.0 + alpha;
+    switch (kind)
+      {
+      case FILTER_LOWPASS:
+        c.b0 = (1.0 - cosw) / 2.0 / a0;
+        c.b1 = (1.0 - cosw) / a0;
+        c.b2 = c.b0;
+        break;
+      case FILTER_HIGHPASS:
+        c.b0 = (1.0 + cosw) / 2.0 / a0;
+        c.b1 = -(1.0 + cosw) / a0;
+        c.b2 = c.b0;
+        break;
+      default:
+        c.b0 = alpha / a0;
+        c.b2 = -alpha / a0;
+        break;
+      }
+    c.a1 = -2.0 * cosw / a0;
+    c.a2 = (1.0 - alpha) / a0;
+    return c;
+    }
+
+  // one sample through the filter, z1 and z2 are its state
+  inline double filter_sample(const filter_coefficients& c, double& z1, double& z2, double x)
+    {
+    const double y = c.b0 * x + z1;
+    z1 = c.b1 * x - c.a1 * y + z2;
+    z2 = c.b2 * x - c.a2 * y;
+    return y;
+    }
+
+  } // namespace forth
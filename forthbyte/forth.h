@@ -2,13 +2,21 @@
 
 #include <algorithm>
 #include <array>
+#include <cstring>
+#include <initializer_list>
+#include <limits>
 #include <map>
+#include <numeric>
 #include <string>
 #include <sstream>
+#include <type_traits>
 #include <variant>
 #include <vector>
 #include <cmath>
 
+#include "filters.h"
+#include "oscillators.h"
+
 namespace forth
   {
 
@@ -19,7 +27,9 @@ namespace forth
       T_WORD,
       T_VALUE,
       T_COLON,
-      T_SEMICOLON
+      T_SEMICOLON,
+      T_MEMO, // memo:, which starts a definition whose results are cached
+      T_CONTROL // k:, which starts a definition that is computed at control rate
       };
 
     e_type type;
@@ -30,8 +40,276 @@ namespace forth
     token(e_type i_type, const std::string& v, int i_line_nr, int i_column_nr) : type(i_type), value(v), line_nr(i_line_nr), column_nr(i_column_nr) {}
     };
 
+  enum e_opcode
+    {
+    OP_VALUE,
+    OP_VARIABLE,
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_LEFT_SHIFT,
+    OP_RIGHT_SHIFT,
+    OP_AND,
+    OP_OR,
+    OP_XOR,
+    OP_NOT,
+    OP_SIN,
+    OP_COS,
+    OP_MOD,
+    OP_LESS,
+    OP_GREATER,
+    OP_LEQ,
+    OP_GEQ,
+    OP_EQ,
+    OP_NEQ,
+    OP_DUP,
+    OP_PICK,
+    OP_DROP,
+    OP_2DUP,
+    OP_OVER,
+    OP_NIP,
+    OP_TUCK,
+    OP_SWAP,
+    OP_ROT,
+    OP_MROT,
+    OP_MIN,
+    OP_MAX,
+    OP_POW,
+    OP_ATAN2,
+    OP_NEGATE,
+    OP_TAN,
+    OP_LOG,
+    OP_EXP,
+    OP_SQRT,
+    OP_FLOOR,
+    OP_CEIL,
+    OP_ABS,
+    OP_OSC_SIN,
+    OP_OSC_SAW,
+    OP_OSC_SQUARE,
+    OP_FETCH,
+    OP_STORE,
+    OP_RETURN_STACK_PUSH,
+    OP_RETURN_STACK_POP,
+    OP_ASSIGN, // to, and the locals of a definition: pops into a global
+    OP_DELAY, // delay and feedback, the index is their line in interpreter::delay_lines
+    OP_FEEDBACK,
+    OP_FILTER, // a filter with literal parameters, the index is the entry in interpreter::filters
+    OP_FILTER_F, // a filter that pops its frequency
+    OP_FILTER_FQ, // a filter that pops its frequency and q
+    // fused opcodes, made by interpreter::optimize: an operator with a literal right operand
+    OP_ADD_VALUE,
+    OP_SUB_VALUE,
+    OP_MUL_VALUE,
+    OP_DIV_VALUE,
+    OP_MOD_VALUE,
+    OP_LEFT_SHIFT_VALUE,
+    OP_RIGHT_SHIFT_VALUE,
+    OP_AND_VALUE,
+    OP_OR_VALUE,
+    OP_XOR_VALUE,
+    OP_SQUARE, // dup *
+    // control flow, made by interpreter::compile from if else then, do loop and begin until
+    OP_JUMP,
+    OP_JUMP_IF_ZERO,
+    OP_DO,
+    OP_LOOP,
+    OP_BEGIN,
+    OP_UNTIL,
+    OP_I, // the counter of the innermost loop
+    OP_J, // the counter of the loop around it
+    OP_CALL,
+    OP_RETURN,
+    OP_MEMO, // looks up the inputs of a memo: word, and skips its call on a hit
+    OP_MEMO_STORE, // caches the outputs of the call before it
+    OP_COUNT
+    };
+
+  // the opcodes that jump, call or use the loop counters, which only interpreter::run executes
+  inline bool is_control_flow(e_opcode op)
+    {
+    return op >= OP_JUMP && op <= OP_MEMO_STORE;
+    }
+
+  // delay, feedback and the filters, which keep state of their own from one evaluation to the
+  // next, and which only interpreter::run executes
+  inline bool has_state(e_opcode op)
+    {
+    return op >= OP_DELAY && op <= OP_FILTER_FQ;
+    }
+
+  // unlike a == b, tells 0 from -0 and compares nan with itself
+  template <class T>
+  inline bool same_bits(T a, T b)
+    {
+    return memcmp(&a, &b, sizeof(T)) == 0;
+    }
+
+  // the operator that a fused opcode applies: OP_ADD for OP_ADD_VALUE, OP_MUL for OP_SQUARE,
+  // and op itself for the other opcodes
+  inline e_opcode fused_operator(e_opcode op)
+    {
+    switch (op)
+      {
+      case OP_ADD_VALUE: return OP_ADD;
+      case OP_SUB_VALUE: return OP_SUB;
+      case OP_MUL_VALUE: return OP_MUL;
+      case OP_DIV_VALUE: return OP_DIV;
+      case OP_MOD_VALUE: return OP_MOD;
+      case OP_LEFT_SHIFT_VALUE: return OP_LEFT_SHIFT;
+      case OP_RIGHT_SHIFT_VALUE: return OP_RIGHT_SHIFT;
+      case OP_AND_VALUE: return OP_AND;
+      case OP_OR_VALUE: return OP_OR;
+      case OP_XOR_VALUE: return OP_XOR;
+      case OP_SQUARE: return OP_MUL;
+      default: return op;
+      }
+    }
+
+  // What a value depends on, from cheap to expensive. A value that depends on the song only
+  // (literals, sr) is the same for every sample, a value that depends on t or on the memory is
+  // the same for both channels, and a value that depends on c is computed once per channel.
+  // A step value depends on t only through a quantization, like t 16 >> or t 1000 / floor, or
+  // on memory that the program does not write, so that it stays the same for runs of samples.
+  enum e_dependency
+    {
+    DEP_SONG,
+    DEP_STEP,
+    DEP_SAMPLE,
+    DEP_CHANNEL
+    };
+
   std::vector<token> tokenize(const std::string& str);
 
+  // the high 64 bits of the 128 bit product a * b
+  inline int64_t multiply_high(int64_t a, int64_t b)
+    {
+#if defined(__SIZEOF_INT128__)
+    __extension__ typedef __int128 int128;
+    return (int64_t)(((int128)a * (int128)b) >> 64);
+#else
+    uint64_t ua = (uint64_t)a, ub = (uint64_t)b;
+    uint64_t a_lo = ua & 0xffffffffull, a_hi = ua >> 32;
+    uint64_t b_lo = ub & 0xffffffffull, b_hi = ub >> 32;
+    uint64_t lo_lo = a_lo * b_lo;
+    uint64_t hi_lo = a_hi * b_lo;
+    uint64_t lo_hi = a_lo * b_hi;
+    uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xffffffffull) + lo_hi;
+    uint64_t high = a_hi * b_hi + (hi_lo >> 32) + (cross >> 32);
+    // from the unsigned to the signed product
+    if (a < 0)
+      high -= ub;
+    if (b < 0)
+      high -= ua;
+    return (int64_t)high;
+#endif
+    }
+
+  // Integer division and remainder by a constant, with a multiplication by a magic number and
+  // shifts instead of a divide instruction (Hacker's Delight, chapter 10), or with a shift and a
+  // mask if |d| is a power of two. quotient and remainder round towards zero like / and %, for
+  // every a. Only divisors with |d| >= 2 are reduced, see is_reducible.
+  struct constant_divisor
+    {
+    int64_t d;
+    int64_t magic;
+    int shift;
+    bool power_of_two; // |d| == 2^shift
+
+    static bool is_reducible(int64_t d)
+      {
+      return d >= 2 || (d <= -2 && d != std::numeric_limits<int64_t>::min());
+      }
+
+    constant_divisor() : d(2), magic(0), shift(1), power_of_two(true)
+      {
+      }
+
+    explicit constant_divisor(int64_t divisor) : d(divisor), magic(0), shift(0), power_of_two(false)
+      {
+      const uint64_t ad = d < 0 ? (uint64_t)0 - (uint64_t)d : (uint64_t)d;
+      if ((ad & (ad - 1)) == 0)
+        {
+        power_of_two = true;
+        while (((uint64_t)1 << shift) < ad)
+          ++shift;
+        return;
+        }
+      const uint64_t two63 = (uint64_t)1 << 63;
+      const uint64_t t = two63 + ((uint64_t)d >> 63);
+      const uint64_t anc = t - 1 - t % ad;
+      int p = 63;
+      uint64_t q1 = two63 / anc, r1 = two63 - q1 * anc;
+      uint64_t q2 = two63 / ad, r2 = two63 - q2 * ad;
+      uint64_t delta;
+      do
+        {
+        ++p;
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= anc)
+          {
+          ++q1;
+          r1 -= anc;
+          }
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= ad)
+          {
+          ++q2;
+          r2 -= ad;
+          }
+        delta = ad - r2;
+        } while (q1 < delta || (q1 == delta && r1 == 0));
+      magic = (int64_t)(q2 + 1);
+      if (d < 0)
+        magic = (int64_t)((uint64_t)0 - (uint64_t)magic);
+      shift = p - 64;
+      }
+
+    int64_t quotient(int64_t a) const
+      {
+      int64_t q;
+      if (power_of_two)
+        {
+        // rounds towards zero by adding |d| - 1 to negative numbers
+        int64_t bias = (int64_t)((uint64_t)(a >> 63) >> (64 - shift));
+        q = (a + bias) >> shift;
+        return d < 0 ? -q : q;
+        }
+      q = multiply_high(magic, a);
+      if (d > 0 && magic < 0)
+        q += a;
+      else if (d < 0 && magic > 0)
+        q -= a;
+      q >>= shift;
+      return q + (int64_t)((uint64_t)q >> 63);
+      }
+
+    int64_t remainder(int64_t a) const
+      {
+      return (int64_t)((uint64_t)a - (uint64_t)quotient(a) * (uint64_t)d);
+      }
+    };
+
+  // Optional vectorized implementations of the primitives, used by interpreter::eval_block.
+  // A kernel computes r[i] = op(a[i]) or r[i] = op(a[i], b[i]) for 0 <= i < n, where r may
+  // alias a or b. Opcodes without a kernel are evaluated with the scalar primitive.
+  template <class T>
+  struct lane_kernels
+    {
+    typedef void(*unary_kernel)(T* r, const T* a, int n);
+    typedef void(*binary_kernel)(T* r, const T* a, const T* b, int n);
+
+    // steps a filter over both channels of a block at once, z1 and z2 hold its state by channel
+    typedef void(*stereo_filter_kernel)(const filter_coefficients& c, double* z1, double* z2, T* left, T* right, int n);
+
+    unary_kernel unary[OP_COUNT] = {};
+    binary_kernel binary[OP_COUNT] = {};
+    stereo_filter_kernel stereo_filter = nullptr;
+    };
+
   template <class T, int N = 256>
   class interpreter
     {
@@ -50,6 +328,7 @@ namespace forth
       struct Primitive
         {
         primitive_fun_ptr fun;
+        e_opcode op;
         };
 
       struct Variable
@@ -57,9 +336,58 @@ namespace forth
         int index;
         };
 
-      typedef std::variant<Value, Primitive, Variable> Statement;
+      // to, which pops the top of the stack into a value or a local
+      struct Assign
+        {
+        int index;
+        };
+
+      // a fused opcode, val is the literal operand
+      struct Fused
+        {
+        e_opcode op;
+        T val;
+        };
+
+      // a word that is too large to inline or a memo: word, an index into Program::words
+      struct Call
+        {
+        int word;
+        int memo; // the entry in interpreter::memos, -1 if the results are not cached
+        };
+
+      // a word with state of its own: delay or feedback, index is the entry in
+      // interpreter::delay_lines, or a filter, index is the entry in interpreter::filters
+      struct Stateful
+        {
+        e_opcode op;
+        int index;
+        };
+
+      struct Branch;
+      struct Loop;
+
+      typedef std::variant<Value, Primitive, Variable, Assign, Fused, Call, Stateful, Branch, Loop> Statement;
       typedef std::vector<Statement> Statements;
 
+      // if ... else ... then, which takes the else part when the condition is zero
+      struct Branch
+        {
+        Statements then_part;
+        Statements else_part;
+        };
+
+      // limit start do ... loop runs the body for start <= i < limit, so not at all if limit <= start,
+      // begin ... until runs the body until it leaves a value that is not zero on the stack, but at
+      // most max_until_iterations times
+      struct Loop
+        {
+        bool counted; // do loop
+        int64_t start;
+        int64_t limit;
+        Statements body;
+        };
+
       struct Definition
         {
         Statements statements;
@@ -69,11 +397,167 @@ namespace forth
       struct Program
         {
         Statements statements;
+        std::vector<Definition> words; // the bodies of the calls
+        };
+
+      struct Instruction
+        {
+        e_opcode op;
+        int index; // the global of OP_VARIABLE and OP_ASSIGN, or for integers the entry in Bytecode::divisors of
+                   // OP_DIV_VALUE and OP_MOD_VALUE, -1 if the divisor is not reduced, or the
+                   // instruction that a jump, OP_LOOP, OP_UNTIL or OP_CALL goes to, or the entry in
+                   // interpreter::memos of OP_MEMO and OP_MEMO_STORE, or the entry in
+                   // interpreter::delay_lines of OP_DELAY and OP_FEEDBACK
+        T val;
+        };
+
+      struct StackEffect
+        {
+        bool is_static; // the stack depth is known at compile time for every instruction
+        int depth; // net number of values the program leaves on the stack
+        int min_depth; // lowest depth reached, relative to the depth at the start
+        int max_depth;
+        int return_depth;
+        int min_return_depth;
+        int max_return_depth;
+        bool writes_memory; // ! or a delay line
+        bool has_control_flow; // jumps, calls or loop counters, see is_control_flow
+        // reads a global that it assigns before assigning it, and so sees what the previous
+        // evaluation left in it
+        bool carries_globals;
+
+        // true if sample t never sees anything that sample t-1 left behind, so that a
+        // block of samples can be evaluated lane by lane in any order
+        bool lanes_are_independent() const
+          {
+          return is_static && min_depth >= 0 && depth >= 1 && min_return_depth >= 0 && return_depth == 0 && !writes_memory && !has_control_flow && !carries_globals;
+          }
+        };
+
+      // The program comes first. If it calls words, it ends with OP_RETURN, and the bodies of
+      // the words that it calls follow, each once and each ending with OP_RETURN.
+      struct Bytecode
+        {
+        std::vector<Instruction> instructions;
+        StackEffect effect;
+        // what the top of the stack depends on after each instruction, empty if the stack
+        // depth is not static or the program jumps
+        std::vector<e_dependency> dependencies;
+        // for each step value in dependencies, the length of its runs if they start at the
+        // multiples of it, as for t 16 >>, or 0 if they do not
+        std::vector<int64_t> periods;
+        // the literal divisors of an integer program
+        std::vector<constant_divisor> divisors;
+        // the number of filters with literal parameters at the end of a program that computes
+        // their input lane by lane, which eval_block runs over whole blocks, 0 if the program
+        // does not end like that
+        int filter_tail = 0;
+
+        // true if eval_block and eval_block_stereo evaluate a block of samples at a time
+        bool runs_in_lanes() const
+          {
+          return effect.lanes_are_independent() || filter_tail > 0;
+          }
+        };
+
+      static constexpr int block_size = 256;
+      // The loops are bounded when the program is parsed, so that a sample always takes a
+      // known amount of work: begin until gives up after max_until_iterations, loops nest at
+      // most max_loop_nesting deep, and all loops of a program together run their bodies at
+      // most max_loop_iterations times.
+      static constexpr int64_t max_until_iterations = 1024;
+      static constexpr int max_loop_nesting = 8;
+      static constexpr int64_t max_loop_iterations = 65536;
+      // A word with more than max_inline_size statements is called instead of inlined, so that
+      // words that use each other do not grow the program exponentially, unless its calls
+      // already nest max_call_depth deep. The program, with every call inlined, has at most
+      // max_program_size statements.
+      // Once the whole program is parsed, the calls of words that are called from one place
+      // only are inlined after all, and so are all calls if the program with every call
+      // inlined has at most max_flat_size statements, as a call keeps the program out of the
+      // lanes of eval_block, the ssa form and the jit.
+      static constexpr int64_t max_inline_size = 32;
+      static constexpr int max_call_depth = 64;
+      static constexpr int64_t max_program_size = 1 << 20;
+      static constexpr int64_t max_flat_size = 1 << 12;
+      // A memo: word takes at most max_memo_arity values and leaves at most as many, and
+      // caches the results of memo_cache_size different inputs.
+      static constexpr int max_memo_arity = 4;
+      static constexpr int memo_cache_bits = 6;
+      static constexpr int memo_cache_size = 1 << memo_cache_bits;
+      // The memory of @ and ! has N entries, unless set_memory_size asks for more, up to
+      // max_memory_size.
+      static constexpr int64_t max_memory_size = 1 << 24;
+      // A delay line holds the next power of two above the literal length in front of delay
+      // or feedback, up to max_delay_size samples, or default_delay_size samples if the
+      // length is computed, for each channel. All lines together hold at most
+      // max_delay_memory samples.
+      static constexpr int64_t max_delay_size = 1 << 21;
+      static constexpr int64_t default_delay_size = 1 << 18;
+      static constexpr int64_t max_delay_memory = 1 << 25;
+      // A k: word sees t rounded down to a multiple of control_rate, default_control_rate
+      // unless #controlrate asks for another, up to max_control_rate.
+      static constexpr int64_t default_control_rate = 64;
+      static constexpr int64_t max_control_rate = 1 << 20;
+
+      // The direct-mapped cache of a memo: word. An entry is picked by a hash of the bits of
+      // the inputs, and a call with other inputs that map to the same entry replaces it.
+      struct Memo
+        {
+        std::string name;
+        int inputs;
+        int outputs;
+        std::vector<T> keys; // max_memo_arity per entry
+        std::vector<T> values; // max_memo_arity per entry
+        std::vector<char> valid;
+        int pending; // the entry of the last miss, which the call fills
+        uint64_t hits;
+        uint64_t misses;
+        };
+
+      // The ring of past samples of one delay or feedback, for both channels: the ring of
+      // channel c starts at offset + c * (mask + 1) in delay_memory, and its next sample goes
+      // to position[c] & mask. The channel is the value of the global channel, 0 if the
+      // program has no variable c.
+      struct DelayLine
+        {
+        int64_t offset;
+        int64_t mask;
+        int64_t position[2];
+        int channel;
+        };
+
+      // A filter and its state for both channels. The coefficients are made for frequency and
+      // q, where the frequency counts Hz if the program has a variable sr, and cycles per
+      // sample if not.
+      struct Filter
+        {
+        e_filter kind;
+        double frequency;
+        double q;
+        filter_coefficients coefficients;
+        double z1[2]; // by channel
+        double z2[2];
+        int channel;
+        int sample_rate;
         };
 
       typedef std::map<std::string, Statements> Dictionary;
 
       Dictionary dictionary;
+      // the definitions that are called, the dictionary holds a Call for them
+      std::vector<Definition> words;
+      // the caches of the memo: words, with their hit and miss counts
+      std::vector<Memo> memos;
+      // the delay lines, one for every delay and feedback in the program, with their samples
+      std::vector<DelayLine> delay_lines;
+      std::vector<T> delay_memory;
+      // the filters, one for every filter word in the program
+      std::vector<Filter> filters;
+      // The globals that to can assign: the values, which are variables too, and the locals of
+      // the definitions, by word.name, which have a global of their own but no variable name.
+      std::map<std::string, int> values;
+      std::map<std::string, int> locals;
 
       Value parse_value(std::vector<token>& tokens);      
       Statements parse_word(std::vector<token>& tokens);
@@ -84,6 +568,9 @@ namespace forth
 
       void set_variable_value(const std::string& name, T value);
 
+      // size is rounded up to a power of two, and the memory is cleared
+      void set_memory_size(int64_t size);
+
       T top();
       T second();
       T pop();
@@ -130,14 +617,35 @@ namespace forth
       void primitive_floor();
       void primitive_ceil();
       void primitive_abs();
+      void primitive_osc_sin();
+      void primitive_osc_saw();
+      void primitive_osc_square();
       void primitive_fetch();
       void primitive_store();
       void primitive_return_stack_push();
       void primitive_return_stack_pop();
+      void primitive_loop_i();
+      void primitive_loop_j();
 
       void eval(const Program& prog);
 
-      typedef std::map<std::string, primitive_fun_ptr> primitive_map;
+      // folds constants, removes stack shuffles that do nothing, branches with a literal
+      // condition and loops that never run, and fuses common pairs of statements, without
+      // changing what the program computes
+      Program optimize(const Program& prog) const;
+      std::string dump(const Statements& stmts) const;
+
+      Bytecode compile(const Program& prog) const;
+      StackEffect stack_effect(const std::vector<Instruction>& instructions) const;
+      // periods, if not null, gets what Bytecode::periods holds
+      std::vector<e_dependency> dependencies(const std::vector<Instruction>& instructions, const StackEffect& effect, std::vector<int64_t>* periods = nullptr) const;
+      void run(const Bytecode& code);
+      void eval_block(const Bytecode& code, int64_t t0, int count, int channel, T* out);
+      // both channels of count samples, as if eval_block was called for channel 0 and 1 of
+      // every sample in turn
+      void eval_block_stereo(const Bytecode& code, int64_t t0, int count, T* left, T* right);
+
+      typedef std::map<std::string, Primitive> primitive_map;
       primitive_map primitives;
 
       typedef std::map<std::string, int> variable_map;
@@ -147,9 +655,109 @@ namespace forth
       int stack_pointer;
       std::array<T, N> globals;
       int variable_index;
-      std::array<T, N> memory_stack;
+      // its size is a power of two, and @ and ! wrap addresses around it
+      std::vector<T> memory_stack;
       std::array<T, N> return_stack;
       int return_stack_pointer;
+      // the counters of the running loops, on top of two zeros for i and j outside of loops
+      std::array<int64_t, max_loop_nesting + 2> loop_counters;
+      int loop_pointer;
+
+      const lane_kernels<T>* kernels;
+      // eval_block calls the operators that is_memoized selects once per run of equal operands
+      bool memoize;
+      // the samples between two updates of a k: word, set it before parse
+      int64_t control_rate;
+
+    private:
+      void _parse_statement(std::vector<token>& tokens, Statements& stmts);
+      std::string _parse_body(std::vector<token>& tokens, Statements& body, std::initializer_list<const char*> ends);
+      // what a piece of code takes when it runs, as if the words that it calls were inlined
+      struct code_cost
+        {
+        int64_t size; // statements, with a call as one
+        int64_t statements;
+        int64_t iterations; // of the loop bodies, where nested bodies count every time they run
+        int nesting; // of the loops
+        int calls; // how deep the calls nest
+        };
+
+      code_cost _cost(const Statements& stmts) const;
+      void _parse_locals(std::vector<token>& tokens, Definition& def);
+      T _take_literal(Statements& stmts, const token& declaration) const;
+      bool _is_local(int index) const;
+      bool _is_pure(const Statements& stmts, int nesting) const;
+      void _make_memo(const Definition& def, const token& memo_token);
+      // counts the places that call each word, in stmts and in the words that they call
+      void _count_calls(const Statements& stmts, std::vector<int>& calls) const;
+      // stmts with the calls of the words that are called from one place inlined, or of all
+      // words if all is true, except for memo: words
+      Statements _inline_calls(const Statements& stmts, const std::vector<int>& calls, bool all) const;
+      // the cached outputs for the inputs on top of the stack st[0, sp) of N values, or null
+      // after counting a miss
+      const T* _memo_find(Memo& m, const T* st, int sp);
+      void _memo_store(Memo& m, const T* st, int sp);
+      // a new line for op, delay or feedback, that is long enough for the literal length in
+      // front of it in stmts
+      Stateful _make_delay(e_opcode op, const Statements& stmts);
+      // a new filter of kind, with its parameters taken from stmts if they are literals
+      Stateful _make_filter(e_filter kind, Statements& stmts);
+      // the statements of a word that is inlined, with new lines for its delays and feedbacks
+      // and new filters, so that every use of the word has a past of its own
+      Statements _with_new_state(const Statements& stmts);
+      // true if stmts has a delay, a feedback or a filter outside of the words that it calls
+      bool _has_state(const Statements& stmts) const;
+      // the body of a k: word, with every t replaced by t rounded down to a multiple of
+      // control_rate, so that eval_block computes it once per control_rate samples, and the
+      // words that it calls replaced by copies that are made the same way
+      Statements _at_control_rate(const Statements& stmts);
+      void _find_delay_lines(const Statements& stmts, std::vector<char>& used) const;
+      // gives the lines that the program uses their samples in delay_memory
+      void _allocate_delay_lines(const Program& prog);
+      T _delay(DelayLine& d, e_opcode op, T x, T length, T gain);
+      void _tune_filter(Filter& f, double frequency, double q) const;
+      T _filter(Filter& f, e_opcode op, T x, T frequency, T q);
+      // runs the filter over a block of the output of _eval_lanes, right is null for one channel
+      void _filter_block(Filter& f, T* left, T* right, int lanes);
+      StackEffect _stack_effect(const std::vector<Instruction>& instructions, size_t begin, std::vector<std::pair<int, int>>& landing, std::map<int, StackEffect>& words) const;
+      void _eval(const Statements& stmts, const std::vector<Definition>& called);
+      // run, where the stack pointer wraps around the ring if wrap is true, and must stay
+      // inside of it if not
+      template <bool wrap>
+      void _run(const Bytecode& code);
+      void _fold(const Statements& stmts, Statements& out) const;
+      Statements _fuse(const Statements& stmts) const;
+      void _compile(const Statements& stmts, Bytecode& code) const;
+      bool _peephole(Statements& stmts) const;
+      // a stack entry of _eval_lanes: a row for each channel, the same row if the value does
+      // not depend on the channel
+      struct lane_entry
+        {
+        int row[2];
+        };
+
+      void _eval_lanes(const Bytecode& code, int64_t t0, int lanes, int t_index, int c_index, T* left, T* right);
+
+      // the last operands and result of a memoized instruction of _eval_lanes
+      struct lane_memo
+        {
+        e_opcode op;
+        T a, b, r;
+        };
+
+      std::vector<T> lane_rows;
+      std::vector<int> lane_row_refs;
+      // the period of a row that only holds the first lane of each run of a held value, 0 for
+      // a row that holds all lanes
+      std::vector<int64_t> lane_row_periods;
+      std::vector<int> free_lane_rows;
+      std::vector<lane_entry> data_lane_rows;
+      std::vector<lane_entry> return_lane_rows;
+      std::vector<lane_memo> lane_memos;
+      std::vector<code_cost> word_costs; // of words
+      std::map<int, int> control_rate_words; // the copies of words that k: words call, by word
+      std::map<std::string, int> local_scope; // the locals of the definition that is being parsed
+      std::vector<std::pair<int, lane_entry>> global_lane_rows; // what to assigned in _eval_lanes
     };
 
   namespace details
@@ -165,7 +773,15 @@ namespace forth
       expected_token,
       definition_in_definition,
       variable_overflow,
-      unknown_variable
+      unknown_variable,
+      unmatched_control,
+      loop_bounds_expected,
+      loop_too_long,
+      program_too_large,
+      impure_memo,
+      memo_arity,
+      misplaced_declaration,
+      not_assignable
       };
 
     inline void _throw_error(int line_nr, int column_nr, error_type t, std::string extra)
@@ -206,6 +822,30 @@ namespace forth
         case unknown_variable:
           str << "Unknown variable";
           break;
+        case unmatched_control:
+          str << "This word does not close a control structure";
+          break;
+        case loop_bounds_expected:
+          str << "I expect two literal values as loop bounds";
+          break;
+        case loop_too_long:
+          str << "The loops take too many iterations";
+          break;
+        case program_too_large:
+          str << "The program is too large";
+          break;
+        case impure_memo:
+          str << "A memo: word can only compute with the values on the stack";
+          break;
+        case memo_arity:
+          str << "A memo: word must take and leave a fixed number of values";
+          break;
+        case misplaced_declaration:
+          str << "Locals are declared in a definition and values and constants outside of it, both outside of control structures";
+          break;
+        case not_assignable:
+          str << "I can only assign to a value or a local";
+          break;
         }
       if (!extra.empty())
         str << "-> " << extra;
@@ -412,8 +1052,21 @@ namespace forth
         }
         case ':':
         {
-        _treat_buffer(buff, tokens, line_nr, column_nr);
-        tokens.emplace_back(token::T_COLON, ":", line_nr, column_nr);
+        if (buff == "memo") // memo: is one token
+          {
+          tokens.emplace_back(token::T_MEMO, "memo:", line_nr, column_nr - (int)buff.length());
+          buff.clear();
+          }
+        else if (buff == "k") // k: too
+          {
+          tokens.emplace_back(token::T_CONTROL, "k:", line_nr, column_nr - (int)buff.length());
+          buff.clear();
+          }
+        else
+          {
+          _treat_buffer(buff, tokens, line_nr, column_nr);
+          tokens.emplace_back(token::T_COLON, ":", line_nr, column_nr);
+          }
         ++s;
         ++column_nr;
         break;
@@ -451,53 +1104,63 @@ namespace forth
     }
 
   template <class T, int N>
-  interpreter<T, N>::interpreter() : stack_pointer(0), variable_index(0), return_stack_pointer(0)
-    {
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>("+", &interpreter::primitive_add));
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>("-", &interpreter::primitive_sub));
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>("*", &interpreter::primitive_mul));
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>("/", &interpreter::primitive_div));
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>("<<", &interpreter::primitive_left_shift));
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>(">>", &interpreter::primitive_right_shift));
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>("&", &interpreter::primitive_and));
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>("|", &interpreter::primitive_or));
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>("^", &interpreter::primitive_xor));
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>("not", &interpreter::primitive_not));
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>("sin", &interpreter::primitive_sin));
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>("cos", &interpreter::primitive_cos));
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>("%", &interpreter::primitive_mod));
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>("<", &interpreter::primitive_less));
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>(">", &interpreter::primitive_greater));
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>("<=", &interpreter::primitive_leq));
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>(">=", &interpreter::primitive_geq));
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>("=", &interpreter::primitive_eq));
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>("<>", &interpreter::primitive_neq));
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>("dup", &interpreter::primitive_dup));
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>("pick", &interpreter::primitive_pick));
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>("drop", &interpreter::primitive_drop));
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>("2dup", &interpreter::primitive_2dup));
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>("over", &interpreter::primitive_over));
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>("nip", &interpreter::primitive_nip));
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>("tuck", &interpreter::primitive_tuck));
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>("swap", &interpreter::primitive_swap));
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>("rot", &interpreter::primitive_rot));
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>("-rot", &interpreter::primitive_mrot));   
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>("min", &interpreter::primitive_min));
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>("max", &interpreter::primitive_max));
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>("pow", &interpreter::primitive_pow));
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>("atan2", &interpreter::primitive_atan2));
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>("negate", &interpreter::primitive_negate));
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>("tan", &interpreter::primitive_tan));
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>("log", &interpreter::primitive_log));
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>("exp", &interpreter::primitive_exp));
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>("sqrt", &interpreter::primitive_sqrt));
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>("floor", &interpreter::primitive_floor));
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>("ceil", &interpreter::primitive_ceil));
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>("abs", &interpreter::primitive_abs));
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>("@", &interpreter::primitive_fetch));
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>("!", &interpreter::primitive_store));
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>(">r", &interpreter::primitive_return_stack_push));
-    primitives.insert(std::pair<std::string, primitive_fun_ptr>("r>", &interpreter::primitive_return_stack_pop));
+  interpreter<T, N>::interpreter() : stack_pointer(0), variable_index(0), return_stack_pointer(0), loop_pointer(2), kernels(nullptr), memoize(true), control_rate(default_control_rate)
+    {
+    stack.fill((T)0);
+    globals.fill((T)0);
+    memory_stack.assign(N, (T)0);
+    return_stack.fill((T)0);
+    loop_counters.fill(0);
+    primitives.insert(std::pair<std::string, Primitive>("+", { &interpreter::primitive_add, OP_ADD }));
+    primitives.insert(std::pair<std::string, Primitive>("-", { &interpreter::primitive_sub, OP_SUB }));
+    primitives.insert(std::pair<std::string, Primitive>("*", { &interpreter::primitive_mul, OP_MUL }));
+    primitives.insert(std::pair<std::string, Primitive>("/", { &interpreter::primitive_div, OP_DIV }));
+    primitives.insert(std::pair<std::string, Primitive>("<<", { &interpreter::primitive_left_shift, OP_LEFT_SHIFT }));
+    primitives.insert(std::pair<std::string, Primitive>(">>", { &interpreter::primitive_right_shift, OP_RIGHT_SHIFT }));
+    primitives.insert(std::pair<std::string, Primitive>("&", { &interpreter::primitive_and, OP_AND }));
+    primitives.insert(std::pair<std::string, Primitive>("|", { &interpreter::primitive_or, OP_OR }));
+    primitives.insert(std::pair<std::string, Primitive>("^", { &interpreter::primitive_xor, OP_XOR }));
+    primitives.insert(std::pair<std::string, Primitive>("not", { &interpreter::primitive_not, OP_NOT }));
+    primitives.insert(std::pair<std::string, Primitive>("sin", { &interpreter::primitive_sin, OP_SIN }));
+    primitives.insert(std::pair<std::string, Primitive>("cos", { &interpreter::primitive_cos, OP_COS }));
+    primitives.insert(std::pair<std::string, Primitive>("%", { &interpreter::primitive_mod, OP_MOD }));
+    primitives.insert(std::pair<std::string, Primitive>("<", { &interpreter::primitive_less, OP_LESS }));
+    primitives.insert(std::pair<std::string, Primitive>(">", { &interpreter::primitive_greater, OP_GREATER }));
+    primitives.insert(std::pair<std::string, Primitive>("<=", { &interpreter::primitive_leq, OP_LEQ }));
+    primitives.insert(std::pair<std::string, Primitive>(">=", { &interpreter::primitive_geq, OP_GEQ }));
+    primitives.insert(std::pair<std::string, Primitive>("=", { &interpreter::primitive_eq, OP_EQ }));
+    primitives.insert(std::pair<std::string, Primitive>("<>", { &interpreter::primitive_neq, OP_NEQ }));
+    primitives.insert(std::pair<std::string, Primitive>("dup", { &interpreter::primitive_dup, OP_DUP }));
+    primitives.insert(std::pair<std::string, Primitive>("pick", { &interpreter::primitive_pick, OP_PICK }));
+    primitives.insert(std::pair<std::string, Primitive>("drop", { &interpreter::primitive_drop, OP_DROP }));
+    primitives.insert(std::pair<std::string, Primitive>("2dup", { &interpreter::primitive_2dup, OP_2DUP }));
+    primitives.insert(std::pair<std::string, Primitive>("over", { &interpreter::primitive_over, OP_OVER }));
+    primitives.insert(std::pair<std::string, Primitive>("nip", { &interpreter::primitive_nip, OP_NIP }));
+    primitives.insert(std::pair<std::string, Primitive>("tuck", { &interpreter::primitive_tuck, OP_TUCK }));
+    primitives.insert(std::pair<std::string, Primitive>("swap", { &interpreter::primitive_swap, OP_SWAP }));
+    primitives.insert(std::pair<std::string, Primitive>("rot", { &interpreter::primitive_rot, OP_ROT }));
+    primitives.insert(std::pair<std::string, Primitive>("-rot", { &interpreter::primitive_mrot, OP_MROT }));   
+    primitives.insert(std::pair<std::string, Primitive>("min", { &interpreter::primitive_min, OP_MIN }));
+    primitives.insert(std::pair<std::string, Primitive>("max", { &interpreter::primitive_max, OP_MAX }));
+    primitives.insert(std::pair<std::string, Primitive>("pow", { &interpreter::primitive_pow, OP_POW }));
+    primitives.insert(std::pair<std::string, Primitive>("atan2", { &interpreter::primitive_atan2, OP_ATAN2 }));
+    primitives.insert(std::pair<std::string, Primitive>("negate", { &interpreter::primitive_negate, OP_NEGATE }));
+    primitives.insert(std::pair<std::string, Primitive>("tan", { &interpreter::primitive_tan, OP_TAN }));
+    primitives.insert(std::pair<std::string, Primitive>("log", { &interpreter::primitive_log, OP_LOG }));
+    primitives.insert(std::pair<std::string, Primitive>("exp", { &interpreter::primitive_exp, OP_EXP }));
+    primitives.insert(std::pair<std::string, Primitive>("sqrt", { &interpreter::primitive_sqrt, OP_SQRT }));
+    primitives.insert(std::pair<std::string, Primitive>("floor", { &interpreter::primitive_floor, OP_FLOOR }));
+    primitives.insert(std::pair<std::string, Primitive>("ceil", { &interpreter::primitive_ceil, OP_CEIL }));
+    primitives.insert(std::pair<std::string, Primitive>("abs", { &interpreter::primitive_abs, OP_ABS }));
+    primitives.insert(std::pair<std::string, Primitive>("osc-sin", { &interpreter::primitive_osc_sin, OP_OSC_SIN }));
+    primitives.insert(std::pair<std::string, Primitive>("osc-saw", { &interpreter::primitive_osc_saw, OP_OSC_SAW }));
+    primitives.insert(std::pair<std::string, Primitive>("osc-square", { &interpreter::primitive_osc_square, OP_OSC_SQUARE }));
+    primitives.insert(std::pair<std::string, Primitive>("@", { &interpreter::primitive_fetch, OP_FETCH }));
+    primitives.insert(std::pair<std::string, Primitive>("!", { &interpreter::primitive_store, OP_STORE }));
+    primitives.insert(std::pair<std::string, Primitive>(">r", { &interpreter::primitive_return_stack_push, OP_RETURN_STACK_PUSH }));
+    primitives.insert(std::pair<std::string, Primitive>("r>", { &interpreter::primitive_return_stack_pop, OP_RETURN_STACK_POP }));
+    primitives.insert(std::pair<std::string, Primitive>("i", { &interpreter::primitive_loop_i, OP_I }));
+    primitives.insert(std::pair<std::string, Primitive>("j", { &interpreter::primitive_loop_j, OP_J }));
     }
 
   template <class T, int N>
@@ -522,23 +1185,23 @@ namespace forth
     if (t.type != token::T_WORD)
       _throw_error(t.line_nr, t.column_nr, word_expected, "");    
     Statements stmts;
+    // the locals of the definition hide the variables
+    auto it_local = local_scope.find(t.value);
     auto it0 = variables.find(t.value);
-    if (it0 != variables.end())
+    if (it_local != local_scope.end() || it0 != variables.end())
       {
       Variable v;
-      v.index = it0->second;
+      v.index = it_local != local_scope.end() ? it_local->second : it0->second;
       stmts.push_back(v);
       return stmts;
       }
     auto it = dictionary.find(t.value);
     if (it != dictionary.end())
-      return it->second;    
+      return _with_new_state(it->second);
     auto it2 = primitives.find(t.value);
     if (it2 != primitives.end())
       {
-      Primitive p;
-      p.fun = it2->second;
-      stmts.push_back(p);
+      stmts.push_back(it2->second);
       }
     else
       {
@@ -551,614 +1214,3325 @@ namespace forth
   typename interpreter<T, N>::Definition interpreter<T, N>::parse_definition(std::vector<token>& tokens)
     {
     using namespace details;
-    _require(tokens, ":");
+    if (tokens.empty() || (tokens.back().type != token::T_MEMO && tokens.back().type != token::T_CONTROL))
+      _require(tokens, ":");
+    else
+      _take(tokens);
     auto name_token = _take(tokens);
     if (name_token.type != token::T_WORD)
       _throw_error(name_token.line_nr, name_token.column_nr, word_expected, name_token.value);
     Definition def;
     def.name = name_token.value;
+    local_scope.clear();
     while (!tokens.empty() && tokens.back().type != token::T_SEMICOLON)
       {
-      const token& t = tokens.back();
-      switch (t.type)
-        {
-        case token::T_WORD:
-        {
-        auto stmts = parse_word(tokens);
-        def.statements.insert(def.statements.end(), stmts.begin(), stmts.end());
-        break;
-        }
-        case token::T_VALUE:
-        {
-        def.statements.push_back(parse_value(tokens));
-        break;
-        }
-        case token::T_COLON:
-        {
-        _throw_error(t.line_nr, t.column_nr, definition_in_definition, "");
-        break;
-        }
-        default:
-        {
-        _throw_error(t.line_nr, t.column_nr, bad_syntax, "");
-        break;
-        }
-        }
+      if (tokens.back().type == token::T_WORD && tokens.back().value == "{")
+        _parse_locals(tokens, def);
+      else
+        _parse_statement(tokens, def.statements);
       }
+    local_scope.clear();
     _require(tokens, ";");
     return def;
     }
 
   template <class T, int N>
-  void interpreter<T, N>::make_variable(const std::string& name)
-    {    
+  void interpreter<T, N>::_parse_locals(std::vector<token>& tokens, Definition& def)
+    {
+    // { a b } pops b and then a, like a stack diagram. Every local gets a global of its own,
+    // and as they are declared outside of control structures, the definition always assigns
+    // them before it reads them. A redefinition gets new globals, named word.a', so that it
+    // can call the word that it replaces without sharing its locals.
     using namespace details;
-    if (variable_index >= N)
-      _throw_error(-1, -1, variable_overflow, "");
-    variables[name] = variable_index;
-    ++variable_index;
+    _take(tokens);
+    std::vector<int> declared;
+    for (;;)
+      {
+      if (tokens.empty() || tokens.back().type == token::T_SEMICOLON)
+        _throw_error(-1, -1, expected_token, "}");
+      auto t = _take(tokens);
+      if (t.type == token::T_WORD && t.value == "}")
+        break;
+      if (t.type != token::T_WORD)
+        _throw_error(t.line_nr, t.column_nr, word_expected, t.value);
+      auto it = local_scope.find(t.value);
+      if (it == local_scope.end())
+        {
+        if (variable_index >= N)
+          _throw_error(t.line_nr, t.column_nr, variable_overflow, "");
+        std::string name = def.name + "." + t.value;
+        while (locals.find(name) != locals.end())
+          name += "'";
+        locals[name] = variable_index;
+        it = local_scope.insert(std::make_pair(t.value, variable_index++)).first;
+        }
+      declared.push_back(it->second);
+      }
+    for (auto it = declared.rbegin(); it != declared.rend(); ++it)
+      def.statements.push_back(Assign{ *it });
     }
 
   template <class T, int N>
-  void interpreter<T, N>::set_variable_value(const std::string& name, T value)
+  T interpreter<T, N>::_take_literal(Statements& stmts, const token& declaration) const
     {
+    // the literal before value or constant, which can be an expression of literals that
+    // folds to one, as in 440 2 * constant a5
     using namespace details;
-    auto it = variables.find(name);
-    if (it != variables.end())
+    if (!stmts.empty() && !std::holds_alternative<Value>(stmts.back()))
       {
-      globals[it->second] = value;
+      Statements folded;
+      _fold(stmts, folded);
+      stmts.swap(folded);
       }
-    else
-      _throw_error(-1, -1, unknown_variable, name);
+    if (stmts.empty() || !std::holds_alternative<Value>(stmts.back()))
+      _throw_error(declaration.line_nr, declaration.column_nr, value_expected, declaration.value);
+    const T val = std::get<Value>(stmts.back()).val;
+    stmts.pop_back();
+    return val;
     }
 
   template <class T, int N>
-  typename interpreter<T, N>::Program interpreter<T, N>::parse(std::vector<token>& tokens)
+  bool interpreter<T, N>::_is_local(int index) const
     {
-    using namespace details;
-
-    Program prog;
-    std::reverse(tokens.begin(), tokens.end());
+    for (const auto& local : locals)
+      if (local.second == index)
+        return true;
+    return false;
+    }
 
-    while (!tokens.empty())
+  template <class T, int N>
+  void interpreter<T, N>::_parse_statement(std::vector<token>& tokens, Statements& stmts)
+    {
+    using namespace details;
+    const token& t = tokens.back();
+    switch (t.type)
       {
-      const token& t = tokens.back();
-      switch (t.type)
+      case token::T_WORD:
+      {
+      if (t.value == "else" || t.value == "then" || t.value == "loop" || t.value == "until")
+        _throw_error(t.line_nr, t.column_nr, unmatched_control, t.value);
+      if (t.value == "{" || t.value == "value" || t.value == "constant")
+        _throw_error(t.line_nr, t.column_nr, misplaced_declaration, t.value);
+      if (t.value == "to")
         {
-        case token::T_WORD:
+        _take(tokens);
+        auto name_token = _take(tokens);
+        auto it_local = local_scope.find(name_token.value);
+        auto it_value = values.find(name_token.value);
+        if (name_token.type != token::T_WORD || (it_local == local_scope.end() && it_value == values.end()))
+          _throw_error(name_token.line_nr, name_token.column_nr, not_assignable, name_token.value);
+        stmts.push_back(Assign{ it_local != local_scope.end() ? it_local->second : it_value->second });
+        }
+      else if (t.value == "if")
         {
-        auto stmts = parse_word(tokens);
-        prog.statements.insert(prog.statements.end(), stmts.begin(), stmts.end());
-        break;
+        _take(tokens);
+        Branch b;
+        if (_parse_body(tokens, b.then_part, { "else", "then" }) == "else")
+          _parse_body(tokens, b.else_part, { "then" });
+        stmts.push_back(b);
         }
-        case token::T_VALUE:
+      else if (t.value == "do")
         {
-        prog.statements.push_back(parse_value(tokens));
-        break;
+        auto do_token = _take(tokens);
+        const size_t n = stmts.size();
+        // limit start do, with integer bounds that a float holds exactly
+        auto bound = [&](size_t i, int64_t& v) -> bool
+          {
+          if (i >= n || !std::holds_alternative<Value>(stmts[i]))
+            return false;
+          T val = std::get<Value>(stmts[i]).val;
+          if (!(val >= (T)-16777216 && val <= (T)16777216) || (T)(int64_t)val != val)
+            return false;
+          v = (int64_t)val;
+          return true;
+          };
+        Loop l;
+        l.counted = true;
+        if (n < 2 || !bound(n - 2, l.limit) || !bound(n - 1, l.start))
+          _throw_error(do_token.line_nr, do_token.column_nr, loop_bounds_expected, "");
+        stmts.resize(n - 2);
+        _parse_body(tokens, l.body, { "loop" });
+        stmts.push_back(l);
         }
-        case token::T_COLON:
+      else if (t.value == "delay" || t.value == "feedback")
         {
-        auto def = parse_definition(tokens);
-        dictionary[def.name] = def.statements;
-        break;
+        auto delay_token = _take(tokens);
+        stmts.push_back(_make_delay(delay_token.value == "delay" ? OP_DELAY : OP_FEEDBACK, stmts));
         }
-        default:
+      else if (filter_kind(t.value) != FILTER_COUNT)
         {
-        _throw_error(t.line_nr, t.column_nr, bad_syntax, "");
-        break;
+        auto filter_token = _take(tokens);
+        stmts.push_back(_make_filter(filter_kind(filter_token.value), stmts));
+        }
+      else if (t.value == "begin")
+        {
+        _take(tokens);
+        Loop l;
+        l.counted = false;
+        l.start = 0;
+        l.limit = max_until_iterations;
+        _parse_body(tokens, l.body, { "until" });
+        stmts.push_back(l);
         }
+      else
+        {
+        auto word = parse_word(tokens);
+        stmts.insert(stmts.end(), word.begin(), word.end());
         }
+      break;
+      }
+      case token::T_VALUE:
+      {
+      stmts.push_back(parse_value(tokens));
+      break;
+      }
+      case token::T_COLON:
+      case token::T_MEMO:
+      case token::T_CONTROL:
+      {
+      _throw_error(t.line_nr, t.column_nr, definition_in_definition, "");
+      break;
+      }
+      default:
+      {
+      _throw_error(t.line_nr, t.column_nr, bad_syntax, "");
+      break;
+      }
       }
-
-    return prog;
     }
 
   template <class T, int N>
-  void interpreter<T, N>::eval(const Program& prog)
+  std::string interpreter<T, N>::_parse_body(std::vector<token>& tokens, Statements& body, std::initializer_list<const char*> ends)
     {
-    for (const auto& s : prog.statements)
+    using namespace details;
+    for (;;)
       {
-      if (std::holds_alternative<Value>(s))
-        push(std::get<Value>(s).val);
-      else if (std::holds_alternative<Primitive>(s))
+      if (tokens.empty() || tokens.back().type == token::T_SEMICOLON)
+        _throw_error(-1, -1, expected_token, *ends.begin());
+      const token& t = tokens.back();
+      if (t.type == token::T_WORD)
         {
-        primitive_fun_ptr ptr = std::get<Primitive>(s).fun;
-        (this->*ptr)();
+        for (const char* end : ends)
+          {
+          if (t.value == end)
+            return _take(tokens).value;
+          }
         }
-      else if (std::holds_alternative<Variable>(s))
-        push(globals[std::get<Variable>(s).index]);
+      _parse_statement(tokens, body);
       }
     }
 
-  template <class T>
-  struct true_value
-    {
-    inline static T value = (T)0xffffffffffffffff;
-    };
-
-  template <>
-  struct true_value<double>
-    {
-    inline static double value = 1.0;
-    };
-
-  template <>
-  struct true_value<float>
-    {
-    inline static double value = 1.f;
-    };
-
-  template <class T>
-  inline T not_value(T input)
+  template <class T, int N>
+  typename interpreter<T, N>::code_cost interpreter<T, N>::_cost(const Statements& stmts) const
     {
-    return (T)(~(uint64_t)input);
+    // Only the longest part of a branch counts for the iterations. The counts stop growing a
+    // little above their limits, which keeps them far from overflowing, as a loop runs at
+    // most 2^25 times.
+    auto limit = [](int64_t count, int64_t maximum) { return std::min(count, maximum + 1); };
+    code_cost cost = { 0, 0, 0, 0, 0 };
+    for (const auto& s : stmts)
+      {
+      ++cost.size;
+      ++cost.statements;
+      if (std::holds_alternative<Call>(s))
+        {
+        const code_cost& word = word_costs[std::get<Call>(s).word];
+        cost.statements += word.statements - 1;
+        cost.iterations += word.iterations;
+        cost.nesting = std::max(cost.nesting, word.nesting);
+        cost.calls = std::max(cost.calls, word.calls + 1);
+        }
+      else if (std::holds_alternative<Branch>(s))
+        {
+        const Branch& b = std::get<Branch>(s);
+        code_cost then_cost = _cost(b.then_part);
+        code_cost else_cost = _cost(b.else_part);
+        cost.size += then_cost.size + else_cost.size;
+        cost.statements += then_cost.statements + else_cost.statements;
+        cost.iterations += std::max(then_cost.iterations, else_cost.iterations);
+        cost.nesting = std::max(cost.nesting, std::max(then_cost.nesting, else_cost.nesting));
+        cost.calls = std::max(cost.calls, std::max(then_cost.calls, else_cost.calls));
+        }
+      else if (std::holds_alternative<Loop>(s))
+        {
+        const Loop& l = std::get<Loop>(s);
+        code_cost body = _cost(l.body);
+        int64_t trips = std::max<int64_t>(l.limit - l.start, 0);
+        cost.size += body.size;
+        cost.statements += body.statements;
+        cost.iterations += trips * (1 + body.iterations);
+        cost.nesting = std::max(cost.nesting, body.nesting + 1);
+        cost.calls = std::max(cost.calls, body.calls);
+        }
+      cost.statements = limit(cost.statements, max_program_size);
+      cost.iterations = limit(cost.iterations, max_loop_iterations);
+      }
+    return cost;
     }
 
-  template <>
-  inline double not_value(double input)
+  template <class T, int N>
+  bool interpreter<T, N>::_is_pure(const Statements& stmts, int nesting) const
     {
-    return input == 0.0 ? 1.0 : 0.0;
-    }
-
-  template <>
-  inline float not_value(float input)
-    {
-    return input == 0.f ? 1.f : 0.f;
-    }
-
-  template <class T>
-  inline T modulo(T a, T b)
-    {
-    return a % b;
-    }
-
-  template <>
-  inline double modulo(double a, double b)
-    {
-    return fmod(a, b);
+    // i and j must count loops of the word itself, as the word can be called from any loop
+    for (const auto& s : stmts)
+      {
+      // locals are assigned before they are read, so only they can be used
+      if (std::holds_alternative<Variable>(s) && !_is_local(std::get<Variable>(s).index))
+        return false;
+      if (std::holds_alternative<Assign>(s) && !_is_local(std::get<Assign>(s).index))
+        return false;
+      if (std::holds_alternative<Primitive>(s))
+        {
+        switch (std::get<Primitive>(s).op)
+          {
+          case OP_FETCH:
+          case OP_STORE:
+          case OP_RETURN_STACK_PUSH:
+          case OP_RETURN_STACK_POP:
+            return false;
+          case OP_I:
+            if (nesting < 1)
+              return false;
+            break;
+          case OP_J:
+            if (nesting < 2)
+              return false;
+            break;
+          default:
+            break;
+          }
+        }
+      else if (std::holds_alternative<Call>(s))
+        {
+        if (!_is_pure(words[std::get<Call>(s).word].statements, nesting))
+          return false;
+        }
+      else if (std::holds_alternative<Stateful>(s))
+        return false;
+      else if (std::holds_alternative<Branch>(s))
+        {
+        const Branch& b = std::get<Branch>(s);
+        if (!_is_pure(b.then_part, nesting) || !_is_pure(b.else_part, nesting))
+          return false;
+        }
+      else if (std::holds_alternative<Loop>(s))
+        {
+        if (!_is_pure(std::get<Loop>(s).body, nesting + 1))
+          return false;
+        }
+      }
+    return true;
     }
 
-  template <>
-  inline float modulo(float a, float b)
+  template <class T, int N>
+  void interpreter<T, N>::_make_memo(const Definition& def, const token& memo_token)
     {
-    return fmod(a, b);
+    using namespace details;
+    if (!_is_pure(def.statements, 0))
+      _throw_error(memo_token.line_nr, memo_token.column_nr, impure_memo, def.name);
+    code_cost cost = _cost(def.statements);
+    if (cost.calls >= max_call_depth)
+      _throw_error(memo_token.line_nr, memo_token.column_nr, program_too_large, "the calls nest too deep");
+    Program body;
+    body.statements = def.statements;
+    body.words = words;
+    const StackEffect effect = compile(body).effect;
+    const int inputs = -effect.min_depth;
+    const int outputs = effect.depth + inputs;
+    if (!effect.is_static || effect.return_depth != 0 || inputs > max_memo_arity || outputs < 1 || outputs > max_memo_arity)
+      _throw_error(memo_token.line_nr, memo_token.column_nr, memo_arity, def.name);
+    Memo m;
+    m.name = def.name;
+    m.inputs = inputs;
+    m.outputs = outputs;
+    m.keys.assign(memo_cache_size * max_memo_arity, (T)0);
+    m.values.assign(memo_cache_size * max_memo_arity, (T)0);
+    m.valid.assign(memo_cache_size, 0);
+    m.pending = 0;
+    m.hits = 0;
+    m.misses = 0;
+    Call c;
+    c.word = (int)words.size();
+    c.memo = (int)memos.size();
+    dictionary[def.name] = Statements(1, c);
+    words.push_back(def);
+    word_costs.push_back(cost);
+    memos.push_back(m);
     }
 
   template <class T, int N>
-  inline T interpreter<T, N>::top()
+  void interpreter<T, N>::_count_calls(const Statements& stmts, std::vector<int>& calls) const
     {
-    return stack_pointer ? stack[stack_pointer-1] : stack[N-1];
+    for (const auto& s : stmts)
+      {
+      if (std::holds_alternative<Call>(s))
+        {
+        const int word = std::get<Call>(s).word;
+        if (calls[word]++ == 0)
+          _count_calls(words[word].statements, calls);
+        }
+      else if (std::holds_alternative<Branch>(s))
+        {
+        _count_calls(std::get<Branch>(s).then_part, calls);
+        _count_calls(std::get<Branch>(s).else_part, calls);
+        }
+      else if (std::holds_alternative<Loop>(s))
+        _count_calls(std::get<Loop>(s).body, calls);
+      }
     }
 
   template <class T, int N>
-  inline T interpreter<T, N>::second()
+  typename interpreter<T, N>::Statements interpreter<T, N>::_inline_calls(const Statements& stmts, const std::vector<int>& calls, bool all) const
     {
-    return stack_pointer>1 ? stack[stack_pointer - 2] : stack[stack_pointer + N - 2];
+    Statements out;
+    out.reserve(stmts.size());
+    for (const auto& s : stmts)
+      {
+      if (std::holds_alternative<Call>(s))
+        {
+        const Call& c = std::get<Call>(s);
+        if (c.memo < 0 && (all || calls[c.word] == 1))
+          {
+          Statements body = _inline_calls(words[c.word].statements, calls, all);
+          out.insert(out.end(), body.begin(), body.end());
+          }
+        else
+          out.push_back(s);
+        }
+      else if (std::holds_alternative<Branch>(s))
+        {
+        const Branch& b = std::get<Branch>(s);
+        out.push_back(Branch{ _inline_calls(b.then_part, calls, all), _inline_calls(b.else_part, calls, all) });
+        }
+      else if (std::holds_alternative<Loop>(s))
+        {
+        Loop l = std::get<Loop>(s);
+        l.body = _inline_calls(l.body, calls, all);
+        out.push_back(l);
+        }
+      else
+        out.push_back(s);
+      }
+    return out;
     }
 
   template <class T, int N>
-  inline T interpreter<T, N>::pop()
+  const T* interpreter<T, N>::_memo_find(Memo& m, const T* st, int sp)
     {
-    --stack_pointer;
-    if (stack_pointer < 0)
-      stack_pointer = N - 1;
-    return stack[stack_pointer];
+    T key[max_memo_arity];
+    uint64_t hash = 0;
+    for (int k = 0; k < m.inputs; ++k)
+      {
+      key[k] = st[(sp + N - m.inputs + k) % N];
+      uint64_t bits = 0;
+      memcpy(&bits, &key[k], sizeof(T));
+      // fold the high half into the low one first, as doubles differ in their high bits and
+      // integers in their low ones, then keep the top bits of the product, which mix all bits
+      hash ^= bits;
+      hash = (hash ^ (hash >> 32)) * 0x9e3779b97f4a7c15ull;
+      }
+    const int entry = (int)(hash >> (64 - memo_cache_bits));
+    T* keys = m.keys.data() + entry * max_memo_arity;
+    if (m.valid[entry])
+      {
+      int k = 0;
+      while (k < m.inputs && same_bits(keys[k], key[k]))
+        ++k;
+      if (k == m.inputs)
+        {
+        ++m.hits;
+        return m.values.data() + entry * max_memo_arity;
+        }
+      }
+    ++m.misses;
+    for (int k = 0; k < m.inputs; ++k)
+      keys[k] = key[k];
+    m.valid[entry] = 0;
+    m.pending = entry;
+    return nullptr;
     }
 
   template <class T, int N>
-  inline void interpreter<T, N>::push(T val)
+  void interpreter<T, N>::_memo_store(Memo& m, const T* st, int sp)
     {
-    stack[stack_pointer] = val;
-    ++stack_pointer;
-    if (stack_pointer >= N)
-      stack_pointer = 0;
+    T* values = m.values.data() + m.pending * max_memo_arity;
+    for (int k = 0; k < m.outputs; ++k)
+      values[k] = st[(sp + N - m.outputs + k) % N];
+    m.valid[m.pending] = 1;
     }
 
   template <class T, int N>
-  void interpreter<T, N>::primitive_add()
+  typename interpreter<T, N>::Stateful interpreter<T, N>::_make_delay(e_opcode op, const Statements& stmts)
     {
-    T b = pop();
-    T a = pop();
-    push(a + b);
+    // x n delay and x n gain feedback, where the gain of feedback can be a variable
+    const size_t n = stmts.size();
+    const size_t at = op == OP_FEEDBACK ? 2 : 1;
+    int64_t size = default_delay_size;
+    bool literal = n >= at && std::holds_alternative<Value>(stmts[n - at]);
+    if (literal && op == OP_FEEDBACK)
+      literal = std::holds_alternative<Value>(stmts[n - 1]) || std::holds_alternative<Variable>(stmts[n - 1]);
+    if (literal)
+      {
+      const T length = std::get<Value>(stmts[n - at]).val;
+      size = 2;
+      while (size < max_delay_size && (T)size <= length)
+        size *= 2;
+      }
+    auto it_c = variables.find("c");
+    DelayLine d;
+    d.offset = -1;
+    d.mask = size - 1;
+    d.position[0] = 0;
+    d.position[1] = 0;
+    d.channel = it_c == variables.end() ? -1 : it_c->second;
+    delay_lines.push_back(d);
+    return Stateful{ op, (int)delay_lines.size() - 1 };
     }
 
   template <class T, int N>
-  void interpreter<T, N>::primitive_sub()
+  typename interpreter<T, N>::Statements interpreter<T, N>::_with_new_state(const Statements& stmts)
     {
-    T b = pop();
-    T a = pop();
-    push(a - b);
+    Statements out;
+    out.reserve(stmts.size());
+    for (const auto& s : stmts)
+      {
+      if (std::holds_alternative<Stateful>(s))
+        {
+        Stateful st = std::get<Stateful>(s);
+        if (st.op == OP_DELAY || st.op == OP_FEEDBACK)
+          {
+          delay_lines.push_back(delay_lines[st.index]);
+          st.index = (int)delay_lines.size() - 1;
+          }
+        else
+          {
+          filters.push_back(filters[st.index]);
+          st.index = (int)filters.size() - 1;
+          }
+        out.push_back(st);
+        }
+      else if (std::holds_alternative<Branch>(s))
+        {
+        const Branch& b = std::get<Branch>(s);
+        out.push_back(Branch{ _with_new_state(b.then_part), _with_new_state(b.else_part) });
+        }
+      else if (std::holds_alternative<Loop>(s))
+        {
+        Loop l = std::get<Loop>(s);
+        l.body = _with_new_state(l.body);
+        out.push_back(l);
+        }
+      else
+        out.push_back(s);
+      }
+    return out;
     }
 
   template <class T, int N>
-  void interpreter<T, N>::primitive_mul()
+  bool interpreter<T, N>::_has_state(const Statements& stmts) const
     {
-    T b = pop();
-    T a = pop();
-    if (a == 0 || b == 0) // multiplying with infinity gives 0
-      push(0);
-    else
-      push(a * b);
+    for (const auto& s : stmts)
+      {
+      if (std::holds_alternative<Stateful>(s))
+        return true;
+      if (std::holds_alternative<Branch>(s) && (_has_state(std::get<Branch>(s).then_part) || _has_state(std::get<Branch>(s).else_part)))
+        return true;
+      if (std::holds_alternative<Loop>(s) && _has_state(std::get<Loop>(s).body))
+        return true;
+      }
+    return false;
     }
 
   template <class T, int N>
-  void interpreter<T, N>::primitive_div()
+  typename interpreter<T, N>::Statements interpreter<T, N>::_at_control_rate(const Statements& stmts)
     {
-    T b = pop();
-    T a = pop();
-    if (b)
-      push(a / b);
+    auto it_t = variables.find("t");
+    if (it_t == variables.end() || control_rate <= 1)
+      return stmts;
+    // t bits >> bits << if the rate is a power of two, else t rate / floor rate *, where the
+    // integer division already rounds down as t is not negative; the dependencies of compile
+    // recognize both as a step of rate samples
+    Statements quantized;
+    quantized.push_back(Variable{ it_t->second });
+    int bits = 0;
+    while (((int64_t)1 << bits) < control_rate)
+      ++bits;
+    if (((int64_t)1 << bits) == control_rate)
+      {
+      quantized.push_back(Value{ (T)bits });
+      quantized.push_back(primitives.find(">>")->second);
+      quantized.push_back(Value{ (T)bits });
+      quantized.push_back(primitives.find("<<")->second);
+      }
     else
-      push(std::numeric_limits<T>::infinity());
+      {
+      quantized.push_back(Value{ (T)control_rate });
+      quantized.push_back(primitives.find("/")->second);
+      if (std::is_floating_point<T>::value)
+        quantized.push_back(primitives.find("floor")->second);
+      quantized.push_back(Value{ (T)control_rate });
+      quantized.push_back(primitives.find("*")->second);
+      }
+    Statements out;
+    out.reserve(stmts.size());
+    for (const auto& s : stmts)
+      {
+      if (std::holds_alternative<Variable>(s) && std::get<Variable>(s).index == it_t->second)
+        out.insert(out.end(), quantized.begin(), quantized.end());
+      else if (std::holds_alternative<Branch>(s))
+        {
+        const Branch& b = std::get<Branch>(s);
+        out.push_back(Branch{ _at_control_rate(b.then_part), _at_control_rate(b.else_part) });
+        }
+      else if (std::holds_alternative<Loop>(s))
+        {
+        Loop l = std::get<Loop>(s);
+        l.body = _at_control_rate(l.body);
+        out.push_back(l);
+        }
+      else if (std::holds_alternative<Call>(s) && std::get<Call>(s).memo < 0)
+        {
+        // a memo: word cannot read t, any other word gets one copy for all k: words
+        Call c = std::get<Call>(s);
+        auto it = control_rate_words.find(c.word);
+        if (it == control_rate_words.end())
+          {
+          Definition def = words[c.word];
+          def.statements = _at_control_rate(def.statements);
+          const code_cost cost = _cost(def.statements);
+          it = control_rate_words.insert(std::make_pair(c.word, (int)words.size())).first;
+          words.push_back(def);
+          word_costs.push_back(cost);
+          }
+        c.word = it->second;
+        out.push_back(c);
+        }
+      else
+        out.push_back(s);
+      }
+    return out;
     }
 
   template <class T, int N>
-  void interpreter<T, N>::primitive_left_shift()
+  void interpreter<T, N>::_find_delay_lines(const Statements& stmts, std::vector<char>& used) const
     {
-    T b = pop();
-    T a = pop();
-    push((T)((uint64_t)a << (uint64_t)b));
+    for (const auto& s : stmts)
+      {
+      if (std::holds_alternative<Stateful>(s) && (std::get<Stateful>(s).op == OP_DELAY || std::get<Stateful>(s).op == OP_FEEDBACK))
+        used[std::get<Stateful>(s).index] = 1;
+      else if (std::holds_alternative<Branch>(s))
+        {
+        _find_delay_lines(std::get<Branch>(s).then_part, used);
+        _find_delay_lines(std::get<Branch>(s).else_part, used);
+        }
+      else if (std::holds_alternative<Loop>(s))
+        _find_delay_lines(std::get<Loop>(s).body, used);
+      }
     }
 
   template <class T, int N>
-  void interpreter<T, N>::primitive_right_shift()
+  void interpreter<T, N>::_allocate_delay_lines(const Program& prog)
     {
-    T b = pop();
-    T a = pop();
-    push((T)((uint64_t)a >> (uint64_t)b));
+    // the lines of the definitions that are inlined are only copied, and get no samples
+    using namespace details;
+    std::vector<char> used(delay_lines.size(), 0);
+    _find_delay_lines(prog.statements, used);
+    for (const auto& word : prog.words)
+      _find_delay_lines(word.statements, used);
+    int64_t size = (int64_t)delay_memory.size();
+    for (size_t i = 0; i < delay_lines.size(); ++i)
+      {
+      if (!used[i] || delay_lines[i].offset >= 0)
+        continue;
+      delay_lines[i].offset = size;
+      size += 2 * (delay_lines[i].mask + 1);
+      if (size > max_delay_memory)
+        _throw_error(-1, -1, program_too_large, "the delay lines take too much memory");
+      }
+    delay_memory.resize((size_t)size, (T)0);
     }
 
   template <class T, int N>
-  void interpreter<T, N>::primitive_and()
+  inline T interpreter<T, N>::_delay(DelayLine& d, e_opcode op, T x, T length, T gain)
     {
-    T b = pop();
-    T a = pop();
-    push((T)((uint64_t)a & (uint64_t)b));
+    // the length is clamped to the ring, so that the sample that is read is never the one
+    // that is written, and nan reads the last sample
+    const int channel = d.channel >= 0 && globals[d.channel] != (T)0 ? 1 : 0;
+    T* ring = delay_memory.data() + d.offset + channel * (d.mask + 1);
+    const int64_t position = d.position[channel]++;
+    const int64_t back = length >= (T)1 ? (length <= (T)d.mask ? (int64_t)length : d.mask) : 1;
+    const T past = ring[(position - back) & d.mask];
+    if (op == OP_DELAY)
+      {
+      ring[position & d.mask] = x;
+      return past;
+      }
+    // integer gains count 256ths, like the phases of the oscillators
+    T y;
+    if (std::is_floating_point<T>::value)
+      y = x + gain * past;
+    else
+      y = (T)((uint64_t)x + (uint64_t)((int64_t)((uint64_t)(int64_t)gain * (uint64_t)(int64_t)past) >> 8));
+    ring[position & d.mask] = y;
+    return y;
     }
 
   template <class T, int N>
-  void interpreter<T, N>::primitive_or()
+  typename interpreter<T, N>::Stateful interpreter<T, N>::_make_filter(e_filter kind, Statements& stmts)
     {
-    T b = pop();
-    T a = pop();
-    push((T)((uint64_t)a | (uint64_t)b));
+    // literal parameters, also after folding, as in 1000 2 / lowpass, are taken from the
+    // program, and the coefficients are made once
+    const size_t parameters = (size_t)filter_parameters(kind);
+    auto literals = [parameters](const Statements& s) -> bool
+      {
+      if (s.size() < parameters)
+        return false;
+      for (size_t i = s.size() - parameters; i < s.size(); ++i)
+        if (!std::holds_alternative<Value>(s[i]))
+          return false;
+      return true;
+      };
+    if (!literals(stmts) && !stmts.empty())
+      {
+      Statements folded;
+      _fold(stmts, folded);
+      if (literals(folded))
+        stmts.swap(folded);
+      }
+    auto it_c = variables.find("c");
+    auto it_sr = variables.find("sr");
+    Filter f;
+    f.kind = kind;
+    f.z1[0] = f.z1[1] = 0.0;
+    f.z2[0] = f.z2[1] = 0.0;
+    f.channel = it_c == variables.end() ? -1 : it_c->second;
+    f.sample_rate = it_sr == variables.end() ? -1 : it_sr->second;
+    e_opcode op = parameters == 2 ? OP_FILTER_FQ : OP_FILTER_F;
+    if (literals(stmts))
+      {
+      const size_t n = stmts.size();
+      const double q = parameters == 2 ? (double)std::get<Value>(stmts[n - 1]).val : 0.0;
+      _tune_filter(f, (double)std::get<Value>(stmts[n - parameters]).val, q);
+      stmts.resize(n - parameters);
+      op = OP_FILTER;
+      }
+    else
+      _tune_filter(f, std::numeric_limits<double>::quiet_NaN(), std::numeric_limits<double>::quiet_NaN());
+    filters.push_back(f);
+    return Stateful{ op, (int)filters.size() - 1 };
     }
 
   template <class T, int N>
-  void interpreter<T, N>::primitive_xor()
+  void interpreter<T, N>::_tune_filter(Filter& f, double frequency, double q) const
     {
-    T b = pop();
-    T a = pop();
-    push((T)((uint64_t)a ^ (uint64_t)b));
+    const double rate = f.sample_rate >= 0 ? (double)globals[f.sample_rate] : 0.0;
+    f.coefficients = make_filter(f.kind, rate > 0.0 ? frequency / rate : frequency, q);
+    f.frequency = frequency;
+    f.q = q;
     }
 
-  template <class T, int N>
-  void interpreter<T, N>::primitive_not()
+  template <class T>
+  inline T filter_output(double y)
     {
-    T a = pop();
-    push(not_value(a));
+    if (std::is_floating_point<T>::value)
+      return (T)y;
+    // integers are rounded, and what they cannot hold becomes 0
+    if (!(std::abs(y) < 9.0e18))
+      return (T)0;
+    return (T)(int64_t)std::floor(y + 0.5);
     }
 
   template <class T, int N>
-  void interpreter<T, N>::primitive_sin()
+  inline T interpreter<T, N>::_filter(Filter& f, e_opcode op, T x, T frequency, T q)
     {
-    T a = pop();
-    push((T)std::sin(a));
+    // the coefficients of computed parameters are only made again when the parameters change
+    if (op != OP_FILTER)
+      {
+      const double fq = op == OP_FILTER_FQ ? (double)q : 0.0;
+      if (!same_bits((double)frequency, f.frequency) || !same_bits(fq, f.q))
+        _tune_filter(f, (double)frequency, fq);
+      }
+    const int channel = f.channel >= 0 && globals[f.channel] != (T)0 ? 1 : 0;
+    return filter_output<T>(filter_sample(f.coefficients, f.z1[channel], f.z2[channel], (double)x));
     }
 
   template <class T, int N>
-  void interpreter<T, N>::primitive_cos()
+  void interpreter<T, N>::_filter_block(Filter& f, T* left, T* right, int lanes)
     {
-    T a = pop();
-    push((T)std::cos(a));
+    if (right && kernels && kernels->stereo_filter)
+      {
+      kernels->stereo_filter(f.coefficients, f.z1, f.z2, left, right, lanes);
+      return;
+      }
+    for (int c = 0; c < (right ? 2 : 1); ++c)
+      {
+      const int channel = right ? c : (f.channel >= 0 && globals[f.channel] != (T)0 ? 1 : 0);
+      T* out = c ? right : left;
+      double z1 = f.z1[channel];
+      double z2 = f.z2[channel];
+      for (int k = 0; k < lanes; ++k)
+        out[k] = filter_output<T>(filter_sample(f.coefficients, z1, z2, (double)out[k]));
+      f.z1[channel] = z1;
+      f.z2[channel] = z2;
+      }
     }
 
   template <class T, int N>
-  void interpreter<T, N>::primitive_mod()
-    {
-    T b = pop();
-    T a = pop();
-    push(modulo(a, b));
+  void interpreter<T, N>::make_variable(const std::string& name)
+    {    
+    using namespace details;
+    if (variable_index >= N)
+      _throw_error(-1, -1, variable_overflow, "");
+    variables[name] = variable_index;
+    ++variable_index;
     }
 
   template <class T, int N>
-  void interpreter<T, N>::primitive_less()
+  void interpreter<T, N>::set_memory_size(int64_t size)
     {
-    T b = pop();
-    T a = pop();
-    if (a < b)
-      push(true_value<T>::value);
-    else
-      push((T)0);
+    int64_t power = 1;
+    while (power < size && power < max_memory_size)
+      power <<= 1;
+    memory_stack.assign((size_t)power, (T)0);
     }
 
   template <class T, int N>
-  void interpreter<T, N>::primitive_greater()
+  void interpreter<T, N>::set_variable_value(const std::string& name, T value)
     {
-    T b = pop();
-    T a = pop();
-    if (a > b)
-      push(true_value<T>::value);
+    using namespace details;
+    auto it = variables.find(name);
+    if (it != variables.end())
+      {
+      globals[it->second] = value;
+      }
     else
-      push((T)0);
+      _throw_error(-1, -1, unknown_variable, name);
     }
 
   template <class T, int N>
-  void interpreter<T, N>::primitive_leq()
+  typename interpreter<T, N>::Program interpreter<T, N>::parse(std::vector<token>& tokens)
     {
-    T b = pop();
-    T a = pop();
-    if (a <= b)
-      push(true_value<T>::value);
-    else
-      push((T)0);
-    }
+    using namespace details;
 
-  template <class T, int N>
-  void interpreter<T, N>::primitive_geq()
-    {
-    T b = pop();
-    T a = pop();
-    if (a >= b)
-      push(true_value<T>::value);
-    else
-      push((T)0);
-    }
+    Program prog;
+    std::reverse(tokens.begin(), tokens.end());
 
-  template <class T, int N>
-  void interpreter<T, N>::primitive_eq()
-    {
-    T b = pop();
-    T a = pop();
-    if (a == b)
-      push(true_value<T>::value);
-    else
-      push((T)0);
+    while (!tokens.empty())
+      {
+      if (tokens.back().type == token::T_MEMO)
+        {
+        const token memo_token = tokens.back();
+        _make_memo(parse_definition(tokens), memo_token);
+        }
+      else if (tokens.back().type == token::T_WORD && (tokens.back().value == "value" || tokens.back().value == "constant"))
+        {
+        // 440 value pitch makes a variable that starts out as 440 and that to can change,
+        // 440 constant a4 makes a word that is replaced by the literal 440
+        auto declaration = _take(tokens);
+        const T val = _take_literal(prog.statements, declaration);
+        auto name_token = _take(tokens);
+        if (name_token.type != token::T_WORD)
+          _throw_error(name_token.line_nr, name_token.column_nr, word_expected, name_token.value);
+        if (declaration.value == "constant")
+          dictionary[name_token.value] = Statements(1, Value{ val });
+        else
+          {
+          make_variable(name_token.value);
+          values[name_token.value] = variables[name_token.value];
+          globals[variables[name_token.value]] = val;
+          }
+        }
+      else if (tokens.back().type == token::T_COLON || tokens.back().type == token::T_CONTROL)
+        {
+        const bool control = tokens.back().type == token::T_CONTROL;
+        auto def = parse_definition(tokens);
+        // a k: word is inlined by the size that it is written with, as a call would take it
+        // out of eval_block, which holds its values
+        const int64_t size = _cost(def.statements).size;
+        if (control)
+          def.statements = _at_control_rate(def.statements);
+        code_cost cost = _cost(def.statements);
+        // a word with delay lines or filters is inlined whatever its size, so that every use
+        // has a state of its own, unless the program could not use it without growing too
+        // large anyway
+        const bool stateful = _has_state(def.statements) && cost.statements <= max_program_size;
+        if (std::min(size, cost.size) <= max_inline_size || cost.calls >= max_call_depth || stateful)
+          dictionary[def.name] = def.statements;
+        else
+          {
+          Call c;
+          c.word = (int)words.size();
+          c.memo = -1;
+          dictionary[def.name] = Statements(1, c);
+          words.push_back(def);
+          word_costs.push_back(cost);
+          }
+        }
+      else
+        _parse_statement(tokens, prog.statements);
+      }
+    code_cost cost = _cost(prog.statements);
+    if (cost.iterations > max_loop_iterations)
+      _throw_error(-1, -1, loop_too_long, "");
+    if (cost.nesting > max_loop_nesting)
+      _throw_error(-1, -1, loop_too_long, "the loops nest too deep");
+    if (cost.statements > max_program_size)
+      _throw_error(-1, -1, program_too_large, "");
+    std::vector<int> calls(words.size(), 0);
+    _count_calls(prog.statements, calls);
+    const bool all = cost.statements <= max_flat_size;
+    prog.statements = _inline_calls(prog.statements, calls, all);
+    // the words that are still called, those called from several places and memo: words, can
+    // call words that are called from one place only
+    for (size_t word = 0; word < words.size(); ++word)
+      {
+      if (calls[word] > 0)
+        {
+        words[word].statements = _inline_calls(words[word].statements, calls, all);
+        word_costs[word] = _cost(words[word].statements);
+        }
+      }
+    prog.words = words;
+    _allocate_delay_lines(prog);
+
+    return prog;
     }
 
   template <class T, int N>
-  void interpreter<T, N>::primitive_neq()
+  void interpreter<T, N>::eval(const Program& prog)
     {
-    T b = pop();
-    T a = pop();
-    if (a != b)
-      push(true_value<T>::value);
-    else
-      push((T)0);
+    _eval(prog.statements, prog.words);
     }
 
   template <class T, int N>
-  void interpreter<T, N>::primitive_dup()
+  void interpreter<T, N>::_eval(const Statements& stmts, const std::vector<Definition>& called)
     {
-    // (x -- xx)
-    T a = top();
-    push(a);
+    for (const auto& s : stmts)
+      {
+      if (std::holds_alternative<Value>(s))
+        push(std::get<Value>(s).val);
+      else if (std::holds_alternative<Primitive>(s))
+        {
+        primitive_fun_ptr ptr = std::get<Primitive>(s).fun;
+        (this->*ptr)();
+        }
+      else if (std::holds_alternative<Variable>(s))
+        push(globals[std::get<Variable>(s).index]);
+      else if (std::holds_alternative<Assign>(s))
+        globals[std::get<Assign>(s).index] = pop();
+      else if (std::holds_alternative<Fused>(s))
+        {
+        const Fused& f = std::get<Fused>(s);
+        T a = pop();
+        push(binary_value(fused_operator(f.op), a, f.op == OP_SQUARE ? a : f.val));
+        }
+      else if (std::holds_alternative<Call>(s))
+        {
+        const Call& c = std::get<Call>(s);
+        if (c.memo < 0)
+          {
+          _eval(called[c.word].statements, called);
+          continue;
+          }
+        Memo& m = memos[c.memo];
+        if (const T* outputs = _memo_find(m, stack.data(), stack_pointer))
+          {
+          stack_pointer = (stack_pointer + N - m.inputs) % N;
+          for (int k = 0; k < m.outputs; ++k)
+            push(outputs[k]);
+          }
+        else
+          {
+          _eval(called[c.word].statements, called);
+          _memo_store(m, stack.data(), stack_pointer);
+          }
+        }
+      else if (std::holds_alternative<Stateful>(s))
+        {
+        const Stateful& st = std::get<Stateful>(s);
+        if (st.op == OP_DELAY || st.op == OP_FEEDBACK)
+          {
+          T gain = st.op == OP_FEEDBACK ? pop() : (T)0;
+          T length = pop();
+          T x = pop();
+          push(_delay(delay_lines[st.index], st.op, x, length, gain));
+          }
+        else
+          {
+          T q = st.op == OP_FILTER_FQ ? pop() : (T)0;
+          T frequency = st.op != OP_FILTER ? pop() : (T)0;
+          T x = pop();
+          push(_filter(filters[st.index], st.op, x, frequency, q));
+          }
+        }
+      else if (std::holds_alternative<Branch>(s))
+        {
+        const Branch& b = std::get<Branch>(s);
+        _eval(pop() == (T)0 ? b.else_part : b.then_part, called);
+        }
+      else if (std::holds_alternative<Loop>(s))
+        {
+        const Loop& l = std::get<Loop>(s);
+        if (l.limit <= l.start)
+          continue;
+        int64_t& counter = loop_counters[loop_pointer++];
+        counter = l.start;
+        if (l.counted)
+          {
+          do
+            _eval(l.body, called);
+          while (++counter < l.limit);
+          }
+        else
+          {
+          do
+            _eval(l.body, called);
+          while (pop() == (T)0 && ++counter < l.limit);
+          }
+        --loop_pointer;
+        }
+      }
     }
 
-  template <class T, int N>
-  void interpreter<T, N>::primitive_pick()
+  template <class T>
+  struct true_value
     {
-    T a = pop();
-    int64_t sp = stack_pointer - (int64_t)a - 1;    
-    while (sp < 0)
-      sp += N;
-    push(stack[sp % N]);
-    }
+    inline static T value = (T)0xffffffffffffffff;
+    };
 
-  template <class T, int N>
-  void interpreter<T, N>::primitive_drop()
+  template <>
+  struct true_value<double>
     {
-    // (x --)
-    --stack_pointer;
-    if (stack_pointer < 0)
-      stack_pointer = N - 1;
-    }
+    inline static double value = 1.0;
+    };
 
-  template <class T, int N>
-  void interpreter<T, N>::primitive_2dup()
+  template <>
+  struct true_value<float>
     {
-    //(xy -- xyxy)
-    T a = top();
-    T b = second();
-    push(b);
-    push(a);
-    }
+    inline static double value = 1.f;
+    };
 
-  template <class T, int N>
-  void interpreter<T, N>::primitive_over()
+  template <class T>
+  inline T not_value(T input)
     {
-    //(xy -- xyx)
-    T a = second();
-    push(a);
+    return (T)(~(uint64_t)input);
     }
 
-  template <class T, int N>
-  void interpreter<T, N>::primitive_nip()
+  template <>
+  inline double not_value(double input)
     {
-    //(xy -- y)
-    T a = pop();
-    stack[stack_pointer ? stack_pointer-1 : N-1] = a;
+    return input == 0.0 ? 1.0 : 0.0;
     }
 
-  template <class T, int N>
-  void interpreter<T, N>::primitive_tuck()
+  template <>
+  inline float not_value(float input)
     {
-    // (xy -- yxy)
-    T b = pop();
-    T a = pop();
-    push(b);
-    push(a);
-    push(b);
+    return input == 0.f ? 1.f : 0.f;
     }
 
-  template <class T, int N>
-  void interpreter<T, N>::primitive_swap()
+  template <class T>
+  inline T modulo(T a, T b)
     {
-    // (xy -- yx)
-    T b = pop();
-    T a = pop();
-    push(b);
-    push(a);
+    return a % b;
     }
 
-  template <class T, int N>
-  void interpreter<T, N>::primitive_rot()
+  template <>
+  inline double modulo(double a, double b)
     {
-    // (abc -- bca)
-    T c = pop();
-    T b = pop();
-    T a = pop();
-    push(b);
-    push(c);
-    push(a);
+    return fmod(a, b);
     }
 
-  template <class T, int N>
-  void interpreter<T, N>::primitive_mrot()
+  template <>
+  inline float modulo(float a, float b)
     {
-    // (abc -- cab)
-    T c = pop();
-    T b = pop();
-    T a = pop();
-    push(c);
-    push(a);
-    push(b);
+    return fmod(a, b);
     }
 
-  template <class T, int N>
-  void interpreter<T, N>::primitive_min()
+  template <class T>
+  inline T multiply(T a, T b)
     {
-    T b = pop();
-    T a = pop();
-    if (a < b)
-      push(a);
-    else
-      push(b);
+    if (a == 0 || b == 0) // multiplying with infinity gives 0
+      return (T)0;
+    return a * b;
     }
 
-  template <class T, int N>
-  void interpreter<T, N>::primitive_max()
+  template <class T>
+  inline T divide(T a, T b)
     {
-    T b = pop();
-    T a = pop();
-    if (a > b)
-      push(a);
-    else
-      push(b);
+    if (b)
+      return a / b;
+    return std::numeric_limits<T>::infinity();
     }
 
-  template <class T, int N>
-  void interpreter<T, N>::primitive_pow()
+  template <class T>
+  inline T left_shift(T a, T b)
     {
-    T b = pop();
-    T a = pop();
-    push((T)std::pow(a, b));
+    return (T)((uint64_t)a << (uint64_t)b);
     }
 
-  template <class T, int N>
-  void interpreter<T, N>::primitive_atan2()
+  template <class T>
+  inline T right_shift(T a, T b)
     {
-    T b = pop();
-    T a = pop();
-    push((T)std::atan2(a, b));
+    return (T)((uint64_t)a >> (uint64_t)b);
     }
 
-  template <class T, int N>
-  void interpreter<T, N>::primitive_negate()
+  template <class T>
+  inline T binary_and(T a, T b)
     {
-    T a = pop();
-    push((T)-a);
+    return (T)((uint64_t)a & (uint64_t)b);
     }
 
-  template <class T, int N>
-  void interpreter<T, N>::primitive_tan()
+  template <class T>
+  inline T binary_or(T a, T b)
     {
-    T a = pop();
-    push((T)std::tan(a));
+    return (T)((uint64_t)a | (uint64_t)b);
     }
 
-  template <class T, int N>
-  void interpreter<T, N>::primitive_log()
+  template <class T>
+  inline T binary_xor(T a, T b)
     {
-    T a = pop();
-    push((T)std::log(a));
+    return (T)((uint64_t)a ^ (uint64_t)b);
     }
 
-  template <class T, int N>
-  void interpreter<T, N>::primitive_exp()
+  template <class T>
+  inline T truth(bool b)
     {
-    T a = pop();
-    push((T)std::exp(a));
+    return b ? true_value<T>::value : (T)0;
     }
 
-  template <class T, int N>
-  void interpreter<T, N>::primitive_sqrt()
+  // the primitives without side effects, applied to values, as run does
+  template <class T>
+  inline T unary_value(e_opcode op, T a)
     {
-    T a = pop();
-    push((T)std::sqrt(a));
+    switch (op)
+      {
+      case OP_NOT: return not_value(a);
+      case OP_SIN: return (T)std::sin(a);
+      case OP_COS: return (T)std::cos(a);
+      case OP_NEGATE: return (T)-a;
+      case OP_TAN: return (T)std::tan(a);
+      case OP_LOG: return (T)std::log(a);
+      case OP_EXP: return (T)std::exp(a);
+      case OP_SQRT: return (T)std::sqrt(a);
+      case OP_FLOOR: return (T)std::floor(a);
+      case OP_CEIL: return (T)std::ceil(a);
+      case OP_ABS: return (T)std::abs(a);
+      case OP_OSC_SIN: return oscillator(WAVE_SIN, a);
+      case OP_OSC_SAW: return oscillator(WAVE_SAW, a);
+      case OP_OSC_SQUARE: return oscillator(WAVE_SQUARE, a);
+      default: return a;
+      }
     }
 
-  template <class T, int N>
-  void interpreter<T, N>::primitive_floor()
+  template <class T>
+  inline T binary_value(e_opcode op, T a, T b)
     {
-    T a = pop();
-    push((T)std::floor(a));
+    switch (op)
+      {
+      case OP_ADD: return a + b;
+      case OP_SUB: return a - b;
+      case OP_MUL: return multiply(a, b);
+      case OP_DIV: return divide(a, b);
+      case OP_LEFT_SHIFT: return left_shift(a, b);
+      case OP_RIGHT_SHIFT: return right_shift(a, b);
+      case OP_AND: return binary_and(a, b);
+      case OP_OR: return binary_or(a, b);
+      case OP_XOR: return binary_xor(a, b);
+      case OP_MOD: return modulo(a, b);
+      case OP_LESS: return truth<T>(a < b);
+      case OP_GREATER: return truth<T>(a > b);
+      case OP_LEQ: return truth<T>(a <= b);
+      case OP_GEQ: return truth<T>(a >= b);
+      case OP_EQ: return truth<T>(a == b);
+      case OP_NEQ: return truth<T>(a != b);
+      case OP_MIN: return a < b ? a : b;
+      case OP_MAX: return a > b ? a : b;
+      case OP_POW: return (T)std::pow(a, b);
+      case OP_ATAN2: return (T)std::atan2(a, b);
+      default: return a;
+      }
     }
 
   template <class T, int N>
-  void interpreter<T, N>::primitive_ceil()
+  bool interpreter<T, N>::_peephole(Statements& stmts) const
     {
-    T a = pop();
-    push((T)std::ceil(a));
+    // Looks at the last statements only, so that applying it after every statement that is
+    // appended rewrites the program from left to right. Returns true if something changed.
+    const int n = (int)stmts.size();
+    auto op_at = [&](int i) -> int
+      {
+      if (i > n || !std::holds_alternative<Primitive>(stmts[n - i]))
+        return -1;
+      return std::get<Primitive>(stmts[n - i]).op;
+      };
+    auto value_at = [&](int i, T& v) -> bool
+      {
+      if (i > n || !std::holds_alternative<Value>(stmts[n - i]))
+        return false;
+      v = std::get<Value>(stmts[n - i]).val;
+      return true;
+      };
+    auto value = [](T v) -> Statement
+      {
+      Value val;
+      val.val = v;
+      return val;
+      };
+    auto primitive = [&](e_opcode op) -> Statement
+      {
+      for (const auto& p : primitives)
+        if (p.second.op == op)
+          return p.second;
+      return Statement();
+      };
+    auto replace = [&](int count, std::initializer_list<Statement> with) -> bool
+      {
+      stmts.resize(n - count);
+      stmts.insert(stmts.end(), with.begin(), with.end());
+      return true;
+      };
+
+    int last = op_at(1);
+    if (last < 0)
+      return false;
+    const e_opcode op = (e_opcode)last;
+    T a, b, c;
+    switch (op)
+      {
+      case OP_ADD:
+      case OP_SUB:
+      case OP_MUL:
+      case OP_DIV:
+      case OP_MOD:
+      case OP_LEFT_SHIFT:
+      case OP_RIGHT_SHIFT:
+      case OP_AND:
+      case OP_OR:
+      case OP_XOR:
+      case OP_LESS:
+      case OP_GREATER:
+      case OP_LEQ:
+      case OP_GEQ:
+      case OP_EQ:
+      case OP_NEQ:
+      case OP_MIN:
+      case OP_MAX:
+      case OP_POW:
+      case OP_ATAN2:
+      {
+      if (!value_at(3, a) || !value_at(2, b))
+        return false;
+      // integer division traps for these, so leave that to run time
+      if (std::numeric_limits<T>::is_integer && ((op == OP_MOD && b == (T)0) || ((op == OP_DIV || op == OP_MOD) && b == (T)-1)))
+        return false;
+      return replace(3, { value(binary_value(op, a, b)) });
+      }
+      case OP_NOT:
+      case OP_SIN:
+      case OP_COS:
+      case OP_NEGATE:
+      case OP_TAN:
+      case OP_LOG:
+      case OP_EXP:
+      case OP_SQRT:
+      case OP_FLOOR:
+      case OP_CEIL:
+      case OP_ABS:
+      case OP_OSC_SIN:
+      case OP_OSC_SAW:
+      case OP_OSC_SQUARE:
+      {
+      if (!value_at(2, a))
+        return false;
+      return replace(2, { value(unary_value(op, a)) });
+      }
+      case OP_DUP:
+      {
+      if (value_at(2, a))
+        return replace(2, { value(a), value(a) });
+      return false;
+      }
+      case OP_DROP:
+      {
+      if (n >= 2 && (std::holds_alternative<Value>(stmts[n - 2]) || std::holds_alternative<Variable>(stmts[n - 2])))
+        return replace(2, {});
+      switch (op_at(2))
+        {
+        case OP_DUP:
+        case OP_OVER: return replace(2, {});
+        case OP_SWAP: return replace(2, { primitive(OP_NIP) });
+        case OP_TUCK: return replace(2, { primitive(OP_SWAP) });
+        case OP_2DUP: return replace(2, { primitive(OP_OVER) });
+        default: return false;
+        }
+      }
+      case OP_SWAP:
+      {
+      if (value_at(3, a) && value_at(2, b))
+        return replace(3, { value(b), value(a) });
+      if (op_at(2) == OP_SWAP)
+        return replace(2, {});
+      if (op_at(2) == OP_DUP)
+        return replace(1, {});
+      return false;
+      }
+      case OP_OVER:
+      {
+      if (value_at(3, a) && value_at(2, b))
+        return replace(3, { value(a), value(b), value(a) });
+      if (op_at(2) == OP_OVER)
+        return replace(2, { primitive(OP_2DUP) });
+      return false;
+      }
+      case OP_NIP:
+      {
+      if (value_at(3, a) && value_at(2, b))
+        return replace(3, { value(b) });
+      return false;
+      }
+      case OP_TUCK:
+      {
+      if (value_at(3, a) && value_at(2, b))
+        return replace(3, { value(b), value(a), value(b) });
+      return false;
+      }
+      case OP_2DUP:
+      {
+      if (value_at(3, a) && value_at(2, b))
+        return replace(3, { value(a), value(b), value(a), value(b) });
+      return false;
+      }
+      case OP_ROT:
+      {
+      if (value_at(4, a) && value_at(3, b) && value_at(2, c))
+        return replace(4, { value(b), value(c), value(a) });
+      if (op_at(2) == OP_MROT)
+        return replace(2, {});
+      if (op_at(2) == OP_ROT)
+        return replace(2, { primitive(OP_MROT) });
+      return false;
+      }
+      case OP_MROT:
+      {
+      if (value_at(4, a) && value_at(3, b) && value_at(2, c))
+        return replace(4, { value(c), value(a), value(b) });
+      if (op_at(2) == OP_ROT)
+        return replace(2, {});
+      if (op_at(2) == OP_MROT)
+        return replace(2, { primitive(OP_ROT) });
+      return false;
+      }
+      case OP_PICK:
+      {
+      if (value_at(2, a) && a == (T)0)
+        return replace(2, { primitive(OP_DUP) });
+      if (value_at(2, a) && a == (T)1)
+        return replace(2, { primitive(OP_OVER) });
+      return false;
+      }
+      case OP_RETURN_STACK_POP:
+      {
+      if (op_at(2) == OP_RETURN_STACK_PUSH)
+        return replace(2, {});
+      return false;
+      }
+      default: return false;
+      }
     }
 
   template <class T, int N>
-  void interpreter<T, N>::primitive_abs()
+  typename interpreter<T, N>::Program interpreter<T, N>::optimize(const Program& prog) const
     {
-    T a = pop();
-    push((T)std::abs(a));
+    // The statements that are removed leave different values behind in the ring buffer above
+    // the stack pointer (and in the return stack). Only programs with a static stack that never
+    // read below the depth they start with are sure not to see them.
+    StackEffect effect = compile(prog).effect;
+    if (!effect.is_static || effect.min_depth < 0 || effect.min_return_depth < 0 || effect.return_depth != 0)
+      return prog;
+    Statements folded;
+    _fold(prog.statements, folded);
+    Program out;
+    out.statements = _fuse(folded);
+    out.words = prog.words;
+    for (auto& word : out.words)
+      {
+      folded.clear();
+      _fold(word.statements, folded);
+      word.statements = _fuse(folded);
+      }
+    return out;
     }
 
   template <class T, int N>
-  void interpreter<T, N>::primitive_fetch()
+  void interpreter<T, N>::_fold(const Statements& stmts, Statements& out) const
     {
-    /*
-    (addr -- value_from_addr)
-     */
+    for (const auto& s : stmts)
+      {
+      if (std::holds_alternative<Branch>(s))
+        {
+        // with a literal condition only one part is left
+        const Branch& b = std::get<Branch>(s);
+        if (!out.empty() && std::holds_alternative<Value>(out.back()))
+          {
+          T cond = std::get<Value>(out.back()).val;
+          out.pop_back();
+          _fold(cond == (T)0 ? b.else_part : b.then_part, out);
+          continue;
+          }
+        Branch folded;
+        _fold(b.then_part, folded.then_part);
+        _fold(b.else_part, folded.else_part);
+        out.push_back(folded);
+        continue;
+        }
+      if (std::holds_alternative<Loop>(s))
+        {
+        const Loop& l = std::get<Loop>(s);
+        if (l.limit <= l.start)
+          continue;
+        Loop folded = l;
+        folded.body.clear();
+        _fold(l.body, folded.body);
+        out.push_back(folded);
+        continue;
+        }
+      out.push_back(s);
+      while (_peephole(out))
+        ;
+      }
+    }
+
+  template <class T, int N>
+  typename interpreter<T, N>::Statements interpreter<T, N>::_fuse(const Statements& stmts) const
+    {
+    Statements fused;
+    for (const auto& s : stmts)
+      {
+      if (std::holds_alternative<Branch>(s))
+        {
+        const Branch& b = std::get<Branch>(s);
+        fused.push_back(Branch{ _fuse(b.then_part), _fuse(b.else_part) });
+        continue;
+        }
+      if (std::holds_alternative<Loop>(s))
+        {
+        Loop l = std::get<Loop>(s);
+        l.body = _fuse(l.body);
+        fused.push_back(l);
+        continue;
+        }
+      fused.push_back(s);
+      size_t n = fused.size();
+      if (n < 2 || !std::holds_alternative<Primitive>(fused[n - 1]))
+        continue;
+      e_opcode op = std::get<Primitive>(fused[n - 1]).op;
+      if (op == OP_MUL && std::holds_alternative<Primitive>(fused[n - 2]) && std::get<Primitive>(fused[n - 2]).op == OP_DUP)
+        {
+        fused.resize(n - 2);
+        fused.push_back(Fused{ OP_SQUARE, (T)0 });
+        continue;
+        }
+      if (!std::holds_alternative<Value>(fused[n - 2]))
+        continue;
+      for (int f = OP_ADD_VALUE; f <= OP_XOR_VALUE; ++f)
+        {
+        if (fused_operator((e_opcode)f) == op)
+          {
+          T val = std::get<Value>(fused[n - 2]).val;
+          fused.resize(n - 2);
+          fused.push_back(Fused{ (e_opcode)f, val });
+          break;
+          }
+        }
+      }
+    return fused;
+    }
+
+  template <class T, int N>
+  std::string interpreter<T, N>::dump(const Statements& stmts) const
+    {
+    auto word = [&](e_opcode op) -> std::string
+      {
+      for (const auto& p : primitives)
+        if (p.second.op == op)
+          return p.first;
+      return "?";
+      };
+    // a variable or value by its name, a local by word.name
+    auto global = [&](int index) -> std::string
+      {
+      for (const auto& v : variables)
+        if (v.second == index)
+          return v.first;
+      for (const auto& v : locals)
+        if (v.second == index)
+          return v.first;
+      return "?";
+      };
+    std::stringstream str;
+    for (size_t i = 0; i < stmts.size(); ++i)
+      {
+      const auto& s = stmts[i];
+      if (i)
+        str << " ";
+      if (std::holds_alternative<Value>(s))
+        str << std::get<Value>(s).val;
+      else if (std::holds_alternative<Primitive>(s))
+        str << word(std::get<Primitive>(s).op);
+      else if (std::holds_alternative<Variable>(s))
+        str << global(std::get<Variable>(s).index);
+      else if (std::holds_alternative<Assign>(s))
+        str << "to " << global(std::get<Assign>(s).index);
+      else if (std::holds_alternative<Fused>(s))
+        {
+        const Fused& f = std::get<Fused>(s);
+        if (f.op == OP_SQUARE)
+          str << "[dup *]";
+        else
+          str << "[" << f.val << " " << word(fused_operator(f.op)) << "]";
+        }
+      else if (std::holds_alternative<Call>(s))
+        str << words[std::get<Call>(s).word].name;
+      else if (std::holds_alternative<Stateful>(s))
+        {
+        // a filter with literal parameters shows them, like a fused opcode
+        const Stateful& st = std::get<Stateful>(s);
+        if (st.op == OP_DELAY || st.op == OP_FEEDBACK)
+          str << (st.op == OP_DELAY ? "delay" : "feedback");
+        else if (st.op != OP_FILTER)
+          str << filter_word(filters[st.index].kind);
+        else
+          {
+          const Filter& f = filters[st.index];
+          str << "[" << f.frequency;
+          if (filter_parameters(f.kind) == 2)
+            str << " " << f.q;
+          str << " " << filter_word(f.kind) << "]";
+          }
+        }
+      else if (std::holds_alternative<Branch>(s))
+        {
+        const Branch& b = std::get<Branch>(s);
+        str << "if";
+        if (!b.then_part.empty())
+          str << " " << dump(b.then_part);
+        if (!b.else_part.empty())
+          str << " else " << dump(b.else_part);
+        str << " then";
+        }
+      else if (std::holds_alternative<Loop>(s))
+        {
+        const Loop& l = std::get<Loop>(s);
+        if (l.counted)
+          str << l.limit << " " << l.start << " do";
+        else
+          str << "begin";
+        if (!l.body.empty())
+          str << " " << dump(l.body);
+        str << (l.counted ? " loop" : " until");
+        }
+      }
+    return str.str();
+    }
+
+  template <class T, int N>
+  inline T interpreter<T, N>::top()
+    {
+    return stack_pointer ? stack[stack_pointer-1] : stack[N-1];
+    }
+
+  template <class T, int N>
+  inline T interpreter<T, N>::second()
+    {
+    return stack_pointer>1 ? stack[stack_pointer - 2] : stack[stack_pointer + N - 2];
+    }
+
+  template <class T, int N>
+  inline T interpreter<T, N>::pop()
+    {
+    --stack_pointer;
+    if (stack_pointer < 0)
+      stack_pointer = N - 1;
+    return stack[stack_pointer];
+    }
+
+  template <class T, int N>
+  inline void interpreter<T, N>::push(T val)
+    {
+    stack[stack_pointer] = val;
+    ++stack_pointer;
+    if (stack_pointer >= N)
+      stack_pointer = 0;
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_add()
+    {
+    T b = pop();
     T a = pop();
-    int index = ((int)a) % N;
-    push(memory_stack[index]);
+    push(a + b);
     }
-    
+
   template <class T, int N>
-  void interpreter<T, N>::primitive_store()
+  void interpreter<T, N>::primitive_sub()
     {
-    /*
-    (x addr -- )
-    */
-    
     T b = pop();
     T a = pop();
-    int index = ((int)b) % N;
-    memory_stack[index] = a;
+    push(a - b);
     }
 
   template <class T, int N>
-  void interpreter<T, N>::primitive_return_stack_push()
+  void interpreter<T, N>::primitive_mul()
     {
+    T b = pop();
     T a = pop();
-    return_stack[return_stack_pointer] = a;
-    ++return_stack_pointer;
-    if (return_stack_pointer >= N)
-      return_stack_pointer = 0;
+    push(multiply(a, b));
     }
 
   template <class T, int N>
-  void interpreter<T, N>::primitive_return_stack_pop()
+  void interpreter<T, N>::primitive_div()
     {
-    --return_stack_pointer;
-    if (return_stack_pointer < 0)
-      return_stack_pointer = N - 1;
-    push(return_stack[return_stack_pointer]);
+    T b = pop();
+    T a = pop();
+    push(divide(a, b));
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_left_shift()
+    {
+    T b = pop();
+    T a = pop();
+    push(left_shift(a, b));
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_right_shift()
+    {
+    T b = pop();
+    T a = pop();
+    push(right_shift(a, b));
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_and()
+    {
+    T b = pop();
+    T a = pop();
+    push(binary_and(a, b));
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_or()
+    {
+    T b = pop();
+    T a = pop();
+    push(binary_or(a, b));
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_xor()
+    {
+    T b = pop();
+    T a = pop();
+    push(binary_xor(a, b));
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_not()
+    {
+    T a = pop();
+    push(not_value(a));
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_sin()
+    {
+    T a = pop();
+    push((T)std::sin(a));
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_cos()
+    {
+    T a = pop();
+    push((T)std::cos(a));
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_mod()
+    {
+    T b = pop();
+    T a = pop();
+    push(modulo(a, b));
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_less()
+    {
+    T b = pop();
+    T a = pop();
+    push(truth<T>(a < b));
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_greater()
+    {
+    T b = pop();
+    T a = pop();
+    push(truth<T>(a > b));
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_leq()
+    {
+    T b = pop();
+    T a = pop();
+    push(truth<T>(a <= b));
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_geq()
+    {
+    T b = pop();
+    T a = pop();
+    push(truth<T>(a >= b));
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_eq()
+    {
+    T b = pop();
+    T a = pop();
+    push(truth<T>(a == b));
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_neq()
+    {
+    T b = pop();
+    T a = pop();
+    push(truth<T>(a != b));
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_dup()
+    {
+    // (x -- xx)
+    T a = top();
+    push(a);
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_pick()
+    {
+    T a = pop();
+    int64_t sp = stack_pointer - (int64_t)a - 1;    
+    while (sp < 0)
+      sp += N;
+    push(stack[sp % N]);
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_drop()
+    {
+    // (x --)
+    --stack_pointer;
+    if (stack_pointer < 0)
+      stack_pointer = N - 1;
     }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_2dup()
+    {
+    //(xy -- xyxy)
+    T a = top();
+    T b = second();
+    push(b);
+    push(a);
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_over()
+    {
+    //(xy -- xyx)
+    T a = second();
+    push(a);
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_nip()
+    {
+    //(xy -- y)
+    T a = pop();
+    stack[stack_pointer ? stack_pointer-1 : N-1] = a;
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_tuck()
+    {
+    // (xy -- yxy)
+    T b = pop();
+    T a = pop();
+    push(b);
+    push(a);
+    push(b);
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_swap()
+    {
+    // (xy -- yx)
+    T b = pop();
+    T a = pop();
+    push(b);
+    push(a);
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_rot()
+    {
+    // (abc -- bca)
+    T c = pop();
+    T b = pop();
+    T a = pop();
+    push(b);
+    push(c);
+    push(a);
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_mrot()
+    {
+    // (abc -- cab)
+    T c = pop();
+    T b = pop();
+    T a = pop();
+    push(c);
+    push(a);
+    push(b);
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_min()
+    {
+    T b = pop();
+    T a = pop();
+    if (a < b)
+      push(a);
+    else
+      push(b);
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_max()
+    {
+    T b = pop();
+    T a = pop();
+    if (a > b)
+      push(a);
+    else
+      push(b);
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_pow()
+    {
+    T b = pop();
+    T a = pop();
+    push((T)std::pow(a, b));
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_atan2()
+    {
+    T b = pop();
+    T a = pop();
+    push((T)std::atan2(a, b));
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_negate()
+    {
+    T a = pop();
+    push((T)-a);
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_tan()
+    {
+    T a = pop();
+    push((T)std::tan(a));
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_log()
+    {
+    T a = pop();
+    push((T)std::log(a));
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_exp()
+    {
+    T a = pop();
+    push((T)std::exp(a));
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_sqrt()
+    {
+    T a = pop();
+    push((T)std::sqrt(a));
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_floor()
+    {
+    T a = pop();
+    push((T)std::floor(a));
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_ceil()
+    {
+    T a = pop();
+    push((T)std::ceil(a));
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_abs()
+    {
+    T a = pop();
+    push((T)std::abs(a));
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_osc_sin()
+    {
+    T a = pop();
+    push(oscillator(WAVE_SIN, a));
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_osc_saw()
+    {
+    T a = pop();
+    push(oscillator(WAVE_SAW, a));
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_osc_square()
+    {
+    T a = pop();
+    push(oscillator(WAVE_SQUARE, a));
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_fetch()
+    {
+    /*
+    (addr -- value_from_addr)
+     */
+    T a = pop();
+    int index = ((int)a) & ((int)memory_stack.size() - 1);
+    push(memory_stack[index]);
+    }
+    
+  template <class T, int N>
+  void interpreter<T, N>::primitive_store()
+    {
+    /*
+    (x addr -- )
+    */
+    
+    T b = pop();
+    T a = pop();
+    int index = ((int)b) & ((int)memory_stack.size() - 1);
+    memory_stack[index] = a;
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_return_stack_push()
+    {
+    T a = pop();
+    return_stack[return_stack_pointer] = a;
+    ++return_stack_pointer;
+    if (return_stack_pointer >= N)
+      return_stack_pointer = 0;
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_return_stack_pop()
+    {
+    --return_stack_pointer;
+    if (return_stack_pointer < 0)
+      return_stack_pointer = N - 1;
+    push(return_stack[return_stack_pointer]);
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_loop_i()
+    {
+    push((T)loop_counters[loop_pointer - 1]);
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::primitive_loop_j()
+    {
+    push((T)loop_counters[loop_pointer - 2]);
+    }
+
+  inline void stack_signature(e_opcode op, int& consumed, int& produced)
+    {
+    switch (op)
+      {
+      case OP_VALUE:
+      case OP_VARIABLE:
+      case OP_RETURN_STACK_POP:
+      case OP_I:
+      case OP_J: consumed = 0; produced = 1; break;
+      case OP_JUMP:
+      case OP_CALL: // see interpreter::stack_effect for what the word does
+      case OP_RETURN:
+      case OP_DO:
+      case OP_LOOP:
+      case OP_BEGIN:
+      case OP_MEMO: // a hit skips the call, with the same effect
+      case OP_MEMO_STORE: consumed = 0; produced = 0; break;
+      case OP_JUMP_IF_ZERO:
+      case OP_UNTIL: consumed = 1; produced = 0; break;
+      case OP_NOT:
+      case OP_SIN:
+      case OP_COS:
+      case OP_PICK:
+      case OP_NEGATE:
+      case OP_TAN:
+      case OP_LOG:
+      case OP_EXP:
+      case OP_SQRT:
+      case OP_FLOOR:
+      case OP_CEIL:
+      case OP_ABS:
+      case OP_OSC_SIN:
+      case OP_OSC_SAW:
+      case OP_OSC_SQUARE:
+      case OP_FETCH:
+      case OP_FILTER:
+      case OP_ADD_VALUE:
+      case OP_SUB_VALUE:
+      case OP_MUL_VALUE:
+      case OP_DIV_VALUE:
+      case OP_MOD_VALUE:
+      case OP_LEFT_SHIFT_VALUE:
+      case OP_RIGHT_SHIFT_VALUE:
+      case OP_AND_VALUE:
+      case OP_OR_VALUE:
+      case OP_XOR_VALUE:
+      case OP_SQUARE: consumed = 1; produced = 1; break;
+      case OP_DUP: consumed = 1; produced = 2; break;
+      case OP_DROP:
+      case OP_RETURN_STACK_PUSH:
+      case OP_ASSIGN: consumed = 1; produced = 0; break;
+      case OP_2DUP: consumed = 2; produced = 4; break;
+      case OP_OVER:
+      case OP_TUCK: consumed = 2; produced = 3; break;
+      case OP_SWAP: consumed = 2; produced = 2; break;
+      case OP_STORE: consumed = 2; produced = 0; break;
+      case OP_ROT:
+      case OP_MROT: consumed = 3; produced = 3; break;
+      case OP_FEEDBACK:
+      case OP_FILTER_FQ: consumed = 3; produced = 1; break;
+      default: consumed = 2; produced = 1; break; // binary operators and nip
+      }
+    }
+
+  // outputs of the stack shuffling words as indices into their inputs
+  inline bool shuffle(e_opcode op, std::vector<int>& outputs)
+    {
+    switch (op)
+      {
+      case OP_DUP: outputs = { 0, 0 }; return true;
+      case OP_DROP: outputs = {}; return true;
+      case OP_2DUP: outputs = { 0, 1, 0, 1 }; return true;
+      case OP_OVER: outputs = { 0, 1, 0 }; return true;
+      case OP_NIP: outputs = { 1 }; return true;
+      case OP_TUCK: outputs = { 1, 0, 1 }; return true;
+      case OP_SWAP: outputs = { 1, 0 }; return true;
+      case OP_ROT: outputs = { 1, 2, 0 }; return true;
+      case OP_MROT: outputs = { 2, 0, 1 }; return true;
+      default: return false;
+      }
+    }
+
+  // The operators that are worth caching when their operands only change every so many samples:
+  // the engines keep the last operands and result of such an instruction, and call the function
+  // again only when the bits of an operand differ, so the result is exactly the same.
+  inline bool is_memoized(e_opcode op, e_dependency dep)
+    {
+    if (dep != DEP_STEP)
+      return false;
+    switch (op)
+      {
+      case OP_SIN:
+      case OP_COS:
+      case OP_TAN:
+      case OP_LOG:
+      case OP_EXP:
+      case OP_POW:
+      case OP_ATAN2:
+        return true;
+      default:
+        return false;
+      }
+    }
+
+  template <class T, int N>
+  typename interpreter<T, N>::Bytecode interpreter<T, N>::compile(const Program& prog) const
+    {
+    Bytecode code;
+    code.instructions.reserve(prog.statements.size());
+    _compile(prog.statements, code);
+    // the words that are called follow the program, each once, in the order of the first calls
+    std::vector<int> start(prog.words.size(), -1);
+    const size_t program_size = code.instructions.size();
+    for (size_t i = 0; i < code.instructions.size(); ++i)
+      {
+      if (code.instructions[i].op != OP_CALL)
+        continue;
+      if (code.instructions.size() == program_size)
+        code.instructions.push_back(Instruction{ OP_RETURN, 0, (T)0 });
+      const int word = code.instructions[i].index;
+      if (start[word] < 0)
+        {
+        start[word] = (int)code.instructions.size();
+        _compile(prog.words[word].statements, code);
+        code.instructions.push_back(Instruction{ OP_RETURN, 0, (T)0 });
+        }
+      code.instructions[i].index = start[word];
+      }
+    code.effect = stack_effect(code.instructions);
+    code.dependencies = dependencies(code.instructions, code.effect, &code.periods);
+    size_t tail = 0;
+    while (tail < code.instructions.size() && code.instructions[code.instructions.size() - 1 - tail].op == OP_FILTER)
+      ++tail;
+    if (tail > 0 && code.dependencies.size() == code.instructions.size())
+      {
+      std::vector<Instruction> input(code.instructions.begin(), code.instructions.end() - tail);
+      if (stack_effect(input).lanes_are_independent())
+        code.filter_tail = (int)tail;
+      }
+    return code;
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::_compile(const Statements& stmts, Bytecode& code) const
+    {
+    for (const auto& s : stmts)
+      {
+      Instruction instr;
+      instr.index = 0;
+      instr.val = (T)0;
+      if (std::holds_alternative<Value>(s))
+        {
+        instr.op = OP_VALUE;
+        instr.val = std::get<Value>(s).val;
+        }
+      else if (std::holds_alternative<Primitive>(s))
+        instr.op = std::get<Primitive>(s).op;
+      else if (std::holds_alternative<Variable>(s))
+        {
+        instr.op = OP_VARIABLE;
+        instr.index = std::get<Variable>(s).index;
+        }
+      else if (std::holds_alternative<Assign>(s))
+        {
+        instr.op = OP_ASSIGN;
+        instr.index = std::get<Assign>(s).index;
+        }
+      else if (std::holds_alternative<Fused>(s))
+        {
+        instr.op = std::get<Fused>(s).op;
+        instr.val = std::get<Fused>(s).val;
+        if (instr.op == OP_DIV_VALUE || instr.op == OP_MOD_VALUE)
+          {
+          instr.index = -1;
+          if (std::is_integral<T>::value && constant_divisor::is_reducible((int64_t)instr.val))
+            {
+            instr.index = (int)code.divisors.size();
+            code.divisors.push_back(constant_divisor((int64_t)instr.val));
+            }
+          }
+        }
+      else if (std::holds_alternative<Call>(s))
+        {
+        // the index is the word until compile knows where its body goes, a memo: word looks
+        // up its inputs before the call and caches its outputs after it
+        const Call& c = std::get<Call>(s);
+        if (c.memo >= 0)
+          code.instructions.push_back(Instruction{ OP_MEMO, c.memo, (T)0 });
+        instr.op = OP_CALL;
+        instr.index = c.word;
+        if (c.memo >= 0)
+          {
+          code.instructions.push_back(instr);
+          instr.op = OP_MEMO_STORE;
+          instr.index = c.memo;
+          }
+        }
+      else if (std::holds_alternative<Stateful>(s))
+        {
+        instr.op = std::get<Stateful>(s).op;
+        instr.index = std::get<Stateful>(s).index;
+        }
+      else if (std::holds_alternative<Branch>(s))
+        {
+        // jump over the then part if the condition is zero, and over the else part after it
+        const Branch& b = std::get<Branch>(s);
+        const size_t branch = code.instructions.size();
+        code.instructions.push_back(Instruction{ OP_JUMP_IF_ZERO, 0, (T)0 });
+        _compile(b.then_part, code);
+        if (!b.else_part.empty())
+          {
+          const size_t jump = code.instructions.size();
+          code.instructions.push_back(Instruction{ OP_JUMP, 0, (T)0 });
+          code.instructions[branch].index = (int)code.instructions.size();
+          _compile(b.else_part, code);
+          code.instructions[jump].index = (int)code.instructions.size();
+          }
+        else
+          code.instructions[branch].index = (int)code.instructions.size();
+        continue;
+        }
+      else if (std::holds_alternative<Loop>(s))
+        {
+        // a loop that never runs is left out, the others run their body at least once, and
+        // jump back from the end for as long as they go on
+        const Loop& l = std::get<Loop>(s);
+        if (l.limit <= l.start)
+          continue;
+        code.instructions.push_back(Instruction{ l.counted ? OP_DO : OP_BEGIN, 0, (T)l.start });
+        const int body = (int)code.instructions.size();
+        _compile(l.body, code);
+        code.instructions.push_back(Instruction{ l.counted ? OP_LOOP : OP_UNTIL, body, (T)l.limit });
+        continue;
+        }
+      code.instructions.push_back(instr);
+      }
+    }
+
+
+  template <class T, int N>
+  typename interpreter<T, N>::StackEffect interpreter<T, N>::stack_effect(const std::vector<Instruction>& instructions) const
+    {
+    std::vector<std::pair<int, int>> landing(instructions.size() + 1, std::make_pair(std::numeric_limits<int>::min(), 0));
+    std::map<int, StackEffect> words;
+    StackEffect effect = _stack_effect(instructions, 0, landing, words);
+    // In straight code a global carries over if it is read before it is assigned. With jumps
+    // the order is not known, and every global that is assigned counts.
+    std::vector<char> assigned(N, 0);
+    std::vector<char> read(N, 0);
+    for (const Instruction& instr : instructions)
+      {
+      if (instr.op == OP_VARIABLE && !assigned[instr.index])
+        read[instr.index] = 1;
+      else if (instr.op == OP_ASSIGN)
+        {
+        if (read[instr.index] || effect.has_control_flow)
+          effect.carries_globals = true;
+        assigned[instr.index] = 1;
+        }
+      }
+    return effect;
+    }
+
+  template <class T, int N>
+  typename interpreter<T, N>::StackEffect interpreter<T, N>::_stack_effect(const std::vector<Instruction>& instructions, size_t begin, std::vector<std::pair<int, int>>& landing, std::map<int, StackEffect>& words) const
+    {
+    // The effect of the program or of a word, from begin up to the end or the OP_RETURN that
+    // ends it. The effects of the words that it calls are kept in words, by their first
+    // instruction.
+    StackEffect effect;
+    effect.is_static = true;
+    effect.depth = 0;
+    effect.min_depth = 0;
+    effect.max_depth = 0;
+    effect.return_depth = 0;
+    effect.min_return_depth = 0;
+    effect.max_return_depth = 0;
+    effect.writes_memory = false;
+    effect.has_control_flow = false;
+    effect.carries_globals = false;
+    // The depths of both stacks where a jump lands, which is only static if every path that
+    // gets there, and every round of a loop, brings the same depths.
+    const int unknown = std::numeric_limits<int>::min();
+    bool reachable = true; // false right after an unconditional jump
+    auto arrive = [&](size_t target)
+      {
+      const auto here = std::make_pair(effect.depth, effect.return_depth);
+      if (landing[target].first == unknown)
+        landing[target] = here;
+      else if (landing[target] != here)
+        effect.is_static = false;
+      };
+    for (size_t i = begin; i <= instructions.size(); ++i)
+      {
+      const bool jumped_to = landing[i].first != unknown;
+      if (reachable)
+        arrive(i);
+      else if (jumped_to)
+        {
+        effect.depth = landing[i].first;
+        effect.return_depth = landing[i].second;
+        }
+      reachable = true;
+      if (i == instructions.size() || instructions[i].op == OP_RETURN)
+        break;
+      const Instruction& instr = instructions[i];
+      if (instr.op == OP_CALL)
+        {
+        auto it = words.find(instr.index);
+        if (it == words.end())
+          it = words.insert(std::make_pair(instr.index, _stack_effect(instructions, instr.index, landing, words))).first;
+        const StackEffect& word = it->second;
+        effect.is_static = effect.is_static && word.is_static;
+        effect.min_depth = std::min(effect.min_depth, effect.depth + word.min_depth);
+        effect.max_depth = std::max(effect.max_depth, effect.depth + word.max_depth);
+        effect.depth += word.depth;
+        effect.min_return_depth = std::min(effect.min_return_depth, effect.return_depth + word.min_return_depth);
+        effect.max_return_depth = std::max(effect.max_return_depth, effect.return_depth + word.max_return_depth);
+        effect.return_depth += word.return_depth;
+        effect.writes_memory = effect.writes_memory || word.writes_memory;
+        effect.has_control_flow = true;
+        continue;
+        }
+      int consumed, produced;
+      stack_signature(instr.op, consumed, produced);
+      int reach = consumed;
+      if (instr.op == OP_PICK)
+        {
+        // only a pick with a literal index reads from a known depth
+        if (i > 0 && !jumped_to && instructions[i - 1].op == OP_VALUE && instructions[i - 1].val >= 0 && instructions[i - 1].val < N - 2)
+          reach = 2 + (int)(int64_t)instructions[i - 1].val;
+        else
+          effect.is_static = false;
+        }
+      effect.min_depth = std::min(effect.min_depth, effect.depth - reach);
+      effect.depth += produced - consumed;
+      effect.max_depth = std::max(effect.max_depth, effect.depth);
+      if (instr.op == OP_RETURN_STACK_PUSH)
+        effect.max_return_depth = std::max(effect.max_return_depth, ++effect.return_depth);
+      else if (instr.op == OP_RETURN_STACK_POP)
+        effect.min_return_depth = std::min(effect.min_return_depth, --effect.return_depth);
+      else if (instr.op == OP_STORE || has_state(instr.op))
+        effect.writes_memory = true;
+      if (is_control_flow(instr.op))
+        effect.has_control_flow = true;
+      if (instr.op == OP_JUMP || instr.op == OP_JUMP_IF_ZERO || instr.op == OP_LOOP || instr.op == OP_UNTIL)
+        arrive(instr.index);
+      if (instr.op == OP_JUMP)
+        reachable = false;
+      }
+    return effect;
+    }
+
+  template <class T, int N>
+  std::vector<e_dependency> interpreter<T, N>::dependencies(const std::vector<Instruction>& instructions, const StackEffect& effect, std::vector<int64_t>* periods) const
+    {
+    std::vector<e_dependency> deps;
+    if (periods)
+      periods->clear();
+    if (!effect.is_static || effect.has_control_flow)
+      return deps;
+    auto it_t = variables.find("t");
+    auto it_c = variables.find("c");
+    int t_index = it_t == variables.end() ? -1 : it_t->second;
+    int c_index = it_c == variables.end() ? -1 : it_c->second;
+    // Next to its dependency, a value keeps the period of a step, 0 if unknown, and the
+    // divisor d if it is exactly t / d, 0 if not, so that t 64 / floor is a step of 64.
+    struct tracked
+      {
+      e_dependency dep;
+      int64_t period;
+      int64_t divisor;
+      };
+    // what lies below the start of the stack was left behind by the previous evaluation, which
+    // can be the other channel, and the same holds for memory that the program writes to
+    std::vector<tracked> st(-effect.min_depth, tracked{ DEP_CHANNEL, 0, 0 });
+    std::vector<tracked> rs;
+    const e_dependency memory = effect.writes_memory ? DEP_CHANNEL : DEP_STEP;
+    // a global that to assigns depends on the value that it got, or before that, like memory,
+    // on what the previous evaluation left in it
+    std::map<int, tracked> assigned;
+    for (const Instruction& instr : instructions)
+      if (instr.op == OP_ASSIGN)
+        assigned[instr.index] = tracked{ DEP_CHANNEL, 0, 0 };
+    auto literal_operand = [&](size_t i, T& val) -> bool
+      {
+      e_opcode op = fused_operator(instructions[i].op);
+      val = op != instructions[i].op ? instructions[i].val : (i > 0 ? instructions[i - 1].val : (T)0);
+      return op != instructions[i].op || (i > 0 && instructions[i - 1].op == OP_VALUE);
+      };
+    // a right shift or an integer division by a literal, and floor and ceil, turn t into steps
+    auto quantizes = [&](size_t i) -> bool
+      {
+      T val;
+      bool literal = literal_operand(i, val);
+      switch (fused_operator(instructions[i].op))
+        {
+        case OP_RIGHT_SHIFT: return literal && val >= (T)1;
+        case OP_DIV: return literal && std::is_integral<T>::value && (val >= (T)2 || val <= (T)-2);
+        case OP_FLOOR:
+        case OP_CEIL: return std::is_floating_point<T>::value;
+        default: return false;
+        }
+      };
+    // the period of the step that quantizes makes of x, if x is t or t / d; the runs of an
+    // integer division start at the multiples of the divisor as long as t is not negative
+    auto step_period = [&](size_t i, const tracked& x) -> int64_t
+      {
+      T val;
+      bool literal = literal_operand(i, val);
+      switch (fused_operator(instructions[i].op))
+        {
+        case OP_RIGHT_SHIFT: return x.divisor == 1 && literal && val < (T)62 ? (int64_t)1 << (int64_t)val : 0;
+        case OP_DIV: return x.divisor == 1 && val >= (T)2 ? (int64_t)val : 0;
+        case OP_FLOOR: return x.divisor;
+        default: return 0;
+        }
+      };
+    // t divided by a literal whole number, before floor
+    auto divides_t = [&](size_t i, const tracked& x) -> int64_t
+      {
+      T val;
+      if (!std::is_floating_point<T>::value || x.divisor != 1 || fused_operator(instructions[i].op) != OP_DIV || !literal_operand(i, val))
+        return 0;
+      return val >= (T)1 && val <= (T)max_control_rate && val == std::floor(val) ? (int64_t)val : 0;
+      };
+    std::vector<int> outputs;
+    deps.reserve(instructions.size());
+    for (size_t i = 0; i < instructions.size(); ++i)
+      {
+      const Instruction& instr = instructions[i];
+      int consumed, produced;
+      stack_signature(instr.op, consumed, produced);
+      std::vector<tracked> in(st.end() - consumed, st.end());
+      st.resize(st.size() - consumed);
+      if (instr.op == OP_VALUE)
+        st.push_back(tracked{ DEP_SONG, 0, 0 });
+      else if (instr.op == OP_VARIABLE && assigned.count(instr.index))
+        st.push_back(assigned[instr.index]);
+      else if (instr.op == OP_VARIABLE)
+        st.push_back(instr.index == c_index ? tracked{ DEP_CHANNEL, 0, 0 } : (instr.index == t_index ? tracked{ DEP_SAMPLE, 0, 1 } : tracked{ DEP_SONG, 0, 0 }));
+      else if (instr.op == OP_ASSIGN)
+        assigned[instr.index] = in[0];
+      else if (shuffle(instr.op, outputs))
+        {
+        for (int j : outputs)
+          st.push_back(in[j]);
+        }
+      else if (instr.op == OP_PICK)
+        st.push_back(st[st.size() - 1 - (int)(int64_t)instructions[i - 1].val]);
+      else if (instr.op == OP_RETURN_STACK_PUSH)
+        rs.push_back(in[0]);
+      else if (instr.op == OP_RETURN_STACK_POP)
+        {
+        st.push_back(rs.empty() ? tracked{ DEP_CHANNEL, 0, 0 } : rs.back());
+        if (!rs.empty())
+          rs.pop_back();
+        }
+      else if (instr.op != OP_STORE)
+        {
+        // a delay line holds the past of the channel
+        tracked r = { instr.op == OP_FETCH ? memory : (has_state(instr.op) ? DEP_CHANNEL : DEP_SONG), 0, 0 };
+        // a value computed from steps changes where one of them changes, so its runs
+        // start at the multiples of the greatest common divisor of their periods
+        bool periodic = instr.op != OP_FETCH;
+        for (const tracked& x : in)
+          {
+          r.dep = std::max(r.dep, x.dep);
+          if (x.dep == DEP_STEP)
+            {
+            periodic = periodic && x.period > 0;
+            r.period = std::gcd(r.period, x.period);
+            }
+          }
+        if (r.dep == DEP_SAMPLE && quantizes(i))
+          {
+          r.dep = DEP_STEP;
+          r.period = in.empty() ? 0 : step_period(i, in[0]);
+          }
+        else if (r.dep == DEP_SAMPLE)
+          r.divisor = in.empty() ? 0 : divides_t(i, in[0]);
+        if (r.dep == DEP_STEP && !periodic)
+          r.period = 0;
+        st.push_back(r);
+        }
+      deps.push_back(st.empty() ? DEP_SONG : st.back().dep);
+      if (periods)
+        periods->push_back(st.empty() || st.back().dep != DEP_STEP ? 0 : st.back().period);
+      }
+    return deps;
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::run(const Bytecode& code)
+    {
+    // A program whose stack depth is static, and stays inside the ring from the stack pointer
+    // on, never wraps the stack pointer, so its pushes and pops need not check for that.
+    const StackEffect& effect = code.effect;
+    if (effect.is_static && stack_pointer + effect.min_depth >= 0 && stack_pointer + effect.max_depth < N)
+      _run<false>(code);
+    else
+      _run<true>(code);
+    }
+
+  template <class T, int N>
+  template <bool wrap>
+  void interpreter<T, N>::_run(const Bytecode& code)
+    {
+    // Same semantics as eval, but without the variant inspection and the call through
+    // a pointer to member. The stack pointer lives in a local during the loop.
+    T* st = stack.data();
+    int sp = stack_pointer;
+    T* memory = memory_stack.data();
+    const int memory_mask = (int)memory_stack.size() - 1;
+    auto pop_value = [&]() -> T
+      {
+      sp = wrap ? (sp ? sp - 1 : N - 1) : sp - 1;
+      return st[sp];
+      };
+    auto push_value = [&](T val)
+      {
+      st[sp] = val;
+      sp = wrap ? (sp == N - 1 ? 0 : sp + 1) : sp + 1;
+      };
+    auto top_value = [&]() -> T
+      {
+      return wrap ? (sp ? st[sp - 1] : st[N - 1]) : st[sp - 1];
+      };
+    auto second_value = [&]() -> T
+      {
+      return wrap ? (sp > 1 ? st[sp - 2] : st[sp + N - 2]) : st[sp - 2];
+      };
+    const Instruction* const ip_begin = code.instructions.data();
+    const Instruction* ip = ip_begin;
+    const Instruction* ip_end = ip + code.instructions.size();
+    const Instruction* return_addresses[max_call_depth];
+    int call_pointer = 0;
+#if defined(__GNUC__)
+    // Threaded dispatch: every handler jumps straight to the next one, which gives the
+    // branch predictor one indirect jump per opcode instead of a single shared one.
+#define FORTH_CASE(op) label_##op
+#define FORTH_NEXT if (++ip == ip_end) goto done; goto *dispatch_table[ip->op]
+    static const void* const dispatch_table[] = {
+      &&label_OP_VALUE,
+      &&label_OP_VARIABLE,
+      &&label_OP_ADD,
+      &&label_OP_SUB,
+      &&label_OP_MUL,
+      &&label_OP_DIV,
+      &&label_OP_LEFT_SHIFT,
+      &&label_OP_RIGHT_SHIFT,
+      &&label_OP_AND,
+      &&label_OP_OR,
+      &&label_OP_XOR,
+      &&label_OP_NOT,
+      &&label_OP_SIN,
+      &&label_OP_COS,
+      &&label_OP_MOD,
+      &&label_OP_LESS,
+      &&label_OP_GREATER,
+      &&label_OP_LEQ,
+      &&label_OP_GEQ,
+      &&label_OP_EQ,
+      &&label_OP_NEQ,
+      &&label_OP_DUP,
+      &&label_OP_PICK,
+      &&label_OP_DROP,
+      &&label_OP_2DUP,
+      &&label_OP_OVER,
+      &&label_OP_NIP,
+      &&label_OP_TUCK,
+      &&label_OP_SWAP,
+      &&label_OP_ROT,
+      &&label_OP_MROT,
+      &&label_OP_MIN,
+      &&label_OP_MAX,
+      &&label_OP_POW,
+      &&label_OP_ATAN2,
+      &&label_OP_NEGATE,
+      &&label_OP_TAN,
+      &&label_OP_LOG,
+      &&label_OP_EXP,
+      &&label_OP_SQRT,
+      &&label_OP_FLOOR,
+      &&label_OP_CEIL,
+      &&label_OP_ABS,
+      &&label_OP_OSC_SIN,
+      &&label_OP_OSC_SAW,
+      &&label_OP_OSC_SQUARE,
+      &&label_OP_FETCH,
+      &&label_OP_STORE,
+      &&label_OP_RETURN_STACK_PUSH,
+      &&label_OP_RETURN_STACK_POP,
+      &&label_OP_ASSIGN,
+      &&label_OP_DELAY,
+      &&label_OP_FEEDBACK,
+      &&label_OP_FILTER,
+      &&label_OP_FILTER_F,
+      &&label_OP_FILTER_FQ,
+      &&label_OP_ADD_VALUE,
+      &&label_OP_SUB_VALUE,
+      &&label_OP_MUL_VALUE,
+      &&label_OP_DIV_VALUE,
+      &&label_OP_MOD_VALUE,
+      &&label_OP_LEFT_SHIFT_VALUE,
+      &&label_OP_RIGHT_SHIFT_VALUE,
+      &&label_OP_AND_VALUE,
+      &&label_OP_OR_VALUE,
+      &&label_OP_XOR_VALUE,
+      &&label_OP_SQUARE,
+      &&label_OP_JUMP,
+      &&label_OP_JUMP_IF_ZERO,
+      &&label_OP_DO,
+      &&label_OP_LOOP,
+      &&label_OP_BEGIN,
+      &&label_OP_UNTIL,
+      &&label_OP_I,
+      &&label_OP_J,
+      &&label_OP_CALL,
+      &&label_OP_RETURN,
+      &&label_OP_MEMO,
+      &&label_OP_MEMO_STORE
+      };
+    static_assert(sizeof(dispatch_table) / sizeof(dispatch_table[0]) == OP_COUNT, "dispatch table does not match e_opcode");
+    if (ip == ip_end)
+      goto done;
+    goto *dispatch_table[ip->op];
+#else
+#define FORTH_CASE(op) case op
+#define FORTH_NEXT break
+    for (; ip != ip_end; ++ip)
+      {
+      switch (ip->op)
+        {
+#endif
+        FORTH_CASE(OP_VALUE): push_value(ip->val); FORTH_NEXT;
+        FORTH_CASE(OP_VARIABLE): push_value(globals[ip->index]); FORTH_NEXT;
+        FORTH_CASE(OP_ADD): { T b = pop_value(); T a = pop_value(); push_value(a + b); FORTH_NEXT; }
+        FORTH_CASE(OP_SUB): { T b = pop_value(); T a = pop_value(); push_value(a - b); FORTH_NEXT; }
+        FORTH_CASE(OP_MUL): { T b = pop_value(); T a = pop_value(); push_value(multiply(a, b)); FORTH_NEXT; }
+        FORTH_CASE(OP_DIV): { T b = pop_value(); T a = pop_value(); push_value(divide(a, b)); FORTH_NEXT; }
+        FORTH_CASE(OP_LEFT_SHIFT): { T b = pop_value(); T a = pop_value(); push_value(left_shift(a, b)); FORTH_NEXT; }
+        FORTH_CASE(OP_RIGHT_SHIFT): { T b = pop_value(); T a = pop_value(); push_value(right_shift(a, b)); FORTH_NEXT; }
+        FORTH_CASE(OP_AND): { T b = pop_value(); T a = pop_value(); push_value(binary_and(a, b)); FORTH_NEXT; }
+        FORTH_CASE(OP_OR): { T b = pop_value(); T a = pop_value(); push_value(binary_or(a, b)); FORTH_NEXT; }
+        FORTH_CASE(OP_XOR): { T b = pop_value(); T a = pop_value(); push_value(binary_xor(a, b)); FORTH_NEXT; }
+        FORTH_CASE(OP_NOT): { T a = pop_value(); push_value(not_value(a)); FORTH_NEXT; }
+        FORTH_CASE(OP_SIN): { T a = pop_value(); push_value((T)std::sin(a)); FORTH_NEXT; }
+        FORTH_CASE(OP_COS): { T a = pop_value(); push_value((T)std::cos(a)); FORTH_NEXT; }
+        FORTH_CASE(OP_MOD): { T b = pop_value(); T a = pop_value(); push_value(modulo(a, b)); FORTH_NEXT; }
+        FORTH_CASE(OP_LESS): { T b = pop_value(); T a = pop_value(); push_value(truth<T>(a < b)); FORTH_NEXT; }
+        FORTH_CASE(OP_GREATER): { T b = pop_value(); T a = pop_value(); push_value(truth<T>(a > b)); FORTH_NEXT; }
+        FORTH_CASE(OP_LEQ): { T b = pop_value(); T a = pop_value(); push_value(truth<T>(a <= b)); FORTH_NEXT; }
+        FORTH_CASE(OP_GEQ): { T b = pop_value(); T a = pop_value(); push_value(truth<T>(a >= b)); FORTH_NEXT; }
+        FORTH_CASE(OP_EQ): { T b = pop_value(); T a = pop_value(); push_value(truth<T>(a == b)); FORTH_NEXT; }
+        FORTH_CASE(OP_NEQ): { T b = pop_value(); T a = pop_value(); push_value(truth<T>(a != b)); FORTH_NEXT; }
+        FORTH_CASE(OP_DUP): { T a = top_value(); push_value(a); FORTH_NEXT; }
+        FORTH_CASE(OP_PICK):
+        {
+        T a = pop_value();
+        int64_t p = sp - (int64_t)a - 1;
+        while (p < 0)
+          p += N;
+        push_value(st[p % N]);
+        FORTH_NEXT;
+        }
+        FORTH_CASE(OP_DROP): { pop_value(); FORTH_NEXT; }
+        FORTH_CASE(OP_2DUP): { T a = top_value(); T b = second_value(); push_value(b); push_value(a); FORTH_NEXT; }
+        FORTH_CASE(OP_OVER): { T a = second_value(); push_value(a); FORTH_NEXT; }
+        FORTH_CASE(OP_NIP): { T a = pop_value(); st[wrap ? (sp ? sp - 1 : N - 1) : sp - 1] = a; FORTH_NEXT; }
+        FORTH_CASE(OP_TUCK): { T b = pop_value(); T a = pop_value(); push_value(b); push_value(a); push_value(b); FORTH_NEXT; }
+        FORTH_CASE(OP_SWAP): { T b = pop_value(); T a = pop_value(); push_value(b); push_value(a); FORTH_NEXT; }
+        FORTH_CASE(OP_ROT): { T c = pop_value(); T b = pop_value(); T a = pop_value(); push_value(b); push_value(c); push_value(a); FORTH_NEXT; }
+        FORTH_CASE(OP_MROT): { T c = pop_value(); T b = pop_value(); T a = pop_value(); push_value(c); push_value(a); push_value(b); FORTH_NEXT; }
+        FORTH_CASE(OP_MIN): { T b = pop_value(); T a = pop_value(); push_value(a < b ? a : b); FORTH_NEXT; }
+        FORTH_CASE(OP_MAX): { T b = pop_value(); T a = pop_value(); push_value(a > b ? a : b); FORTH_NEXT; }
+        FORTH_CASE(OP_POW): { T b = pop_value(); T a = pop_value(); push_value((T)std::pow(a, b)); FORTH_NEXT; }
+        FORTH_CASE(OP_ATAN2): { T b = pop_value(); T a = pop_value(); push_value((T)std::atan2(a, b)); FORTH_NEXT; }
+        FORTH_CASE(OP_NEGATE): { T a = pop_value(); push_value((T)-a); FORTH_NEXT; }
+        FORTH_CASE(OP_TAN): { T a = pop_value(); push_value((T)std::tan(a)); FORTH_NEXT; }
+        FORTH_CASE(OP_LOG): { T a = pop_value(); push_value((T)std::log(a)); FORTH_NEXT; }
+        FORTH_CASE(OP_EXP): { T a = pop_value(); push_value((T)std::exp(a)); FORTH_NEXT; }
+        FORTH_CASE(OP_SQRT): { T a = pop_value(); push_value((T)std::sqrt(a)); FORTH_NEXT; }
+        FORTH_CASE(OP_FLOOR): { T a = pop_value(); push_value((T)std::floor(a)); FORTH_NEXT; }
+        FORTH_CASE(OP_CEIL): { T a = pop_value(); push_value((T)std::ceil(a)); FORTH_NEXT; }
+        FORTH_CASE(OP_ABS): { T a = pop_value(); push_value((T)std::abs(a)); FORTH_NEXT; }
+        FORTH_CASE(OP_OSC_SIN): { T a = pop_value(); push_value(oscillator(WAVE_SIN, a)); FORTH_NEXT; }
+        FORTH_CASE(OP_OSC_SAW): { T a = pop_value(); push_value(oscillator(WAVE_SAW, a)); FORTH_NEXT; }
+        FORTH_CASE(OP_OSC_SQUARE): { T a = pop_value(); push_value(oscillator(WAVE_SQUARE, a)); FORTH_NEXT; }
+        FORTH_CASE(OP_FETCH): { T a = pop_value(); push_value(memory[((int)a) & memory_mask]); FORTH_NEXT; }
+        FORTH_CASE(OP_STORE): { T b = pop_value(); T a = pop_value(); memory[((int)b) & memory_mask] = a; FORTH_NEXT; }
+        FORTH_CASE(OP_RETURN_STACK_PUSH):
+        {
+        return_stack[return_stack_pointer] = pop_value();
+        ++return_stack_pointer;
+        if (return_stack_pointer >= N)
+          return_stack_pointer = 0;
+        FORTH_NEXT;
+        }
+        FORTH_CASE(OP_RETURN_STACK_POP):
+        {
+        --return_stack_pointer;
+        if (return_stack_pointer < 0)
+          return_stack_pointer = N - 1;
+        push_value(return_stack[return_stack_pointer]);
+        FORTH_NEXT;
+        }
+        FORTH_CASE(OP_ASSIGN): globals[ip->index] = pop_value(); FORTH_NEXT;
+        FORTH_CASE(OP_DELAY): { T b = pop_value(); T a = pop_value(); push_value(_delay(delay_lines[ip->index], OP_DELAY, a, b, (T)0)); FORTH_NEXT; }
+        FORTH_CASE(OP_FEEDBACK): { T c = pop_value(); T b = pop_value(); T a = pop_value(); push_value(_delay(delay_lines[ip->index], OP_FEEDBACK, a, b, c)); FORTH_NEXT; }
+        FORTH_CASE(OP_FILTER): { T a = pop_value(); push_value(_filter(filters[ip->index], OP_FILTER, a, (T)0, (T)0)); FORTH_NEXT; }
+        FORTH_CASE(OP_FILTER_F): { T b = pop_value(); T a = pop_value(); push_value(_filter(filters[ip->index], OP_FILTER_F, a, b, (T)0)); FORTH_NEXT; }
+        FORTH_CASE(OP_FILTER_FQ): { T c = pop_value(); T b = pop_value(); T a = pop_value(); push_value(_filter(filters[ip->index], OP_FILTER_FQ, a, b, c)); FORTH_NEXT; }
+        FORTH_CASE(OP_ADD_VALUE): { T a = pop_value(); push_value(a + ip->val); FORTH_NEXT; }
+        FORTH_CASE(OP_SUB_VALUE): { T a = pop_value(); push_value(a - ip->val); FORTH_NEXT; }
+        FORTH_CASE(OP_MUL_VALUE): { T a = pop_value(); push_value(multiply(a, ip->val)); FORTH_NEXT; }
+        FORTH_CASE(OP_DIV_VALUE):
+        {
+        T a = pop_value();
+        push_value(ip->index >= 0 ? (T)code.divisors[ip->index].quotient((int64_t)a) : divide(a, ip->val));
+        FORTH_NEXT;
+        }
+        FORTH_CASE(OP_MOD_VALUE):
+        {
+        T a = pop_value();
+        push_value(ip->index >= 0 ? (T)code.divisors[ip->index].remainder((int64_t)a) : modulo(a, ip->val));
+        FORTH_NEXT;
+        }
+        FORTH_CASE(OP_LEFT_SHIFT_VALUE): { T a = pop_value(); push_value(left_shift(a, ip->val)); FORTH_NEXT; }
+        FORTH_CASE(OP_RIGHT_SHIFT_VALUE): { T a = pop_value(); push_value(right_shift(a, ip->val)); FORTH_NEXT; }
+        FORTH_CASE(OP_AND_VALUE): { T a = pop_value(); push_value(binary_and(a, ip->val)); FORTH_NEXT; }
+        FORTH_CASE(OP_OR_VALUE): { T a = pop_value(); push_value(binary_or(a, ip->val)); FORTH_NEXT; }
+        FORTH_CASE(OP_XOR_VALUE): { T a = pop_value(); push_value(binary_xor(a, ip->val)); FORTH_NEXT; }
+        FORTH_CASE(OP_SQUARE): { T a = pop_value(); push_value(multiply(a, a)); FORTH_NEXT; }
+        // a jump goes to the instruction before its target, as FORTH_NEXT steps over it,
+        // which is fine as a target is never the first instruction
+        FORTH_CASE(OP_JUMP): { ip = ip_begin + (ip->index - 1); FORTH_NEXT; }
+        FORTH_CASE(OP_JUMP_IF_ZERO):
+        {
+        T a = pop_value();
+        if (a == (T)0)
+          ip = ip_begin + (ip->index - 1);
+        FORTH_NEXT;
+        }
+        FORTH_CASE(OP_DO): { loop_counters[loop_pointer++] = (int64_t)ip->val; FORTH_NEXT; }
+        FORTH_CASE(OP_LOOP):
+        {
+        if (++loop_counters[loop_pointer - 1] < (int64_t)ip->val)
+          ip = ip_begin + (ip->index - 1);
+        else
+          --loop_pointer;
+        FORTH_NEXT;
+        }
+        FORTH_CASE(OP_BEGIN): { loop_counters[loop_pointer++] = 0; FORTH_NEXT; }
+        FORTH_CASE(OP_UNTIL):
+        {
+        T a = pop_value();
+        if (a == (T)0 && ++loop_counters[loop_pointer - 1] < (int64_t)ip->val)
+          ip = ip_begin + (ip->index - 1);
+        else
+          --loop_pointer;
+        FORTH_NEXT;
+        }
+        FORTH_CASE(OP_I): { push_value((T)loop_counters[loop_pointer - 1]); FORTH_NEXT; }
+        FORTH_CASE(OP_J): { push_value((T)loop_counters[loop_pointer - 2]); FORTH_NEXT; }
+        FORTH_CASE(OP_CALL):
+        {
+        return_addresses[call_pointer++] = ip;
+        ip = ip_begin + (ip->index - 1);
+        FORTH_NEXT;
+        }
+        // the return that ends the program goes to the last instruction, where FORTH_NEXT stops
+        FORTH_CASE(OP_RETURN): { ip = call_pointer ? return_addresses[--call_pointer] : ip_end - 1; FORTH_NEXT; }
+        FORTH_CASE(OP_MEMO):
+        {
+        // on a hit, replace the inputs by the outputs and skip the call and OP_MEMO_STORE
+        Memo& m = memos[ip->index];
+        if (const T* outputs = _memo_find(m, st, sp))
+          {
+          sp = (sp + N - m.inputs) % N;
+          for (int k = 0; k < m.outputs; ++k)
+            push_value(outputs[k]);
+          ip += 2;
+          }
+        FORTH_NEXT;
+        }
+        FORTH_CASE(OP_MEMO_STORE): { _memo_store(memos[ip->index], st, sp); FORTH_NEXT; }
+#if defined(__GNUC__)
+    done:
+#else
+        }
+      }
+#endif
+#undef FORTH_CASE
+#undef FORTH_NEXT
+    stack_pointer = sp;
+    }
+  template <class T, int N>
+  void interpreter<T, N>::eval_block(const Bytecode& code, int64_t t0, int count, int channel, T* out)
+    {
+    auto it_t = variables.find("t");
+    auto it_c = variables.find("c");
+    int t_index = it_t == variables.end() ? -1 : it_t->second;
+    int c_index = it_c == variables.end() ? -1 : it_c->second;
+    if (c_index >= 0)
+      globals[c_index] = (T)channel;
+    if (!code.runs_in_lanes())
+      {
+      for (int k = 0; k < count; ++k)
+        {
+        if (t_index >= 0)
+          globals[t_index] = (T)(t0 + k);
+        run(code);
+        out[k] = pop();
+        }
+      return;
+      }
+    for (int offset = 0; offset < count; offset += block_size)
+      {
+      int lanes = std::min(block_size, count - offset);
+      _eval_lanes(code, t0 + offset, lanes, t_index, -1, out + offset, nullptr);
+      }
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::eval_block_stereo(const Bytecode& code, int64_t t0, int count, T* left, T* right)
+    {
+    auto it_t = variables.find("t");
+    auto it_c = variables.find("c");
+    int t_index = it_t == variables.end() ? -1 : it_t->second;
+    int c_index = it_c == variables.end() ? -1 : it_c->second;
+    if (!code.runs_in_lanes())
+      {
+      for (int k = 0; k < count; ++k)
+        {
+        if (t_index >= 0)
+          globals[t_index] = (T)(t0 + k);
+        for (int channel = 0; channel < 2; ++channel)
+          {
+          if (c_index >= 0)
+            globals[c_index] = (T)channel;
+          run(code);
+          (channel ? right : left)[k] = pop();
+          }
+        }
+      return;
+      }
+    for (int offset = 0; offset < count; offset += block_size)
+      {
+      int lanes = std::min(block_size, count - offset);
+      _eval_lanes(code, t0 + offset, lanes, t_index, c_index, left + offset, right + offset);
+      }
+    if (c_index >= 0)
+      globals[c_index] = (T)1;
+    }
+
+  template <class T, int N>
+  void interpreter<T, N>::_eval_lanes(const Bytecode& code, int64_t t0, int lanes, int t_index, int c_index, T* left, T* right)
+    {
+    // Every position on the stack is a row of block_size lanes, one lane per sample.
+    // Rows are reference counted, so that dup, swap, rot, pick, >r and friends only
+    // shuffle row indices, and arithmetic overwrites its operand row when nobody else
+    // refers to it.
+    // When right is given, both channels are evaluated at once. Only the values that depend
+    // on c (see Bytecode::dependencies) get a row per channel, the others are computed once
+    // and shared. Values that depend on the song only are computed on the first lane and
+    // copied to the others.
+    // A global that to assigns keeps the entry that it got, which later reads share.
+    // A value that is held over runs of lanes, and a value that is the same for all lanes, only
+    // gets the first lane of each run written, until something needs all lanes of it.
+    const int channels = right ? 2 : 1;
+    const int assignments = (int)std::count_if(code.instructions.begin(), code.instructions.end(), [](const Instruction& instr) { return instr.op == OP_ASSIGN; });
+    const int rows = channels * (code.effect.max_depth + code.effect.max_return_depth + assignments + 2);
+    if ((int)lane_row_refs.size() < rows)
+      {
+      lane_rows.resize((size_t)rows * block_size);
+      lane_row_refs.resize(rows);
+      lane_row_periods.resize(rows);
+      free_lane_rows.reserve(rows);
+      data_lane_rows.reserve(rows);
+      return_lane_rows.reserve(rows);
+      }
+    free_lane_rows.clear();
+    for (int r = rows - 1; r >= 0; --r)
+      {
+      lane_row_refs[r] = 0;
+      free_lane_rows.push_back(r);
+      }
+    data_lane_rows.clear();
+    return_lane_rows.clear();
+    global_lane_rows.clear();
+
+    auto row = [&](int r) -> T*
+      {
+      return lane_rows.data() + (size_t)r * block_size;
+      };
+    auto new_row = [&]() -> int
+      {
+      int r = free_lane_rows.back();
+      free_lane_rows.pop_back();
+      lane_row_refs[r] = 1;
+      lane_row_periods[r] = 0;
+      return r;
+      };
+    auto release_row = [&](int r)
+      {
+      if (--lane_row_refs[r] == 0)
+        free_lane_rows.push_back(r);
+      };
+    auto release = [&](const lane_entry& e)
+      {
+      release_row(e.row[0]);
+      if (e.row[1] != e.row[0])
+        release_row(e.row[1]);
+      };
+    auto share = [&](const lane_entry& e) -> lane_entry
+      {
+      ++lane_row_refs[e.row[0]];
+      if (e.row[1] != e.row[0])
+        ++lane_row_refs[e.row[1]];
+      return e;
+      };
+    auto single = [](int r) -> lane_entry
+      {
+      lane_entry e;
+      e.row[0] = e.row[1] = r;
+      return e;
+      };
+    auto pop_row = [&]() -> lane_entry
+      {
+      lane_entry e = data_lane_rows.back();
+      data_lane_rows.pop_back();
+      return e;
+      };
+    // the runs are counted from t = 0, so a row is only held if t0 is not negative
+    const int64_t whole_block = std::numeric_limits<int64_t>::max();
+    auto fill_row = [&](int r, T val)
+      {
+      T* pr = row(r);
+      pr[0] = val;
+      if (t0 >= 0)
+        lane_row_periods[r] = whole_block;
+      else
+        for (int k = 1; k < lanes; ++k)
+          pr[k] = val;
+      };
+    // lane k of a row, which is the first lane of its run if the row is held
+    auto lane = [&](int r, int k) -> T
+      {
+      const int64_t p = lane_row_periods[r];
+      if (p == 0 || p == whole_block)
+        return row(r)[p ? 0 : k];
+      return row(r)[std::max<int64_t>(0, k - (t0 + k) % p)];
+      };
+    auto expand_row = [&](int r)
+      {
+      const int64_t p = lane_row_periods[r];
+      if (!p)
+        return;
+      T* pr = row(r);
+      int k = 0;
+      while (k < lanes)
+        {
+        const int end = (int)std::min<int64_t>(lanes, k + p - (t0 + k) % p);
+        std::fill(pr + k + 1, pr + end, pr[k]);
+        k = end;
+        }
+      lane_row_periods[r] = 0;
+      };
+    auto expand = [&](const lane_entry& e)
+      {
+      expand_row(e.row[0]);
+      expand_row(e.row[1]);
+      };
+    auto fill = [&](T val)
+      {
+      int r = new_row();
+      fill_row(r, val);
+      data_lane_rows.push_back(single(r));
+      };
+    // the row that channel c of the result goes to: an operand row that is not needed anymore,
+    // or a new one. A row that both channels share is still needed until the last channel.
+    auto result_row = [&](const lane_entry& a, int c, int last) -> int
+      {
+      if (lane_row_refs[a.row[c]] == 1 && (a.row[0] != a.row[1] || c == last))
+        return a.row[c];
+      return -1;
+      };
+    auto finish = [&](lane_entry& r, bool split, std::initializer_list<lane_entry> operands)
+      {
+      if (!split)
+        r.row[1] = r.row[0];
+      for (const lane_entry& a : operands)
+        for (int c = 0; c < 2; ++c)
+          {
+          if (c == 1 && a.row[1] == a.row[0])
+            break;
+          if (a.row[c] != r.row[0] && a.row[c] != r.row[1])
+            release_row(a.row[c]);
+          }
+      data_lane_rows.push_back(r);
+      };
+    // what the value that the current instruction computes depends on
+    e_dependency dep = DEP_CHANNEL;
+    const bool analysed = code.dependencies.size() == code.instructions.size();
+    // A step value whose runs start at the multiples of period, like the values of a k: word,
+    // is computed for the first lane of each run in the block only. Short runs are left to the
+    // kernels, which compute all lanes faster than this steps from run to run.
+    const int64_t min_held_period = 16;
+    int64_t period = 0;
+    auto held = [&](int r, int a, int b, auto f) -> bool
+      {
+      if (period < min_held_period || t0 < 0)
+        return false;
+      // from the last run to the first, as r can be the row of an operand that holds longer
+      // runs, whose first lanes lie at or before the lanes that are written
+      T* pr = row(r);
+      // an operand with the same runs has its first lanes where they are written
+      auto first_lane = [&](int x, int k) -> T
+        {
+        return lane_row_periods[x] == period ? row(x)[k] : lane(x, k);
+        };
+      int k = (int)std::max<int64_t>(0, lanes - 1 - (t0 + lanes - 1) % period);
+      for (;;)
+        {
+        pr[k] = f(first_lane(a, k), first_lane(b, k));
+        if (k == 0)
+          break;
+        k = (int)std::max<int64_t>(0, k - period);
+        }
+      lane_row_periods[r] = period;
+      return true;
+      };
+    // A memoized operator calls f once per run of equal operands, carrying the last run over
+    // from the previous block. Where a vectorized kernel exists it is only skipped if the
+    // operands change in a few lanes. Returns false if the operator should not be memoized.
+    bool memo = false;
+    if (lane_memos.size() < code.instructions.size())
+      lane_memos.resize(code.instructions.size(), lane_memo{ OP_COUNT, (T)0, (T)0, (T)0 });
+    lane_memo* m = nullptr;
+    auto memoized = [&](e_opcode op, int operands, T* pr, const T* pa, const T* pb, auto f) -> bool
+      {
+      if (!memo)
+        return false;
+      if (kernels && (operands == 1 ? kernels->unary[op] != nullptr : kernels->binary[op] != nullptr))
+        {
+        int changes = 0;
+        for (int k = 1; k < lanes; ++k)
+          changes += !same_bits(pa[k], pa[k - 1]) || !same_bits(pb[k], pb[k - 1]);
+        if (changes * 8 > lanes)
+          return false;
+        }
+      if (m->op != op)
+        {
+        m->op = op;
+        m->a = pa[0];
+        m->b = pb[0];
+        m->r = f(pa[0], pb[0]);
+        }
+      for (int k = 0; k < lanes; ++k)
+        {
+        if (!same_bits(pa[k], m->a) || !same_bits(pb[k], m->b))
+          {
+          m->a = pa[k];
+          m->b = pb[k];
+          m->r = f(pa[k], pb[k]);
+          }
+        pr[k] = m->r;
+        }
+      return true;
+      };
+    auto unary = [&](e_opcode op, auto f)
+      {
+      lane_entry a = pop_row();
+      bool split = channels == 2 && dep == DEP_CHANNEL;
+      lane_entry r;
+      for (int c = 0; c < (split ? 2 : 1); ++c)
+        {
+        int x = result_row(a, c, split ? 1 : 0);
+        r.row[c] = x >= 0 ? x : new_row();
+        const T* pa = row(a.row[c]);
+        T* pr = row(r.row[c]);
+        if (dep == DEP_SONG)
+          {
+          fill_row(r.row[c], f(pa[0]));
+          continue;
+          }
+        if (held(r.row[c], a.row[c], a.row[c], [&f](T x, T) { return f(x); }))
+          continue;
+        expand_row(a.row[c]);
+        if (memoized(op, 1, pr, pa, pa, [&f](T x, T) { return f(x); }))
+          continue;
+        else if (kernels && kernels->unary[op])
+          kernels->unary[op](pr, pa, lanes);
+        else
+          for (int k = 0; k < lanes; ++k)
+            pr[k] = f(pa[k]);
+        }
+      finish(r, split, { a });
+      };
+    auto binary = [&](e_opcode op, auto f)
+      {
+      lane_entry b = pop_row();
+      lane_entry a = pop_row();
+      bool split = channels == 2 && dep == DEP_CHANNEL;
+      lane_entry r;
+      for (int c = 0; c < (split ? 2 : 1); ++c)
+        {
+        int x = result_row(a, c, split ? 1 : 0);
+        if (x < 0)
+          x = result_row(b, c, split ? 1 : 0);
+        r.row[c] = x >= 0 ? x : new_row();
+        const T* pa = row(a.row[c]);
+        const T* pb = row(b.row[c]);
+        T* pr = row(r.row[c]);
+        if (dep == DEP_SONG)
+          {
+          fill_row(r.row[c], f(pa[0], pb[0]));
+          continue;
+          }
+        if (held(r.row[c], a.row[c], b.row[c], f))
+          continue;
+        expand_row(a.row[c]);
+        expand_row(b.row[c]);
+        if (memoized(op, 2, pr, pa, pb, f))
+          continue;
+        else if (kernels && kernels->binary[op])
+          kernels->binary[op](pr, pa, pb, lanes);
+        else
+          for (int k = 0; k < lanes; ++k)
+            pr[k] = f(pa[k], pb[k]);
+        }
+      finish(r, split, { a, b });
+      };
+
+    const Instruction* first = code.instructions.data();
+    const Instruction* ip_end = first + code.instructions.size() - code.filter_tail;
+    for (const Instruction* ip = first; ip != ip_end; ++ip)
+      {
+      if (analysed)
+        {
+        dep = code.dependencies[ip - first];
+        period = code.periods.size() == code.instructions.size() ? code.periods[ip - first] : 0;
+        memo = memoize && is_memoized(ip->op, dep);
+        m = &lane_memos[ip - first];
+        }
+      switch (ip->op)
+        {
+        case OP_VALUE: fill(ip->val); break;
+        case OP_VARIABLE:
+        {
+        auto assigned = std::find_if(global_lane_rows.begin(), global_lane_rows.end(), [ip](const std::pair<int, lane_entry>& g) { return g.first == ip->index; });
+        if (assigned != global_lane_rows.end())
+          data_lane_rows.push_back(share(assigned->second));
+        else if (ip->index == t_index)
+          {
+          int r = new_row();
+          T* pr = row(r);
+          for (int k = 0; k < lanes; ++k)
+            pr[k] = (T)(t0 + k);
+          data_lane_rows.push_back(single(r));
+          }
+        else if (ip->index == c_index)
+          {
+          lane_entry e;
+          for (int c = 0; c < 2; ++c)
+            {
+            e.row[c] = new_row();
+            fill_row(e.row[c], (T)c);
+            }
+          data_lane_rows.push_back(e);
+          }
+        else
+          fill(globals[ip->index]);
+        break;
+        }
+        case OP_ADD: binary(OP_ADD, [](T a, T b) { return a + b; }); break;
+        case OP_SUB: binary(OP_SUB, [](T a, T b) { return a - b; }); break;
+        case OP_MUL: binary(OP_MUL, [](T a, T b) { return multiply(a, b); }); break;
+        case OP_DIV: binary(OP_DIV, [](T a, T b) { return divide(a, b); }); break;
+        case OP_LEFT_SHIFT: binary(OP_LEFT_SHIFT, [](T a, T b) { return left_shift(a, b); }); break;
+        case OP_RIGHT_SHIFT: binary(OP_RIGHT_SHIFT, [](T a, T b) { return right_shift(a, b); }); break;
+        case OP_AND: binary(OP_AND, [](T a, T b) { return binary_and(a, b); }); break;
+        case OP_OR: binary(OP_OR, [](T a, T b) { return binary_or(a, b); }); break;
+        case OP_XOR: binary(OP_XOR, [](T a, T b) { return binary_xor(a, b); }); break;
+        case OP_NOT: unary(OP_NOT, [](T a) { return not_value(a); }); break;
+        case OP_SIN: unary(OP_SIN, [](T a) { return (T)std::sin(a); }); break;
+        case OP_COS: unary(OP_COS, [](T a) { return (T)std::cos(a); }); break;
+        case OP_MOD: binary(OP_MOD, [](T a, T b) { return modulo(a, b); }); break;
+        case OP_LESS: binary(OP_LESS, [](T a, T b) { return truth<T>(a < b); }); break;
+        case OP_GREATER: binary(OP_GREATER, [](T a, T b) { return truth<T>(a > b); }); break;
+        case OP_LEQ: binary(OP_LEQ, [](T a, T b) { return truth<T>(a <= b); }); break;
+        case OP_GEQ: binary(OP_GEQ, [](T a, T b) { return truth<T>(a >= b); }); break;
+        case OP_EQ: binary(OP_EQ, [](T a, T b) { return truth<T>(a == b); }); break;
+        case OP_NEQ: binary(OP_NEQ, [](T a, T b) { return truth<T>(a != b); }); break;
+        case OP_DUP: data_lane_rows.push_back(share(data_lane_rows.back())); break;
+        case OP_PICK:
+        {
+        int k = (int)(int64_t)(ip - 1)->val;
+        release(pop_row());
+        data_lane_rows.push_back(share(data_lane_rows[data_lane_rows.size() - 1 - k]));
+        break;
+        }
+        case OP_DROP: release(pop_row()); break;
+        case OP_2DUP:
+        {
+        lane_entry a = data_lane_rows[data_lane_rows.size() - 1];
+        lane_entry b = data_lane_rows[data_lane_rows.size() - 2];
+        data_lane_rows.push_back(share(b));
+        data_lane_rows.push_back(share(a));
+        break;
+        }
+        case OP_OVER: data_lane_rows.push_back(share(data_lane_rows[data_lane_rows.size() - 2])); break;
+        case OP_NIP:
+        {
+        lane_entry b = pop_row();
+        release(pop_row());
+        data_lane_rows.push_back(b);
+        break;
+        }
+        case OP_TUCK:
+        {
+        lane_entry b = pop_row();
+        lane_entry a = pop_row();
+        data_lane_rows.push_back(b);
+        data_lane_rows.push_back(a);
+        data_lane_rows.push_back(share(b));
+        break;
+        }
+        case OP_SWAP:
+        {
+        lane_entry b = pop_row();
+        lane_entry a = pop_row();
+        data_lane_rows.push_back(b);
+        data_lane_rows.push_back(a);
+        break;
+        }
+        case OP_ROT:
+        {
+        lane_entry c = pop_row();
+        lane_entry b = pop_row();
+        lane_entry a = pop_row();
+        data_lane_rows.push_back(b);
+        data_lane_rows.push_back(c);
+        data_lane_rows.push_back(a);
+        break;
+        }
+        case OP_MROT:
+        {
+        lane_entry c = pop_row();
+        lane_entry b = pop_row();
+        lane_entry a = pop_row();
+        data_lane_rows.push_back(c);
+        data_lane_rows.push_back(a);
+        data_lane_rows.push_back(b);
+        break;
+        }
+        case OP_MIN: binary(OP_MIN, [](T a, T b) { return a < b ? a : b; }); break;
+        case OP_MAX: binary(OP_MAX, [](T a, T b) { return a > b ? a : b; }); break;
+        case OP_POW: binary(OP_POW, [](T a, T b) { return (T)std::pow(a, b); }); break;
+        case OP_ATAN2: binary(OP_ATAN2, [](T a, T b) { return (T)std::atan2(a, b); }); break;
+        case OP_NEGATE: unary(OP_NEGATE, [](T a) { return (T)-a; }); break;
+        case OP_TAN: unary(OP_TAN, [](T a) { return (T)std::tan(a); }); break;
+        case OP_LOG: unary(OP_LOG, [](T a) { return (T)std::log(a); }); break;
+        case OP_EXP: unary(OP_EXP, [](T a) { return (T)std::exp(a); }); break;
+        case OP_SQRT: unary(OP_SQRT, [](T a) { return (T)std::sqrt(a); }); break;
+        case OP_FLOOR: unary(OP_FLOOR, [](T a) { return (T)std::floor(a); }); break;
+        case OP_CEIL: unary(OP_CEIL, [](T a) { return (T)std::ceil(a); }); break;
+        case OP_ABS: unary(OP_ABS, [](T a) { return (T)std::abs(a); }); break;
+        case OP_OSC_SIN: unary(OP_OSC_SIN, [](T a) { return oscillator(WAVE_SIN, a); }); break;
+        case OP_OSC_SAW: unary(OP_OSC_SAW, [](T a) { return oscillator(WAVE_SAW, a); }); break;
+        case OP_OSC_SQUARE: unary(OP_OSC_SQUARE, [](T a) { return oscillator(WAVE_SQUARE, a); }); break;
+        case OP_FETCH: unary(OP_FETCH, [this](T a) { return memory_stack[((int)a) & ((int)memory_stack.size() - 1)]; }); break;
+        case OP_RETURN_STACK_PUSH: return_lane_rows.push_back(pop_row()); break;
+        case OP_RETURN_STACK_POP:
+        {
+        data_lane_rows.push_back(return_lane_rows.back());
+        return_lane_rows.pop_back();
+        break;
+        }
+        case OP_SQUARE:
+        {
+        data_lane_rows.push_back(share(data_lane_rows.back()));
+        binary(OP_MUL, [](T a, T b) { return multiply(a, b); });
+        break;
+        }
+        case OP_ADD_VALUE:
+        case OP_SUB_VALUE:
+        case OP_MUL_VALUE:
+        case OP_DIV_VALUE:
+        case OP_MOD_VALUE:
+        case OP_LEFT_SHIFT_VALUE:
+        case OP_RIGHT_SHIFT_VALUE:
+        case OP_AND_VALUE:
+        case OP_OR_VALUE:
+        case OP_XOR_VALUE:
+        {
+        if ((ip->op == OP_DIV_VALUE || ip->op == OP_MOD_VALUE) && ip->index >= 0)
+          {
+          const constant_divisor& divisor = code.divisors[ip->index];
+          if (ip->op == OP_DIV_VALUE)
+            unary(ip->op, [&divisor](T a) { return (T)divisor.quotient((int64_t)a); });
+          else
+            unary(ip->op, [&divisor](T a) { return (T)divisor.remainder((int64_t)a); });
+          break;
+          }
+        e_opcode op = fused_operator(ip->op);
+        fill(ip->val);
+        binary(op, [op](T a, T b) { return binary_value(op, a, b); });
+        break;
+        }
+        case OP_ASSIGN:
+        {
+        lane_entry e = pop_row();
+        auto assigned = std::find_if(global_lane_rows.begin(), global_lane_rows.end(), [ip](const std::pair<int, lane_entry>& g) { return g.first == ip->index; });
+        if (assigned == global_lane_rows.end())
+          global_lane_rows.push_back(std::make_pair(ip->index, e));
+        else
+          {
+          release(assigned->second);
+          assigned->second = e;
+          }
+        break;
+        }
+        default: break; // OP_STORE, delay lines and control flow never get here, see StackEffect::lanes_are_independent
+        }
+      }
+
+    lane_entry result = pop_row();
+    expand(result);
+    for (int c = 0; c < channels; ++c)
+      {
+      const T* pr = row(result.row[c]);
+      T* out = c ? right : left;
+      for (int k = 0; k < lanes; ++k)
+        out[k] = pr[k];
+      }
+    for (size_t i = code.instructions.size() - code.filter_tail; i < code.instructions.size(); ++i)
+      _filter_block(filters[code.instructions[i].index], left, right, lanes);
+
+    // leave the stack as if the samples had been evaluated one after the other
+    for (const lane_entry& e : data_lane_rows)
+      expand(e);
+    for (int k = 0; k < lanes; ++k)
+      for (int c = 0; c < channels; ++c)
+        for (const lane_entry& e : data_lane_rows)
+          push(row(e.row[c])[k]);
+    for (const auto& g : global_lane_rows)
+      globals[g.first] = lane(g.second.row[channels - 1], lanes - 1);
+    if (t_index >= 0)
+      globals[t_index] = (T)(t0 + lanes - 1);
+    }
+
   } // namespace forth
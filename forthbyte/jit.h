@@ -0,0 +1,1692 @@
+#pragma once
+
+#include "cse.h"
+#include "forth.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <initializer_list>
+#include <map>
+#include <stdint.h>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/*
+x86-64 native code generation for interpreter::Bytecode.
+
+The generated code has exactly the same effect on the interpreter as interpreter::run, including
+the values that run leaves behind in the ring buffer above the stack pointer, so that songs that
+pick into old stack values sound the same. The depth of the stack is known at compile time for
+every instruction, so stack entries are kept in registers and are only written to the ring
+buffer when the interpreter would be able to observe them: at the end of the program, or before
+a pick with an index that is not a literal. >r and r> use the return stack in memory. A global
+that to assigns is read as the value that it got, and is only written at the end.
+
+Common subexpressions are numbered with an expression_table (cse.h) before code is generated. An
+operator whose value was computed before is not evaluated again: the earlier value is kept alive,
+in a register or a spill slot, until its last reuse.
+
+The expensive operators that is_memoized selects keep their last operands and result in spill
+slots. The code compares the bits of the operands with the last ones, and only calls the function
+when they differ.
+*/
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define FORTH_JIT_X64
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <intrin.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#endif
+
+namespace forth
+  {
+
+  // the data the generated code works on, filled in by jit::run
+  template <class T>
+  struct jit_context
+    {
+    T* stack;
+    T* globals;
+    T* memory;
+    int64_t memory_mask;
+    T* return_stack;
+    int64_t stack_pointer;
+    int64_t return_stack_pointer;
+    T* spill;
+    };
+
+#if defined(FORTH_JIT_X64)
+  namespace x64
+    {
+
+    enum e_register { rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi, r8, r9, r10, r11, r12, r13, r14, r15 };
+
+    enum e_condition { cc_e = 0x4, cc_ne = 0x5, cc_s = 0x8, cc_l = 0xC, cc_ge = 0xD, cc_le = 0xE, cc_g = 0xF };
+
+    // [base + 8*index + disp], without index if index < 0
+    struct memory_operand
+      {
+      int base;
+      int index;
+      int32_t disp;
+      };
+
+    inline memory_operand mem(int base, int32_t disp)
+      {
+      return memory_operand{ base, -1, disp };
+      }
+
+    inline memory_operand mem(int base, int index, int32_t disp)
+      {
+      return memory_operand{ base, index, disp };
+      }
+
+    class emitter
+      {
+      public:
+        std::vector<uint8_t> code;
+
+        void byte(uint8_t b)
+          {
+          code.push_back(b);
+          }
+
+        void dword(uint32_t d)
+          {
+          for (int i = 0; i < 4; ++i)
+            byte((uint8_t)(d >> (8 * i)));
+          }
+
+        void qword(uint64_t q)
+          {
+          for (int i = 0; i < 8; ++i)
+            byte((uint8_t)(q >> (8 * i)));
+          }
+
+        // [prefix] [rex] opcode modrm, with a register operand in rm
+        void rr(uint8_t prefix, bool w, std::initializer_list<uint8_t> opcode, int reg, int rm)
+          {
+          if (prefix)
+            byte(prefix);
+          uint8_t rex = (uint8_t)(0x40 | (w ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0));
+          if (rex != 0x40)
+            byte(rex);
+          for (auto b : opcode)
+            byte(b);
+          byte((uint8_t)(0xC0 | ((reg & 7) << 3) | (rm & 7)));
+          }
+
+        // [prefix] [rex] opcode modrm [sib] disp32, with a memory operand in rm
+        void rm(uint8_t prefix, bool w, std::initializer_list<uint8_t> opcode, int reg, const memory_operand& m)
+          {
+          if (prefix)
+            byte(prefix);
+          uint8_t rex = (uint8_t)(0x40 | (w ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((m.index >= 0 && (m.index & 8)) ? 2 : 0) | ((m.base & 8) ? 1 : 0));
+          if (rex != 0x40)
+            byte(rex);
+          for (auto b : opcode)
+            byte(b);
+          if (m.index >= 0)
+            {
+            byte((uint8_t)(0x80 | ((reg & 7) << 3) | 4));
+            byte((uint8_t)(0xC0 | ((m.index & 7) << 3) | (m.base & 7)));
+            }
+          else
+            {
+            byte((uint8_t)(0x80 | ((reg & 7) << 3) | (m.base & 7)));
+            if ((m.base & 7) == rsp)
+              byte(0x24);
+            }
+          dword((uint32_t)m.disp);
+          }
+
+        void push(int r)
+          {
+          if (r & 8)
+            byte(0x41);
+          byte((uint8_t)(0x50 + (r & 7)));
+          }
+
+        void pop(int r)
+          {
+          if (r & 8)
+            byte(0x41);
+          byte((uint8_t)(0x58 + (r & 7)));
+          }
+
+        void ret() { byte(0xC3); }
+        void mov(int dst, int src) { rr(0, true, { 0x8B }, dst, src); }
+        void mov(int dst, const memory_operand& m) { rm(0, true, { 0x8B }, dst, m); }
+        void mov(const memory_operand& m, int src) { rm(0, true, { 0x89 }, src, m); }
+        void mov_imm(const memory_operand& m, int32_t imm) { rm(0, true, { 0xC7 }, 0, m); dword((uint32_t)imm); }
+        void mov32(int dst, int src) { rr(0, false, { 0x8B }, dst, src); }
+
+        void mov_imm(int dst, int64_t imm)
+          {
+          if (imm == (int32_t)imm)
+            {
+            rr(0, true, { 0xC7 }, 0, dst);
+            dword((uint32_t)imm);
+            }
+          else
+            {
+            byte((uint8_t)(0x48 | ((dst & 8) ? 1 : 0)));
+            byte((uint8_t)(0xB8 + (dst & 7)));
+            qword((uint64_t)imm);
+            }
+          }
+
+        void lea(int dst, const memory_operand& m) { rm(0, true, { 0x8D }, dst, m); }
+        void alu(uint8_t opcode, int dst, int src) { rr(0, true, { opcode }, dst, src); }
+        void alu(uint8_t opcode, int dst, const memory_operand& m) { rm(0, true, { opcode }, dst, m); }
+        void alu_imm(int extension, int dst, int32_t imm) { rr(0, true, { 0x81 }, extension, dst); dword((uint32_t)imm); }
+        void and32_imm(int dst, int32_t imm) { rr(0, false, { 0x81 }, 4, dst); dword((uint32_t)imm); }
+        void imul(int dst, int src) { rr(0, true, { 0x0F, 0xAF }, dst, src); }
+        void imul(int dst, const memory_operand& m) { rm(0, true, { 0x0F, 0xAF }, dst, m); }
+        void imul_imm(int dst, int src, int32_t imm) { rr(0, true, { 0x69 }, dst, src); dword((uint32_t)imm); }
+        void unary(int extension, int r) { rr(0, true, { 0xF7 }, extension, r); } // 2: not, 3: neg, 5: imul into rdx:rax, 7: idiv
+        void cqo() { byte(0x48); byte(0x99); }
+        void shift_cl(int extension, int r) { rr(0, true, { 0xD3 }, extension, r); } // 4: shl, 5: shr
+        void shift32_imm(int extension, int r, uint8_t count) { rr(0, false, { 0xC1 }, extension, r); byte(count); } // 5: shr, 7: sar
+        void shift_imm(int extension, int r, uint8_t count) { rr(0, true, { 0xC1 }, extension, r); byte(count); } // 5: shr, 7: sar
+        void test(int a, int b) { rr(0, true, { 0x85 }, b, a); }
+        void setcc_al(int cc) { rr(0, false, { 0x0F, (uint8_t)(0x90 + cc) }, 0, rax); }
+        void movzx_eax_al() { rr(0, false, { 0x0F, 0xB6 }, rax, rax); }
+        void cmov(int cc, int dst, int src) { rr(0, true, { 0x0F, (uint8_t)(0x40 + cc) }, dst, src); }
+        void cmov(int cc, int dst, const memory_operand& m) { rm(0, true, { 0x0F, (uint8_t)(0x40 + cc) }, dst, m); }
+        void movsxd(int dst, int src) { rr(0, true, { 0x63 }, dst, src); }
+        void call(int r) { rr(0, false, { 0xFF }, 2, r); }
+
+        // jumps with a 32 bit displacement, patched by bind
+        size_t jcc(int cc) { byte(0x0F); byte((uint8_t)(0x80 + cc)); dword(0); return code.size(); }
+        size_t jmp() { byte(0xE9); dword(0); return code.size(); }
+        void bind(size_t jump)
+          {
+          uint32_t rel = (uint32_t)(code.size() - jump);
+          memcpy(code.data() + jump - 4, &rel, 4);
+          }
+
+        void movsd(int dst, const memory_operand& m) { rm(0xF2, false, { 0x0F, 0x10 }, dst, m); }
+        void movsd(const memory_operand& m, int src) { rm(0xF2, false, { 0x0F, 0x11 }, src, m); }
+        void movapd(int dst, int src) { rr(0x66, false, { 0x0F, 0x28 }, dst, src); }
+        void movups(int dst, const memory_operand& m) { rm(0, false, { 0x0F, 0x10 }, dst, m); }
+        void movups(const memory_operand& m, int src) { rm(0, false, { 0x0F, 0x11 }, src, m); }
+        void movq_to_xmm(int dst, int src) { rr(0x66, true, { 0x0F, 0x6E }, dst, src); }
+        void movq_from_xmm(int dst, int src) { rr(0x66, true, { 0x0F, 0x7E }, src, dst); }
+        void sse(uint8_t prefix, uint8_t opcode, int dst, int src) { rr(prefix, false, { 0x0F, opcode }, dst, src); }
+        void sse(uint8_t prefix, uint8_t opcode, int dst, const memory_operand& m) { rm(prefix, false, { 0x0F, opcode }, dst, m); }
+        void cmpsd(int dst, int src, uint8_t predicate) { rr(0xF2, false, { 0x0F, 0xC2 }, dst, src); byte(predicate); }
+        void cmpsd(int dst, const memory_operand& m, uint8_t predicate) { rm(0xF2, false, { 0x0F, 0xC2 }, dst, m); byte(predicate); }
+        void roundsd(int dst, int src, uint8_t mode) { rr(0x66, false, { 0x0F, 0x3A, 0x0B }, dst, src); byte(mode); }
+        void roundsd(int dst, const memory_operand& m, uint8_t mode) { rm(0x66, false, { 0x0F, 0x3A, 0x0B }, dst, m); byte(mode); }
+        void cvttsd2si(bool w, int dst, int src) { rr(0xF2, w, { 0x0F, 0x2C }, dst, src); }
+        void cvttsd2si(bool w, int dst, const memory_operand& m) { rm(0xF2, w, { 0x0F, 0x2C }, dst, m); }
+      };
+
+    enum e_sse
+      {
+      sse_add = 0x58,
+      sse_mul = 0x59,
+      sse_sub = 0x5C,
+      sse_min = 0x5D,
+      sse_div = 0x5E,
+      sse_max = 0x5F,
+      sse_sqrt = 0x51,
+      sse_and = 0x54,
+      sse_andn = 0x55,
+      sse_or = 0x56,
+      sse_xor = 0x57
+      };
+
+    enum e_alu
+      {
+      alu_add = 0x03,
+      alu_or = 0x0B,
+      alu_and = 0x23,
+      alu_sub = 0x2B,
+      alu_xor = 0x33,
+      alu_cmp = 0x3B
+      };
+
+    inline int alu_extension(uint8_t opcode)
+      {
+      switch (opcode)
+        {
+        case alu_add: return 0;
+        case alu_or: return 1;
+        case alu_and: return 4;
+        case alu_sub: return 5;
+        case alu_xor: return 6;
+        default: return 7;
+        }
+      }
+
+    inline bool cpu_supports_sse41()
+      {
+#if defined(_MSC_VER) && !defined(__clang__)
+      int info[4];
+      __cpuid(info, 1);
+      return (info[2] & (1 << 19)) != 0;
+#else
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("sse4.1");
+#endif
+      }
+
+    // The primitives that are not generated inline are called through these, so that they
+    // round and convert exactly like the interpreter.
+    template <class T> T call_sin(T a) { return (T)std::sin(a); }
+    template <class T> T call_cos(T a) { return (T)std::cos(a); }
+    template <class T> T call_tan(T a) { return (T)std::tan(a); }
+    template <class T> T call_log(T a) { return (T)std::log(a); }
+    template <class T> T call_exp(T a) { return (T)std::exp(a); }
+    template <class T> T call_sqrt(T a) { return (T)std::sqrt(a); }
+    template <class T> T call_floor(T a) { return (T)std::floor(a); }
+    template <class T> T call_ceil(T a) { return (T)std::ceil(a); }
+    template <class T, e_waveform W> T call_oscillator(T a) { return oscillator(W, a); }
+    template <class T> T call_pow(T a, T b) { return (T)std::pow(a, b); }
+    template <class T> T call_atan2(T a, T b) { return (T)std::atan2(a, b); }
+    template <class T> T call_mod(T a, T b) { return modulo(a, b); }
+    template <class T> T call_left_shift(T a, T b) { return left_shift(a, b); }
+    template <class T> T call_right_shift(T a, T b) { return right_shift(a, b); }
+    template <class T> T call_and(T a, T b) { return binary_and(a, b); }
+    template <class T> T call_or(T a, T b) { return binary_or(a, b); }
+    template <class T> T call_xor(T a, T b) { return binary_xor(a, b); }
+
+    template <class T, int N>
+    class generator
+      {
+      public:
+        typedef typename interpreter<T, N>::Instruction Instruction;
+
+        static constexpr bool is_double = std::is_same<T, double>::value;
+
+        emitter e;
+        int spill_count;
+        int shared; // operators that reuse the value of an earlier operator
+        int memoized; // operators that are only called when an operand changes
+        std::vector<std::pair<int, T>> spill_values; // spill slots that do not start out as 0
+
+        generator() : spill_count(0), shared(0), memoized(0), lo(0), hi(0), depth(0), memo_call(false), sse41(cpu_supports_sse41())
+          {
+          for (int& o : owner)
+            o = -1;
+          if (is_double)
+            {
+            for (int r = 0; r < 14; ++r)
+              pool.push_back(r);
+            }
+          else
+            pool = { rbp, rsi, rdi, r8, r9, r10, r11 };
+          }
+
+        // dependencies as in interpreter::Bytecode, empty to memoize nothing
+        bool generate(const std::vector<Instruction>& instructions, const std::vector<e_dependency>& dependencies, bool share)
+          {
+          if (!_analyse(instructions))
+            return false;
+          if (share)
+            _number_values(instructions);
+          memo.assign(instructions.size(), false);
+          if (dependencies.size() == instructions.size())
+            for (size_t i = 0; i < instructions.size(); ++i)
+              memo[i] = is_memoized(instructions[i].op, dependencies[i]);
+          computed.assign(instructions.size(), -1);
+          _prologue();
+          ring.assign(hi - lo, -1);
+          live.assign(hi - lo, -1);
+          for (int p = lo; p < 0; ++p)
+            {
+            int id = _new_value();
+            ring[p - lo] = id;
+            live[p - lo] = id;
+            values[id].refs = 1;
+            }
+          depth = 0;
+          for (size_t i = 0; i < instructions.size(); ++i)
+            _instruction(instructions[i], i);
+          for (int p = lo; p < depth; ++p)
+            _write_slot(p, live[p - lo]);
+          for (const auto& g : assigned)
+            _store(mem(r13, 8 * g.first), _materialize(g.second));
+          e.lea(rax, mem(rbx, depth));
+          e.and32_imm(rax, N - 1);
+          e.mov(mem(r15, offsetof(jit_context<T>, stack_pointer)), rax);
+          _epilogue();
+          return true;
+          }
+
+      private:
+        struct value
+          {
+          int reg;
+          int spill;
+          int global;
+          bool is_constant;
+          T constant;
+          int refs;
+          };
+
+        struct step
+          {
+          int consumed;
+          int produced;
+          int depth;
+          int pick_position; // position that a pick with a literal index reads
+          bool dynamic_pick;
+          std::vector<bool> store_residue; // for the positions [depth - consumed + produced, depth)
+          int reuse; // earlier instruction that computed the same value, or -1
+          int shares; // number of later instructions that reuse the value of this one
+          };
+
+        std::vector<value> values;
+        std::vector<int> live; // value at each stack position
+        std::vector<int> ring; // value that the ring buffer holds at each stack position, or -1
+        std::vector<step> steps;
+        std::vector<int> computed; // value made by each instruction that is reused later
+        std::vector<bool> memo; // instructions that are memoized
+        std::vector<int> pool;
+        std::vector<int> pins;
+        std::map<int, int> assigned; // the value that each global got from to
+        int owner[16]; // value in each register, -1 if free
+        int lo, hi, depth;
+        bool memo_call; // the next _call is memoized
+        bool sse41;
+
+        static constexpr int reserved = -2;
+        static constexpr int scratch0 = is_double ? 14 : rax;
+        static constexpr int scratch1 = is_double ? 15 : rdx;
+
+        static bool literal_pick_index(T val, int& k)
+          {
+          if (!(val >= 0 && val < N - 2))
+            return false;
+          k = (int)(int64_t)val;
+          return true;
+          }
+
+        // Computes the stack positions that the program touches, which picks have a literal
+        // index, and which popped values must reach the ring buffer because the interpreter
+        // would leave them there and something can read them before they get overwritten.
+        bool _analyse(const std::vector<Instruction>& instructions)
+          {
+          if ((N & (N - 1)) != 0)
+            return false;
+          size_t n = instructions.size();
+          // straight code only, programs with jumps, delay lines or filters stay with interpreter::run
+          for (const auto& instr : instructions)
+            if (is_control_flow(instr.op) || has_state(instr.op))
+              return false;
+          steps.resize(n);
+          int d = 0;
+          int low = 0, high = 0;
+          for (size_t i = 0; i < n; ++i)
+            {
+            stack_signature(instructions[i].op, steps[i].consumed, steps[i].produced);
+            steps[i].depth = d;
+            low = std::min(low, d - steps[i].consumed);
+            d += steps[i].produced - steps[i].consumed;
+            high = std::max(high, d);
+            }
+          // constant tracking, to find out which picks have a literal index
+          std::vector<int> source(high - low, -1);
+          std::vector<int> outputs;
+          lo = low;
+          for (size_t i = 0; i < n; ++i)
+            {
+            step& s = steps[i];
+            s.dynamic_pick = false;
+            s.pick_position = 0;
+            s.reuse = -1;
+            s.shares = 0;
+            int base = s.depth - s.consumed;
+            std::vector<int> in(source.begin() + (base - low), source.begin() + (s.depth - low));
+            if (instructions[i].op == OP_VALUE)
+              source[s.depth - low] = (int)i;
+            else if (shuffle(instructions[i].op, outputs))
+              {
+              for (size_t j = 0; j < outputs.size(); ++j)
+                source[base + j - low] = in[outputs[j]];
+              }
+            else if (instructions[i].op == OP_PICK)
+              {
+              int k;
+              if (in[0] >= 0 && literal_pick_index(instructions[in[0]].val, k))
+                {
+                s.pick_position = s.depth - 2 - k;
+                lo = std::min(lo, s.pick_position);
+                source[base - low] = s.pick_position >= low ? source[s.pick_position - low] : -1;
+                }
+              else
+                {
+                s.dynamic_pick = true;
+                source[base - low] = -1;
+                }
+              }
+            else
+              {
+              for (int j = 0; j < s.produced; ++j)
+                source[base + j - low] = -1;
+              }
+            }
+          hi = high;
+          if (hi - lo > N)
+            return false;
+          // backward pass: a popped value must be stored if the slot is observed (by a dynamic
+          // pick or after the program) before it is overwritten
+          const int never = 2 * (int)n + 2;
+          std::vector<int> next_write(hi - lo, never);
+          for (int p = lo; p < d; ++p)
+            next_write[p - lo] = 2 * (int)n;
+          int next_barrier = 2 * (int)n + 1;
+          for (size_t ii = n; ii-- > 0;)
+            {
+            step& s = steps[ii];
+            int base = s.depth - s.consumed;
+            s.store_residue.clear();
+            for (int p = base + s.produced; p < s.depth; ++p)
+              s.store_residue.push_back(!(next_write[p - lo] < next_barrier));
+            if (s.dynamic_pick)
+              next_barrier = 2 * (int)ii;
+            for (int p = base; p < base + s.produced; ++p)
+              next_write[p - lo] = 2 * (int)ii + 1;
+            }
+          return true;
+          }
+
+        // Gives every stack entry the number of its value, and finds the operators that compute a
+        // value that an earlier operator computed already.
+        void _number_values(const std::vector<Instruction>& instructions)
+          {
+          expression_table<T, N> expressions;
+          std::vector<int> number(hi - lo);
+          for (int p = lo; p < 0; ++p)
+            number[p - lo] = expressions.unknown();
+          std::vector<int> return_stack;
+          std::map<int, int> assigned_numbers;
+          std::vector<int> first; // instruction that computed each number first, or -1
+          std::vector<int> outputs;
+          for (size_t i = 0; i < instructions.size(); ++i)
+            {
+            step& s = steps[i];
+            const Instruction& instr = instructions[i];
+            int base = s.depth - s.consumed;
+            std::vector<int> in(number.begin() + (base - lo), number.begin() + (s.depth - lo));
+            std::vector<int> out;
+            if (instr.op == OP_VALUE)
+              out.push_back(expressions.value(instr.val));
+            else if (instr.op == OP_VARIABLE)
+              {
+              auto it = assigned_numbers.find(instr.index);
+              out.push_back(it != assigned_numbers.end() ? it->second : expressions.variable(instr.index));
+              }
+            else if (instr.op == OP_ASSIGN)
+              assigned_numbers[instr.index] = in[0];
+            else if (shuffle(instr.op, outputs))
+              {
+              for (int j : outputs)
+                out.push_back(in[j]);
+              }
+            else if (instr.op == OP_PICK)
+              out.push_back(s.dynamic_pick ? expressions.unknown() : number[s.pick_position - lo]);
+            else if (instr.op == OP_STORE)
+              expressions.store();
+            else if (instr.op == OP_RETURN_STACK_PUSH)
+              {
+              return_stack.push_back(in[0]);
+              // the return stack is a ring buffer too, the oldest entry gets overwritten
+              if ((int)return_stack.size() > N)
+                return_stack.erase(return_stack.begin());
+              }
+            else if (instr.op == OP_RETURN_STACK_POP)
+              {
+              if (return_stack.empty())
+                out.push_back(expressions.unknown());
+              else
+                {
+                out.push_back(return_stack.back());
+                return_stack.pop_back();
+                }
+              }
+            else
+              {
+              e_opcode op = fused_operator(instr.op);
+              int b = s.consumed == 2 ? in[1] : -1;
+              if (instr.op == OP_SQUARE)
+                b = in[0];
+              else if (op != instr.op)
+                b = expressions.value(instr.val);
+              int x = expressions.operation(op, in[0], b);
+              first.resize(expressions.size(), -1);
+              if (first[x] >= 0)
+                {
+                s.reuse = first[x];
+                ++steps[first[x]].shares;
+                ++shared;
+                }
+              else
+                first[x] = (int)i;
+              out.push_back(x);
+              }
+            for (size_t j = 0; j < out.size(); ++j)
+              number[base + (int)j - lo] = out[j];
+            }
+          }
+
+#if defined(_WIN32)
+        static constexpr int frame_size = 32 + 160 + 8;
+#else
+        static constexpr int frame_size = 8;
+#endif
+
+        void _prologue()
+          {
+          const int saved[] = { rbx, rbp, rsi, rdi, r12, r13, r14, r15 };
+          for (int r : saved)
+            e.push(r);
+          e.alu_imm(5, rsp, frame_size);
+#if defined(_WIN32)
+          for (int i = 0; i < 10; ++i)
+            e.movups(mem(rsp, 32 + 16 * i), 6 + i);
+          e.mov(r15, rcx);
+#else
+          e.mov(r15, rdi);
+#endif
+          e.mov(rbx, mem(r15, offsetof(jit_context<T>, stack_pointer)));
+          e.mov(r12, mem(r15, offsetof(jit_context<T>, stack)));
+          e.mov(r13, mem(r15, offsetof(jit_context<T>, globals)));
+          e.mov(r14, mem(r15, offsetof(jit_context<T>, spill)));
+          }
+
+        void _epilogue()
+          {
+#if defined(_WIN32)
+          for (int i = 0; i < 10; ++i)
+            e.movups(6 + i, mem(rsp, 32 + 16 * i));
+#endif
+          e.alu_imm(0, rsp, frame_size);
+          const int saved[] = { r15, r14, r13, r12, rdi, rsi, rbp, rbx };
+          for (int r : saved)
+            e.pop(r);
+          e.ret();
+          }
+
+        int _new_value()
+          {
+          value v;
+          v.reg = -1;
+          v.spill = -1;
+          v.global = -1;
+          v.is_constant = false;
+          v.constant = (T)0;
+          v.refs = 0;
+          values.push_back(v);
+          return (int)values.size() - 1;
+          }
+
+        bool _is_pinned(int id) const
+          {
+          return std::find(pins.begin(), pins.end(), id) != pins.end();
+          }
+
+        bool _fits_imm(int id) const
+          {
+          if (is_double || !values[id].is_constant)
+            return false;
+          int64_t c = (int64_t)values[id].constant;
+          return c == (int32_t)c;
+          }
+
+        // true if the value can be found without its register, not counting ring slot except
+        bool _has_home(int id, int except) const
+          {
+          const value& v = values[id];
+          if (v.is_constant || v.global >= 0 || v.spill >= 0)
+            return true;
+          for (int p = lo; p < hi; ++p)
+            if (p != except && ring[p - lo] == id)
+              return true;
+          return false;
+          }
+
+        void _load(int r, const memory_operand& m)
+          {
+          if (is_double)
+            e.movsd(r, m);
+          else
+            e.mov(r, m);
+          }
+
+        void _store(const memory_operand& m, int r)
+          {
+          if (is_double)
+            e.movsd(m, r);
+          else
+            e.mov(m, r);
+          }
+
+        void _move(int dst, int src)
+          {
+          if (dst == src)
+            return;
+          if (is_double)
+            e.movapd(dst, src);
+          else
+            e.mov(dst, src);
+          }
+
+        void _load_constant(int r, T c)
+          {
+          if (is_double)
+            {
+            uint64_t bits;
+            memcpy(&bits, &c, sizeof(T));
+            if (bits == 0)
+              e.sse(0x66, sse_xor, r, r);
+            else
+              {
+              e.mov_imm(rax, (int64_t)bits);
+              e.movq_to_xmm(r, rax);
+              }
+            }
+          else
+            e.mov_imm(r, (int64_t)c);
+          }
+
+        // address of the ring slot of stack position p, uses rax
+        memory_operand _ring_slot(int p)
+          {
+          e.lea(rax, mem(rbx, p));
+          e.and32_imm(rax, N - 1);
+          return mem(r12, rax, 0);
+          }
+
+        void _evict(int r)
+          {
+          int id = owner[r];
+          if (id < 0)
+            return;
+          if (!_has_home(id, INT32_MIN))
+            {
+            values[id].spill = spill_count++;
+            _store(mem(r14, 8 * values[id].spill), r);
+            }
+          values[id].reg = -1;
+          owner[r] = -1;
+          }
+
+        int _alloc_reg()
+          {
+          for (int r : pool)
+            if (owner[r] == -1)
+              return r;
+          int victim = -1;
+          for (int r : pool)
+            {
+            if (owner[r] < 0 || _is_pinned(owner[r]))
+              continue;
+            if (_has_home(owner[r], INT32_MIN))
+              {
+              victim = r;
+              break;
+              }
+            if (victim < 0)
+              victim = r;
+            }
+          _evict(victim);
+          return victim;
+          }
+
+        // a register for a result that is still being computed
+        int _reserve_reg()
+          {
+          int r = _alloc_reg();
+          owner[r] = reserved;
+          return r;
+          }
+
+        // loads value id into register r without making r the home of id
+        void _load_into(int r, int id)
+          {
+          const value& v = values[id];
+          if (v.reg >= 0)
+            _move(r, v.reg);
+          else if (v.is_constant)
+            _load_constant(r, v.constant);
+          else if (v.global >= 0)
+            _load(r, mem(r13, 8 * v.global));
+          else if (v.spill >= 0)
+            _load(r, mem(r14, 8 * v.spill));
+          else
+            {
+            int p = lo;
+            while (ring[p - lo] != id)
+              ++p;
+            _load(r, _ring_slot(p));
+            }
+          }
+
+        int _materialize(int id)
+          {
+          if (values[id].reg >= 0)
+            return values[id].reg;
+          pins.push_back(id);
+          int r = _alloc_reg();
+          pins.pop_back();
+          _load_into(r, id);
+          values[id].reg = r;
+          owner[r] = id;
+          return r;
+          }
+
+        // operand for the second argument of an instruction: a register or a memory location
+        bool _memory_operand(int id, memory_operand& m) const
+          {
+          const value& v = values[id];
+          if (v.reg >= 0)
+            return false;
+          if (v.global >= 0)
+            {
+            m = mem(r13, 8 * v.global);
+            return true;
+            }
+          if (v.spill >= 0)
+            {
+            m = mem(r14, 8 * v.spill);
+            return true;
+            }
+          return false;
+          }
+
+        void _write_slot(int p, int id)
+          {
+          if (ring[p - lo] == id)
+            return;
+          int old = ring[p - lo];
+          pins.push_back(id);
+          // the old content of the slot may be the only copy of a value that is still needed
+          pins.push_back(old);
+          if (old >= 0 && values[old].refs > 0 && values[old].reg < 0 && !_has_home(old, p))
+            _materialize(old);
+          if (_fits_imm(id) && values[id].reg < 0)
+            e.mov_imm(_ring_slot(p), (int32_t)(int64_t)values[id].constant);
+          else
+            {
+            int r = _materialize(id);
+            _store(_ring_slot(p), r);
+            }
+          pins.pop_back();
+          pins.pop_back();
+          ring[p - lo] = id;
+          }
+
+        // a register that holds a copy of a, and that will hold the result
+        int _begin_result(int a, bool& in_place)
+          {
+          in_place = values[a].refs == 1 && values[a].reg >= 0;
+          if (in_place)
+            return values[a].reg;
+          int r = _reserve_reg();
+          _load_into(r, a);
+          return r;
+          }
+
+        int _result(int r, int a, bool in_place)
+          {
+          int id = _new_value();
+          if (in_place)
+            values[a].reg = -1;
+          values[id].reg = r;
+          owner[r] = id;
+          return id;
+          }
+
+        int _fresh_result(int r)
+          {
+          int id = _new_value();
+          values[id].reg = r;
+          owner[r] = id;
+          return id;
+          }
+
+        void _int_alu(uint8_t opcode, int r, int b)
+          {
+          memory_operand m;
+          if (_fits_imm(b))
+            e.alu_imm(alu_extension(opcode), r, (int32_t)(int64_t)values[b].constant);
+          else if (_memory_operand(b, m))
+            e.alu(opcode, r, m);
+          else
+            e.alu(opcode, r, _materialize(b));
+          }
+
+        void _sse(uint8_t opcode, int r, int b)
+          {
+          memory_operand m;
+          if (_memory_operand(b, m))
+            e.sse(0xF2, opcode, r, m);
+          else
+            e.sse(0xF2, opcode, r, _materialize(b));
+          }
+
+        void _cmpsd(int r, int b, uint8_t predicate)
+          {
+          memory_operand m;
+          if (_memory_operand(b, m))
+            e.cmpsd(r, m, predicate);
+          else
+            e.cmpsd(r, _materialize(b), predicate);
+          }
+
+        void _load_double_constant(int r, uint64_t bits)
+          {
+          e.mov_imm(rax, (int64_t)bits);
+          e.movq_to_xmm(r, rax);
+          }
+
+        // (int)value & memory_mask in rax, as in the fetch and store primitives
+        void _memory_index(int id)
+          {
+          if (is_double)
+            {
+            memory_operand m;
+            if (_memory_operand(id, m))
+              e.cvttsd2si(false, rax, m);
+            else
+              e.cvttsd2si(false, rax, _materialize(id));
+            }
+          else
+            _load_into(rax, id);
+          // the mask is below 2^31, so the bits above the int do not matter
+          e.alu(alu_and, rax, mem(r15, offsetof(jit_context<T>, memory_mask)));
+          }
+
+        int _call(int64_t fun, int a, int b)
+          {
+          for (int r : pool)
+            {
+#if !defined(_WIN32)
+            if (!is_double && r == rbp)
+              continue;
+#else
+            if (!is_double && (r == rbp || r == rsi || r == rdi))
+              continue;
+#endif
+            _evict(r);
+            }
+          if (is_double)
+            {
+            _load_into(0, a);
+            if (b >= 0)
+              _load_into(1, b);
+            }
+          else
+            {
+#if defined(_WIN32)
+            const int arg0 = rcx, arg1 = rdx;
+#else
+            const int arg0 = rdi, arg1 = rsi;
+#endif
+            if (b >= 0)
+              _load_into(arg1, b);
+            _load_into(arg0, a);
+            }
+          if (memo_call)
+            _memoized_call(fun, b >= 0);
+          else
+            {
+            e.mov_imm(rax, fun);
+            e.call(rax);
+            }
+          int r = _alloc_reg();
+          _move(r, is_double ? 0 : rax);
+          return _fresh_result(r);
+          }
+
+        typedef T(*unary_function)(T);
+        typedef T(*binary_function)(T, T);
+
+        // the call of _call when the operands are in the argument registers, skipped if they
+        // have the same bits as last time. The slots start out with the result for 0.
+        void _memoized_call(int64_t fun, bool binary)
+          {
+#if defined(_WIN32)
+          const int args[] = { is_double ? 0 : rcx, is_double ? 1 : rdx };
+#else
+          const int args[] = { is_double ? 0 : rdi, is_double ? 1 : rsi };
+#endif
+          const int result = is_double ? 0 : rax;
+          const int slot = spill_count;
+          spill_count += 3;
+          T zero = (T)0;
+          T value = binary ? ((binary_function)(intptr_t)fun)(zero, zero) : ((unary_function)(intptr_t)fun)(zero);
+          spill_values.push_back(std::make_pair(slot + 2, value));
+          const int operands = binary ? 2 : 1;
+          size_t changed[2];
+          for (int j = 0; j < operands; ++j)
+            {
+            if (is_double)
+              {
+              e.movq_from_xmm(rax, args[j]);
+              e.alu(alu_cmp, rax, mem(r14, 8 * (slot + j)));
+              }
+            else
+              e.alu(alu_cmp, args[j], mem(r14, 8 * (slot + j)));
+            changed[j] = e.jcc(cc_ne);
+            }
+          _load(result, mem(r14, 8 * (slot + 2)));
+          size_t done = e.jmp();
+          for (int j = 0; j < operands; ++j)
+            e.bind(changed[j]);
+          for (int j = 0; j < operands; ++j)
+            _store(mem(r14, 8 * (slot + j)), args[j]);
+          e.mov_imm(rax, fun);
+          e.call(rax);
+          _store(mem(r14, 8 * (slot + 2)), result);
+          e.bind(done);
+          memo_call = false;
+          ++memoized;
+          }
+
+        int _call(unary_function f, int a)
+          {
+          return _call((int64_t)(intptr_t)f, a, -1);
+          }
+
+        int _call(binary_function f, int a, int b)
+          {
+          return _call((int64_t)(intptr_t)f, a, b);
+          }
+
+        int _int_binary(e_opcode op, int a, int b)
+          {
+          bool in_place;
+          switch (op)
+            {
+            case OP_ADD:
+            case OP_SUB:
+            case OP_AND:
+            case OP_OR:
+            case OP_XOR:
+            {
+            static const uint8_t opcodes[] = { alu_add, alu_sub, alu_and, alu_or, alu_xor };
+            uint8_t opcode = op == OP_ADD ? opcodes[0] : op == OP_SUB ? opcodes[1] : op == OP_AND ? opcodes[2] : op == OP_OR ? opcodes[3] : opcodes[4];
+            int r = _begin_result(a, in_place);
+            _int_alu(opcode, r, b);
+            return _result(r, a, in_place);
+            }
+            case OP_MUL:
+            {
+            int r = _begin_result(a, in_place);
+            memory_operand m;
+            if (_fits_imm(b))
+              e.imul_imm(r, r, (int32_t)(int64_t)values[b].constant);
+            else if (_memory_operand(b, m))
+              e.imul(r, m);
+            else
+              e.imul(r, _materialize(b));
+            return _result(r, a, in_place);
+            }
+            case OP_DIV:
+            case OP_MOD:
+            {
+            if (values[b].is_constant && constant_divisor::is_reducible((int64_t)values[b].constant))
+              return _constant_division(op, a, constant_divisor((int64_t)values[b].constant));
+            // x / 0 gives 0 (infinity for integers), and x / -1 is a negation so that
+            // the minimum value does not trap
+            in_place = in_place_candidate(a);
+            int r = in_place ? values[a].reg : _reserve_reg();
+            _load_into(rcx, b);
+            _load_into(rax, a);
+            e.test(rcx, rcx);
+            size_t zero = e.jcc(cc_e);
+            e.alu_imm(7, rcx, -1);
+            size_t minus_one = e.jcc(cc_e);
+            e.cqo();
+            e.unary(7, rcx);
+            if (op == OP_MOD)
+              e.mov(rax, rdx);
+            size_t done = e.jmp();
+            e.bind(minus_one);
+            if (op == OP_DIV)
+              e.unary(3, rax);
+            else
+              e.alu(alu_xor, rax, rax);
+            size_t done2 = e.jmp();
+            e.bind(zero);
+            e.alu(alu_xor, rax, rax);
+            e.bind(done);
+            e.bind(done2);
+            e.mov(r, rax);
+            return _result(r, a, in_place);
+            }
+            case OP_LEFT_SHIFT:
+            case OP_RIGHT_SHIFT:
+            {
+            int r = _begin_result(a, in_place);
+            _load_into(rcx, b);
+            e.shift_cl(op == OP_LEFT_SHIFT ? 4 : 5, r);
+            return _result(r, a, in_place);
+            }
+            case OP_LESS:
+            case OP_GREATER:
+            case OP_LEQ:
+            case OP_GEQ:
+            case OP_EQ:
+            case OP_NEQ:
+            {
+            int cc = op == OP_LESS ? cc_l : op == OP_GREATER ? cc_g : op == OP_LEQ ? cc_le : op == OP_GEQ ? cc_ge : op == OP_EQ ? cc_e : cc_ne;
+            int r = _begin_result(a, in_place);
+            _int_alu(alu_cmp, r, b);
+            e.setcc_al(cc);
+            e.movzx_eax_al();
+            e.unary(3, rax);
+            e.mov(r, rax);
+            return _result(r, a, in_place);
+            }
+            case OP_MIN:
+            case OP_MAX:
+            {
+            int r = _begin_result(a, in_place);
+            memory_operand m;
+            int cc = op == OP_MIN ? cc_ge : cc_le;
+            if (_memory_operand(b, m))
+              {
+              e.alu(alu_cmp, r, m);
+              e.cmov(cc, r, m);
+              }
+            else
+              {
+              int rb = _materialize(b);
+              e.alu(alu_cmp, r, rb);
+              e.cmov(cc, r, rb);
+              }
+            return _result(r, a, in_place);
+            }
+            case OP_POW: return _call(&call_pow<T>, a, b);
+            case OP_ATAN2: return _call(&call_atan2<T>, a, b);
+            default: return -1;
+            }
+          }
+
+        // a / d or a % d for a literal d, with the multiplication and shifts of constant_divisor
+        int _constant_division(e_opcode op, int a, const constant_divisor& divisor)
+          {
+          bool in_place;
+          int r = _begin_result(a, in_place);
+          if (divisor.power_of_two)
+            {
+            // rax = a + (a < 0 ? |d| - 1 : 0)
+            e.mov(rax, r);
+            e.shift_imm(7, rax, 63);
+            e.shift_imm(5, rax, (uint8_t)(64 - divisor.shift));
+            e.alu(alu_add, rax, r);
+            if (op == OP_DIV)
+              {
+              e.shift_imm(7, rax, (uint8_t)divisor.shift);
+              if (divisor.d < 0)
+                e.unary(3, rax);
+              e.mov(r, rax);
+              }
+            else
+              {
+              int64_t mask = (int64_t)((uint64_t)0 - ((uint64_t)1 << divisor.shift));
+              if (mask == (int32_t)mask)
+                e.alu_imm(4, rax, (int32_t)mask);
+              else
+                {
+                e.mov_imm(rdx, mask);
+                e.alu(alu_and, rax, rdx);
+                }
+              e.alu(alu_sub, r, rax);
+              }
+            return _result(r, a, in_place);
+            }
+          // rdx = the high half of magic * a
+          e.mov_imm(rax, divisor.magic);
+          e.unary(5, r);
+          if (divisor.d > 0 && divisor.magic < 0)
+            e.alu(alu_add, rdx, r);
+          else if (divisor.d < 0 && divisor.magic > 0)
+            e.alu(alu_sub, rdx, r);
+          if (divisor.shift > 0)
+            e.shift_imm(7, rdx, (uint8_t)divisor.shift);
+          e.mov(rax, rdx);
+          e.shift_imm(5, rax, 63);
+          e.alu(alu_add, rdx, rax);
+          if (op == OP_DIV)
+            e.mov(r, rdx);
+          else
+            {
+            if (divisor.d == (int32_t)divisor.d)
+              e.imul_imm(rdx, rdx, (int32_t)divisor.d);
+            else
+              {
+              e.mov_imm(rax, divisor.d);
+              e.imul(rdx, rax);
+              }
+            e.alu(alu_sub, r, rdx);
+            }
+          return _result(r, a, in_place);
+          }
+
+        bool in_place_candidate(int a) const
+          {
+          return values[a].refs == 1 && values[a].reg >= 0;
+          }
+
+        int _double_binary(e_opcode op, int a, int b)
+          {
+          bool in_place;
+          switch (op)
+            {
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MIN:
+            case OP_MAX:
+            {
+            uint8_t opcode = op == OP_ADD ? sse_add : op == OP_SUB ? sse_sub : op == OP_MIN ? sse_min : sse_max;
+            int r = _begin_result(a, in_place);
+            _sse(opcode, r, b);
+            return _result(r, a, in_place);
+            }
+            case OP_MUL:
+            {
+            // multiplying with 0 gives 0, also for infinity and nan
+            int r = _begin_result(a, in_place);
+            e.sse(0x66, sse_xor, scratch0, scratch0);
+            e.cmpsd(scratch0, r, 0);
+            e.sse(0x66, sse_xor, scratch1, scratch1);
+            _cmpsd(scratch1, b, 0);
+            e.sse(0x66, sse_or, scratch0, scratch1);
+            _sse(sse_mul, r, b);
+            e.sse(0x66, sse_andn, scratch0, r);
+            e.movapd(r, scratch0);
+            return _result(r, a, in_place);
+            }
+            case OP_DIV:
+            {
+            // dividing by 0 gives infinity
+            int r = _begin_result(a, in_place);
+            _sse(sse_div, r, b);
+            e.sse(0x66, sse_xor, scratch0, scratch0);
+            _cmpsd(scratch0, b, 0);
+            _load_double_constant(scratch1, 0x7ff0000000000000ull);
+            e.sse(0x66, sse_and, scratch1, scratch0);
+            e.sse(0x66, sse_andn, scratch0, r);
+            e.sse(0x66, sse_or, scratch0, scratch1);
+            e.movapd(r, scratch0);
+            return _result(r, a, in_place);
+            }
+            case OP_LESS:
+            case OP_GREATER:
+            case OP_LEQ:
+            case OP_GEQ:
+            case OP_EQ:
+            case OP_NEQ:
+            {
+            // a > b is computed as b < a
+            bool swapped = op == OP_GREATER || op == OP_GEQ;
+            uint8_t predicate = (op == OP_LESS || op == OP_GREATER) ? 1 : (op == OP_LEQ || op == OP_GEQ) ? 2 : op == OP_EQ ? 0 : 4;
+            pins.push_back(a);
+            pins.push_back(b);
+            _load_into(scratch0, swapped ? b : a);
+            _cmpsd(scratch0, swapped ? a : b, predicate);
+            pins.pop_back();
+            pins.pop_back();
+            return _truth(a);
+            }
+            case OP_POW: return _call(&call_pow<T>, a, b);
+            case OP_ATAN2: return _call(&call_atan2<T>, a, b);
+            case OP_MOD: return _call(&call_mod<T>, a, b);
+            case OP_LEFT_SHIFT: return _call(&call_left_shift<T>, a, b);
+            case OP_RIGHT_SHIFT: return _call(&call_right_shift<T>, a, b);
+            case OP_AND: return _call(&call_and<T>, a, b);
+            case OP_OR: return _call(&call_or<T>, a, b);
+            case OP_XOR: return _call(&call_xor<T>, a, b);
+            default: return -1;
+            }
+          }
+
+        // turns the comparison mask in scratch0 into 1.0 or 0.0
+        int _truth(int a)
+          {
+          _load_double_constant(scratch1, 0x3ff0000000000000ull);
+          e.sse(0x66, sse_and, scratch0, scratch1);
+          bool in_place = in_place_candidate(a);
+          int r = in_place ? values[a].reg : _reserve_reg();
+          e.movapd(r, scratch0);
+          return _result(r, a, in_place);
+          }
+
+        int _int_unary(e_opcode op, int a)
+          {
+          bool in_place;
+          switch (op)
+            {
+            case OP_NOT:
+            case OP_NEGATE:
+            {
+            int r = _begin_result(a, in_place);
+            e.unary(op == OP_NOT ? 2 : 3, r);
+            return _result(r, a, in_place);
+            }
+            case OP_ABS:
+            {
+            int r = _begin_result(a, in_place);
+            e.mov(rax, r);
+            e.unary(3, rax);
+            e.cmov(cc_s, rax, r);
+            e.mov(r, rax);
+            return _result(r, a, in_place);
+            }
+            case OP_SIN: return _call(&call_sin<T>, a);
+            case OP_COS: return _call(&call_cos<T>, a);
+            case OP_TAN: return _call(&call_tan<T>, a);
+            case OP_LOG: return _call(&call_log<T>, a);
+            case OP_EXP: return _call(&call_exp<T>, a);
+            case OP_SQRT: return _call(&call_sqrt<T>, a);
+            case OP_FLOOR: return _call(&call_floor<T>, a);
+            case OP_CEIL: return _call(&call_ceil<T>, a);
+            case OP_OSC_SIN:
+            case OP_OSC_SAW:
+            case OP_OSC_SQUARE:
+            {
+            // an entry of the byte table, without a call
+            const e_waveform w = op == OP_OSC_SIN ? WAVE_SIN : (op == OP_OSC_SAW ? WAVE_SAW : WAVE_SQUARE);
+            int r = _begin_result(a, in_place);
+            e.and32_imm(r, oscillator_tables::byte_size - 1);
+            e.mov_imm(rax, (int64_t)oscillator_table_data.bytes[w]);
+            e.mov(r, mem(rax, r, 0));
+            return _result(r, a, in_place);
+            }
+            default: return -1;
+            }
+          }
+
+        int _double_unary(e_opcode op, int a)
+          {
+          bool in_place;
+          switch (op)
+            {
+            case OP_NOT:
+            {
+            pins.push_back(a);
+            e.sse(0x66, sse_xor, scratch0, scratch0);
+            _cmpsd(scratch0, a, 0);
+            pins.pop_back();
+            return _truth(a);
+            }
+            case OP_NEGATE:
+            case OP_ABS:
+            {
+            int r = _begin_result(a, in_place);
+            _load_double_constant(scratch0, op == OP_NEGATE ? 0x8000000000000000ull : 0x7fffffffffffffffull);
+            e.sse(0x66, op == OP_NEGATE ? sse_xor : sse_and, r, scratch0);
+            return _result(r, a, in_place);
+            }
+            case OP_SQRT:
+            {
+            int r = _begin_result(a, in_place);
+            e.sse(0xF2, sse_sqrt, r, r);
+            return _result(r, a, in_place);
+            }
+            case OP_FLOOR:
+            case OP_CEIL:
+            {
+            if (!sse41)
+              return _call(op == OP_FLOOR ? &call_floor<T> : &call_ceil<T>, a);
+            int r = _begin_result(a, in_place);
+            e.roundsd(r, r, op == OP_FLOOR ? 9 : 10);
+            return _result(r, a, in_place);
+            }
+            case OP_SIN: return _call(&call_sin<T>, a);
+            case OP_COS: return _call(&call_cos<T>, a);
+            case OP_TAN: return _call(&call_tan<T>, a);
+            case OP_LOG: return _call(&call_log<T>, a);
+            case OP_EXP: return _call(&call_exp<T>, a);
+            case OP_OSC_SIN: return _call(&call_oscillator<T, WAVE_SIN>, a);
+            case OP_OSC_SAW: return _call(&call_oscillator<T, WAVE_SAW>, a);
+            case OP_OSC_SQUARE: return _call(&call_oscillator<T, WAVE_SQUARE>, a);
+            default: return -1;
+            }
+          }
+
+        void _instruction(const Instruction& instr, size_t i)
+          {
+          const step& s = steps[i];
+          int base = depth - s.consumed;
+          std::vector<int> in(live.begin() + (base - lo), live.begin() + (depth - lo));
+          for (int p = base + s.produced, j = 0; p < depth; ++p, ++j)
+            if (s.store_residue[j])
+              _write_slot(p, live[p - lo]);
+          pins = in;
+          memo_call = memo[i];
+          std::vector<int> out;
+          std::vector<int> outputs;
+          if (s.reuse >= 0)
+            {
+            // the reference that was reserved for this instruction goes to the stack entry
+            int id = computed[s.reuse];
+            --values[id].refs;
+            out.push_back(id);
+            }
+          else if (instr.op == OP_VALUE)
+            {
+            int id = _new_value();
+            values[id].is_constant = true;
+            values[id].constant = instr.val;
+            out.push_back(id);
+            }
+          else if (instr.op == OP_VARIABLE)
+            {
+            auto it = assigned.find(instr.index);
+            int id = it != assigned.end() ? it->second : _new_value();
+            if (it == assigned.end())
+              values[id].global = instr.index;
+            out.push_back(id);
+            }
+          else if (instr.op == OP_ASSIGN)
+            {
+            // A value that is read from a global is copied, as that global can be written
+            // before this one at the end.
+            int id = in[0];
+            if (values[id].global >= 0)
+              {
+              int r = _reserve_reg();
+              _load_into(r, id);
+              id = _fresh_result(r);
+              }
+            ++values[id].refs;
+            auto it = assigned.find(instr.index);
+            if (it == assigned.end())
+              assigned[instr.index] = id;
+            else
+              {
+              int old = it->second;
+              if (--values[old].refs == 0 && values[old].reg >= 0)
+                {
+                owner[values[old].reg] = -1;
+                values[old].reg = -1;
+                }
+              it->second = id;
+              }
+            }
+          else if (shuffle(instr.op, outputs))
+            {
+            for (int j : outputs)
+              out.push_back(in[j]);
+            }
+          else if (instr.op == OP_PICK)
+            {
+            if (!s.dynamic_pick)
+              out.push_back(live[s.pick_position - lo]);
+            else
+              {
+              // the index is only known at run time, so the ring buffer must be up to date
+              for (int p = lo; p < depth; ++p)
+                _write_slot(p, live[p - lo]);
+              int r = _reserve_reg();
+              if (is_double)
+                {
+                memory_operand m;
+                if (_memory_operand(in[0], m))
+                  e.cvttsd2si(true, rax, m);
+                else
+                  e.cvttsd2si(true, rax, _materialize(in[0]));
+                }
+              else
+                _load_into(rax, in[0]);
+              e.lea(rcx, mem(rbx, depth - 2));
+              e.alu(alu_sub, rcx, rax);
+              e.and32_imm(rcx, N - 1);
+              _load(r, mem(r12, rcx, 0));
+              out.push_back(_fresh_result(r));
+              }
+            }
+          else if (instr.op == OP_FETCH)
+            {
+            int r = _reserve_reg();
+            _memory_index(in[0]);
+            e.mov(rdx, mem(r15, offsetof(jit_context<T>, memory)));
+            _load(r, mem(rdx, rax, 0));
+            out.push_back(_fresh_result(r));
+            }
+          else if (instr.op == OP_STORE)
+            {
+            int ra = _materialize(in[0]);
+            _memory_index(in[1]);
+            e.mov(rdx, mem(r15, offsetof(jit_context<T>, memory)));
+            _store(mem(rdx, rax, 0), ra);
+            }
+          else if (instr.op == OP_RETURN_STACK_PUSH)
+            {
+            int ra = _materialize(in[0]);
+            e.mov(rdx, mem(r15, offsetof(jit_context<T>, return_stack)));
+            e.mov(rcx, mem(r15, offsetof(jit_context<T>, return_stack_pointer)));
+            _store(mem(rdx, rcx, 0), ra);
+            e.alu_imm(0, rcx, 1);
+            e.and32_imm(rcx, N - 1);
+            e.mov(mem(r15, offsetof(jit_context<T>, return_stack_pointer)), rcx);
+            }
+          else if (instr.op == OP_RETURN_STACK_POP)
+            {
+            int r = _alloc_reg();
+            e.mov(rcx, mem(r15, offsetof(jit_context<T>, return_stack_pointer)));
+            e.alu_imm(5, rcx, 1);
+            e.and32_imm(rcx, N - 1);
+            e.mov(mem(r15, offsetof(jit_context<T>, return_stack_pointer)), rcx);
+            e.mov(rdx, mem(r15, offsetof(jit_context<T>, return_stack)));
+            _load(r, mem(rdx, rcx, 0));
+            out.push_back(_fresh_result(r));
+            }
+          else if (fused_operator(instr.op) != instr.op)
+            {
+            // the literal operand becomes a constant value, released together with the inputs
+            int b = in[0];
+            if (instr.op != OP_SQUARE)
+              {
+              b = _new_value();
+              values[b].is_constant = true;
+              values[b].constant = instr.val;
+              }
+            ++values[b].refs;
+            in.push_back(b);
+            pins = in;
+            e_opcode op = fused_operator(instr.op);
+            out.push_back(is_double ? _double_binary(op, in[0], b) : _int_binary(op, in[0], b));
+            }
+          else if (s.consumed == 1)
+            out.push_back(is_double ? _double_unary(instr.op, in[0]) : _int_unary(instr.op, in[0]));
+          else
+            out.push_back(is_double ? _double_binary(instr.op, in[0], in[1]) : _int_binary(instr.op, in[0], in[1]));
+          pins.clear();
+          for (int id : out)
+            ++values[id].refs;
+          if (s.shares > 0)
+            {
+            computed[i] = out[0];
+            values[out[0]].refs += s.shares;
+            }
+          for (int id : in)
+            {
+            if (--values[id].refs == 0 && values[id].reg >= 0)
+              {
+              owner[values[id].reg] = -1;
+              values[id].reg = -1;
+              }
+            }
+          for (size_t j = 0; j < out.size(); ++j)
+            live[base + (int)j - lo] = out[j];
+          depth = base + (int)out.size();
+          }
+      };
+
+    } // namespace x64
+#endif
+
+  // Native code for one Bytecode. compile returns false if the program cannot be compiled
+  // (other processors, or a program that touches more than N stack entries), in which case
+  // interpreter::run should be used instead.
+  template <class T, int N = 256>
+  class jit
+    {
+    public:
+      typedef void(*function)(jit_context<T>*);
+
+      jit() : fun(nullptr), memory(nullptr), memory_size(0), shared(0), memoized(0)
+        {
+        }
+
+      ~jit()
+        {
+        clear();
+        }
+
+      jit(const jit&) = delete;
+      jit& operator = (const jit&) = delete;
+
+      // with share set to false, common subexpressions are evaluated every time they occur, with
+      // memoize set to false, every operator is called every time
+      bool compile(const typename interpreter<T, N>::Bytecode& code, bool share = true, bool memoize = true)
+        {
+        clear();
+#if defined(FORTH_JIT_X64)
+        if (!std::is_same<T, int64_t>::value && !std::is_same<T, double>::value)
+          return false;
+        x64::generator<T, N> gen;
+        if (!gen.generate(code.instructions, memoize ? code.dependencies : std::vector<e_dependency>(), share))
+          return false;
+        spill.assign(gen.spill_count + 1, (T)0);
+        for (const auto& sv : gen.spill_values)
+          spill[sv.first] = sv.second;
+        if (!_allocate(gen.e.code))
+          return false;
+        shared = gen.shared;
+        memoized = gen.memoized;
+        return true;
+#else
+        (void)code;
+        (void)share;
+        (void)memoize;
+        return false;
+#endif
+        }
+
+      void clear()
+        {
+#if defined(FORTH_JIT_X64)
+        if (memory)
+          {
+#if defined(_WIN32)
+          VirtualFree(memory, 0, MEM_RELEASE);
+#else
+          munmap(memory, memory_size);
+#endif
+          }
+#endif
+        memory = nullptr;
+        memory_size = 0;
+        fun = nullptr;
+        shared = 0;
+        memoized = 0;
+        }
+
+      bool is_compiled() const
+        {
+        return fun != nullptr;
+        }
+
+      size_t code_size() const
+        {
+        return memory_size;
+        }
+
+      // the number of operators that were not compiled because an earlier one computes their value
+      int shared_count() const
+        {
+        return shared;
+        }
+
+      // the number of operators that are only called when an operand changes
+      int memoized_count() const
+        {
+        return memoized;
+        }
+
+      void run(interpreter<T, N>& interpr)
+        {
+        context.stack = interpr.stack.data();
+        context.globals = interpr.globals.data();
+        context.memory = interpr.memory_stack.data();
+        context.memory_mask = (int64_t)interpr.memory_stack.size() - 1;
+        context.return_stack = interpr.return_stack.data();
+        context.stack_pointer = interpr.stack_pointer;
+        context.return_stack_pointer = interpr.return_stack_pointer;
+        context.spill = spill.data();
+        fun(&context);
+        interpr.stack_pointer = (int)context.stack_pointer;
+        interpr.return_stack_pointer = (int)context.return_stack_pointer;
+        }
+
+    private:
+      bool _allocate(const std::vector<uint8_t>& code)
+        {
+#if defined(FORTH_JIT_X64)
+#if defined(_WIN32)
+        memory_size = code.size();
+        memory = VirtualAlloc(nullptr, memory_size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        if (!memory)
+          return false;
+        memcpy(memory, code.data(), code.size());
+        DWORD old_protect;
+        if (!VirtualProtect(memory, memory_size, PAGE_EXECUTE_READ, &old_protect))
+          {
+          clear();
+          return false;
+          }
+        FlushInstructionCache(GetCurrentProcess(), memory, memory_size);
+#else
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        memory_size = (code.size() + page - 1) / page * page;
+        memory = mmap(nullptr, memory_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+          {
+          memory = nullptr;
+          return false;
+          }
+        memcpy(memory, code.data(), code.size());
+        if (mprotect(memory, memory_size, PROT_READ | PROT_EXEC) != 0)
+          {
+          clear();
+          return false;
+          }
+#endif
+        fun = (function)memory;
+        return true;
+#else
+        (void)code;
+        return false;
+#endif
+        }
+
+      function fun;
+      void* memory;
+      size_t memory_size;
+      int shared;
+      int memoized;
+      jit_context<T> context;
+      std::vector<T> spill;
+    };
+
+  } // namespace forth
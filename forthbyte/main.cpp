@@ -2,11 +2,19 @@
 #include <SDL_syswm.h>
 #include <curses.h>
 
+#include <chrono>
 #include <iostream>
+#include <memory>
+#include <stdexcept>
 #include <stdlib.h>
+#include <string>
 
+#include "buffer.h"
+#include "compiler.h"
 #include "engine.h"
 #include "fbicon.h"
+#include "music.h"
+#include "preprocessor.h"
 
 extern "C"
   {
@@ -19,8 +27,75 @@ extern "C"
 
 
 
+namespace
+  {
+
+  bool has_option(int argc, char** argv, const std::string& option)
+    {
+    for (int i = 1; i < argc; ++i)
+      if (option == argv[i])
+        return true;
+    return false;
+    }
+
+  // the value that follows option, or an empty string
+  std::string option_value(int argc, char** argv, const std::string& option)
+    {
+    for (int i = 1; i + 1 < argc; ++i)
+      if (option == argv[i])
+        return std::string(argv[i + 1]);
+    return std::string();
+    }
+
+  // forthbyte --render song.txt --seconds N --out file.wav [--device-rate hz]
+  // renders the song to a wav file as fast as possible, without SDL video or pdcurses
+  int render_offline(int argc, char** argv)
+    {
+    const std::string song = option_value(argc, argv, "--render");
+    const std::string out = option_value(argc, argv, "--out");
+    const double seconds = atof(option_value(argc, argv, "--seconds").c_str());
+    if (song.empty() || out.empty() || !(seconds > 0.0))
+      {
+      std::cout << "Usage: forthbyte --render song.txt --seconds N --out file.wav [--device-rate hz]" << std::endl;
+      return 1;
+      }
+    music m;
+    const std::string rate = option_value(argc, argv, "--device-rate");
+    if (!rate.empty())
+      m.set_device_rate((uint32_t)std::max(0, atoi(rate.c_str())));
+    try
+      {
+      file_buffer buffer = read_from_file(song);
+      auto sett = preprocess(buffer.content);
+      std::unique_ptr<compiler> c(new compiler());
+      c->compile(buffer_to_string(buffer), sett, song);
+      m.set_song(c, sett);
+      }
+    catch (std::logic_error& e)
+      {
+      std::cout << song << ": " << e.what() << std::endl;
+      return 1;
+      }
+    auto tic = std::chrono::steady_clock::now();
+    if (!m.render_to_file(out, seconds))
+      {
+      std::cout << "Could not write " << out << std::endl;
+      return 1;
+      }
+    const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - tic).count();
+    std::cout << "Rendered " << seconds << " s of " << song << " to " << out << " at " << m.get_device_rate() << " Hz in " << elapsed << " s";
+    if (elapsed > 0.0)
+      std::cout << " (" << (seconds / elapsed) << " times real time)";
+    std::cout << std::endl;
+    return 0;
+    }
+
+  }
+
 int main(int argc, char** argv)
   {
+  if (has_option(argc, argv, "--render"))
+    return render_offline(argc, argv);
 
   /* Initialize SDL */
   if (SDL_Init(SDL_INIT_VIDEO) < 0)
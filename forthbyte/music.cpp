@@ -4,70 +4,39 @@
 #include <SDL.h>
 #include <stdint.h>
 
+#include <algorithm>
 #include <cassert>
+#include <cmath>
 
 #include <jtk/file_utils.h>
 
 namespace
   {
 
-//#define USE_MIX
-
-  static unsigned char* audio_pos;
-  static uint32_t audio_len;
-  static uint64_t current_t;
-  static uint64_t last_sample = 0;
-  static int32_t last_result[2] = { 0,0 };
   static int32_t volume = 64;
-  static unsigned char mixsrc[4096 * 4]; // * 2 for uint16 and * 2 for channels
 
-  void my_audio_callback(void *userdata, unsigned char* stream, int len)
-    {
-    music* m = (music*)userdata;
-    for (uint32_t i = 0; i < len / m->channels(); i += 2)
-      {
-      uint64_t sample = (current_t*m->get_sample_rate()) / 44100;
-      int32_t result[2];
-      if (sample == last_sample)
-        {
-        result[0] = last_result[0];
-        result[1] = last_result[1];
-        }
-      else
-        {
-        result[0] = m->run_left(sample);
-        result[1] = m->run_right(sample);
-        last_sample = sample;
-        last_result[0] = result[0];
-        last_result[1] = result[1];
-        }
-
-      for (uint32_t j = 0; j < m->channels(); ++j)
-        {
-#ifdef USE_MIX
-        int16_t* store = (int16_t*)&mixsrc[m->channels() * i + 2 * j];
-#else
-        int16_t* store = (int16_t*)&stream[m->channels() * i + 2*j];
-#endif
-        *store = (int16_t)result[j];
-        }
-
-      ++current_t;
-      }
-#ifdef USE_MIX
-    SDL_memset(stream, 0, len);
-    SDL_MixAudioFormat(stream, mixsrc, AUDIO_S16SYS, len, SDL_MIX_MAXVOLUME / 2);
-#endif
+  // the frames that the render thread renders at a time
+  constexpr uint32_t render_chunk_frames = 256;
 
-    m->record(stream, len);
+  // the frames that render_to_file renders at a time
+  constexpr uint32_t offline_chunk_frames = 4096;
 
+  void my_audio_callback(void *userdata, unsigned char* stream, int len)
+    {
+    ((music*)userdata)->pull(stream, len);
     }
 
   }
 
-music::music(compiler* c) : _sample_rate(8000), _samples_per_go(4096), 
-_playing(false), _float(true), out(nullptr), _channels(2), _comp(c)
+music::music() : _sample_rate(8000), _samples_per_go(default_period), 
+_playing(false), _float(true), _channels(2), _comp(new compiler()),
+_rendering(false), _render_ahead(default_render_ahead), _ahead(default_render_ahead), _ring_target(0),
+_device(0), _device_rate(default_device_rate), _requested_rate(default_device_rate), _requested_period(default_period),
+_song_device_rate(0), _song_period(0), _max_period(default_period), _low_latency(false), _underruns_at_open(0), _song_t(0),
+_callback_fill(0), _played_frames(0), _underruns(0), _overruns(0)
   {
+  _resampler.reset(_sample_rate, _device_rate, default_resample_quality);
+  _last_frame[0] = _last_frame[1] = 0;
   _start = std::chrono::high_resolution_clock::now();
   }
 
@@ -91,6 +60,142 @@ int32_t music::run(uint64_t t, int c)
   return result;
   }
 
+void music::_reserve_blocks(uint32_t count)
+  {
+  if (_block[0].size() < count)
+    {
+    for (int c = 0; c < 2; ++c)
+      {
+      _block[c].resize(count);
+      _float_block[c].resize(count);
+      _byte_block[c].resize(count);
+      }
+    }
+  }
+
+void music::run_block(uint64_t t0, uint32_t count)
+  {
+  _reserve_blocks(count);
+  if (_float)
+    {
+    _comp->run_float_block((int64_t)t0, (int)count, _float_block[0].data(), _float_block[1].data());
+    for (int c = 0; c < 2; ++c)
+      for (uint32_t i = 0; i < count; ++i)
+        _block[c][i] = (int32_t)std::floor(_float_block[c][i] * 128.0*volume);
+    }
+  else
+    {
+    _comp->run_byte_block((int64_t)t0, (int)count, _byte_block[0].data(), _byte_block[1].data());
+    for (int c = 0; c < 2; ++c)
+      for (uint32_t i = 0; i < count; ++i)
+        _block[c][i] = ((int32_t)_byte_block[c][i] - 128) * volume;
+    }
+  }
+
+void music::_render(int16_t* out, uint32_t frames)
+  {
+  const uint32_t needed = _resampler.input_needed(frames);
+  if (needed > 0)
+    {
+    run_block(_song_t, needed);
+    _resampler.push(_block[0].data(), _block[1].data(), needed);
+    _song_t += needed;
+    }
+  _resampler.process(out, frames, _channels);
+  }
+
+bool music::_fill(std::vector<int16_t>& chunk)
+  {
+  if (_ring.size() + chunk.size() > _ring_target)
+    return false;
+  std::unique_lock<std::mutex> lock(_song_mutex);
+  _render(chunk.data(), (uint32_t)(chunk.size() / _channels));
+  lock.unlock();
+  const size_t written = _ring.write(chunk.data(), chunk.size());
+  if (written < chunk.size())
+    _overruns.fetch_add(chunk.size() - written, std::memory_order_relaxed);
+  return true;
+  }
+
+void music::_render_loop()
+  {
+  std::vector<int16_t> chunk(render_chunk_frames * _channels);
+  while (_rendering.load(std::memory_order_acquire))
+    {
+    if (!_fill(chunk))
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+
+void music::_stop_rendering()
+  {
+  _rendering.store(false, std::memory_order_release);
+  if (_render_thread.joinable())
+    _render_thread.join();
+  }
+
+void music::pull(unsigned char* stream, int len)
+  {
+  int16_t* samples = (int16_t*)stream;
+  const size_t count = len / 2;
+  _callback_fill.store((uint32_t)(_ring.size() / _channels), std::memory_order_relaxed);
+  const size_t got = _ring.read(samples, count);
+  if (got >= _channels)
+    {
+    for (uint32_t j = 0; j < _channels; ++j)
+      _last_frame[j] = samples[got - _channels + j];
+    }
+  if (got < count)
+    {
+    // repeat the last frame instead of clicking to silence until the render thread catches up
+    _underruns.fetch_add(1, std::memory_order_relaxed);
+    for (size_t i = got; i < count; ++i)
+      samples[i] = _last_frame[(i - got) % _channels];
+    }
+  _played_frames.fetch_add(got / _channels, std::memory_order_relaxed);
+
+  record(stream, len);
+  }
+
+void music::set_song(std::unique_ptr<compiler>& c, const preprocess_settings& sett)
+  {
+  std::lock_guard<std::mutex> lock(_song_mutex);
+  std::swap(_comp, c);
+  const uint32_t sample_rate = (uint32_t)sett._sample_rate;
+  // the song plays on from _song_t, but the resampler starts over when its rates or quality change
+  if (sample_rate != _sample_rate || sett._resample_quality != _resampler.quality())
+    _resampler.reset(sample_rate, _device_rate, sett._resample_quality);
+  _sample_rate = sample_rate;
+  _float = sett._float;
+  _song_device_rate = (uint32_t)sett._device_rate;
+  _song_period = (uint32_t)sett._period;
+  }
+
+void music::set_render_ahead(uint32_t milliseconds)
+  {
+  _render_ahead = milliseconds < max_render_ahead ? milliseconds : max_render_ahead;
+  }
+
+void music::set_device_rate(uint32_t rate)
+  {
+  _requested_rate = std::min(std::max(rate, min_device_rate), max_device_rate);
+  }
+
+void music::set_period(uint32_t period)
+  {
+  _requested_period = min_period;
+  while (_requested_period < period && _requested_period < max_period)
+    _requested_period *= 2;
+  }
+
+double music::get_latency() const
+  {
+  if (_device == 0)
+    return 0.0;
+  const uint64_t frames = (uint64_t)_callback_fill.load(std::memory_order_relaxed) + _samples_per_go;
+  return (double)frames * 1000.0 / (double)_device_rate;
+  }
+
 int32_t music::run_left(uint64_t t)
   {
   _left_value = run(t, 0);
@@ -103,96 +208,155 @@ int32_t music::run_right(uint64_t t)
   return stereo ? run(t, 1) : _left_value;
   }
 
-void music::play()
+bool music::_open_device(uint32_t rate, uint32_t period, bool allow_rate_change)
   {
-  stop();
-  _playing = true;
-  SDL_AudioSpec wav_spec;
+  SDL_AudioSpec wav_spec, obtained;
   SDL_zero(wav_spec);
+  SDL_zero(obtained);
   wav_spec.callback = my_audio_callback;
   wav_spec.userdata = this;
   wav_spec.channels = (uint8_t)_channels;
   wav_spec.format = AUDIO_S16SYS;
-  wav_spec.freq = 44100;
+  wav_spec.freq = (int)rate;
   wav_spec.padding = 0;
-  wav_spec.samples = _samples_per_go;   
-  if (SDL_OpenAudio(&wav_spec, NULL) < 0) {
+  wav_spec.samples = (uint16_t)period;
+  // the device may pick another period, and at first another rate, but the samples stay 16 bit stereo
+  const int allowed = SDL_AUDIO_ALLOW_SAMPLES_CHANGE | (allow_rate_change ? SDL_AUDIO_ALLOW_FREQUENCY_CHANGE : 0);
+  _device = SDL_OpenAudioDevice(NULL, 0, &wav_spec, &obtained, allowed);
+  if (_device == 0)
+    return false;
+  _device_rate = (uint32_t)obtained.freq;
+  _samples_per_go = obtained.samples;
+  _underruns_at_open = underruns();
+  return true;
+  }
+
+void music::_close_device()
+  {
+  if (_device != 0)
+    {
+    SDL_CloseAudioDevice(_device);
+    _device = 0;
+    }
+  }
+
+void music::_start_rendering()
+  {
+  // room for the input of one chunk, so that the render thread does not need to allocate
+  _reserve_blocks(render_chunk_frames * (_sample_rate / _device_rate + 1) + _resampler.taps() + 1);
+  // the render ahead comes on top of the callback that the device asks for at once
+  const uint32_t ahead_frames = (uint32_t)((uint64_t)_ahead * _device_rate / 1000);
+  _ring_target = (size_t)(ahead_frames + _samples_per_go) * _channels;
+  _ring.reset(_ring_target + render_chunk_frames * _channels);
+  _callback_fill.store(0, std::memory_order_relaxed);
+
+  // the device starts with a full ring
+  std::vector<int16_t> chunk(render_chunk_frames * _channels);
+  while (_fill(chunk))
+    ;
+  _rendering.store(true, std::memory_order_release);
+  _render_thread = std::thread(&music::_render_loop, this);
+  }
+
+void music::play()
+  {
+  stop();
+  _playing = true;
+  const uint32_t rate = _song_device_rate ? _song_device_rate : _requested_rate;
+  const uint32_t period = _song_period ? _song_period : _requested_period;
+  // the low latency profile starts small, and adapt_latency grows it towards the requested period and render ahead
+  _ahead = _low_latency ? std::min(low_latency_render_ahead, _render_ahead) : _render_ahead;
+  _max_period = period;
+  if (!_open_device(rate, _low_latency ? std::min(low_latency_period, period) : period, true)) {
     printf("Couldn't open audio: %s\n", SDL_GetError());
     exit(-1);
     }
+  _resampler.reset(_sample_rate, _device_rate, _resampler.quality());
+  _last_frame[0] = _last_frame[1] = 0;
 
-  out = fopen(session_filename.c_str(), "wb");
-  if (out)
-    {
-    fwrite("RIFF----WAVEfmt ", 16, 1, out);
-    uint32_t val32 = 16; // no extension data
-    fwrite(&val32, 4, 1, out);
-    uint16_t val16 = 1; // PCM - integer samples
-    fwrite(&val16, 2, 1, out);
-    val16 = (uint16_t)_channels; // two channels
-    fwrite(&val16, 2, 1, out);
-    val32 = 44100;// _sample_rate; // samples per second (Hz)
-    fwrite(&val32, 4, 1, out);
-    val32 = 44100*16* _channels /8; // (Sample Rate * BitsPerSample * Channels) / 8
-    fwrite(&val32, 4, 1, out);
-    val16 = (uint16_t)(2* _channels); // data block size (size of two integer samples, one for each channel)
-    fwrite(&val16, 2, 1, out);
-    val16 = 16; // number of bits per sample (use a multiple of 8)
-    fwrite(&val16, 2, 1, out);
-    data_chunk_pos = ftell(out);
-    fwrite("data----", 8, 1, out);
+  // the recording is written by a thread of its own, so that the audio callback never waits for the disk
+  _recording.open(session_filename, _device_rate, _channels);
 
-    }
+  _start_rendering();
 
   _start = std::chrono::high_resolution_clock::now();
-  SDL_PauseAudio(0);
+  SDL_PauseAudioDevice(_device, 0);
 
   }
-  
-void music::toggle_pause()
+
+bool music::render_to_file(const std::string& filename, double seconds)
   {
-  _playing = !_playing;
-  if (_playing)
+  stop();
+  wav_writer file;
+  _device_rate = _song_device_rate ? _song_device_rate : _requested_rate;
+  uint64_t frames = (uint64_t)(seconds * _device_rate);
+  if (!file.open(filename, _device_rate, _channels))
+    return false;
+  _resampler.reset(_sample_rate, _device_rate, _resampler.quality());
+  _song_t = 0;
+  std::vector<int16_t> chunk(offline_chunk_frames * _channels);
+  while (frames > 0)
     {
-    SDL_PauseAudio(0);
-    } else
+    const uint32_t n = (uint32_t)std::min<uint64_t>(frames, offline_chunk_frames);
+    _render(chunk.data(), n);
+    file.write_all(chunk.data(), (size_t)n * _channels);
+    frames -= n;
+    }
+  file.close();
+  return true;
+  }
+
+bool music::adapt_latency()
+  {
+  if (!_playing || !_low_latency || _device == 0)
+    return false;
+  if (_samples_per_go >= _max_period && _ahead >= _render_ahead)
+    return false;
+  if (underruns() < _underruns_at_open + low_latency_fallback_underruns)
+    return false;
+  // the device keeps its rate, so that the recording stays valid
+  _close_device();
+  _stop_rendering();
+  _ahead = std::min(_ahead * 2, _render_ahead);
+  if (!_open_device(_device_rate, std::min((uint32_t)_samples_per_go * 2, _max_period), false))
     {
-    SDL_PauseAudio(1);
+    printf("Couldn't open audio: %s\n", SDL_GetError());
+    exit(-1);
     }
+  _start_rendering();
+  SDL_PauseAudioDevice(_device, 0);
+  return true;
+  }
+  
+void music::toggle_pause()
+  {
+  _playing = !_playing;
+  if (_device != 0)
+    SDL_PauseAudioDevice(_device, _playing ? 0 : 1);
   }
 
 void music::stop()
   {
   _playing = false;
-  SDL_CloseAudio();
-  if (out)
-    {
-    long file_length = ftell(out);
-    fseek(out, data_chunk_pos + 4, SEEK_SET);
-    uint32_t value = file_length - data_chunk_pos + 8;
-    fwrite(&value, 4, 1, out);
-    fseek(out, 4, SEEK_SET);
-    value = file_length - 8;
-    fwrite(&value, 4, 1, out);
-    fclose(out);
-    out = nullptr;
-    }
+  _close_device();
+  _stop_rendering();
+  _recording.close();
   }
 
 void music::reset_timer()
   {
   _start = std::chrono::high_resolution_clock::now();
-  current_t = 0;
+    {
+    std::lock_guard<std::mutex> lock(_song_mutex);
+    _song_t = 0;
+    _resampler.reset(_sample_rate, _device_rate, _resampler.quality());
+    }
+  _played_frames.store(0, std::memory_order_relaxed);
   }
 
 uint64_t music::get_timer() const
   {
-  return current_t;
-  }
-
-void music::set_sample_rate(uint32_t sample_rate)
-  {
-  _sample_rate = sample_rate;
+  return _played_frames.load(std::memory_order_relaxed);
   }
 
 uint64_t music::get_estimated_timer_based_on_clock() const
@@ -211,10 +375,7 @@ std::chrono::high_resolution_clock::time_point music::get_starting_point_clock()
 
 void music::record(unsigned char* stream, int len)
   {
-  if (out)
-    {
-    fwrite((const void*)stream, 1, len, out);
-    }
+  _recording.write((const int16_t*)stream, (size_t)len / 2);
   }
 
 void music::set_session_filename(const std::string& filename)
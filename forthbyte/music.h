@@ -4,14 +4,54 @@
 #include <vector>
 #include <fstream>
 
+#include <atomic>
 #include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "preprocessor.h"
+#include "resampler.h"
+#include "spsc_ring.h"
+#include "wav_writer.h"
 
 class compiler;
 
+/*
+The samples are rendered on a thread of their own, which keeps the ring _ring filled up to
+get_render_ahead() milliseconds beyond the samples that the audio device asked for. The audio
+callback only copies out of the ring, so that a song that is slow to evaluate, or that is
+recompiled, never stalls the device. When the ring runs short the callback repeats the last
+frame and counts an underrun. The song is only touched by the render thread, under
+_song_mutex, and is replaced as a whole by set_song.
+
+The render thread evaluates exactly the #samplerate samples of the song per second, in blocks,
+and converts them to the rate of the audio device with _resampler.
+
+The device opens at the rate and period (the frames of one callback) of set_device, or of the
+#devicerate and #period directives of the song, and keeps the rate and period that SDL
+negotiates. The low latency profile opens with a period of low_latency_period and a render
+ahead of low_latency_render_ahead, and adapt_latency doubles both, up to the requested ones,
+whenever low_latency_fallback_underruns underruns happened since the device was opened.
+*/
+
+constexpr uint32_t default_render_ahead = 50;
+constexpr uint32_t max_render_ahead = 2000;
+constexpr e_resample_quality default_resample_quality = RESAMPLE_SINC;
+constexpr uint32_t default_device_rate = 44100;
+constexpr uint32_t min_device_rate = 8000;
+constexpr uint32_t max_device_rate = 192000;
+constexpr uint32_t default_period = 4096;
+constexpr uint32_t min_period = 32;
+constexpr uint32_t max_period = 8192;
+constexpr uint32_t low_latency_period = 256;
+constexpr uint32_t low_latency_render_ahead = 10;
+constexpr uint64_t low_latency_fallback_underruns = 3;
+
 class music
   {
   public:
-    music(compiler* c);
+    music();
     ~music();
 
     void play();
@@ -24,7 +64,10 @@ class music
 
     uint64_t get_timer() const;
 
-    void set_sample_rate(uint32_t sample_rate);
+    // makes c the song that is played, with the sample rate, type, resampling and device of sett,
+    // and gives the previous song back in c, so that a song is compiled while the previous one
+    // plays on; a new device rate or period takes effect from the next play on
+    void set_song(std::unique_ptr<compiler>& c, const preprocess_settings& sett);
 
     uint32_t get_sample_rate() const { return _sample_rate; }
 
@@ -32,10 +75,6 @@ class music
 
     std::chrono::high_resolution_clock::time_point get_starting_point_clock();
 
-    void set_float() { _float = true; }
-
-    void set_byte() { _float = false; }
-
     bool is_float() const { return _float; }
 
     bool is_byte() const { return !_float; }
@@ -48,10 +87,64 @@ class music
 
     uint32_t channels() const { return _channels; }
 
+    // the milliseconds that the render thread stays ahead of the audio device, from the next play on
+    void set_render_ahead(uint32_t milliseconds);
+    uint32_t get_render_ahead() const { return _render_ahead; }
+
+    // the device rate, and the period rounded up to a power of two, for songs without
+    // #devicerate or #period, from the next play on
+    void set_device_rate(uint32_t rate);
+    void set_period(uint32_t period);
+    void set_low_latency(bool low_latency) { _low_latency = low_latency; }
+    bool is_low_latency() const { return _low_latency; }
+
+    // the rate and period that the device opened with
+    uint32_t get_device_rate() const { return _device_rate; }
+    uint32_t get_period() const { return _samples_per_go; }
+
+    // the milliseconds between rendering a frame and the device starting to play it: the frames
+    // that waited in the ring at the last callback plus the period that the device buffers
+    double get_latency() const;
+
+    // in the low latency profile, reopens the device with a longer period after underruns,
+    // returns true if it did; called regularly from the main thread
+    bool adapt_latency();
+
+    // the callbacks that found too few samples in the ring, and the rendered samples that did not fit in it
+    uint64_t underruns() const { return _underruns.load(std::memory_order_relaxed); }
+    uint64_t overruns() const { return _overruns.load(std::memory_order_relaxed); }
+
+    // renders the first seconds of the song at the device rate to a wav file, as fast as
+    // possible and without the audio device, returns false if the file cannot be made
+    bool render_to_file(const std::string& filename, double seconds);
+
+    // the samples of the session recording that were dropped because the disk fell behind
+    uint64_t recording_drops() const { return _recording.dropped(); }
+
+    // the audio callback: copies len bytes of interleaved 16 bit frames out of the ring
+    void pull(unsigned char* stream, int len);
+
     int32_t run(uint64_t t, int c);
     int32_t run_left(uint64_t t);
     int32_t run_right(uint64_t t);
 
+    // computes the samples t0, ..., t0+count-1 of both channels, see get_block
+    void run_block(uint64_t t0, uint32_t count);
+    const int32_t* get_block(uint32_t c) const { return _block[c].data(); }
+
+  private:
+    void _reserve_blocks(uint32_t count);
+    // renders the next frames at the device rate into out
+    void _render(int16_t* out, uint32_t frames);
+    // renders one chunk into the ring if it has room for it below the render ahead, returns false otherwise
+    bool _fill(std::vector<int16_t>& chunk);
+    void _render_loop();
+    // fills the ring and starts the render thread, for the opened device
+    void _start_rendering();
+    void _stop_rendering();
+    bool _open_device(uint32_t rate, uint32_t period, bool allow_rate_change);
+    void _close_device();
+
   private:
     uint32_t _sample_rate;
     uint16_t _samples_per_go;
@@ -60,10 +153,38 @@ class music
 
     bool _playing;
     bool _float;
-    FILE* out;
-    long data_chunk_pos;
-    compiler* _comp;
+    wav_writer _recording;
+    std::unique_ptr<compiler> _comp;
     int32_t _left_value;
+    std::vector<int32_t> _block[2];
+    std::vector<double> _float_block[2];
+    std::vector<unsigned char> _byte_block[2];
+
+    std::mutex _song_mutex;
+    std::thread _render_thread;
+    std::atomic<bool> _rendering;
+    spsc_ring<int16_t> _ring;
+    uint32_t _render_ahead;
+    // the render ahead of the device as it is opened now
+    uint32_t _ahead;
+    size_t _ring_target;
+    // an SDL_AudioDeviceID, 0 if the device is closed
+    uint32_t _device;
+    uint32_t _device_rate;
+    uint32_t _requested_rate, _requested_period;
+    uint32_t _song_device_rate, _song_period;
+    uint32_t _max_period;
+    bool _low_latency;
+    uint64_t _underruns_at_open;
+    // the sample of the song that is evaluated next
+    uint64_t _song_t;
+    resampler _resampler;
+    // only touched by the audio callback
+    int16_t _last_frame[2];
+    std::atomic<uint32_t> _callback_fill;
+    std::atomic<uint64_t> _played_frames;
+    std::atomic<uint64_t> _underruns;
+    std::atomic<uint64_t> _overruns;
     
     std::string session_filename;
   };
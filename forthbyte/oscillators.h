@@ -0,0 +1,114 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdint.h>
+#include <type_traits>
+
+/*
+One cycle of a sine, a sawtooth and a square wave, sampled once when the program starts, for
+the words osc-sin, osc-saw and osc-square.
+
+The phase counts cycles: a floating point phase of 0.25 is a quarter of a cycle, so that
+t 440 * sr / osc-sin plays an A, and the value between two table entries is interpolated
+linearly. Integers count 256ths of a cycle and read the nearest entry of a 256 entry table
+that holds values from 0 to 255, the range of bytebeat, so that t 2 * osc-saw is a ramp that
+repeats every 128 samples.
+
+The sawtooth and the square wave are summed from their first oscillator_tables::harmonics
+harmonics, with the Lanczos sigma factor against the ripple at the jumps, so they do not fold
+overtones above half the sample rate back into the audible range as long as the frequency
+stays below sample rate / (2 * harmonics).
+*/
+
+namespace forth
+  {
+
+  enum e_waveform
+    {
+    WAVE_SIN,
+    WAVE_SAW,
+    WAVE_SQUARE,
+    WAVE_COUNT
+    };
+
+  struct oscillator_tables
+    {
+    static constexpr int size = 1024;
+    static constexpr int harmonics = 32;
+    static constexpr int byte_size = 256;
+
+    // size entries for a cycle, and the first entries again after them, so that the
+    // interpolation at the end of a cycle stays in the table; a row fills whole cache lines
+    alignas(64) double values[WAVE_COUNT][size + 8];
+    alignas(64) int64_t bytes[WAVE_COUNT][byte_size];
+
+    oscillator_tables()
+      {
+      const double pi = 3.14159265358979323846;
+      for (int w = 0; w < WAVE_COUNT; ++w)
+        {
+        double peak = 0.0;
+        for (int i = 0; i < size; ++i)
+          {
+          const double x = 2.0 * pi * i / size;
+          double v = 0.0;
+          if (w == WAVE_SIN)
+            v = std::sin(x);
+          else
+            {
+            for (int k = 1; k <= harmonics; ++k)
+              {
+              if (w == WAVE_SQUARE && (k & 1) == 0)
+                continue;
+              const double s = pi * k / (harmonics + 1);
+              const double sigma = std::sin(s) / s;
+              v += sigma * std::sin(k * x) / k;
+              }
+            // the sawtooth rises from -1 to 1 over a cycle
+            if (w == WAVE_SAW)
+              v = -v;
+            }
+          values[w][i] = v;
+          peak = std::max(peak, std::abs(v));
+          }
+        for (int i = 0; i < size; ++i)
+          values[w][i] /= peak;
+        for (int i = size; i < size + 8; ++i)
+          values[w][i] = values[w][i - size];
+        for (int i = 0; i < byte_size; ++i)
+          {
+          const double v = std::round(values[w][i * (size / byte_size)] * 128.0 + 128.0);
+          bytes[w][i] = (int64_t)std::min(255.0, std::max(0.0, v));
+          }
+        }
+      }
+    };
+
+  inline const oscillator_tables oscillator_table_data;
+
+  inline double interpolated_oscillator(e_waveform w, double phase)
+    {
+    const double cycle = phase - std::floor(phase);
+    // inf and nan have no place in the cycle
+    if (!(cycle >= 0.0 && cycle <= 1.0))
+      return std::numeric_limits<double>::quiet_NaN();
+    const double x = cycle * oscillator_tables::size;
+    const int i = (int)x;
+    const double f = x - (double)i;
+    const double* table = oscillator_table_data.values[w];
+    const double a = table[i];
+    const double b = table[i + 1];
+    return a + f * (b - a);
+    }
+
+  template <class T>
+  inline T oscillator(e_waveform w, T phase)
+    {
+    if (std::is_floating_point<T>::value)
+      return (T)interpolated_oscillator(w, (double)phase);
+    return (T)oscillator_table_data.bytes[w][(int64_t)phase & (oscillator_tables::byte_size - 1)];
+    }
+
+  } // namespace forth
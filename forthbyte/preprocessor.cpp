@@ -9,6 +9,12 @@ preprocess_settings preprocess(text code)
   preprocess_settings out;
   bool _float = true;
   uint64_t sample_rate = 8000;
+  bool jit = true;
+  int64_t memory_size = 256;
+  int64_t control_rate = 64;
+  e_resample_quality resample = RESAMPLE_SINC;
+  uint64_t device_rate = 0;
+  uint64_t period = 0;
 
   auto it = code.begin();
   auto it_end = code.end();
@@ -38,6 +44,97 @@ preprocess_settings preprocess(text code)
       {
       _float = true;
       }
+    else if (first_word == L"#jit")
+      {
+      line_it += first_word.length();
+      while (line_it != line_it_end && (*line_it == L' ' || *line_it == L'\t'))
+        ++line_it;
+      std::wstring second_word = read_next_word(line_it, line_it_end);
+      if (second_word == L"off")
+        jit = false;
+      else if (second_word == L"on")
+        jit = true;
+      else
+        throw std::logic_error("#jit expects on or off");
+      }
+    else if (first_word == L"#memory")
+      {
+      line_it += first_word.length();
+      while (line_it != line_it_end && (*line_it == L' ' || *line_it == L'\t'))
+        ++line_it;
+      std::wstring second_word = read_next_word(line_it, line_it_end);
+      std::wstringstream str;
+      str << second_word;
+      if (!(str >> memory_size) || memory_size <= 0)
+        throw std::logic_error("#memory expects a positive number");
+      }
+    else if (first_word == L"#controlrate")
+      {
+      line_it += first_word.length();
+      while (line_it != line_it_end && (*line_it == L' ' || *line_it == L'\t'))
+        ++line_it;
+      std::wstring second_word = read_next_word(line_it, line_it_end);
+      std::wstringstream str;
+      str << second_word;
+      if (!(str >> control_rate) || control_rate <= 0)
+        throw std::logic_error("#controlrate expects a positive number");
+      }
+    else if (first_word == L"#resample")
+      {
+      line_it += first_word.length();
+      while (line_it != line_it_end && (*line_it == L' ' || *line_it == L'\t'))
+        ++line_it;
+      std::wstring second_word = read_next_word(line_it, line_it_end);
+      resample = resample_quality(jtk::convert_wstring_to_string(second_word));
+      if (resample == RESAMPLE_QUALITY_COUNT)
+        throw std::logic_error("#resample expects hold, linear, sinc or best");
+      }
+    else if (first_word == L"#devicerate")
+      {
+      line_it += first_word.length();
+      while (line_it != line_it_end && (*line_it == L' ' || *line_it == L'\t'))
+        ++line_it;
+      std::wstring second_word = read_next_word(line_it, line_it_end);
+      std::wstringstream str;
+      str << second_word;
+      if (!(str >> device_rate) || device_rate < 8000 || device_rate > 192000)
+        throw std::logic_error("#devicerate expects a rate from 8000 to 192000");
+      }
+    else if (first_word == L"#period")
+      {
+      line_it += first_word.length();
+      while (line_it != line_it_end && (*line_it == L' ' || *line_it == L'\t'))
+        ++line_it;
+      std::wstring second_word = read_next_word(line_it, line_it_end);
+      std::wstringstream str;
+      str << second_word;
+      if (!(str >> period) || period < 32 || period > 8192 || (period & (period - 1)) != 0)
+        throw std::logic_error("#period expects a power of two from 32 to 8192");
+      }
+    else if (first_word == L"#loadtable")
+      {
+      line_it += first_word.length();
+      while (line_it != line_it_end && (*line_it == L' ' || *line_it == L'\t'))
+        ++line_it;
+      std::wstring filename = read_next_word(line_it, line_it_end);
+      if (filename.empty())
+        throw std::logic_error("#loadtable expects a file name");
+      line_it += filename.length();
+      while (line_it != line_it_end && (*line_it == L' ' || *line_it == L'\t'))
+        ++line_it;
+      std::wstring offset_word = read_next_word(line_it, line_it_end);
+      table_file table;
+      table.filename = jtk::convert_wstring_to_string(filename);
+      table.offset = 0;
+      if (!offset_word.empty())
+        {
+        std::wstringstream str;
+        str << offset_word;
+        if (!(str >> table.offset) || table.offset < 0)
+          throw std::logic_error("#loadtable expects a memory offset that is not negative");
+        }
+      out.tables.push_back(table);
+      }
     else if (first_word == L"#initmemory")
       {
       std::wstring current_word = first_word;
@@ -63,6 +160,12 @@ preprocess_settings preprocess(text code)
     
   out._float = _float;
   out._sample_rate = sample_rate;
+  out._jit = jit;
+  out._memory_size = memory_size;
+  out._control_rate = control_rate;
+  out._resample_quality = resample;
+  out._device_rate = device_rate;
+  out._period = period;
   return out;
   }
 
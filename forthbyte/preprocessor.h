@@ -1,15 +1,30 @@
 #pragma once
 
 #include "buffer.h"
+#include "resampler.h"
 #include <stdint.h>
 #include <string>
 #include <vector>
 
+struct table_file
+  {
+  std::string filename;
+  int64_t offset;
+  };
+
 struct preprocess_settings
   {
   bool _float;
   uint64_t _sample_rate;
+  bool _jit;
+  int64_t _memory_size;
+  int64_t _control_rate;
+  e_resample_quality _resample_quality;
+  // 0 if the song leaves the device rate or the period to the command line
+  uint64_t _device_rate;
+  uint64_t _period;
   std::vector<std::string> init_memory;
+  std::vector<table_file> tables;
   };
 
 preprocess_settings preprocess(text code);
@@ -0,0 +1,253 @@
+#pragma once
+
+#include "simd.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/*
+Converts the samples of a song, computed at its own #samplerate, to the rate of the audio
+device, one stereo block at a time.
+
+Every output frame lies at an input position i + f, with i an integer and 0 <= f < 1, that is
+tracked exactly as a fraction of the device rate, so that the song never drifts. The frame is
+the dot product of the input samples i - half + 1, ..., i + half with the filter for f. The
+filters are tabulated for resample_phases values of f, and the filter of a frame is
+interpolated linearly between the two nearest of them (a polyphase filter bank).
+
+  - RESAMPLE_HOLD repeats every input sample until the next one, which keeps the harsh
+    aliasing of classic bytebeat (half = 1, with filters 1 0)
+  - RESAMPLE_LINEAR interpolates between two input samples (half = 1, with filters 1-f f)
+  - RESAMPLE_SINC and RESAMPLE_BEST use a Kaiser windowed sinc of 16 and 64 taps, cut off a
+    little below the lower of both Nyquist frequencies, and normalized to a gain of 1
+
+The windowed sincs are computed with AVX2 when the processor supports it. The output is
+delayed by half input samples, and the input before the first sample counts as silence.
+*/
+
+enum e_resample_quality
+  {
+  RESAMPLE_HOLD,
+  RESAMPLE_LINEAR,
+  RESAMPLE_SINC,
+  RESAMPLE_BEST,
+  RESAMPLE_QUALITY_COUNT
+  };
+
+constexpr int resample_phases = 256;
+
+inline const char* resample_quality_name(e_resample_quality quality)
+  {
+  static const char* const names[RESAMPLE_QUALITY_COUNT] = { "hold", "linear", "sinc", "best" };
+  return names[quality];
+  }
+
+// RESAMPLE_QUALITY_COUNT if name is not a quality
+inline e_resample_quality resample_quality(const std::string& name)
+  {
+  int quality = 0;
+  while (quality < RESAMPLE_QUALITY_COUNT && name != resample_quality_name((e_resample_quality)quality))
+    ++quality;
+  return (e_resample_quality)quality;
+  }
+
+#if defined(FORTH_SIMD_X86)
+// the frames of both channels for the filter r0 + frac (r1 - r0), taps is a multiple of 8
+FORTH_TARGET_AVX2 inline void resample_frame_avx2(const float* r0, const float* r1, float frac, const float* left, const float* right, int taps, float& out_left, float& out_right)
+  {
+  const __m256 f = _mm256_set1_ps(frac);
+  __m256 sum_left = _mm256_setzero_ps();
+  __m256 sum_right = _mm256_setzero_ps();
+  for (int k = 0; k < taps; k += 8)
+    {
+    const __m256 a = _mm256_loadu_ps(r0 + k);
+    const __m256 c = _mm256_fmadd_ps(f, _mm256_sub_ps(_mm256_loadu_ps(r1 + k), a), a);
+    sum_left = _mm256_fmadd_ps(c, _mm256_loadu_ps(left + k), sum_left);
+    sum_right = _mm256_fmadd_ps(c, _mm256_loadu_ps(right + k), sum_right);
+    }
+  // both sums at once: the low halves of (l0+l4 ... l3+l7) and (r0+r4 ... r3+r7) side by side
+  const __m128 l = _mm_add_ps(_mm256_castps256_ps128(sum_left), _mm256_extractf128_ps(sum_left, 1));
+  const __m128 r = _mm_add_ps(_mm256_castps256_ps128(sum_right), _mm256_extractf128_ps(sum_right, 1));
+  const __m128 h = _mm_hadd_ps(l, r);
+  const __m128 s = _mm_hadd_ps(h, h);
+  out_left = _mm_cvtss_f32(s);
+  out_right = _mm_cvtss_f32(_mm_shuffle_ps(s, s, 1));
+  }
+#endif
+
+inline void resample_frame(const float* r0, const float* r1, float frac, const float* left, const float* right, int taps, float& out_left, float& out_right)
+  {
+  float sum_left = 0.f;
+  float sum_right = 0.f;
+  for (int k = 0; k < taps; ++k)
+    {
+    const float c = r0[k] + frac * (r1[k] - r0[k]);
+    sum_left += c * left[k];
+    sum_right += c * right[k];
+    }
+  out_left = sum_left;
+  out_right = sum_right;
+  }
+
+class resampler
+  {
+  public:
+    resampler() : _avx2(forth::cpu_supports_avx2())
+      {
+      reset(44100, 44100, RESAMPLE_HOLD);
+      }
+
+    // forgets the input, and converts from input_rate to output_rate from now on
+    void reset(uint32_t input_rate, uint32_t output_rate, e_resample_quality quality)
+      {
+      _in = input_rate > 0 ? input_rate : 1;
+      _out = output_rate > 0 ? output_rate : 1;
+      _quality = quality;
+      _step = _in / _out;
+      _step_rem = _in % _out;
+      _rem = 0;
+      _phase_scale = (double)resample_phases / (double)_out;
+      _make_table();
+      for (int c = 0; c < 2; ++c)
+        _input[c].assign(_half - 1, 0.f);
+      _center = _half - 1;
+      }
+
+    uint32_t input_rate() const { return _in; }
+    uint32_t output_rate() const { return _out; }
+    e_resample_quality quality() const { return _quality; }
+    int taps() const { return _taps; }
+
+    // the input frames to push before process can make frames output frames
+    uint32_t input_needed(uint32_t frames) const
+      {
+      if (frames == 0)
+        return 0;
+      const uint64_t last = _center + ((uint64_t)_rem + (uint64_t)(frames - 1) * _in) / _out;
+      const uint64_t end = last + _half + 1;
+      return end > _input[0].size() ? (uint32_t)(end - _input[0].size()) : 0;
+      }
+
+    // appends count input frames, left and right
+    void push(const int32_t* left, const int32_t* right, uint32_t count)
+      {
+      const int32_t* channels[2] = { left, right };
+      for (int c = 0; c < 2; ++c)
+        {
+        const size_t size = _input[c].size();
+        _input[c].resize(size + count);
+        for (uint32_t i = 0; i < count; ++i)
+          _input[c][size + i] = (float)channels[c][i];
+        }
+      }
+
+    // writes frames output frames of channels (1 or 2) interleaved values, after input_needed(frames) input frames were pushed
+    void process(int16_t* out, uint32_t frames, uint32_t channels)
+      {
+      const bool avx2 = _avx2 && _taps % 8 == 0;
+      for (uint32_t n = 0; n < frames; ++n)
+        {
+        const double x = (double)_rem * _phase_scale;
+        const int p = (int)x;
+        const float frac = (float)(x - (double)p);
+        const float* r0 = &_table[(size_t)p * _taps];
+        const size_t first = _center + 1 - _half;
+        float frame[2];
+#if defined(FORTH_SIMD_X86)
+        if (avx2)
+          resample_frame_avx2(r0, r0 + _taps, frac, &_input[0][first], &_input[1][first], _taps, frame[0], frame[1]);
+        else
+#endif
+          resample_frame(r0, r0 + _taps, frac, &_input[0][first], &_input[1][first], _taps, frame[0], frame[1]);
+        for (uint32_t c = 0; c < channels; ++c)
+          {
+          const float v = std::floor(frame[c] + 0.5f);
+          out[channels * n + c] = (int16_t)(v < -32768.f ? -32768.f : (v > 32767.f ? 32767.f : v));
+          }
+        _center += _step;
+        _rem += _step_rem;
+        if (_rem >= _out)
+          {
+          _rem -= _out;
+          ++_center;
+          }
+        }
+      // keeps the input from the first sample of the next frame on, which when downsampling
+      // can lie beyond the input that was pushed so far
+      const size_t first = std::min(_center + 1 - _half, _input[0].size());
+      for (int c = 0; c < 2; ++c)
+        _input[c].erase(_input[c].begin(), _input[c].begin() + first);
+      _center -= first;
+      }
+
+  private:
+    static double _bessel_i0(double x)
+      {
+      double sum = 1.0;
+      double term = 1.0;
+      for (int k = 1; k < 32; ++k)
+        {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+        }
+      return sum;
+      }
+
+    void _make_table()
+      {
+      const double pi = 3.14159265358979323846;
+      _half = _quality >= RESAMPLE_SINC ? (_quality == RESAMPLE_BEST ? 32 : 8) : 1;
+      _taps = 2 * _half;
+      // resample_phases + 1 rows, so that every phase has a next one to interpolate with
+      _table.assign((size_t)(resample_phases + 1) * _taps, 0.f);
+      const double ratio = _out < _in ? (double)_out / (double)_in : 1.0;
+      const double cutoff = 0.5 * ratio * (_quality == RESAMPLE_BEST ? 0.94 : 0.85);
+      const double beta = _quality == RESAMPLE_BEST ? 9.0 : 6.0;
+      for (int p = 0; p <= resample_phases; ++p)
+        {
+        const double f = (double)p / (double)resample_phases;
+        float* row = &_table[(size_t)p * _taps];
+        if (_quality == RESAMPLE_HOLD)
+          {
+          // also the last row, so that interpolating towards it keeps holding
+          row[0] = 1.f;
+          continue;
+          }
+        if (_quality == RESAMPLE_LINEAR)
+          {
+          row[0] = (float)(1.0 - f);
+          row[1] = (float)f;
+          continue;
+          }
+        double sum = 0.0;
+        std::vector<double> h(_taps);
+        for (int k = 0; k < _taps; ++k)
+          {
+          // the distance of tap k, at input sample i - half + 1 + k, to the position i + f
+          const double d = (double)(k - _half + 1) - f;
+          const double x = 2.0 * cutoff * d;
+          const double sinc = std::fabs(x) < 1e-12 ? 1.0 : std::sin(pi * x) / (pi * x);
+          const double w = d / (double)_half;
+          const double window = std::fabs(w) >= 1.0 ? 0.0 : _bessel_i0(beta * std::sqrt(1.0 - w * w)) / _bessel_i0(beta);
+          h[k] = sinc * window;
+          sum += h[k];
+          }
+        for (int k = 0; k < _taps; ++k)
+          row[k] = (float)(h[k] / sum);
+        }
+      }
+
+  private:
+    uint32_t _in, _out;
+    e_resample_quality _quality;
+    uint32_t _step, _step_rem, _rem;
+    double _phase_scale;
+    int _half, _taps;
+    std::vector<float> _table;
+    std::vector<float> _input[2];
+    size_t _center;
+    bool _avx2;
+  };
@@ -0,0 +1,606 @@
+#pragma once
+
+#include "forth.h"
+
+#include <cmath>
+#include <stdint.h>
+
+/*
+Vectorized kernels for interpreter::eval_block.
+
+simd_lane_kernels<T>() returns the AVX2 (+FMA) kernels when the processor supports them, and
+nullptr otherwise, in which case eval_block keeps using the scalar primitives.
+
+Accuracy with respect to the scalar primitives:
+  - bit exact: + - * / % min max < > <= >= = <> floor ceil abs negate sqrt osc-sin osc-saw
+    osc-square, the filters, and every int64_t kernel
+  - sin, cos: at most 2 ulp for |x| < 2^28; larger arguments, inf and nan use std::sin / std::cos
+  - tan: at most 4 ulp for |x| < 2^28, except within a few ulp of a pole
+  - exp: at most 2 ulp; results in the subnormal range use std::exp
+  - log: at most 2 ulp for normal positive x; everything else uses std::log
+  - pow: integer exponents |b| <= 64 use repeated squaring, which is exact when the result is
+         exactly representable and within 1 ulp per multiplication (at most 14 ulp) otherwise;
+         other exponents have a relative error of at most (2 |b log a| + 4) ulp;
+         a <= 0, non-finite input and subnormal results use std::pow
+The tolerances are verified by simd_tests.cpp.
+*/
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define FORTH_SIMD_X86
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define FORTH_TARGET_AVX2
+#define FORTH_TARGET_AVX2_NO_FMA
+#else
+#define FORTH_TARGET_AVX2 __attribute__((target("avx2,fma")))
+// for kernels that must round like the scalar code, which the compiler would otherwise fuse
+// into fused multiply adds
+#define FORTH_TARGET_AVX2_NO_FMA __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace forth
+  {
+
+  inline bool cpu_supports_avx2()
+    {
+#if defined(FORTH_SIMD_X86)
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+      return false;
+    __cpuid(info, 1);
+    bool fma = (info[2] & (1 << 12)) != 0;
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    if (!fma || !osxsave || (_xgetbv(0) & 6) != 6)
+      return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+#else
+    return false;
+#endif
+    }
+
+#if defined(FORTH_SIMD_X86)
+
+  namespace simd
+    {
+
+    FORTH_TARGET_AVX2 inline __m256d set1(double d)
+      {
+      return _mm256_set1_pd(d);
+      }
+
+    FORTH_TARGET_AVX2 inline bool all_lanes(__m256d mask)
+      {
+      return _mm256_movemask_pd(mask) == 15;
+      }
+
+    template <int M>
+    FORTH_TARGET_AVX2 inline __m256d polynomial(__m256d x, const double(&c)[M])
+      {
+      __m256d r = set1(c[0]);
+      for (int i = 1; i < M; ++i)
+        r = _mm256_fmadd_pd(r, x, set1(c[i]));
+      return r;
+      }
+
+    // same as polynomial, but with an implicit leading coefficient 1
+    template <int M>
+    FORTH_TARGET_AVX2 inline __m256d polynomial1(__m256d x, const double(&c)[M])
+      {
+      __m256d r = _mm256_add_pd(x, set1(c[0]));
+      for (int i = 1; i < M; ++i)
+        r = _mm256_fmadd_pd(r, x, set1(c[i]));
+      return r;
+      }
+
+    // converts integral doubles in [-2^31, 2^31) to int64 lanes
+    FORTH_TARGET_AVX2 inline __m256i to_int64(__m256d x)
+      {
+      return _mm256_cvtepi32_epi64(_mm256_cvttpd_epi32(x));
+      }
+
+    // 2^n for int64 lanes n in [-1022, 1023]
+    FORTH_TARGET_AVX2 inline __m256d exp2_int(__m256i n)
+      {
+      return _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_add_epi64(n, _mm256_set1_epi64x(1023)), 52));
+      }
+
+    template <class F>
+    FORTH_TARGET_AVX2 inline __m256d scalar_lanes(__m256d x, F f)
+      {
+      alignas(32) double v[4];
+      _mm256_store_pd(v, x);
+      for (int i = 0; i < 4; ++i)
+        v[i] = f(v[i]);
+      return _mm256_load_pd(v);
+      }
+
+    template <class F>
+    FORTH_TARGET_AVX2 inline __m256d scalar_lanes(__m256d x, __m256d y, F f)
+      {
+      alignas(32) double v[4];
+      alignas(32) double w[4];
+      _mm256_store_pd(v, x);
+      _mm256_store_pd(w, y);
+      for (int i = 0; i < 4; ++i)
+        v[i] = f(v[i], w[i]);
+      return _mm256_load_pd(v);
+      }
+
+    // Cephes style argument reduction to [-pi/4, pi/4]. Returns sin (or cos if cosine is true),
+    // and optionally the cosine (sine) counterpart in other, which is used by tan.
+    FORTH_TARGET_AVX2 inline __m256d sin_cos_reduced(__m256d x, bool cosine, __m256d* other)
+      {
+      static const double sin_coefficients[] = { 1.58962301576546568060E-10, -2.50507477628578072866E-8, 2.75573136213857245213E-6, -1.98412698295895385996E-4, 8.33333333332211858878E-3, -1.66666666666666307295E-1 };
+      static const double cos_coefficients[] = { -1.13585365213876817300E-11, 2.08757008419747316778E-9, -2.75573141792967388112E-7, 2.48015872888517045348E-5, -1.38888888888730564116E-3, 4.16666666666665929218E-2 };
+      const __m256d sign_mask = set1(-0.0);
+      __m256d sign = cosine ? _mm256_setzero_pd() : _mm256_and_pd(x, sign_mask);
+      x = _mm256_andnot_pd(sign_mask, x);
+      __m256d y = _mm256_floor_pd(_mm256_mul_pd(x, set1(1.27323954473516268615))); // 4/pi
+      __m256i j = to_int64(y);
+      // make the octant even
+      __m256i odd = _mm256_and_si256(j, _mm256_set1_epi64x(1));
+      j = _mm256_add_epi64(j, odd);
+      y = _mm256_add_pd(y, _mm256_and_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(odd, _mm256_set1_epi64x(1))), set1(1.0)));
+      __m256i q = _mm256_srli_epi64(j, 1);
+      if (cosine)
+        q = _mm256_add_epi64(q, _mm256_set1_epi64x(1));
+      __m256d z = _mm256_fnmadd_pd(y, set1(7.85398125648498535156E-1), x);
+      z = _mm256_fnmadd_pd(y, set1(3.77489470793079817668E-8), z);
+      z = _mm256_fnmadd_pd(y, set1(2.69515142907905952645E-15), z);
+      __m256d zz = _mm256_mul_pd(z, z);
+      __m256d s = _mm256_fmadd_pd(_mm256_mul_pd(z, zz), polynomial(zz, sin_coefficients), z);
+      __m256d c = _mm256_fmadd_pd(_mm256_mul_pd(zz, zz), polynomial(zz, cos_coefficients), _mm256_fnmadd_pd(set1(0.5), zz, set1(1.0)));
+      __m256d use_cos = _mm256_castsi256_pd(_mm256_cmpeq_epi64(_mm256_and_si256(q, _mm256_set1_epi64x(1)), _mm256_set1_epi64x(1)));
+      __m256d flip = _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_and_si256(q, _mm256_set1_epi64x(2)), 62));
+      __m256d result = _mm256_xor_pd(_mm256_xor_pd(_mm256_blendv_pd(s, c, use_cos), flip), sign);
+      if (other)
+        {
+        // the counterpart lives one quadrant further
+        __m256i q1 = _mm256_add_epi64(q, _mm256_set1_epi64x(1));
+        __m256d flip1 = _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_and_si256(q1, _mm256_set1_epi64x(2)), 62));
+        *other = _mm256_xor_pd(_mm256_blendv_pd(c, s, use_cos), flip1);
+        }
+      return result;
+      }
+
+    FORTH_TARGET_AVX2 inline __m256d reducible(__m256d x)
+      {
+      return _mm256_cmp_pd(_mm256_andnot_pd(set1(-0.0), x), set1(268435456.0), _CMP_LT_OQ); // 2^28
+      }
+
+    FORTH_TARGET_AVX2 inline __m256d sin_pd(__m256d x)
+      {
+      if (!all_lanes(reducible(x)))
+        return scalar_lanes(x, [](double a) { return std::sin(a); });
+      return sin_cos_reduced(x, false, nullptr);
+      }
+
+    FORTH_TARGET_AVX2 inline __m256d cos_pd(__m256d x)
+      {
+      if (!all_lanes(reducible(x)))
+        return scalar_lanes(x, [](double a) { return std::cos(a); });
+      return sin_cos_reduced(x, true, nullptr);
+      }
+
+    FORTH_TARGET_AVX2 inline __m256d tan_pd(__m256d x)
+      {
+      if (!all_lanes(reducible(x)))
+        return scalar_lanes(x, [](double a) { return std::tan(a); });
+      __m256d c;
+      __m256d s = sin_cos_reduced(x, false, &c);
+      return _mm256_div_pd(s, c);
+      }
+
+    // exp for lanes that are known to give a normal or infinite result
+    FORTH_TARGET_AVX2 inline __m256d exp_unchecked(__m256d x)
+      {
+      static const double p[] = { 1.26177193074810590878E-4, 3.02994407707441961300E-2, 9.99999999999999999910E-1 };
+      static const double q[] = { 3.00198505138664455042E-6, 2.52448340349684104192E-3, 2.27265548208155028766E-1, 2.00000000000000000009E0 };
+      __m256d overflow = _mm256_cmp_pd(x, set1(7.09782712893383996843E2), _CMP_GT_OQ);
+      x = _mm256_min_pd(x, set1(7.09782712893383996843E2));
+      __m256d n = _mm256_floor_pd(_mm256_fmadd_pd(x, set1(1.4426950408889634073599), set1(0.5))); // log2(e)
+      x = _mm256_fnmadd_pd(n, set1(6.93145751953125E-1), x);
+      x = _mm256_fnmadd_pd(n, set1(1.42860682030941723212E-6), x);
+      __m256d xx = _mm256_mul_pd(x, x);
+      __m256d px = _mm256_mul_pd(x, polynomial(xx, p));
+      x = _mm256_div_pd(px, _mm256_sub_pd(polynomial(xx, q), px));
+      x = _mm256_fmadd_pd(x, set1(2.0), set1(1.0));
+      // n can be 1024, so scale in two steps
+      __m256i ni = to_int64(n);
+      __m256i n1 = _mm256_srai_epi32(ni, 1); // ni is in [-1022, 1024], so the upper halves are sign bits
+      n1 = _mm256_cvtepi32_epi64(_mm256_castsi256_si128(_mm256_permutevar8x32_epi32(n1, _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6))));
+      __m256i n2 = _mm256_sub_epi64(ni, n1);
+      x = _mm256_mul_pd(_mm256_mul_pd(x, exp2_int(n1)), exp2_int(n2));
+      return _mm256_blendv_pd(x, set1(std::numeric_limits<double>::infinity()), overflow);
+      }
+
+    FORTH_TARGET_AVX2 inline __m256d exp_pd(__m256d x)
+      {
+      // below -708.39 the result is subnormal (or zero, but we leave that to std::exp as well)
+      __m256d ok = _mm256_cmp_pd(x, set1(-7.08396418532264106224E2), _CMP_GE_OQ);
+      if (!all_lanes(ok))
+        return scalar_lanes(x, [](double a) { return std::exp(a); });
+      return exp_unchecked(x);
+      }
+
+    // log for normal positive finite lanes
+    FORTH_TARGET_AVX2 inline __m256d log_unchecked(__m256d x)
+      {
+      static const double p[] = { 1.01875663804580931796E-4, 4.97494994976747001425E-1, 4.70579119878881725854E0, 1.44989225341610930846E1, 1.79368678507819816313E1, 7.70838733755885391666E0 };
+      static const double q[] = { 1.12873587189167450590E1, 4.52279145837532221105E1, 8.29875266912776603211E1, 7.11544750618563894466E1, 2.31251620126765340583E1 };
+      __m256i bits = _mm256_castpd_si256(x);
+      // frexp: x = m * 2^e with m in [0.5, 1)
+      __m256i exponent = _mm256_srli_epi64(bits, 52);
+      __m256d e = _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(exponent, _mm256_castpd_si256(set1(4503599627370496.0)))), set1(4503599627370496.0 + 1022.0)); // 2^52
+      __m256d m = _mm256_castsi256_pd(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi64x(0x000fffffffffffffll)), _mm256_set1_epi64x(0x3fe0000000000000ll)));
+      __m256d small = _mm256_cmp_pd(m, set1(0.70710678118654752440), _CMP_LT_OQ);
+      e = _mm256_sub_pd(e, _mm256_and_pd(small, set1(1.0)));
+      x = _mm256_sub_pd(_mm256_add_pd(m, _mm256_and_pd(small, m)), set1(1.0));
+      __m256d z = _mm256_mul_pd(x, x);
+      __m256d y = _mm256_mul_pd(x, _mm256_div_pd(_mm256_mul_pd(z, polynomial(x, p)), polynomial1(x, q)));
+      y = _mm256_fnmadd_pd(e, set1(2.121944400546905827679e-4), y);
+      y = _mm256_fnmadd_pd(set1(0.5), z, y);
+      z = _mm256_add_pd(x, y);
+      return _mm256_fmadd_pd(e, set1(0.693359375), z);
+      }
+
+    FORTH_TARGET_AVX2 inline __m256d normal_positive(__m256d x)
+      {
+      __m256d lower = _mm256_cmp_pd(x, set1(std::numeric_limits<double>::min()), _CMP_GE_OQ);
+      __m256d upper = _mm256_cmp_pd(x, set1(std::numeric_limits<double>::max()), _CMP_LE_OQ);
+      return _mm256_and_pd(lower, upper);
+      }
+
+    FORTH_TARGET_AVX2 inline __m256d log_pd(__m256d x)
+      {
+      if (!all_lanes(normal_positive(x)))
+        return scalar_lanes(x, [](double a) { return std::log(a); });
+      return log_unchecked(x);
+      }
+
+    FORTH_TARGET_AVX2 inline __m256d pow_pd(__m256d a, __m256d b)
+      {
+      __m256d b_abs = _mm256_andnot_pd(set1(-0.0), b);
+      __m256d ok = _mm256_and_pd(normal_positive(a), _mm256_cmp_pd(b_abs, set1(std::numeric_limits<double>::max()), _CMP_LE_OQ));
+      if (!all_lanes(ok))
+        return scalar_lanes(a, b, [](double x, double y) { return std::pow(x, y); });
+      __m256d integral = _mm256_and_pd(_mm256_cmp_pd(_mm256_floor_pd(b), b, _CMP_EQ_OQ), _mm256_cmp_pd(b_abs, set1(64.0), _CMP_LE_OQ));
+      if (all_lanes(integral))
+        {
+        // binary powering keeps results like 3^5 exact
+        __m256i n = to_int64(b_abs);
+        __m256d result = set1(1.0);
+        __m256d base = a;
+        for (int bit = 0; bit < 7; ++bit)
+          {
+          __m256d use = _mm256_castsi256_pd(_mm256_cmpeq_epi64(_mm256_and_si256(n, _mm256_set1_epi64x(1ll << bit)), _mm256_set1_epi64x(1ll << bit)));
+          result = _mm256_blendv_pd(result, _mm256_mul_pd(result, base), use);
+          base = _mm256_mul_pd(base, base);
+          }
+        __m256d negative = _mm256_cmp_pd(b, _mm256_setzero_pd(), _CMP_LT_OQ);
+        result = _mm256_blendv_pd(result, _mm256_div_pd(set1(1.0), result), negative);
+        // overflow or underflow on the way gives an inexact result, let std::pow decide
+        if (all_lanes(normal_positive(result)))
+          return result;
+        return scalar_lanes(a, b, [](double x, double y) { return std::pow(x, y); });
+        }
+      __m256d y = _mm256_mul_pd(b, log_unchecked(a));
+      __m256d ok_exp = _mm256_cmp_pd(y, set1(-7.08396418532264106224E2), _CMP_GE_OQ);
+      if (!all_lanes(ok_exp))
+        return scalar_lanes(a, b, [](double x, double y) { return std::pow(x, y); });
+      return exp_unchecked(y);
+      }
+
+    FORTH_TARGET_AVX2 inline __m256d mod_pd(__m256d a, __m256d b)
+      {
+      // |a| - q|b| is exact when q is the correct quotient, and q is off by at most one
+      const __m256d sign_mask = set1(-0.0);
+      __m256d a_abs = _mm256_andnot_pd(sign_mask, a);
+      __m256d b_abs = _mm256_andnot_pd(sign_mask, b);
+      __m256d q = _mm256_round_pd(_mm256_div_pd(a_abs, b_abs), _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+      __m256d ok = _mm256_and_pd(_mm256_cmp_pd(q, set1(4503599627370496.0), _CMP_LT_OQ), _mm256_cmp_pd(b_abs, set1(std::numeric_limits<double>::min()), _CMP_GE_OQ));
+      ok = _mm256_and_pd(ok, _mm256_cmp_pd(b_abs, set1(std::numeric_limits<double>::max()), _CMP_LE_OQ));
+      if (!all_lanes(ok))
+        return scalar_lanes(a, b, [](double x, double y) { return std::fmod(x, y); });
+      __m256d r = _mm256_fnmadd_pd(q, b_abs, a_abs);
+      r = _mm256_add_pd(r, _mm256_and_pd(_mm256_cmp_pd(r, _mm256_setzero_pd(), _CMP_LT_OQ), b_abs));
+      r = _mm256_sub_pd(r, _mm256_and_pd(_mm256_cmp_pd(r, b_abs, _CMP_GE_OQ), b_abs));
+      return _mm256_or_pd(r, _mm256_and_pd(a, sign_mask));
+      }
+
+    FORTH_TARGET_AVX2 inline __m256d truth_pd(__m256d mask)
+      {
+      return _mm256_and_pd(mask, set1(1.0));
+      }
+
+    struct add_pd { static FORTH_TARGET_AVX2 __m256d apply(__m256d a, __m256d b) { return _mm256_add_pd(a, b); } static double scalar(double a, double b) { return a + b; } };
+    struct sub_pd { static FORTH_TARGET_AVX2 __m256d apply(__m256d a, __m256d b) { return _mm256_sub_pd(a, b); } static double scalar(double a, double b) { return a - b; } };
+    struct mul_pd
+      {
+      static FORTH_TARGET_AVX2 __m256d apply(__m256d a, __m256d b)
+        {
+        __m256d zero = _mm256_or_pd(_mm256_cmp_pd(a, _mm256_setzero_pd(), _CMP_EQ_OQ), _mm256_cmp_pd(b, _mm256_setzero_pd(), _CMP_EQ_OQ));
+        return _mm256_andnot_pd(zero, _mm256_mul_pd(a, b));
+        }
+      static double scalar(double a, double b) { return multiply(a, b); }
+      };
+    struct div_pd
+      {
+      static FORTH_TARGET_AVX2 __m256d apply(__m256d a, __m256d b)
+        {
+        __m256d zero = _mm256_cmp_pd(b, _mm256_setzero_pd(), _CMP_EQ_OQ);
+        return _mm256_blendv_pd(_mm256_div_pd(a, b), set1(std::numeric_limits<double>::infinity()), zero);
+        }
+      static double scalar(double a, double b) { return divide(a, b); }
+      };
+    struct mod_op_pd { static FORTH_TARGET_AVX2 __m256d apply(__m256d a, __m256d b) { return mod_pd(a, b); } static double scalar(double a, double b) { return modulo(a, b); } };
+    struct less_pd { static FORTH_TARGET_AVX2 __m256d apply(__m256d a, __m256d b) { return truth_pd(_mm256_cmp_pd(a, b, _CMP_LT_OQ)); } static double scalar(double a, double b) { return truth<double>(a < b); } };
+    struct greater_pd { static FORTH_TARGET_AVX2 __m256d apply(__m256d a, __m256d b) { return truth_pd(_mm256_cmp_pd(a, b, _CMP_GT_OQ)); } static double scalar(double a, double b) { return truth<double>(a > b); } };
+    struct leq_pd { static FORTH_TARGET_AVX2 __m256d apply(__m256d a, __m256d b) { return truth_pd(_mm256_cmp_pd(a, b, _CMP_LE_OQ)); } static double scalar(double a, double b) { return truth<double>(a <= b); } };
+    struct geq_pd { static FORTH_TARGET_AVX2 __m256d apply(__m256d a, __m256d b) { return truth_pd(_mm256_cmp_pd(a, b, _CMP_GE_OQ)); } static double scalar(double a, double b) { return truth<double>(a >= b); } };
+    struct eq_pd { static FORTH_TARGET_AVX2 __m256d apply(__m256d a, __m256d b) { return truth_pd(_mm256_cmp_pd(a, b, _CMP_EQ_OQ)); } static double scalar(double a, double b) { return truth<double>(a == b); } };
+    struct neq_pd { static FORTH_TARGET_AVX2 __m256d apply(__m256d a, __m256d b) { return truth_pd(_mm256_cmp_pd(a, b, _CMP_NEQ_UQ)); } static double scalar(double a, double b) { return truth<double>(a != b); } };
+    struct min_pd { static FORTH_TARGET_AVX2 __m256d apply(__m256d a, __m256d b) { return _mm256_min_pd(a, b); } static double scalar(double a, double b) { return a < b ? a : b; } };
+    struct max_pd { static FORTH_TARGET_AVX2 __m256d apply(__m256d a, __m256d b) { return _mm256_max_pd(a, b); } static double scalar(double a, double b) { return a > b ? a : b; } };
+    struct pow_op_pd { static FORTH_TARGET_AVX2 __m256d apply(__m256d a, __m256d b) { return pow_pd(a, b); } static double scalar(double a, double b) { return std::pow(a, b); } };
+    struct not_pd { static FORTH_TARGET_AVX2 __m256d apply(__m256d a) { return truth_pd(_mm256_cmp_pd(a, _mm256_setzero_pd(), _CMP_EQ_OQ)); } static double scalar(double a) { return not_value(a); } };
+    struct sin_op_pd { static FORTH_TARGET_AVX2 __m256d apply(__m256d a) { return sin_pd(a); } static double scalar(double a) { return std::sin(a); } };
+    struct cos_op_pd { static FORTH_TARGET_AVX2 __m256d apply(__m256d a) { return cos_pd(a); } static double scalar(double a) { return std::cos(a); } };
+    struct tan_op_pd { static FORTH_TARGET_AVX2 __m256d apply(__m256d a) { return tan_pd(a); } static double scalar(double a) { return std::tan(a); } };
+    struct exp_op_pd { static FORTH_TARGET_AVX2 __m256d apply(__m256d a) { return exp_pd(a); } static double scalar(double a) { return std::exp(a); } };
+    struct log_op_pd { static FORTH_TARGET_AVX2 __m256d apply(__m256d a) { return log_pd(a); } static double scalar(double a) { return std::log(a); } };
+    struct sqrt_pd { static FORTH_TARGET_AVX2 __m256d apply(__m256d a) { return _mm256_sqrt_pd(a); } static double scalar(double a) { return std::sqrt(a); } };
+    struct floor_pd { static FORTH_TARGET_AVX2 __m256d apply(__m256d a) { return _mm256_floor_pd(a); } static double scalar(double a) { return std::floor(a); } };
+    struct ceil_pd { static FORTH_TARGET_AVX2 __m256d apply(__m256d a) { return _mm256_ceil_pd(a); } static double scalar(double a) { return std::ceil(a); } };
+    struct abs_pd { static FORTH_TARGET_AVX2 __m256d apply(__m256d a) { return _mm256_andnot_pd(set1(-0.0), a); } static double scalar(double a) { return std::abs(a); } };
+    struct negate_pd { static FORTH_TARGET_AVX2 __m256d apply(__m256d a) { return _mm256_xor_pd(set1(-0.0), a); } static double scalar(double a) { return -a; } };
+
+    FORTH_TARGET_AVX2 inline __m256i not_epi64(__m256i a)
+      {
+      return _mm256_xor_si256(a, _mm256_set1_epi64x(-1));
+      }
+
+    struct add_epi64 { static FORTH_TARGET_AVX2 __m256i apply(__m256i a, __m256i b) { return _mm256_add_epi64(a, b); } static int64_t scalar(int64_t a, int64_t b) { return a + b; } };
+    struct sub_epi64 { static FORTH_TARGET_AVX2 __m256i apply(__m256i a, __m256i b) { return _mm256_sub_epi64(a, b); } static int64_t scalar(int64_t a, int64_t b) { return a - b; } };
+    struct mul_epi64
+      {
+      static FORTH_TARGET_AVX2 __m256i apply(__m256i a, __m256i b)
+        {
+        __m256i low = _mm256_mul_epu32(a, b);
+        __m256i cross = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b), _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+        return _mm256_add_epi64(low, _mm256_slli_epi64(cross, 32));
+        }
+      static int64_t scalar(int64_t a, int64_t b) { return multiply(a, b); }
+      };
+    // x86 shifts only look at the lowest 6 bits of the count, the vector shifts give 0 for counts above 63
+    struct left_shift_epi64 { static FORTH_TARGET_AVX2 __m256i apply(__m256i a, __m256i b) { return _mm256_sllv_epi64(a, _mm256_and_si256(b, _mm256_set1_epi64x(63))); } static int64_t scalar(int64_t a, int64_t b) { return left_shift(a, b & 63); } };
+    struct right_shift_epi64 { static FORTH_TARGET_AVX2 __m256i apply(__m256i a, __m256i b) { return _mm256_srlv_epi64(a, _mm256_and_si256(b, _mm256_set1_epi64x(63))); } static int64_t scalar(int64_t a, int64_t b) { return right_shift(a, b & 63); } };
+    struct and_epi64 { static FORTH_TARGET_AVX2 __m256i apply(__m256i a, __m256i b) { return _mm256_and_si256(a, b); } static int64_t scalar(int64_t a, int64_t b) { return binary_and(a, b); } };
+    struct or_epi64 { static FORTH_TARGET_AVX2 __m256i apply(__m256i a, __m256i b) { return _mm256_or_si256(a, b); } static int64_t scalar(int64_t a, int64_t b) { return binary_or(a, b); } };
+    struct xor_epi64 { static FORTH_TARGET_AVX2 __m256i apply(__m256i a, __m256i b) { return _mm256_xor_si256(a, b); } static int64_t scalar(int64_t a, int64_t b) { return binary_xor(a, b); } };
+    struct less_epi64 { static FORTH_TARGET_AVX2 __m256i apply(__m256i a, __m256i b) { return _mm256_cmpgt_epi64(b, a); } static int64_t scalar(int64_t a, int64_t b) { return truth<int64_t>(a < b); } };
+    struct greater_epi64 { static FORTH_TARGET_AVX2 __m256i apply(__m256i a, __m256i b) { return _mm256_cmpgt_epi64(a, b); } static int64_t scalar(int64_t a, int64_t b) { return truth<int64_t>(a > b); } };
+    struct leq_epi64 { static FORTH_TARGET_AVX2 __m256i apply(__m256i a, __m256i b) { return not_epi64(_mm256_cmpgt_epi64(a, b)); } static int64_t scalar(int64_t a, int64_t b) { return truth<int64_t>(a <= b); } };
+    struct geq_epi64 { static FORTH_TARGET_AVX2 __m256i apply(__m256i a, __m256i b) { return not_epi64(_mm256_cmpgt_epi64(b, a)); } static int64_t scalar(int64_t a, int64_t b) { return truth<int64_t>(a >= b); } };
+    struct eq_epi64 { static FORTH_TARGET_AVX2 __m256i apply(__m256i a, __m256i b) { return _mm256_cmpeq_epi64(a, b); } static int64_t scalar(int64_t a, int64_t b) { return truth<int64_t>(a == b); } };
+    struct neq_epi64 { static FORTH_TARGET_AVX2 __m256i apply(__m256i a, __m256i b) { return not_epi64(_mm256_cmpeq_epi64(a, b)); } static int64_t scalar(int64_t a, int64_t b) { return truth<int64_t>(a != b); } };
+    struct min_epi64 { static FORTH_TARGET_AVX2 __m256i apply(__m256i a, __m256i b) { return _mm256_blendv_epi8(b, a, _mm256_cmpgt_epi64(b, a)); } static int64_t scalar(int64_t a, int64_t b) { return a < b ? a : b; } };
+    struct max_epi64 { static FORTH_TARGET_AVX2 __m256i apply(__m256i a, __m256i b) { return _mm256_blendv_epi8(b, a, _mm256_cmpgt_epi64(a, b)); } static int64_t scalar(int64_t a, int64_t b) { return a > b ? a : b; } };
+    struct not_epi64_op { static FORTH_TARGET_AVX2 __m256i apply(__m256i a) { return not_epi64(a); } static int64_t scalar(int64_t a) { return not_value(a); } };
+    struct negate_epi64 { static FORTH_TARGET_AVX2 __m256i apply(__m256i a) { return _mm256_sub_epi64(_mm256_setzero_si256(), a); } static int64_t scalar(int64_t a) { return (int64_t)(0 - (uint64_t)a); } };
+    struct abs_epi64
+      {
+      static FORTH_TARGET_AVX2 __m256i apply(__m256i a)
+        {
+        return _mm256_blendv_epi8(a, _mm256_sub_epi64(_mm256_setzero_si256(), a), _mm256_cmpgt_epi64(_mm256_setzero_si256(), a));
+        }
+      static int64_t scalar(int64_t a) { return a < 0 ? (int64_t)(0 - (uint64_t)a) : a; }
+      };
+
+    template <class Op>
+    FORTH_TARGET_AVX2 void unary_kernel_pd(double* r, const double* a, int n)
+      {
+      int i = 0;
+      for (; i + 4 <= n; i += 4)
+        _mm256_storeu_pd(r + i, Op::apply(_mm256_loadu_pd(a + i)));
+      for (; i < n; ++i)
+        r[i] = Op::scalar(a[i]);
+      }
+
+    // the table lookup of oscillator for four phases, with two gathers and the interpolation in
+    // the same order, so that the result is bit exact
+    template <e_waveform W>
+    FORTH_TARGET_AVX2_NO_FMA __m256d oscillator_pd(__m256d a)
+      {
+      __m256d cycle = _mm256_sub_pd(a, _mm256_floor_pd(a));
+      // inf and nan give nan, and are looked up as 0 meanwhile
+      __m256d valid = _mm256_and_pd(_mm256_cmp_pd(cycle, _mm256_setzero_pd(), _CMP_GE_OQ), _mm256_cmp_pd(cycle, _mm256_set1_pd(1.0), _CMP_LE_OQ));
+      __m256d x = _mm256_mul_pd(_mm256_and_pd(cycle, valid), _mm256_set1_pd((double)oscillator_tables::size));
+      __m128i i = _mm256_cvttpd_epi32(x);
+      __m256d f = _mm256_sub_pd(x, _mm256_cvtepi32_pd(i));
+      const double* table = oscillator_table_data.values[W];
+      // masked gathers of all lanes, as the unmasked ones start from an undefined register,
+      // which gcc warns about
+      const __m256d all = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+      __m256d lo = _mm256_mask_i32gather_pd(_mm256_setzero_pd(), table, i, all, 8);
+      __m256d hi = _mm256_mask_i32gather_pd(_mm256_setzero_pd(), table + 1, i, all, 8);
+      __m256d r = _mm256_add_pd(lo, _mm256_mul_pd(f, _mm256_sub_pd(hi, lo)));
+      return _mm256_blendv_pd(_mm256_set1_pd(std::numeric_limits<double>::quiet_NaN()), r, valid);
+      }
+
+    template <e_waveform W>
+    FORTH_TARGET_AVX2_NO_FMA void oscillator_kernel_pd(double* r, const double* a, int n)
+      {
+      int i = 0;
+      for (; i + 4 <= n; i += 4)
+        _mm256_storeu_pd(r + i, oscillator_pd<W>(_mm256_loadu_pd(a + i)));
+      for (; i < n; ++i)
+        r[i] = interpolated_oscillator(W, a[i]);
+      }
+
+    template <class Op>
+    FORTH_TARGET_AVX2 void binary_kernel_pd(double* r, const double* a, const double* b, int n)
+      {
+      int i = 0;
+      for (; i + 4 <= n; i += 4)
+        _mm256_storeu_pd(r + i, Op::apply(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+      for (; i < n; ++i)
+        r[i] = Op::scalar(a[i], b[i]);
+      }
+
+    template <e_waveform W>
+    struct oscillator_epi64
+      {
+      static FORTH_TARGET_AVX2 __m256i apply(__m256i a)
+        {
+        __m256i i = _mm256_and_si256(a, _mm256_set1_epi64x(oscillator_tables::byte_size - 1));
+        return _mm256_mask_i64gather_epi64(_mm256_setzero_si256(), (const long long*)oscillator_table_data.bytes[W], i, _mm256_set1_epi64x(-1), 8);
+        }
+      static int64_t scalar(int64_t a) { return oscillator(W, a); }
+      };
+
+    template <class Op>
+    FORTH_TARGET_AVX2 void unary_kernel_epi64(int64_t* r, const int64_t* a, int n)
+      {
+      int i = 0;
+      for (; i + 4 <= n; i += 4)
+        _mm256_storeu_si256((__m256i*)(r + i), Op::apply(_mm256_loadu_si256((const __m256i*)(a + i))));
+      for (; i < n; ++i)
+        r[i] = Op::scalar(a[i]);
+      }
+
+    template <class Op>
+    FORTH_TARGET_AVX2 void binary_kernel_epi64(int64_t* r, const int64_t* a, const int64_t* b, int n)
+      {
+      int i = 0;
+      for (; i + 4 <= n; i += 4)
+        _mm256_storeu_si256((__m256i*)(r + i), Op::apply(_mm256_loadu_si256((const __m256i*)(a + i)), _mm256_loadu_si256((const __m256i*)(b + i))));
+      for (; i < n; ++i)
+        r[i] = Op::scalar(a[i], b[i]);
+      }
+
+    // Both channels in the two halves of one register, with the operations of filter_sample in
+    // the same order and without fused multiply-adds, so that the result is bit exact.
+    FORTH_TARGET_AVX2_NO_FMA inline void stereo_filter_pd(const filter_coefficients& c, double* z1, double* z2, double* left, double* right, int n)
+      {
+      const __m128d b0 = _mm_set1_pd(c.b0);
+      const __m128d b1 = _mm_set1_pd(c.b1);
+      const __m128d b2 = _mm_set1_pd(c.b2);
+      const __m128d a1 = _mm_set1_pd(c.a1);
+      const __m128d a2 = _mm_set1_pd(c.a2);
+      __m128d s1 = _mm_loadu_pd(z1);
+      __m128d s2 = _mm_loadu_pd(z2);
+      for (int i = 0; i < n; ++i)
+        {
+        const __m128d x = _mm_set_pd(right[i], left[i]);
+        const __m128d y = _mm_add_pd(_mm_mul_pd(b0, x), s1);
+        s1 = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(b1, x), _mm_mul_pd(a1, y)), s2);
+        s2 = _mm_sub_pd(_mm_mul_pd(b2, x), _mm_mul_pd(a2, y));
+        _mm_storel_pd(left + i, y);
+        _mm_storeh_pd(right + i, y);
+        }
+      _mm_storeu_pd(z1, s1);
+      _mm_storeu_pd(z2, s2);
+      }
+
+    inline lane_kernels<double> make_avx2_kernels_double()
+      {
+      lane_kernels<double> k;
+      k.binary[OP_ADD] = &binary_kernel_pd<add_pd>;
+      k.binary[OP_SUB] = &binary_kernel_pd<sub_pd>;
+      k.binary[OP_MUL] = &binary_kernel_pd<mul_pd>;
+      k.binary[OP_DIV] = &binary_kernel_pd<div_pd>;
+      k.binary[OP_MOD] = &binary_kernel_pd<mod_op_pd>;
+      k.binary[OP_LESS] = &binary_kernel_pd<less_pd>;
+      k.binary[OP_GREATER] = &binary_kernel_pd<greater_pd>;
+      k.binary[OP_LEQ] = &binary_kernel_pd<leq_pd>;
+      k.binary[OP_GEQ] = &binary_kernel_pd<geq_pd>;
+      k.binary[OP_EQ] = &binary_kernel_pd<eq_pd>;
+      k.binary[OP_NEQ] = &binary_kernel_pd<neq_pd>;
+      k.binary[OP_MIN] = &binary_kernel_pd<min_pd>;
+      k.binary[OP_MAX] = &binary_kernel_pd<max_pd>;
+      k.binary[OP_POW] = &binary_kernel_pd<pow_op_pd>;
+      k.unary[OP_NOT] = &unary_kernel_pd<not_pd>;
+      k.unary[OP_SIN] = &unary_kernel_pd<sin_op_pd>;
+      k.unary[OP_COS] = &unary_kernel_pd<cos_op_pd>;
+      k.unary[OP_TAN] = &unary_kernel_pd<tan_op_pd>;
+      k.unary[OP_EXP] = &unary_kernel_pd<exp_op_pd>;
+      k.unary[OP_LOG] = &unary_kernel_pd<log_op_pd>;
+      k.unary[OP_SQRT] = &unary_kernel_pd<sqrt_pd>;
+      k.unary[OP_FLOOR] = &unary_kernel_pd<floor_pd>;
+      k.unary[OP_CEIL] = &unary_kernel_pd<ceil_pd>;
+      k.unary[OP_ABS] = &unary_kernel_pd<abs_pd>;
+      k.unary[OP_NEGATE] = &unary_kernel_pd<negate_pd>;
+      k.unary[OP_OSC_SIN] = &oscillator_kernel_pd<WAVE_SIN>;
+      k.unary[OP_OSC_SAW] = &oscillator_kernel_pd<WAVE_SAW>;
+      k.unary[OP_OSC_SQUARE] = &oscillator_kernel_pd<WAVE_SQUARE>;
+      k.stereo_filter = &stereo_filter_pd;
+      return k;
+      }
+
+    inline lane_kernels<int64_t> make_avx2_kernels_int64()
+      {
+      lane_kernels<int64_t> k;
+      k.binary[OP_ADD] = &binary_kernel_epi64<add_epi64>;
+      k.binary[OP_SUB] = &binary_kernel_epi64<sub_epi64>;
+      k.binary[OP_MUL] = &binary_kernel_epi64<mul_epi64>;
+      k.binary[OP_LEFT_SHIFT] = &binary_kernel_epi64<left_shift_epi64>;
+      k.binary[OP_RIGHT_SHIFT] = &binary_kernel_epi64<right_shift_epi64>;
+      k.binary[OP_AND] = &binary_kernel_epi64<and_epi64>;
+      k.binary[OP_OR] = &binary_kernel_epi64<or_epi64>;
+      k.binary[OP_XOR] = &binary_kernel_epi64<xor_epi64>;
+      k.binary[OP_LESS] = &binary_kernel_epi64<less_epi64>;
+      k.binary[OP_GREATER] = &binary_kernel_epi64<greater_epi64>;
+      k.binary[OP_LEQ] = &binary_kernel_epi64<leq_epi64>;
+      k.binary[OP_GEQ] = &binary_kernel_epi64<geq_epi64>;
+      k.binary[OP_EQ] = &binary_kernel_epi64<eq_epi64>;
+      k.binary[OP_NEQ] = &binary_kernel_epi64<neq_epi64>;
+      k.binary[OP_MIN] = &binary_kernel_epi64<min_epi64>;
+      k.binary[OP_MAX] = &binary_kernel_epi64<max_epi64>;
+      k.unary[OP_NOT] = &unary_kernel_epi64<not_epi64_op>;
+      k.unary[OP_NEGATE] = &unary_kernel_epi64<negate_epi64>;
+      k.unary[OP_ABS] = &unary_kernel_epi64<abs_epi64>;
+      k.unary[OP_OSC_SIN] = &unary_kernel_epi64<oscillator_epi64<WAVE_SIN>>;
+      k.unary[OP_OSC_SAW] = &unary_kernel_epi64<oscillator_epi64<WAVE_SAW>>;
+      k.unary[OP_OSC_SQUARE] = &unary_kernel_epi64<oscillator_epi64<WAVE_SQUARE>>;
+      return k;
+      }
+
+    } // namespace simd
+
+#endif // FORTH_SIMD_X86
+
+  template <class T>
+  inline const lane_kernels<T>* simd_lane_kernels()
+    {
+    return nullptr;
+    }
+
+#if defined(FORTH_SIMD_X86)
+  template <>
+  inline const lane_kernels<double>* simd_lane_kernels<double>()
+    {
+    static const lane_kernels<double> kernels = simd::make_avx2_kernels_double();
+    static const bool supported = cpu_supports_avx2();
+    return supported ? &kernels : nullptr;
+    }
+
+  template <>
+  inline const lane_kernels<int64_t>* simd_lane_kernels<int64_t>()
+    {
+    static const lane_kernels<int64_t> kernels = simd::make_avx2_kernels_int64();
+    static const bool supported = cpu_supports_avx2();
+    return supported ? &kernels : nullptr;
+    }
+#endif
+
+  } // namespace forth
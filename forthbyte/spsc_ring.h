@@ -0,0 +1,106 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <stddef.h>
+#include <type_traits>
+#include <vector>
+
+/*
+A ring of values between one producer thread and one consumer thread, without locks: write
+only runs on the producer and read only on the consumer, and neither ever waits for the other.
+
+The producer owns the head and the consumer the tail. Each side loads the index of the other
+with acquire and publishes its own with release, so the values that write copies in are
+visible to the read that sees the new head, and the room that read frees is only reused after
+the values were copied out. The indices count up without wrapping, the capacity is a power of
+two, and an index masked with capacity - 1 is its position in the ring.
+*/
+
+template <class T>
+class spsc_ring
+  {
+  static_assert(std::is_trivially_copyable<T>::value, "the values are copied with memcpy");
+
+  public:
+    explicit spsc_ring(size_t capacity = 0)
+      {
+      reset(capacity);
+      }
+
+    spsc_ring(const spsc_ring&) = delete;
+    spsc_ring& operator = (const spsc_ring&) = delete;
+
+    // empties the ring and makes room for at least capacity values, only while neither the
+    // producer nor the consumer runs
+    void reset(size_t capacity)
+      {
+      size_t size = 1;
+      while (size < capacity)
+        size *= 2;
+      _values.assign(size, T());
+      _mask = size - 1;
+      _head.store(0, std::memory_order_relaxed);
+      _tail.store(0, std::memory_order_relaxed);
+      }
+
+    size_t capacity() const
+      {
+      return _mask + 1;
+      }
+
+    // the values that can be read: on the producer an upper bound, since the consumer may have
+    // read more since, so that a producer that finds room for a write has at least that room;
+    // on the consumer a lower bound, since the producer may have written more since
+    size_t size() const
+      {
+      return _head.load(std::memory_order_acquire) - _tail.load(std::memory_order_acquire);
+      }
+
+    // copies in as many of the count values as fit and returns how many, on the producer
+    size_t write(const T* values, size_t count)
+      {
+      const size_t head = _head.load(std::memory_order_relaxed);
+      const size_t tail = _tail.load(std::memory_order_acquire);
+      count = std::min(count, capacity() - (head - tail));
+      _copy_in(head & _mask, values, count);
+      _head.store(head + count, std::memory_order_release);
+      return count;
+      }
+
+    // copies out up to count values and returns how many, on the consumer
+    size_t read(T* values, size_t count)
+      {
+      const size_t tail = _tail.load(std::memory_order_relaxed);
+      const size_t head = _head.load(std::memory_order_acquire);
+      count = std::min(count, head - tail);
+      _copy_out(tail & _mask, values, count);
+      _tail.store(tail + count, std::memory_order_release);
+      return count;
+      }
+
+  private:
+    // copies count values into the ring from position on, wrapping around at its end
+    void _copy_in(size_t position, const T* values, size_t count)
+      {
+      const size_t first = std::min(count, capacity() - position);
+      memcpy(&_values[position], values, first * sizeof(T));
+      memcpy(&_values[0], values + first, (count - first) * sizeof(T));
+      }
+
+    // copies count values out of the ring from position on, wrapping around at its end
+    void _copy_out(size_t position, T* values, size_t count) const
+      {
+      const size_t first = std::min(count, capacity() - position);
+      memcpy(values, &_values[position], first * sizeof(T));
+      memcpy(values + first, &_values[0], (count - first) * sizeof(T));
+      }
+
+  private:
+    std::vector<T> _values;
+    size_t _mask;
+    // on cache lines of their own, so that the two threads do not share one
+    alignas(64) std::atomic<size_t> _head;
+    alignas(64) std::atomic<size_t> _tail;
+  };
@@ -0,0 +1,504 @@
+#pragma once
+
+#include "cse.h"
+#include "forth.h"
+
+#include <map>
+#include <stdint.h>
+#include <type_traits>
+#include <vector>
+
+/*
+Register form of interpreter::Bytecode.
+
+When the stack depth is known at compile time for every instruction, the stack is only a way of
+naming intermediate values. ssa::compile executes the bytecode symbolically and turns every value
+that is computed into a node of an expression DAG in static single assignment form: a node is
+assigned once, refers to its operands by node number, and gets a register slot. Stack shuffles
+(dup, swap, rot, over, nip, tuck, pick with a literal index, >r and r>) only rename nodes and
+disappear, and so do to and the locals of definitions: a global that is assigned is read as the
+node that it got, and is only written once, at the end of the program. Nodes that do not contribute to the result or to memory are dropped, and slots are
+reused as soon as their node is dead. Nodes are hash-consed with an expression_table (cse.h), so a
+subexpression that occurs several times in a song, like t 1000 / in separate voices, becomes one
+node and is evaluated once per sample. The expensive operators that is_memoized selects keep their
+last operands and result, and are only evaluated again when an operand changes. Integer division and remainder by a literal
+use a constant_divisor instead of a divide instruction. ssa::run evaluates the nodes in program order and pushes
+the values that the program leaves behind, so no stack pointer is maintained along the way.
+
+Programs that read below the stack they start with (they depend on what the previous sample left
+behind, or on the wraparound of the ring buffer), that pick with a computed index, or that leave
+values on the return stack are not compiled, and interpreter::run should be used for them. The
+ring buffer slots above the stack pointer, where run leaves its intermediate values, are not
+written: the programs that are compiled cannot read them.
+*/
+
+namespace forth
+  {
+
+  template <class T, int N = 256>
+  class ssa
+    {
+    public:
+      struct Node
+        {
+        e_opcode op; // OP_VALUE, OP_VARIABLE, OP_FETCH, OP_STORE, OP_ASSIGN or an operator
+        int a, b; // operand nodes, -1 if not used
+        int index; // the global of OP_VARIABLE and OP_ASSIGN
+        T val; // the constant of OP_VALUE
+        int slot; // the register slot that holds the result, -1 for dead nodes, OP_STORE and OP_ASSIGN
+        bool memoized;
+        };
+
+      ssa() : sharing(true), shared(0), memoized(0), compiled(false)
+        {
+        }
+
+      // returns false if the stack effect of the program is not fully static. With share set
+      // to false, common subexpressions are evaluated every time they occur, with memoize set to
+      // false, every operator is evaluated every time.
+      bool compile(const typename interpreter<T, N>::Bytecode& code, bool share = true, bool memoize = true);
+
+      void clear()
+        {
+        nodes.clear();
+        operations.clear();
+        outputs.clear();
+        registers.clear();
+        expressions.clear();
+        node_of_number.clear();
+        number_of_node.clear();
+        memos.clear();
+        divisors.clear();
+        shared = 0;
+        memoized = 0;
+        compiled = false;
+        }
+
+      bool is_compiled() const
+        {
+        return compiled;
+        }
+
+      // the number of nodes that are evaluated by run, constants excluded
+      int operation_count() const
+        {
+        return (int)operations.size();
+        }
+
+      int register_count() const
+        {
+        return (int)registers.size();
+        }
+
+      // the number of operations that were replaced by an earlier node with the same value
+      int shared_count() const
+        {
+        return shared;
+        }
+
+      // the number of operations that are only evaluated when an operand changes
+      int memoized_count() const
+        {
+        return memoized;
+        }
+
+      void run(interpreter<T, N>& interpr);
+
+      std::vector<Node> nodes;
+
+    private:
+      struct Operation
+        {
+        e_opcode op;
+        int r, a, b;
+        int index; // the global of OP_VARIABLE and OP_ASSIGN, the entry in divisors of OP_DIV and OP_MOD or -1
+        int memo; // the first of the last operands and the result in memos, or -1
+        };
+
+      int _node(e_opcode op, int a, int b);
+      int _shared_node(e_opcode op, int a, int b, int index, T val);
+      void _allocate_slots();
+
+      expression_table<T, N> expressions;
+      std::vector<int> node_of_number;
+      std::vector<int> number_of_node;
+      bool sharing;
+      int shared;
+      int memoized;
+      std::vector<T> memos;
+      std::vector<constant_divisor> divisors;
+
+      std::vector<Operation> operations;
+      std::vector<int> outputs; // slots, bottom of the stack first
+      std::vector<T> registers;
+      bool compiled;
+    };
+
+  template <class T, int N>
+  int ssa<T, N>::_node(e_opcode op, int a, int b)
+    {
+    Node n;
+    n.op = op;
+    n.a = a;
+    n.b = b;
+    n.index = 0;
+    n.val = (T)0;
+    n.slot = -1;
+    n.memoized = false;
+    nodes.push_back(n);
+    number_of_node.push_back(-1);
+    return (int)nodes.size() - 1;
+    }
+
+  // returns the node that computes op(a, b) or loads the constant val or the global index, a node
+  // that was made before if it has the same value
+  template <class T, int N>
+  int ssa<T, N>::_shared_node(e_opcode op, int a, int b, int index, T val)
+    {
+    if (!sharing)
+      {
+      int id = _node(op, a, b);
+      nodes[id].index = index;
+      nodes[id].val = val;
+      return id;
+      }
+    int number;
+    if (op == OP_VALUE)
+      number = expressions.value(val);
+    else if (op == OP_VARIABLE)
+      number = expressions.variable(index);
+    else
+      number = expressions.operation(op, number_of_node[a], b >= 0 ? number_of_node[b] : -1);
+    if (number < (int)node_of_number.size())
+      {
+      if (op != OP_VALUE)
+        ++shared;
+      return node_of_number[number];
+      }
+    int id = _node(op, a, b);
+    nodes[id].index = index;
+    nodes[id].val = val;
+    node_of_number.push_back(id);
+    number_of_node[id] = number;
+    return id;
+    }
+
+  template <class T, int N>
+  bool ssa<T, N>::compile(const typename interpreter<T, N>::Bytecode& code, bool share, bool memoize)
+    {
+    clear();
+    const auto& effect = code.effect;
+    // a register form needs straight code, programs with jumps stay with interpreter::run
+    if (!effect.is_static || effect.min_depth < 0 || effect.min_return_depth < 0 || effect.return_depth != 0 || effect.has_control_flow)
+      return false;
+    // and so do delay lines and filters, which keep state of their own
+    for (const auto& instr : code.instructions)
+      if (has_state(instr.op))
+        return false;
+    sharing = share;
+
+    std::vector<int> st, rs;
+    std::vector<int> result_nodes;
+    std::map<int, int> assigned; // the node that each global got from to
+    auto pop = [&]() -> int
+      {
+      int id = st.back();
+      st.pop_back();
+      return id;
+      };
+    const bool analysed = code.dependencies.size() == code.instructions.size();
+    for (size_t i = 0; i < code.instructions.size(); ++i)
+      {
+      const auto& instr = code.instructions[i];
+      switch (instr.op)
+        {
+        case OP_VALUE: st.push_back(_shared_node(OP_VALUE, -1, -1, 0, instr.val)); break;
+        case OP_VARIABLE:
+        {
+        auto it = assigned.find(instr.index);
+        st.push_back(it != assigned.end() ? it->second : _shared_node(OP_VARIABLE, -1, -1, instr.index, (T)0));
+        break;
+        }
+        case OP_ASSIGN: assigned[instr.index] = pop(); break;
+        case OP_DUP: st.push_back(st.back()); break;
+        case OP_DROP: st.pop_back(); break;
+        case OP_2DUP:
+        {
+        int b = st[st.size() - 1];
+        int a = st[st.size() - 2];
+        st.push_back(a);
+        st.push_back(b);
+        break;
+        }
+        case OP_OVER: st.push_back(st[st.size() - 2]); break;
+        case OP_NIP:
+        {
+        int b = pop();
+        st.back() = b;
+        break;
+        }
+        case OP_TUCK:
+        {
+        int b = pop();
+        int a = pop();
+        st.push_back(b);
+        st.push_back(a);
+        st.push_back(b);
+        break;
+        }
+        case OP_SWAP: std::swap(st[st.size() - 1], st[st.size() - 2]); break;
+        case OP_ROT:
+        {
+        int c = pop();
+        int b = pop();
+        int a = pop();
+        st.push_back(b);
+        st.push_back(c);
+        st.push_back(a);
+        break;
+        }
+        case OP_MROT:
+        {
+        int c = pop();
+        int b = pop();
+        int a = pop();
+        st.push_back(c);
+        st.push_back(a);
+        st.push_back(b);
+        break;
+        }
+        case OP_PICK:
+        {
+        // static, so the index is the constant that was pushed just before
+        int k = (int)(int64_t)nodes[pop()].val;
+        st.push_back(st[st.size() - 1 - k]);
+        break;
+        }
+        case OP_RETURN_STACK_PUSH: rs.push_back(pop()); break;
+        case OP_RETURN_STACK_POP:
+        {
+        st.push_back(rs.back());
+        rs.pop_back();
+        break;
+        }
+        case OP_STORE:
+        {
+        int b = pop();
+        int a = pop();
+        _node(OP_STORE, a, b);
+        expressions.store();
+        break;
+        }
+        case OP_SQUARE:
+        {
+        int a = pop();
+        st.push_back(_shared_node(OP_MUL, a, a, 0, (T)0));
+        break;
+        }
+        default:
+        {
+        if (fused_operator(instr.op) != instr.op)
+          {
+          int b = _shared_node(OP_VALUE, -1, -1, 0, instr.val);
+          int a = pop();
+          st.push_back(_shared_node(fused_operator(instr.op), a, b, 0, (T)0));
+          break;
+          }
+        int consumed, produced;
+        stack_signature(instr.op, consumed, produced);
+        int b = consumed == 2 ? pop() : -1;
+        int a = pop();
+        st.push_back(_shared_node(instr.op, a, b, 0, (T)0));
+        if (memoize && analysed && is_memoized(instr.op, code.dependencies[i]))
+          nodes[st.back()].memoized = true;
+        break;
+        }
+        }
+      }
+    // reads of the globals come before their writes, which the program leaves as it ends
+    for (const auto& g : assigned)
+      nodes[_node(OP_ASSIGN, g.second, -1)].index = g.first;
+    result_nodes.swap(st);
+    outputs = result_nodes;
+    _allocate_slots();
+    compiled = true;
+    return true;
+    }
+
+  template <class T, int N>
+  void ssa<T, N>::_allocate_slots()
+    {
+    const int node_count = (int)nodes.size();
+    const int end = node_count; // outputs are live until the end of the program
+
+    // a node is live if a store or the result depends on it
+    std::vector<bool> live(node_count, false);
+    for (int id : outputs)
+      live[id] = true;
+    for (int id = node_count - 1; id >= 0; --id)
+      {
+      if (nodes[id].op == OP_STORE || nodes[id].op == OP_ASSIGN)
+        live[id] = true;
+      if (!live[id])
+        continue;
+      if (nodes[id].a >= 0)
+        live[nodes[id].a] = true;
+      if (nodes[id].b >= 0)
+        live[nodes[id].b] = true;
+      }
+
+    std::vector<int> last_use(node_count, -1);
+    for (int id = 0; id < node_count; ++id)
+      {
+      if (!live[id])
+        continue;
+      if (nodes[id].a >= 0)
+        last_use[nodes[id].a] = id;
+      if (nodes[id].b >= 0)
+        last_use[nodes[id].b] = id;
+      }
+    for (int id : outputs)
+      last_use[id] = end;
+
+    // constants get a slot of their own that is filled here and never reused
+    std::vector<T> constants;
+    std::vector<int> free_slots;
+    int slot_count = 0;
+    for (int id = 0; id < node_count; ++id)
+      {
+      if (live[id] && nodes[id].op == OP_VALUE)
+        {
+        nodes[id].slot = slot_count++;
+        constants.push_back(nodes[id].val);
+        }
+      }
+    for (int id = 0; id < node_count; ++id)
+      {
+      Node& n = nodes[id];
+      if (!live[id] || n.op == OP_VALUE)
+        continue;
+      // operands are read before the result is written, so a dying operand can hand over its slot
+      for (int operand : { n.a, n.b })
+        {
+        if (operand >= 0 && last_use[operand] == id && nodes[operand].op != OP_VALUE)
+          {
+          free_slots.push_back(nodes[operand].slot);
+          last_use[operand] = -1; // n.a and n.b can be the same node
+          }
+        }
+      Operation o;
+      o.op = n.op;
+      o.a = n.a >= 0 ? nodes[n.a].slot : -1;
+      o.b = n.b >= 0 ? nodes[n.b].slot : -1;
+      o.index = n.index;
+      o.r = -1;
+      o.memo = -1;
+      if (n.op == OP_DIV || n.op == OP_MOD)
+        {
+        // integer division by a literal without a divide instruction
+        o.index = -1;
+        const Node& b = nodes[n.b];
+        if (std::is_integral<T>::value && b.op == OP_VALUE && constant_divisor::is_reducible((int64_t)b.val))
+          {
+          o.index = (int)divisors.size();
+          divisors.push_back(constant_divisor((int64_t)b.val));
+          }
+        }
+      if (n.memoized)
+        {
+        // starts out as the result for operands that are 0
+        o.memo = (int)memos.size();
+        memos.push_back((T)0);
+        memos.push_back((T)0);
+        memos.push_back(n.b >= 0 ? binary_value(n.op, (T)0, (T)0) : unary_value(n.op, (T)0));
+        ++memoized;
+        }
+      if (n.op != OP_STORE && n.op != OP_ASSIGN)
+        {
+        if (free_slots.empty())
+          n.slot = slot_count++;
+        else
+          {
+          n.slot = free_slots.back();
+          free_slots.pop_back();
+          }
+        o.r = n.slot;
+        }
+      operations.push_back(o);
+      }
+    registers.assign(slot_count, (T)0);
+    std::copy(constants.begin(), constants.end(), registers.begin());
+    for (auto& id : outputs)
+      id = nodes[id].slot;
+    }
+
+  template <class T, int N>
+  void ssa<T, N>::run(interpreter<T, N>& interpr)
+    {
+    T* r = registers.data();
+    T* globals = interpr.globals.data();
+    T* memory = interpr.memory_stack.data();
+    const int memory_mask = (int)interpr.memory_stack.size() - 1;
+    for (const Operation& o : operations)
+      {
+      if (o.memo >= 0)
+        {
+        T* m = memos.data() + o.memo;
+        T b = o.b >= 0 ? r[o.b] : (T)0;
+        if (!same_bits(r[o.a], m[0]) || !same_bits(b, m[1]))
+          {
+          m[0] = r[o.a];
+          m[1] = b;
+          m[2] = o.b >= 0 ? binary_value(o.op, m[0], b) : unary_value(o.op, m[0]);
+          }
+        r[o.r] = m[2];
+        continue;
+        }
+      switch (o.op)
+        {
+        case OP_VARIABLE: r[o.r] = globals[o.index]; break;
+        case OP_ASSIGN: globals[o.index] = r[o.a]; break;
+        case OP_ADD: r[o.r] = r[o.a] + r[o.b]; break;
+        case OP_SUB: r[o.r] = r[o.a] - r[o.b]; break;
+        case OP_MUL: r[o.r] = multiply(r[o.a], r[o.b]); break;
+        case OP_DIV: r[o.r] = o.index >= 0 ? (T)divisors[o.index].quotient((int64_t)r[o.a]) : divide(r[o.a], r[o.b]); break;
+        case OP_LEFT_SHIFT: r[o.r] = left_shift(r[o.a], r[o.b]); break;
+        case OP_RIGHT_SHIFT: r[o.r] = right_shift(r[o.a], r[o.b]); break;
+        case OP_AND: r[o.r] = binary_and(r[o.a], r[o.b]); break;
+        case OP_OR: r[o.r] = binary_or(r[o.a], r[o.b]); break;
+        case OP_XOR: r[o.r] = binary_xor(r[o.a], r[o.b]); break;
+        case OP_NOT: r[o.r] = not_value(r[o.a]); break;
+        case OP_SIN: r[o.r] = (T)std::sin(r[o.a]); break;
+        case OP_COS: r[o.r] = (T)std::cos(r[o.a]); break;
+        case OP_MOD: r[o.r] = o.index >= 0 ? (T)divisors[o.index].remainder((int64_t)r[o.a]) : modulo(r[o.a], r[o.b]); break;
+        case OP_LESS: r[o.r] = truth<T>(r[o.a] < r[o.b]); break;
+        case OP_GREATER: r[o.r] = truth<T>(r[o.a] > r[o.b]); break;
+        case OP_LEQ: r[o.r] = truth<T>(r[o.a] <= r[o.b]); break;
+        case OP_GEQ: r[o.r] = truth<T>(r[o.a] >= r[o.b]); break;
+        case OP_EQ: r[o.r] = truth<T>(r[o.a] == r[o.b]); break;
+        case OP_NEQ: r[o.r] = truth<T>(r[o.a] != r[o.b]); break;
+        case OP_MIN: r[o.r] = r[o.a] < r[o.b] ? r[o.a] : r[o.b]; break;
+        case OP_MAX: r[o.r] = r[o.a] > r[o.b] ? r[o.a] : r[o.b]; break;
+        case OP_POW: r[o.r] = (T)std::pow(r[o.a], r[o.b]); break;
+        case OP_ATAN2: r[o.r] = (T)std::atan2(r[o.a], r[o.b]); break;
+        case OP_NEGATE: r[o.r] = (T)-r[o.a]; break;
+        case OP_TAN: r[o.r] = (T)std::tan(r[o.a]); break;
+        case OP_LOG: r[o.r] = (T)std::log(r[o.a]); break;
+        case OP_EXP: r[o.r] = (T)std::exp(r[o.a]); break;
+        case OP_SQRT: r[o.r] = (T)std::sqrt(r[o.a]); break;
+        case OP_FLOOR: r[o.r] = (T)std::floor(r[o.a]); break;
+        case OP_CEIL: r[o.r] = (T)std::ceil(r[o.a]); break;
+        case OP_ABS: r[o.r] = (T)std::abs(r[o.a]); break;
+        case OP_OSC_SIN: r[o.r] = oscillator(WAVE_SIN, r[o.a]); break;
+        case OP_OSC_SAW: r[o.r] = oscillator(WAVE_SAW, r[o.a]); break;
+        case OP_OSC_SQUARE: r[o.r] = oscillator(WAVE_SQUARE, r[o.a]); break;
+        case OP_FETCH: r[o.r] = memory[((int)r[o.a]) & memory_mask]; break;
+        case OP_STORE: memory[((int)r[o.b]) & memory_mask] = r[o.a]; break;
+        default: break;
+        }
+      }
+    for (int slot : outputs)
+      interpr.push(r[slot]);
+    }
+
+  } // namespace forth
@@ -0,0 +1,288 @@
+#include "tables.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace
+  {
+
+  std::logic_error table_error(const std::string& filename, const std::string& message)
+    {
+    std::stringstream str;
+    str << "#loadtable " << filename << ": " << message;
+    return std::logic_error(str.str());
+    }
+
+  }
+
+mapped_file::mapped_file(const std::string& filename) : _data(nullptr), _size(0)
+  {
+#ifdef _WIN32
+  _file = INVALID_HANDLE_VALUE;
+  _mapping = nullptr;
+  int length = MultiByteToWideChar(CP_UTF8, 0, filename.c_str(), -1, nullptr, 0);
+  std::wstring wfilename(length > 0 ? length - 1 : 0, L'\0');
+  if (length > 1)
+    MultiByteToWideChar(CP_UTF8, 0, filename.c_str(), -1, &wfilename[0], length);
+  _file = CreateFileW(wfilename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+  if (_file == INVALID_HANDLE_VALUE)
+    throw table_error(filename, "cannot open the file");
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(_file, &size))
+    {
+    CloseHandle(_file);
+    throw table_error(filename, "cannot read the file");
+    }
+  _size = (uint64_t)size.QuadPart;
+  if (_size == 0)
+    return;
+  _mapping = CreateFileMappingW(_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (_mapping)
+    _data = (const unsigned char*)MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0);
+  if (!_data)
+    {
+    if (_mapping)
+      CloseHandle(_mapping);
+    CloseHandle(_file);
+    throw table_error(filename, "cannot map the file");
+    }
+#else
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw table_error(filename, "cannot open the file");
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+    {
+    close(fd);
+    throw table_error(filename, "cannot read the file");
+    }
+  _size = (uint64_t)st.st_size;
+  if (_size > 0)
+    {
+    void* p = mmap(nullptr, (size_t)_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED)
+      {
+      close(fd);
+      throw table_error(filename, "cannot map the file");
+      }
+    // the samples are read once from front to back
+    madvise(p, (size_t)_size, MADV_SEQUENTIAL);
+    _data = (const unsigned char*)p;
+    }
+  // the mapping keeps its own reference to the file
+  close(fd);
+#endif
+  }
+
+mapped_file::~mapped_file()
+  {
+#ifdef _WIN32
+  if (_data)
+    UnmapViewOfFile(_data);
+  if (_mapping)
+    CloseHandle(_mapping);
+  if (_file != INVALID_HANDLE_VALUE)
+    CloseHandle(_file);
+#else
+  if (_data)
+    munmap((void*)_data, (size_t)_size);
+#endif
+  }
+
+namespace
+  {
+
+  enum e_sample_format
+    {
+    SF_UINT8,
+    SF_INT16,
+    SF_INT24,
+    SF_INT32,
+    SF_FLOAT32,
+    SF_FLOAT64
+    };
+
+  struct sample_data
+    {
+    const unsigned char* samples;
+    uint64_t frames;
+    uint32_t channels;
+    e_sample_format format;
+    };
+
+  uint32_t bytes_per_sample(e_sample_format format)
+    {
+    switch (format)
+      {
+      case SF_UINT8: return 1;
+      case SF_INT16: return 2;
+      case SF_INT24: return 3;
+      case SF_INT32: return 4;
+      case SF_FLOAT32: return 4;
+      case SF_FLOAT64: return 8;
+      }
+    return 1;
+    }
+
+  uint16_t read_u16(const unsigned char* p)
+    {
+    return (uint16_t)(p[0] | (p[1] << 8));
+    }
+
+  uint32_t read_u32(const unsigned char* p)
+    {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+    }
+
+  // a little endian sample as a value from -1 to 1
+  double read_sample(const unsigned char* p, e_sample_format format)
+    {
+    switch (format)
+      {
+      case SF_UINT8: return ((int)p[0] - 128) / 128.0;
+      case SF_INT16: return (int16_t)read_u16(p) / 32768.0;
+      case SF_INT24: return (int32_t)(((uint32_t)p[0] << 8) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 24)) / 2147483648.0;
+      case SF_INT32: return (int32_t)read_u32(p) / 2147483648.0;
+      case SF_FLOAT32:
+        {
+        uint32_t bits = read_u32(p);
+        float f;
+        memcpy(&f, &bits, sizeof(f));
+        return (double)f;
+        }
+      case SF_FLOAT64:
+        {
+        uint64_t bits = (uint64_t)read_u32(p) | ((uint64_t)read_u32(p + 4) << 32);
+        double d;
+        memcpy(&d, &bits, sizeof(d));
+        return d;
+        }
+      }
+    return 0.0;
+    }
+
+  bool has_extension(const std::string& filename, const std::string& extension)
+    {
+    if (filename.size() < extension.size())
+      return false;
+    std::string ext = filename.substr(filename.size() - extension.size());
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](char ch) { return (char)::tolower(ch); });
+    return ext == extension;
+    }
+
+  sample_data parse_raw(const mapped_file& f)
+    {
+    sample_data d;
+    d.samples = f.data();
+    d.frames = f.size() / 4;
+    d.channels = 1;
+    d.format = SF_FLOAT32;
+    return d;
+    }
+
+  sample_data parse_wav(const mapped_file& f, const std::string& filename)
+    {
+    const unsigned char* p = f.data();
+    const uint64_t size = f.size();
+    if (size < 12 || (memcmp(p, "RIFF", 4) != 0 && memcmp(p, "RF64", 4) != 0) || memcmp(p + 8, "WAVE", 4) != 0)
+      throw table_error(filename, "this is not a wav file");
+    bool has_format = false;
+    uint16_t tag = 0, channels = 0, bits = 0;
+    uint64_t pos = 12;
+    while (pos + 8 <= size)
+      {
+      const unsigned char* chunk = p + pos;
+      // the data chunk of a file that is still being written, or of an RF64 file, claims more
+      // than the file holds, so it is cut off at the end of the file
+      const uint64_t chunk_size = std::min<uint64_t>(read_u32(chunk + 4), size - pos - 8);
+      if (memcmp(chunk, "fmt ", 4) == 0 && chunk_size >= 16)
+        {
+        has_format = true;
+        tag = read_u16(chunk + 8);
+        channels = read_u16(chunk + 10);
+        bits = read_u16(chunk + 22);
+        if (tag == 0xFFFE && chunk_size >= 26)
+          tag = read_u16(chunk + 32); // the first bytes of the sub format of WAVE_FORMAT_EXTENSIBLE
+        }
+      else if (memcmp(chunk, "data", 4) == 0)
+        {
+        if (!has_format || channels == 0)
+          throw table_error(filename, "the format chunk is missing");
+        sample_data d;
+        d.samples = chunk + 8;
+        d.channels = channels;
+        if (tag == 1 && bits == 8)
+          d.format = SF_UINT8;
+        else if (tag == 1 && bits == 16)
+          d.format = SF_INT16;
+        else if (tag == 1 && bits == 24)
+          d.format = SF_INT24;
+        else if (tag == 1 && bits == 32)
+          d.format = SF_INT32;
+        else if (tag == 3 && bits == 32)
+          d.format = SF_FLOAT32;
+        else if (tag == 3 && bits == 64)
+          d.format = SF_FLOAT64;
+        else
+          throw table_error(filename, "only 8, 16, 24 or 32 bit pcm and 32 or 64 bit float samples are supported");
+        d.frames = chunk_size / (bytes_per_sample(d.format) * channels);
+        return d;
+        }
+      pos += 8 + chunk_size + (chunk_size & 1);
+      }
+    throw table_error(filename, "the data chunk is missing");
+    }
+
+  template <class T, class Convert>
+  void copy_table(const std::string& filename, int64_t offset, T* memory, int64_t memory_size, Convert convert)
+    {
+    mapped_file f(filename);
+    sample_data d;
+    if (has_extension(filename, ".raw"))
+      d = parse_raw(f);
+    else if (has_extension(filename, ".wav"))
+      d = parse_wav(f, filename);
+    else
+      throw table_error(filename, "I expect a .wav or a .raw file");
+    if (offset < 0 || offset > memory_size || (int64_t)d.frames > memory_size - offset)
+      {
+      std::stringstream str;
+      str << "the " << d.frames << " samples do not fit in the memory at " << offset << ", make the memory larger with #memory";
+      throw table_error(filename, str.str());
+      }
+    const uint32_t sample_bytes = bytes_per_sample(d.format);
+    const uint32_t frame_bytes = sample_bytes * d.channels;
+    for (uint64_t i = 0; i < d.frames; ++i)
+      {
+      const unsigned char* frame = d.samples + i * frame_bytes;
+      double sum = 0.0;
+      for (uint32_t c = 0; c < d.channels; ++c)
+        sum += read_sample(frame + c * sample_bytes, d.format);
+      memory[offset + i] = convert(sum / d.channels);
+      }
+    }
+
+  }
+
+void load_table(const std::string& filename, int64_t offset, double* memory, int64_t memory_size)
+  {
+  copy_table(filename, offset, memory, memory_size, [](double v) { return v; });
+  }
+
+void load_table(const std::string& filename, int64_t offset, int64_t* memory, int64_t memory_size)
+  {
+  // 8 bit samples come out unchanged
+  copy_table(filename, offset, memory, memory_size, [](double v) { return (int64_t)std::min(255.0, std::max(0.0, std::round(v * 128.0 + 128.0))); });
+  }
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+// A file mapped read-only into memory: opening it costs the same for any size, and its pages
+// are read from disk when they are first touched.
+class mapped_file
+  {
+  public:
+    // throws std::logic_error when the file cannot be opened
+    mapped_file(const std::string& filename);
+    ~mapped_file();
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    const unsigned char* data() const { return _data; }
+    uint64_t size() const { return _size; }
+
+  private:
+    const unsigned char* _data;
+    uint64_t _size;
+#ifdef _WIN32
+    void* _file;
+    void* _mapping;
+#endif
+  };
+
+// Copies the samples of a .wav file (8, 16, 24 or 32 bit pcm, or 32 or 64 bit float) or of a
+// .raw file (32 bit floats) into memory, starting at offset. Several channels are mixed down
+// to one. The float version stores samples from -1 to 1, the byte version from 0 to 255, the
+// ranges of the output of #float and #byte songs. Throws std::logic_error when the file cannot
+// be read or does not fit in memory.
+void load_table(const std::string& filename, int64_t offset, double* memory, int64_t memory_size);
+void load_table(const std::string& filename, int64_t offset, int64_t* memory, int64_t memory_size);
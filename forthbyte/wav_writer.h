@@ -0,0 +1,257 @@
+#pragma once
+
+#include "spsc_ring.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+Records 16 bit samples to a wav file without ever waiting for the disk on the thread that
+records: write copies the samples into a lock-free ring of wav_queue_samples values, and a
+thread of its own drains the ring to the file in blocks of wav_write_block bytes. The first
+block is shorter than the others, so that every later block starts at a multiple of
+wav_write_block in the file. Samples that do not fit in the ring because the disk falls
+behind are dropped and counted.
+
+The header reserves a JUNK chunk for a ds64 chunk. When close finds more data than a RIFF
+file can hold (riff_limit bytes, 4 GB), the file becomes an RF64 file (EBU Tech 3306): RIFF
+becomes RF64, JUNK becomes ds64 with the 64 bit sizes, and the 32 bit sizes become 0xFFFFFFFF.
+*/
+
+constexpr size_t wav_queue_samples = 1 << 20;
+constexpr size_t wav_write_block = 1 << 16;
+constexpr uint64_t wav_riff_limit = 0xFFFFFFFF;
+
+class wav_writer
+  {
+  public:
+    // riff_limit is only lowered by the tests, to make RF64 files that are not 4 GB large
+    explicit wav_writer(uint64_t riff_limit = wav_riff_limit) : _file(nullptr), _riff_limit(riff_limit), _channels(0),
+      _file_pos(0), _data_bytes(0), _writing(false), _dropped(0)
+      {
+      }
+
+    wav_writer(const wav_writer&) = delete;
+    wav_writer& operator = (const wav_writer&) = delete;
+
+    ~wav_writer()
+      {
+      close();
+      }
+
+    // starts a file of 16 bit samples at rate with channels interleaved channels, returns false
+    // if the file cannot be made
+    bool open(const std::string& filename, uint32_t rate, uint32_t channels)
+      {
+      close();
+      _file = fopen(filename.c_str(), "wb");
+      if (!_file)
+        return false;
+      // the blocks are large already, and go to the disk as they are
+      setvbuf(_file, nullptr, _IONBF, 0);
+      _channels = channels;
+      _data_bytes = 0;
+      _dropped.store(0, std::memory_order_relaxed);
+      _header.clear();
+      _put("RIFF");
+      _put32(0);
+      _put("WAVE");
+      // room for a ds64 chunk: its riff size, data size and sample count, and an empty table
+      _put("JUNK");
+      _put32(28);
+      _header.resize(_header.size() + 28, 0);
+      _put("fmt ");
+      _put32(16);
+      _put16(1); // integer samples
+      _put16((uint16_t)channels);
+      _put32(rate);
+      _put32(rate * 2 * channels); // bytes per second
+      _put16((uint16_t)(2 * channels)); // bytes per frame
+      _put16(16); // bits per sample
+      _put("data");
+      _put32(0);
+      fwrite(_header.data(), 1, _header.size(), _file);
+      _block.clear();
+      _block.reserve(wav_write_block);
+      _file_pos = _header.size();
+      _ring.reset(wav_queue_samples);
+      _writing.store(true, std::memory_order_release);
+      _thread = std::thread(&wav_writer::_write_loop, this);
+      return true;
+      }
+
+    bool is_open() const
+      {
+      return _file != nullptr;
+      }
+
+    // queues count samples for the file, returns how many fit, the rest is dropped; only
+    // one thread writes
+    size_t write(const int16_t* samples, size_t count)
+      {
+      if (!_file)
+        return 0;
+      const size_t written = _ring.write(samples, count);
+      if (written < count)
+        _dropped.fetch_add(count - written, std::memory_order_relaxed);
+      return written;
+      }
+
+    // like write, but waits for room instead of dropping, for offline rendering
+    void write_all(const int16_t* samples, size_t count)
+      {
+      if (!_file)
+        return;
+      while (count > 0)
+        {
+        const size_t written = _ring.write(samples, count);
+        samples += written;
+        count -= written;
+        if (count > 0)
+          std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+      }
+
+    // the samples that were dropped since open
+    uint64_t dropped() const
+      {
+      return _dropped.load(std::memory_order_relaxed);
+      }
+
+    // writes what is queued, completes the header, and closes the file
+    void close()
+      {
+      if (!_file)
+        return;
+      _writing.store(false, std::memory_order_release);
+      if (_thread.joinable())
+        _thread.join();
+      _drain();
+      _flush();
+      _finish_header();
+      fclose(_file);
+      _file = nullptr;
+      }
+
+  private:
+    void _put(const char* id)
+      {
+      _header.insert(_header.end(), id, id + 4);
+      }
+
+    void _put16(uint16_t value)
+      {
+      for (int i = 0; i < 2; ++i)
+        _header.push_back((unsigned char)(value >> (8 * i)));
+      }
+
+    void _put32(uint32_t value)
+      {
+      for (int i = 0; i < 4; ++i)
+        _header.push_back((unsigned char)(value >> (8 * i)));
+      }
+
+    void _put64(uint64_t value)
+      {
+      for (int i = 0; i < 8; ++i)
+        _header.push_back((unsigned char)(value >> (8 * i)));
+      }
+
+    void _write_loop()
+      {
+      while (_writing.load(std::memory_order_acquire))
+        {
+        if (!_drain())
+          std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+      }
+
+    // moves the queued samples into blocks and writes the full ones, returns false if nothing was queued
+    bool _drain()
+      {
+      bool any = false;
+      for (;;)
+        {
+        // the first block ends at wav_write_block in the file, so that the others are aligned
+        const size_t block_end = wav_write_block - (size_t)(_file_pos % wav_write_block);
+        const size_t room = (block_end - _block.size()) / sizeof(int16_t);
+        const size_t size = _block.size();
+        _block.resize(size + room * sizeof(int16_t));
+        const size_t got = _ring.read((int16_t*)(_block.data() + size), room);
+        _block.resize(size + got * sizeof(int16_t));
+        if (got == 0)
+          return any;
+        any = true;
+        if (got == room)
+          _flush();
+        }
+      }
+
+    void _flush()
+      {
+      if (_block.empty())
+        return;
+      fwrite(_block.data(), 1, _block.size(), _file);
+      _file_pos += _block.size();
+      _data_bytes += _block.size();
+      _block.clear();
+      }
+
+    void _finish_header()
+      {
+      // the data chunk is padded to an even length
+      if (_data_bytes % 2 != 0)
+        fputc(0, _file);
+      const uint64_t riff_size = _header.size() - 8 + _data_bytes + _data_bytes % 2;
+      const size_t ds64_pos = 12;
+      const size_t data_size_pos = _header.size() - 4;
+      _header.clear();
+      if (riff_size <= _riff_limit)
+        {
+        _put32((uint32_t)riff_size);
+        fseek(_file, 4, SEEK_SET);
+        fwrite(_header.data(), 1, 4, _file);
+        _header.clear();
+        _put32((uint32_t)_data_bytes);
+        fseek(_file, (long)data_size_pos, SEEK_SET);
+        fwrite(_header.data(), 1, 4, _file);
+        return;
+        }
+      _put("RF64");
+      _put32(0xFFFFFFFF);
+      fseek(_file, 0, SEEK_SET);
+      fwrite(_header.data(), 1, 8, _file);
+      _header.clear();
+      _put("ds64");
+      _put32(28);
+      _put64(riff_size);
+      _put64(_data_bytes);
+      _put64(_data_bytes / (2 * _channels));
+      _put32(0);
+      fseek(_file, (long)ds64_pos, SEEK_SET);
+      fwrite(_header.data(), 1, _header.size(), _file);
+      _header.clear();
+      _put32(0xFFFFFFFF);
+      fseek(_file, (long)data_size_pos, SEEK_SET);
+      fwrite(_header.data(), 1, 4, _file);
+      }
+
+  private:
+    FILE* _file;
+    uint64_t _riff_limit;
+    uint32_t _channels;
+    std::vector<unsigned char> _header;
+    std::vector<unsigned char> _block;
+    uint64_t _file_pos;
+    uint64_t _data_bytes;
+    spsc_ring<int16_t> _ring;
+    std::thread _thread;
+    std::atomic<bool> _writing;
+    std::atomic<uint64_t> _dropped;
+  };